@@ -0,0 +1,44 @@
+#! /bin/bash
+# Large file and directory benchmarks. Run them with the file system mounted in mount-point:
+#	./Bench.sh [MiB written] [random reads] [directory entries] [entries per subdirectory] [entries at scale]
+# The number of entries is bounded by the inodes of the volume (-i when it is formatted). The last benchmark
+# formats a scratch volume with an inode per entry (1000000 by default, 0 skips it), mounted in bench-mount
+
+MPOINT="./mount-point"
+SIZE_MB=${1:-3}
+READS=${2:-2000}
+ENTRIES=${3:-200}
+PER_DIR=${4:-0}
+SCALE_ENTRIES=${5:-1000000}
+SCALE_MPOINT="./bench-mount"
+SCALE_DISK="./bench-disk"
+
+make -s fs-fuse tools/myfs-bench tools/myfs-fsck || exit 1
+
+echo "Sequential write of a ${SIZE_MB} MiB file..."
+./tools/myfs-bench seqwrite $MPOINT/bench.bin $SIZE_MB 128 || exit 1
+
+echo "Random 4 KiB reads over it..."
+./tools/myfs-bench randread $MPOINT/bench.bin $READS 4 || exit 1
+
+rm -f $MPOINT/bench.bin
+
+echo "Create, stat, list and remove ${ENTRIES} directory entries..."
+./tools/myfs-bench entries $MPOINT/entries $ENTRIES $PER_DIR || exit 1
+
+echo "Block cache counters:"
+getfattr --only-values -n user.myfs.stats $MPOINT
+
+[ "$SCALE_ENTRIES" -gt 0 ] || exit 0
+# 1000 entries per subdirectory. Each inode takes 256 B of the disk (and of memory while mounted), 512 B per
+# entry leave room for the pages of the directories
+echo "Create, stat, list and remove ${SCALE_ENTRIES} directory entries in a scratch volume..."
+mkdir -p $SCALE_MPOINT
+rm -f $SCALE_DISK
+./fs-fuse -t $(( SCALE_ENTRIES * 512 + 64 * 1048576 )) -i $(( SCALE_ENTRIES + SCALE_ENTRIES / 1000 + 16 )) -a $SCALE_DISK \
+	-f "$SCALE_MPOINT" > /dev/null || exit 1
+while ! mountpoint -q $SCALE_MPOINT; do sleep 0.1; done
+./tools/myfs-bench entries $SCALE_MPOINT/entries $SCALE_ENTRIES 1000
+fusermount -u $SCALE_MPOINT
+./tools/myfs-fsck $SCALE_DISK | tail -1
+rm -f $SCALE_DISK
@@ -0,0 +1,44 @@
+#! /bin/bash
+# Compares copying a file inside the volume with cp (every byte read and written again) and with a clone
+# (user.myfs.clone: the copy shares the blocks of the source). Formats and mounts a scratch disk, so mount-point
+# must not be in use. Reports the time of each copy, the references shared (user.myfs.stats) and checks the disk
+# (fsck):
+#	./BenchClone.sh [MiB of the file]
+
+MPOINT="./mount-point"
+DISK="./bench-disk"
+SIZE_MB=${1:-1024}
+
+make -s fs-fuse tools/myfs-bench tools/myfs-fsck || exit 1
+mkdir -p $MPOINT
+
+mountDisk() {
+	./fs-fuse "$@" -a $DISK -f "$MPOINT" > /dev/null || exit 1
+	while ! mountpoint -q $MPOINT; do sleep 0.1; done
+}
+
+# Milliseconds taken by a command
+timeIt() {
+	local start=$(date +%s%N)
+
+	"$@" || exit 1
+	echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+rm -f $DISK
+mountDisk -t $(( (SIZE_MB * 2 + 16) * 1048576 ))
+./tools/myfs-bench seqwrite $MPOINT/bench.bin $SIZE_MB 128 || exit 1
+
+echo "cp: $(timeIt cp $MPOINT/bench.bin $MPOINT/copy.bin) ms for $SIZE_MB MiB"
+rm $MPOINT/copy.bin
+touch $MPOINT/clone.bin
+echo "clone: $(timeIt setfattr -n user.myfs.clone -v /bench.bin $MPOINT/clone.bin) ms for $SIZE_MB MiB"
+getfattr --only-values -n user.myfs.stats $MPOINT | grep dedup
+
+# The first writes to the clone copy the tables they go through
+echo "write after the clone: $(timeIt dd if=/dev/zero of=$MPOINT/clone.bin bs=128K count=8 conv=notrunc status=none) ms"
+cmp -s $MPOINT/bench.bin $MPOINT/clone.bin && echo "The source changed"
+fusermount -u $MPOINT
+
+./tools/myfs-fsck $DISK | tail -1
+rm -f $DISK
@@ -0,0 +1,34 @@
+#! /bin/bash
+# Compares a plain volume with a compressed one (-z) on the same workloads. Formats and mounts a
+# scratch disk for each mode, so mount-point must not be in use. The file is read after a remount,
+# so the reads go to the disk (and inflate the clusters):
+#	./BenchCompress.sh [MiB written]
+
+MPOINT="./mount-point"
+DISK="./bench-disk"
+SIZE_MB=${1:-8}
+
+make -s fs-fuse tools/myfs-bench tools/myfs-frag || exit 1
+mkdir -p $MPOINT
+
+mountDisk() {
+	./fs-fuse "$@" -a $DISK -f "$MPOINT" > /dev/null || exit 1
+	while ! mountpoint -q $MPOINT; do sleep 0.1; done
+}
+
+for MODE in "" "-z"; do
+	echo "=== Mode: ${MODE:-uncompressed} ==="
+	rm -f $DISK
+	mountDisk $MODE -t 4000000
+	./tools/myfs-bench seqwrite $MPOINT/bench.bin $SIZE_MB 128 || exit 1
+	fusermount -u $MPOINT
+
+	mountDisk $MODE -m
+	./tools/myfs-bench seqread $MPOINT/bench.bin 128 || exit 1
+	./tools/myfs-bench randread $MPOINT/bench.bin 2000 4 || exit 1
+	getfattr --only-values -n user.myfs.stats $MPOINT
+	fusermount -u $MPOINT
+
+	./tools/myfs-frag $DISK
+done
+rm -f $DISK
@@ -0,0 +1,30 @@
+#! /bin/bash
+# Compares a plain volume with a deduplicated one (-D) writing the same content to several files.
+# Formats and mounts a scratch disk for each mode, so mount-point must not be in use. Reports the
+# write throughput and latency, the blocks shared (user.myfs.stats) and the free blocks left (fsck):
+#	./BenchDedup.sh [MiB per copy] [copies]
+
+MPOINT="./mount-point"
+DISK="./bench-disk"
+SIZE_MB=${1:-2}
+COPIES=${2:-6}
+
+make -s fs-fuse tools/myfs-bench tools/myfs-fsck || exit 1
+mkdir -p $MPOINT
+
+mountDisk() {
+	./fs-fuse "$@" -a $DISK -f "$MPOINT" > /dev/null || exit 1
+	while ! mountpoint -q $MPOINT; do sleep 0.1; done
+}
+
+for MODE in "" "-D"; do
+	echo "=== Mode: ${MODE:-no deduplication} ==="
+	rm -f $DISK
+	mountDisk $MODE -t 16000000
+	./tools/myfs-bench copies $MPOINT $SIZE_MB $COPIES 128 || exit 1
+	getfattr --only-values -n user.myfs.stats $MPOINT
+	fusermount -u $MPOINT
+
+	./tools/myfs-fsck $DISK | tail -1
+done
+rm -f $DISK
@@ -0,0 +1,41 @@
+#! /bin/bash
+# Times growing a file with truncate (the new blocks are not written), shrinking it and removing it (the blocks
+# freed become holes of the backup file), with the space the backup file takes in the host after each step.
+# Formats and mounts a scratch disk, so mount-point must not be in use:
+#	./BenchHoles.sh [MiB of the file]
+
+MPOINT="./mount-point"
+DISK="./bench-disk"
+SIZE_MB=${1:-1024}
+
+make -s fs-fuse tools/myfs-bench tools/myfs-fsck || exit 1
+mkdir -p $MPOINT
+
+mountDisk() {
+	./fs-fuse "$@" -a $DISK -f "$MPOINT" > /dev/null || exit 1
+	while ! mountpoint -q $MPOINT; do sleep 0.1; done
+}
+
+# Milliseconds taken by a command
+timeIt() {
+	local start=$(date +%s%N)
+
+	"$@" || exit 1
+	echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+rm -f $DISK
+mountDisk -t $(( (SIZE_MB + 16) * 1048576 ))
+echo "backup file after mkfs: $(du -h $DISK | cut -f1)"
+echo "truncate to $SIZE_MB MiB: $(timeIt truncate -s ${SIZE_MB}M $MPOINT/bench.bin) ms, backup file $(du -h $DISK | cut -f1)"
+rm $MPOINT/bench.bin
+./tools/myfs-bench seqwrite $MPOINT/bench.bin $SIZE_MB 128 || exit 1
+echo "backup file after writing $SIZE_MB MiB: $(du -h $DISK | cut -f1)"
+echo "truncate to 1 MiB: $(timeIt truncate -s 1M $MPOINT/bench.bin) ms, backup file $(du -h $DISK | cut -f1)"
+# The blocks freed become holes once the change that freed them is in the disk (sync of the volume)
+echo "rm: $(timeIt rm $MPOINT/bench.bin) ms, backup file $(sync $MPOINT; du -h $DISK | cut -f1)"
+getfattr --only-values -n user.myfs.stats $MPOINT | grep holes
+fusermount -u $MPOINT
+
+./tools/myfs-fsck $DISK | tail -1
+rm -f $DISK
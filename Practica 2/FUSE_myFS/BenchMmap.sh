@@ -0,0 +1,27 @@
+#! /bin/bash
+# Compares the block cache with the mmap mode (-M) on the same workloads. Formats and mounts a
+# scratch disk for each mode, so mount-point must not be in use:
+#	./BenchMmap.sh [directory entries] [MiB written]
+
+MPOINT="./mount-point"
+DISK="./bench-disk"
+ENTRIES=${1:-200}
+SIZE_MB=${2:-3}
+
+make -s fs-fuse tools/myfs-bench || exit 1
+mkdir -p $MPOINT
+
+for MODE in "" "-M"; do
+	echo "=== Mode: ${MODE:-block cache} ==="
+	rm -f $DISK
+	./fs-fuse $MODE -t 4000000 -a $DISK -f "$MPOINT" > /dev/null || exit 1
+	while ! mountpoint -q $MPOINT; do sleep 0.1; done
+
+	./tools/myfs-bench entries $MPOINT/entries $ENTRIES || exit 1
+	./tools/myfs-bench seqwrite $MPOINT/bench.bin $SIZE_MB 128 || exit 1
+	./tools/myfs-bench randread $MPOINT/bench.bin 2000 4 || exit 1
+	getfattr --only-values -n user.myfs.stats $MPOINT
+
+	fusermount -u $MPOINT
+done
+rm -f $DISK
@@ -0,0 +1,39 @@
+#! /bin/bash
+# Takes a snapshot (mkdir under /.snapshots) of a volume with little data and of one with a lot of it, with the
+# same number of inodes: the time must not grow with the data. Then half of the big file is written again (the
+# blocks shared with the snapshot are copied) and the snapshot is dropped. Formats and mounts a scratch disk for
+# each size, so mount-point must not be in use. Reports the time of the snapshot and the references still shared
+# (user.myfs.stats), then checks that dropping it left no block behind (fsck):
+#	./BenchSnapshot.sh [small MiB] [large MiB]
+
+MPOINT="./mount-point"
+DISK="./bench-disk"
+SIZES_MB="${1:-1} ${2:-64}"
+
+make -s fs-fuse tools/myfs-bench tools/myfs-fsck || exit 1
+mkdir -p $MPOINT
+
+mountDisk() {
+	./fs-fuse "$@" -a $DISK -f "$MPOINT" > /dev/null || exit 1
+	while ! mountpoint -q $MPOINT; do sleep 0.1; done
+}
+
+for SIZE_MB in $SIZES_MB; do
+	echo "=== $SIZE_MB MiB of data ==="
+	rm -f $DISK
+	mountDisk -t $(( (SIZE_MB * 2 + 16) * 1048576 )) -i 1024
+	./tools/myfs-bench seqwrite $MPOINT/bench.bin $SIZE_MB 128 || exit 1
+	./tools/myfs-bench entries $MPOINT/tree 200 20 > /dev/null || exit 1
+	mkdir $MPOINT/.snapshots/before || exit 1
+	getfattr --only-values -n user.myfs.stats $MPOINT | grep snapshots
+
+	# Copy on write of the blocks the snapshot still holds
+	dd if=/dev/urandom of=$MPOINT/bench.bin bs=128K count=$(( SIZE_MB * 4 )) conv=notrunc status=none
+	cmp -s -n $(( SIZE_MB * 524288 )) $MPOINT/bench.bin $MPOINT/.snapshots/before/bench.bin && echo "The snapshot changed"
+	getfattr --only-values -n user.myfs.stats $MPOINT | grep dedup
+	rmdir $MPOINT/.snapshots/before || exit 1
+	fusermount -u $MPOINT
+
+	./tools/myfs-fsck $DISK | tail -1
+done
+rm -f $DISK
@@ -1,6 +1,7 @@
 #! /bin/bash
 
 clear
+make -s tools/myfs-fsck || exit 1
 echo "Checking if directory /temp exists..."
 if [ -d "temp" ]
 then
@@ -22,7 +23,8 @@ echo "Copying myFS.h to /mount-point..."
 cp myFS.h mount-point/myFS.h
 
 echo "Checking Virtual Disk..."
-./my-fsck-static-64 virtual-disk
+sync mount-point
+./tools/myfs-fsck virtual-disk
 
 if ! diff temp/fuseLib.c mount-point/fuseLib.c
 then
@@ -41,7 +43,8 @@ truncate -s -1 -o temp/fuseLib.c
 truncate -s -1 -o mount-point/fuseLib.c
 
 echo "Checking Virtual Disk..."
-./my-fsck-static-64 virtual-disk
+sync mount-point
+./tools/myfs-fsck virtual-disk
 
 if ! diff temp/fuseLib.c mount-point/fuseLib.c
 then
@@ -53,7 +56,8 @@ echo "Copying Makefile into /mount-point..."
 cp Makefile mount-point/Makefile
 
 echo "Checking Virtual Disk..."
-./my-fsck-static-64 virtual-disk
+sync mount-point
+./tools/myfs-fsck virtual-disk
 
 if ! diff Makefile mount-point/Makefile
 then
@@ -66,7 +70,8 @@ truncate -s +1 -o temp/myFS.h
 truncate -s +1 -o mount-point/myFS.h
 
 echo "Checking virtual disk..."
-./my-fsck-static-64 virtual-disk
+sync mount-point
+./tools/myfs-fsck virtual-disk
 
 echo "Comparing temp/myFS.h and mount-point/myFS.h..."
 if ! diff temp/myFS.h mount-point/myFS.h
@@ -0,0 +1,90 @@
+#! /bin/bash
+# Copy on write after a clone (user.myfs.clone): the file system must be mounted in mount-point
+# with virtual-disk, as for Script.sh
+
+MPOINT="mount-point"
+
+clear
+make -s tools/myfs-fsck || exit 1
+echo "Checking if directory /temp exists..."
+if [ -d "temp" ]
+then
+	echo "Deleting /temp..."
+	rm -rf temp
+fi
+
+echo "Creating /temp..."
+mkdir temp
+
+checkDisk() {
+	echo "Checking Virtual Disk..."
+	sync $MPOINT
+	if ! ./tools/myfs-fsck virtual-disk
+	then
+		echo "The virtual disk is inconsistent $1"
+		exit 1
+	fi
+}
+
+compare() {
+	if ! cmp $1 $2
+	then
+		echo "$1 and $2 are different $3"
+		exit 1
+	fi
+}
+
+# Big enough for the double indirect tables to be shared too
+echo "Copying a file of 5 MiB to /temp and /mount-point..."
+head -c 5M /dev/urandom > temp/big.bin
+cp temp/big.bin $MPOINT/big.bin
+
+echo "Cloning big.bin into clone.bin..."
+touch $MPOINT/clone.bin
+setfattr -n user.myfs.clone -v /big.bin $MPOINT/clone.bin || exit 1
+cp temp/big.bin temp/clone.bin
+checkDisk "after the clone"
+compare temp/clone.bin $MPOINT/clone.bin "after the clone"
+
+echo "Writing into the middle of clone.bin..."
+head -c 100K /dev/urandom > temp/patch.bin
+dd if=temp/patch.bin of=temp/clone.bin bs=1K seek=2000 conv=notrunc status=none
+dd if=temp/patch.bin of=$MPOINT/clone.bin bs=1K seek=2000 conv=notrunc status=none
+checkDisk "after writing into the clone"
+compare temp/clone.bin $MPOINT/clone.bin "after writing into the clone"
+compare temp/big.bin $MPOINT/big.bin "after writing into the clone"
+
+echo "Writing into the beginning of big.bin..."
+dd if=temp/patch.bin of=temp/big.bin bs=1K conv=notrunc status=none
+dd if=temp/patch.bin of=$MPOINT/big.bin bs=1K conv=notrunc status=none
+checkDisk "after writing into the source"
+compare temp/big.bin $MPOINT/big.bin "after writing into the source"
+compare temp/clone.bin $MPOINT/clone.bin "after writing into the source"
+
+echo "Truncating clone.bin to one block less and appending to big.bin..."
+truncate -s -4096 temp/clone.bin
+truncate -s -4096 $MPOINT/clone.bin
+cat temp/patch.bin >> temp/big.bin
+cat temp/patch.bin >> $MPOINT/big.bin
+checkDisk "after the truncate"
+compare temp/clone.bin $MPOINT/clone.bin "after the truncate"
+compare temp/big.bin $MPOINT/big.bin "after the truncate"
+
+echo "Restoring big.bin from a snapshot..."
+mkdir $MPOINT/.snapshots/clone-test || exit 1
+cp temp/big.bin temp/saved.bin
+dd if=temp/patch.bin of=$MPOINT/big.bin bs=1K seek=3000 conv=notrunc status=none
+setfattr -n user.myfs.clone -v /.snapshots/clone-test/big.bin $MPOINT/big.bin || exit 1
+rmdir $MPOINT/.snapshots/clone-test || exit 1
+checkDisk "after restoring from the snapshot"
+compare temp/saved.bin $MPOINT/big.bin "after restoring from the snapshot"
+
+echo "Removing big.bin..."
+rm $MPOINT/big.bin
+checkDisk "after removing the source"
+compare temp/clone.bin $MPOINT/clone.bin "after removing the source"
+rm $MPOINT/clone.bin
+checkDisk "after removing the clone"
+
+echo " "
+echo "Everything OK!"
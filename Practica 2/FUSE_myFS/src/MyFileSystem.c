@@ -7,16 +7,15 @@
 
 MyFileSystem myFileSystem;
 
-#define USAGE			"Usage: %s -t diskSize -a backupFileName -f 'fuse options'\n"
-#define EXAMPLE		"Example:\n%s -t 2097152 -a virtual-disk -f '-d -s mount-point'\n"
-#define EXAMPLE2 	"Example:\n%s -m -a <virtual-disk> -f '-d -s mount-point'\n"
+#define USAGE			"Usage: %s [-M] [-S scrubMiBps] [-z] [-D] -t diskSize [-i numInodes] -a backupFileName -f 'fuse options'\n"
+#define EXAMPLE		"Example:\n%s -t 2097152 -a virtual-disk -f '-d mount-point'\n"
+#define EXAMPLE2 	"Example:\n%s -m -a <virtual-disk> -f '-d mount-point'\n"
 
 int main(int argc, char **argv) {
-	myFileSystem.numFreeNodes = MAX_NODES;
-
 	int ret; // Resulting code of the functions call
 
-	int opt, diskSize = -1;
+	int opt, numNodes = -1;
+	int64_t diskSize = -1;
 	char *backupFileName = NULL;
 	char *argsFUSE = NULL;
 
@@ -24,10 +23,15 @@ int main(int argc, char **argv) {
 	char *pTmp;
 	int mount=0;
 
-	while((opt = getopt(argc, argv, "t:a:f:m")) != -1) {
+	while((opt = getopt(argc, argv, "t:i:a:f:mMS:zD")) != -1) {
 		switch(opt) {
 			case 't':
-				diskSize = atoi(optarg);
+				// In bytes, it may be well past 2 GiB
+				diskSize = strtoll(optarg, NULL, 10);
+				break;
+			case 'i':
+				// Without it the number of inodes follows the size of the disk
+				numNodes = atoi(optarg);
 				break;
 			case 'a':
 				backupFileName = optarg;
@@ -38,6 +42,22 @@ int main(int argc, char **argv) {
 			case 'm':
 				mount=1;
 				break;
+			case 'M':
+				// The backup file is mapped in memory instead of read and written block by block
+				myFileSystem.mapDisk = true;
+				break;
+			case 'S':
+				// Background verification of the checksums of the whole disk, at most this many MiB/s
+				myFileSystem.scrubRate = atoi(optarg);
+				break;
+			case 'z':
+				// Every file created while mounted is compressed (a single file with the xattr user.myfs.compress)
+				myFileSystem.compress = true;
+				break;
+			case 'D':
+				// Blocks written with the data of a block already in the disk share it (not in mmap mode, see allocateDelayed)
+				myFileSystem.dedup = true;
+				break;
 			default: /* '?' */
 				fprintf(stderr, USAGE, argv[0]);
 				fprintf(stderr, EXAMPLE, argv[0]);
@@ -54,7 +74,7 @@ int main(int argc, char **argv) {
 		}
 
 		// Format file without format?
-		ret = myMkfs(&myFileSystem, diskSize, backupFileName);
+		ret = myMkfs(&myFileSystem, diskSize, numNodes, backupFileName);
 	} else {
 		// Any parameter missing?
 		if(backupFileName == NULL || argsFUSE == NULL) {
@@ -77,10 +97,12 @@ int main(int argc, char **argv) {
 	argvNew[0] = argv[0];
 
 	pTmp = strtok(argsFUSE, " ");
-	while(pTmp && argc < MAX_FUSE_NARGS) {
+	while(pTmp && argc < MAX_FUSE_NARGS - 2) {
 		argvNew[argc++] = pTmp;
 		pTmp = strtok(0, " ");
 	}
+	argvNew[argc++] = "-o";
+	argvNew[argc++] = FUSE_DEFAULT_OPTIONS;
 
 	// We mount the FS, exit with Control-C
 	if((ret = fuse_main(argc, argvNew, &myFS_operations, NULL))) {
@@ -0,0 +1,1335 @@
+#include "cache.h"
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define HASH(lba) ((unsigned int)(lba) & (CACHE_HASH_SIZE - 1))
+#define MAP_BLOCK(cache, lba) ((cache)->map + (size_t)(lba) * BLOCK_SIZE_BYTES)
+#define MAP_DIRTY(cache, lba) (((cache)->mapDirty[(lba) / 64] >> ((lba) % 64)) & 1)
+
+/**
+* @brief Checks that a run of blocks lies inside the mapping: a wrong block number read from the disk must not
+* 	 touch the memory around it. Returns 0 or -EIO
+**/
+static int checkMapped(BlockCache *cache, DISK_LBA lba, int numBlocks) {
+	if(lba < 0 || numBlocks < 0 || lba + numBlocks > cache->mapBlocks) {
+		fprintf(stderr, "Blocks %" PRId64 " to %" PRId64 " out of the mapping\n", lba, lba + numBlocks - 1);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+* @brief Marks a run of blocks of the mapping as modified since the last msync, or not. Called with the cache lock held
+**/
+static void setMapDirty(BlockCache *cache, DISK_LBA lba, int numBlocks, BOOLEAN dirty) {
+	for(; numBlocks > 0; lba++, numBlocks--) {
+		if(dirty)
+			cache->mapDirty[lba / 64] |= UINT64_C(1) << (lba % 64);
+		else
+			cache->mapDirty[lba / 64] &= ~(UINT64_C(1) << (lba % 64));
+	}
+}
+
+/**
+* @brief CLOCK replacement for the frames of the checksum area: returns an empty frame, writing a dirty one back
+* 	 first, or waiting for one if every frame is being read or written. Called with the cache lock held, which is
+* 	 dropped meanwhile: the caller takes the frame before dropping it again. NO_SLOT on error
+**/
+static int evictChecksumFrame(MyFileSystem *myFileSystem) {
+	BlockCache *cache = myFileSystem->cache;
+	ssize_t n;
+	int tries;
+
+	// Two full turns: the first one may only clear reference bits. A frame is only busy during its I/O
+	for(tries = 0;; tries++) {
+		if(tries == 2 * CACHE_CHECKSUM_FRAMES) {
+			pthread_cond_wait(&cache->ioDone, &cache->lock);
+			tries = 0;
+		}
+		int f = cache->checksumHand;
+		ChecksumFrame *frame = &cache->checksumFrames[f];
+		cache->checksumHand = (cache->checksumHand + 1) % CACHE_CHECKSUM_FRAMES;
+
+		if(frame->busy)
+			continue;
+		if(frame->block == -1)
+			return f;
+		if(frame->referenced) {
+			frame->referenced = false;
+			continue;
+		}
+		if(frame->dirty) {
+			frame->dirty = false;
+			frame->busy = true;
+			pthread_mutex_unlock(&cache->lock);
+			n = pwrite(myFileSystem->fdVirtualDisk, frame->sums, BLOCK_SIZE_BYTES,
+					   (off_t)(myFileSystem->superBlock.checksumIdx + frame->block) * BLOCK_SIZE_BYTES);
+			pthread_mutex_lock(&cache->lock);
+			frame->busy = false;
+			pthread_cond_broadcast(&cache->ioDone);
+			if(n != BLOCK_SIZE_BYTES) {
+				perror("Failed pwrite in evictChecksumFrame");
+				frame->dirty = true;
+				return NO_SLOT;
+			}
+			// Somebody may have used it meanwhile
+			if(frame->referenced || frame->dirty)
+				continue;
+		}
+		cache->checksumFrameOf[frame->block] = NO_SLOT;
+		frame->block = -1;
+		return f;
+	}
+}
+
+/**
+* @brief Frame holding the block of the checksum area with the checksum of lba, read from the backup file if it is not
+* 	 in memory. Called with the cache lock held, which is dropped during the I/O. NO_SLOT on error
+**/
+static int checksumFrame(MyFileSystem *myFileSystem, DISK_LBA lba) {
+	BlockCache *cache = myFileSystem->cache;
+	int b = lba / CHECKSUMS_PER_BLOCK, f;
+	ChecksumFrame *frame;
+	ssize_t n;
+
+	assert(lba >= 0 && b < myFileSystem->superBlock.numChecksumBlocks);
+	// evictChecksumFrame may drop the lock: somebody may bring the block meanwhile, and then the frame evicted is left empty
+	while((f = cache->checksumFrameOf[b]) == NO_SLOT || cache->checksumFrames[f].busy) {
+		if(f != NO_SLOT) {
+			pthread_cond_wait(&cache->ioDone, &cache->lock);
+			continue;
+		}
+		if((f = evictChecksumFrame(myFileSystem)) == NO_SLOT)
+			return NO_SLOT;
+		if(cache->checksumFrameOf[b] != NO_SLOT)
+			continue;
+
+		// Read without the lock: whoever needs the frame meanwhile waits for it
+		frame = &cache->checksumFrames[f];
+		frame->block = b;
+		frame->dirty = false;
+		frame->busy = true;
+		cache->checksumFrameOf[b] = f;
+		pthread_mutex_unlock(&cache->lock);
+		n = pread(myFileSystem->fdVirtualDisk, frame->sums, BLOCK_SIZE_BYTES, (off_t)(myFileSystem->superBlock.checksumIdx + b) * BLOCK_SIZE_BYTES);
+		if(n == -1)
+			perror("Failed pread in checksumFrame");
+		else if(n < BLOCK_SIZE_BYTES)
+			memset((char *)frame->sums + n, 0, BLOCK_SIZE_BYTES - n);
+		pthread_mutex_lock(&cache->lock);
+		frame->busy = false;
+		pthread_cond_broadcast(&cache->ioDone);
+		if(n == -1) {
+			cache->checksumFrameOf[b] = NO_SLOT;
+			frame->block = -1;
+			return NO_SLOT;
+		}
+	}
+	cache->checksumFrames[f].referenced = true;
+	return f;
+}
+
+/**
+* @brief Checksum stored for a block, NO_CHECKSUM if its frame cannot be read (nothing is verified then). Called with
+* 	 the cache lock held, which checksumFrame may drop
+**/
+static uint32_t getChecksum(MyFileSystem *myFileSystem, DISK_LBA lba) {
+	int f = checksumFrame(myFileSystem, lba);
+	return f == NO_SLOT ? NO_CHECKSUM : myFileSystem->cache->checksumFrames[f].sums[lba % CHECKSUMS_PER_BLOCK];
+}
+
+/**
+* @brief Stores the checksum of a block, marking its frame dirty. Called with the cache lock held, which checksumFrame
+* 	 may drop: a slot whose checksum is being stored stays busy until then
+**/
+static void setChecksum(MyFileSystem *myFileSystem, DISK_LBA lba, uint32_t sum) {
+	ChecksumFrame *frame;
+	int f;
+
+	if((f = checksumFrame(myFileSystem, lba)) == NO_SLOT) {
+		fprintf(stderr, "Lost the checksum of block %" PRId64 "\n", lba);
+		return;
+	}
+	frame = &myFileSystem->cache->checksumFrames[f];
+	if(frame->sums[lba % CHECKSUMS_PER_BLOCK] == sum)
+		return;
+	frame->sums[lba % CHECKSUMS_PER_BLOCK] = sum;
+	frame->dirty = true;
+}
+
+/**
+* @brief Checksum of a whole block
+**/
+static uint32_t blockChecksum(const char *data) {
+	return BLOCK_CHECKSUM(crc32c(0, data, BLOCK_SIZE_BYTES));
+}
+
+/**
+* @brief Checksums of the blocks of a run, whatever the pieces of iov look like
+**/
+static void checksumIov(const struct iovec *iov, int iovcnt, uint32_t *sums) {
+	size_t inBlock = 0;
+	uint32_t crc = 0;
+	int i;
+
+	for(i = 0; i < iovcnt; i++) {
+		const char *p = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while(left) {
+			size_t n = left < BLOCK_SIZE_BYTES - inBlock ? left : BLOCK_SIZE_BYTES - inBlock;
+			crc = crc32c(crc, p, n);
+			p += n;
+			left -= n;
+			if((inBlock += n) == BLOCK_SIZE_BYTES) {
+				*sums++ = BLOCK_CHECKSUM(crc);
+				crc = 0;
+				inBlock = 0;
+			}
+		}
+	}
+}
+
+/**
+* @brief Compares the checksum of a block read from the backup file with the one stored, counting and reporting a
+* 	 mismatch. Called with the cache lock held, which getChecksum may drop
+**/
+static int checkBlock(MyFileSystem *myFileSystem, DISK_LBA lba, uint32_t sum) {
+	uint32_t stored = getChecksum(myFileSystem, lba);
+
+	if(stored == NO_CHECKSUM || stored == sum)
+		return 0;
+	__atomic_add_fetch(&myFileSystem->cache->checksumErrors, 1, __ATOMIC_RELAXED);
+	fprintf(stderr, "Checksum mismatch in block %" PRId64 "\n", lba);
+	return -EIO;
+}
+
+/**
+* @brief Verifies a block read from the backup file (checkBlock). Called without the cache lock: the lock of the file
+* 	 the block belongs to or its busy slot keep its checksum from changing meanwhile
+**/
+static int verifyBlock(MyFileSystem *myFileSystem, DISK_LBA lba, const char *data) {
+	uint32_t sum = blockChecksum(data);
+	int ret;
+
+	pthread_mutex_lock(&myFileSystem->cache->lock);
+	ret = checkBlock(myFileSystem, lba, sum);
+	pthread_mutex_unlock(&myFileSystem->cache->lock);
+	return ret;
+}
+
+/**
+* @brief Reads a whole block from the backup file. Blocks past the end of the file are read as zeros
+**/
+static int readBlock(MyFileSystem *myFileSystem, DISK_LBA lba, char *data) {
+	ssize_t n = pread(myFileSystem->fdVirtualDisk, data, BLOCK_SIZE_BYTES, (off_t)lba * BLOCK_SIZE_BYTES);
+	if(n == -1) {
+		perror("Failed pread in readBlock");
+		return -EIO;
+	}
+	if(n < BLOCK_SIZE_BYTES)
+		memset(data + n, 0, BLOCK_SIZE_BYTES - n);
+	return 0;
+}
+
+/**
+* @brief Reads a whole block from the backup file and verifies it. Called without the cache lock
+**/
+static int diskReadBlock(MyFileSystem *myFileSystem, DISK_LBA lba, char *data) {
+	return readBlock(myFileSystem, lba, data) ? -EIO : verifyBlock(myFileSystem, lba, data);
+}
+
+/**
+* @brief Reads a block of a compressed cluster: the blocks of the cluster are read with a single pread, verified and
+* 	 inflated into cluster (2 * COMPRESS_CLUSTER blocks), where keepCluster finds the rest of its data. Returns the
+* 	 blocks of data of the cluster, <0 on error. Called without the cache lock, with the slot of lba busy
+**/
+static int loadCompressed(MyFileSystem *myFileSystem, DISK_LBA lba, char *data, char *cluster) {
+	BlockCache *cache = myFileSystem->cache;
+	DISK_LBA first = COMPRESSED_FIRST(lba);
+	int len = COMPRESSED_LEN(lba), i;
+	char *in = cluster + (size_t)COMPRESS_CLUSTER * BLOCK_SIZE_BYTES;
+	size_t bytes = (size_t)len * BLOCK_SIZE_BYTES;
+	ssize_t n;
+
+	if(len < 1 || first < FIRST_DATA_BLOCK(myFileSystem) || first + len > myFileSystem->superBlock.diskSizeInBlocks) {
+		fprintf(stderr, "Wrong compressed block %" PRIx64 "\n", lba);
+		return -EIO;
+	}
+	if(cache->map) {
+		memcpy(in, MAP_BLOCK(cache, first), bytes);
+	}
+	else {
+		if((n = pread(myFileSystem->fdVirtualDisk, in, bytes, (off_t)first * BLOCK_SIZE_BYTES)) == -1) {
+			perror("Failed pread in loadCompressed");
+			return -EIO;
+		}
+		if(n < bytes)
+			memset(in + n, 0, bytes - n);
+		for(i = 0; i < len; i++) {
+			if(verifyBlock(myFileSystem, first + i, in + (size_t)i * BLOCK_SIZE_BYTES))
+				return -EIO;
+		}
+	}
+	if((n = inflateBlocks(in, len, cluster)) < 0) {
+		fprintf(stderr, "Corrupted compressed cluster in block %" PRId64 "\n", first);
+		return -EIO;
+	}
+
+	// A block past the data of the cluster was never written
+	if(COMPRESSED_INDEX(lba) < n)
+		memcpy(data, cluster + (size_t)COMPRESSED_INDEX(lba) * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+	else
+		memset(data, 0, BLOCK_SIZE_BYTES);
+	return n;
+}
+
+/**
+* @brief Returns the slot holding lba, or NO_SLOT if the block is not cached
+**/
+static int lookupSlot(BlockCache *cache, DISK_LBA lba) {
+	int s;
+	for(s = cache->hash[HASH(lba)]; s != NO_SLOT; s = cache->slots[s].nextInHash) {
+		if(cache->slots[s].lba == lba)
+			return s;
+	}
+	return NO_SLOT;
+}
+
+/**
+* @brief lookupSlot once no read or write of the slot is running. Called with the cache lock held, which is dropped
+* 	 while waiting: the block may be gone when it comes back
+**/
+static int waitSlot(BlockCache *cache, DISK_LBA lba) {
+	int s;
+	while((s = lookupSlot(cache, lba)) != NO_SLOT && cache->slots[s].busy)
+		pthread_cond_wait(&cache->ioDone, &cache->lock);
+	return s;
+}
+
+static void unlinkSlot(BlockCache *cache, int slot) {
+	int *prev = &cache->hash[HASH(cache->slots[slot].lba)];
+	while(*prev != slot)
+		prev = &cache->slots[*prev].nextInHash;
+	*prev = cache->slots[slot].nextInHash;
+	cache->slots[slot].lba = -1;
+	cache->slots[slot].nextInHash = NO_SLOT;
+}
+
+/**
+* @brief CLOCK replacement: looks for an unpinned slot not referenced recently and returns it empty and pinned. A
+* 	 dirty slot is written back first if mayWrite, skipped otherwise. Called with the cache lock held, which is
+* 	 dropped during the write: the pin keeps the slot returned for the caller
+**/
+static int evictSlot(MyFileSystem *myFileSystem, BOOLEAN mayWrite) {
+	BlockCache *cache = myFileSystem->cache;
+	uint32_t sum;
+	ssize_t n;
+	int tries;
+
+	// Two full turns: the first one may only clear reference bits
+	for(tries = 0; tries < 2 * CACHE_NUM_BLOCKS; tries++) {
+		int s = cache->clockHand;
+		CacheBlock *cb = &cache->slots[s];
+		cache->clockHand = (cache->clockHand + 1) % CACHE_NUM_BLOCKS;
+
+		if(cb->pinCount || cb->busy)
+			continue;
+		if(cb->lba != -1 && cb->referenced) {
+			cb->referenced = false;
+			continue;
+		}
+		if(cb->lba != -1 && cb->dirty) {
+			if(!mayWrite)
+				continue;
+			// The slot stays in the hash while it is written: whoever looks for the block waits for it
+			assert(cb->lba >= 0 && cb->lba < COMPRESSED_BASE);
+			cb->dirty = false;
+			cb->busy = true;
+			pthread_mutex_unlock(&cache->lock);
+			n = pwrite(myFileSystem->fdVirtualDisk, cb->data, BLOCK_SIZE_BYTES, (off_t)cb->lba * BLOCK_SIZE_BYTES);
+			sum = blockChecksum(cb->data);
+			pthread_mutex_lock(&cache->lock);
+			// Still busy while its checksum is stored
+			if(n == BLOCK_SIZE_BYTES)
+				setChecksum(myFileSystem, cb->lba, sum);
+			cb->busy = false;
+			pthread_cond_broadcast(&cache->ioDone);
+			if(n != BLOCK_SIZE_BYTES) {
+				perror("Failed pwrite in evictSlot");
+				cb->dirty = true;
+				return NO_SLOT;
+			}
+			cache->writeBacks++;
+			// Somebody may have taken the block meanwhile
+			if(cb->pinCount || cb->referenced || cb->dirty)
+				continue;
+		}
+		if(cb->lba != -1)
+			unlinkSlot(cache, s);
+		cb->pinCount = 1;
+		return s;
+	}
+	if(mayWrite)
+		fprintf(stderr, "Block cache exhausted: every block is pinned\n");
+	return NO_SLOT;
+}
+
+/**
+* @brief Keeps the rest of the cluster just inflated by loadCompressed for lba in clean slots, so the next reads
+* 	 of the cluster are hits (only in slots that need no write back). Called with the cache lock held, once the
+* 	 slot of lba is pinned
+**/
+static void keepCluster(MyFileSystem *myFileSystem, DISK_LBA lba, const char *cluster, int numBlocks) {
+	BlockCache *cache = myFileSystem->cache;
+	DISK_LBA key;
+	int i, s;
+
+	for(i = 0; i < numBlocks; i++) {
+		key = COMPRESSED_LBA(COMPRESSED_FIRST(lba), COMPRESSED_LEN(lba), i);
+		if(key == lba || lookupSlot(cache, key) != NO_SLOT)
+			continue;
+		if((s = evictSlot(myFileSystem, false)) == NO_SLOT)
+			return;
+		memcpy(cache->slots[s].data, cluster + (size_t)i * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+		cache->slots[s].lba = key;
+		cache->slots[s].dirty = false;
+		cache->slots[s].referenced = true;
+		cache->slots[s].pinCount = 0;
+		cache->slots[s].nextInHash = cache->hash[HASH(key)];
+		cache->hash[HASH(key)] = s;
+	}
+}
+
+int cacheInit(MyFileSystem *myFileSystem) {
+	BlockCache *cache;
+	int i, numChecksumBlocks = myFileSystem->superBlock.numChecksumBlocks;
+
+	if((cache = malloc(sizeof(BlockCache))) == NULL) {
+		perror("Error in malloc");
+		return -1;
+	}
+	if(posix_memalign((void **)&cache->buffer, BLOCK_SIZE_BYTES, (size_t)CACHE_NUM_BLOCKS * BLOCK_SIZE_BYTES)) {
+		perror("Error in posix_memalign");
+		free(cache);
+		return -1;
+	}
+	// Only CACHE_CHECKSUM_FRAMES blocks of the checksum area are in memory at a time
+	if(posix_memalign((void **)&cache->checksumBuffer, BLOCK_SIZE_BYTES, (size_t)CACHE_CHECKSUM_FRAMES * BLOCK_SIZE_BYTES)) {
+		perror("Error in posix_memalign");
+		free(cache->buffer);
+		free(cache);
+		return -1;
+	}
+	if((cache->checksumFrameOf = malloc(numChecksumBlocks * sizeof(int))) == NULL) {
+		perror("Error in malloc");
+		free(cache->checksumBuffer);
+		free(cache->buffer);
+		free(cache);
+		return -1;
+	}
+	for(i = 0; i < numChecksumBlocks; i++)
+		cache->checksumFrameOf[i] = NO_SLOT;
+	for(i = 0; i < CACHE_CHECKSUM_FRAMES; i++) {
+		cache->checksumFrames[i].block = -1;
+		cache->checksumFrames[i].dirty = false;
+		cache->checksumFrames[i].referenced = false;
+		cache->checksumFrames[i].busy = false;
+		cache->checksumFrames[i].sums = (uint32_t *)(cache->checksumBuffer + (size_t)i * BLOCK_SIZE_BYTES);
+	}
+	cache->checksumHand = 0;
+	cache->writingRuns = 0;
+	cache->checksumErrors = cache->scrubbed = 0;
+	cache->inflated = 0;
+	for(i = 0; i < CACHE_HASH_SIZE; i++)
+		cache->hash[i] = NO_SLOT;
+	for(i = 0; i < CACHE_NUM_BLOCKS; i++) {
+		cache->slots[i].lba = -1;
+		cache->slots[i].dirty = false;
+		cache->slots[i].referenced = false;
+		cache->slots[i].pinCount = 0;
+		cache->slots[i].busy = false;
+		cache->slots[i].nextInHash = NO_SLOT;
+		cache->slots[i].data = cache->buffer + (size_t)i * BLOCK_SIZE_BYTES;
+	}
+	cache->clockHand = 0;
+	cache->hits = cache->misses = cache->writeBacks = cache->prefetched = 0;
+	cache->unsynced = false;
+	cache->delayedBlocks = 0;
+	cache->pinnedTables = 0;
+	cache->nextDelayed = DELAYED_LBA;
+	cache->map = NULL;
+	cache->mapBlocks = 0;
+	cache->mapDirty = NULL;
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->ioDone, NULL);
+	pthread_mutex_init(&cache->flushLock, NULL);
+
+	myFileSystem->cache = cache;
+	return 0;
+}
+
+int cacheMap(MyFileSystem *myFileSystem, DISK_LBA numBlocks) {
+	BlockCache *cache = myFileSystem->cache;
+	size_t size = (size_t)numBlocks * BLOCK_SIZE_BYTES;
+	struct stat st;
+
+	// Every block has to exist in the file: touching a page past its end is a SIGBUS
+	if(fstat(myFileSystem->fdVirtualDisk, &st) == -1 || (st.st_size < size && ftruncate(myFileSystem->fdVirtualDisk, size) == -1)) {
+		perror("Failed to size the backup file in cacheMap");
+		return -1;
+	}
+	if((cache->mapDirty = calloc((numBlocks + 63) / 64, sizeof(uint64_t))) == NULL) {
+		perror("Error in calloc");
+		return -1;
+	}
+	cache->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, myFileSystem->fdVirtualDisk, 0);
+	if(cache->map == MAP_FAILED) {
+		perror("Failed mmap in cacheMap");
+		free(cache->mapDirty);
+		cache->mapDirty = NULL;
+		cache->map = NULL;
+		return -1;
+	}
+	cache->mapBlocks = numBlocks;
+	return 0;
+}
+
+void cacheFree(MyFileSystem *myFileSystem) {
+	if(myFileSystem->cache == NULL)
+		return;
+	cacheFlush(myFileSystem);
+	if(myFileSystem->cache->map) {
+		munmap(myFileSystem->cache->map, (size_t)myFileSystem->cache->mapBlocks * BLOCK_SIZE_BYTES);
+		free(myFileSystem->cache->mapDirty);
+	}
+	pthread_mutex_destroy(&myFileSystem->cache->lock);
+	pthread_cond_destroy(&myFileSystem->cache->ioDone);
+	pthread_mutex_destroy(&myFileSystem->cache->flushLock);
+	free(myFileSystem->cache->checksumFrameOf);
+	free(myFileSystem->cache->checksumBuffer);
+	free(myFileSystem->cache->buffer);
+	free(myFileSystem->cache);
+	myFileSystem->cache = NULL;
+}
+
+char *cacheGetBlock(MyFileSystem *myFileSystem, DISK_LBA lba, BOOLEAN load) {
+	BlockCache *cache = myFileSystem->cache;
+	CacheBlock *cb;
+	char *cluster = NULL;
+	int s, victim = NO_SLOT, ret = 0;
+
+	// The mapping needs no lookup nor pinning, the page cache of the kernel does the rest. The data of
+	// compressed clusters is not in the backup file, it lives in the slots
+	if(cache->map && !IS_COMPRESSED(lba)) {
+		if(checkMapped(cache, lba, 1))
+			return NULL;
+		if(!load)
+			memset(MAP_BLOCK(cache, lba), 0, BLOCK_SIZE_BYTES);
+		return MAP_BLOCK(cache, lba);
+	}
+
+	if(load && IS_COMPRESSED(lba) && (cluster = malloc((size_t)2 * COMPRESS_CLUSTER * BLOCK_SIZE_BYTES)) == NULL) {
+		perror("Error in malloc");
+		return NULL;
+	}
+
+	// evictSlot may drop the lock to write a block back: somebody may bring lba meanwhile, and then the slot
+	// evicted is left empty
+	pthread_mutex_lock(&cache->lock);
+	while((s = waitSlot(cache, lba)) == NO_SLOT && victim == NO_SLOT) {
+		if((victim = evictSlot(myFileSystem, true)) == NO_SLOT) {
+			pthread_mutex_unlock(&cache->lock);
+			free(cluster);
+			return NULL;
+		}
+	}
+	if(s != NO_SLOT) {
+		cache->hits++;
+		cb = &cache->slots[s];
+		cb->pinCount++;
+		if(victim != NO_SLOT)
+			cache->slots[victim].pinCount = 0;
+	}
+	else {
+		cache->misses++;
+		s = victim;
+		cb = &cache->slots[s];
+		assert(load || !IS_COMPRESSED(lba));
+		cb->lba = lba;
+		cb->dirty = false;
+		cb->nextInHash = cache->hash[HASH(lba)];
+		cache->hash[HASH(lba)] = s;
+		if(load) {
+			// Read without the lock: whoever looks for the block meanwhile waits for the slot
+			cb->busy = true;
+			pthread_mutex_unlock(&cache->lock);
+			ret = IS_COMPRESSED(lba) ? loadCompressed(myFileSystem, lba, cb->data, cluster) : diskReadBlock(myFileSystem, lba, cb->data);
+			pthread_mutex_lock(&cache->lock);
+			cb->busy = false;
+			pthread_cond_broadcast(&cache->ioDone);
+			if(ret < 0) {
+				cb->pinCount = 0;
+				cb->referenced = false;
+				unlinkSlot(cache, s);
+				pthread_mutex_unlock(&cache->lock);
+				free(cluster);
+				return NULL;
+			}
+			if(IS_COMPRESSED(lba)) {
+				cache->inflated++;
+				keepCluster(myFileSystem, lba, cluster, ret);
+			}
+		}
+		else {
+			memset(cb->data, 0, BLOCK_SIZE_BYTES);
+		}
+	}
+	cb->referenced = true;
+	pthread_mutex_unlock(&cache->lock);
+	free(cluster);
+	return cb->data;
+}
+
+void cachePutBlock(MyFileSystem *myFileSystem, DISK_LBA lba, BOOLEAN dirty) {
+	BlockCache *cache = myFileSystem->cache;
+	int s;
+
+	assert(!dirty || !IS_COMPRESSED(lba));
+	if(cache->map && !IS_COMPRESSED(lba)) {
+		assert(lba >= 0 && lba < cache->mapBlocks);
+		if(dirty) {
+			pthread_mutex_lock(&cache->lock);
+			setMapDirty(cache, lba, 1, true);
+			pthread_mutex_unlock(&cache->lock);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	s = lookupSlot(cache, lba);
+	assert(s != NO_SLOT && cache->slots[s].pinCount > 0);
+	cache->slots[s].pinCount--;
+	if(dirty)
+		cache->slots[s].dirty = true;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+BOOLEAN cacheReservePin(MyFileSystem *myFileSystem) {
+	BlockCache *cache = myFileSystem->cache;
+	BOOLEAN ok;
+
+	pthread_mutex_lock(&cache->lock);
+	if((ok = cache->pinnedTables < CACHE_PINNED_TABLES))
+		cache->pinnedTables++;
+	pthread_mutex_unlock(&cache->lock);
+	return ok;
+}
+
+void cacheReleasePin(MyFileSystem *myFileSystem) {
+	BlockCache *cache = myFileSystem->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	assert(cache->pinnedTables > 0);
+	cache->pinnedTables--;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int cacheRead(MyFileSystem *myFileSystem, DISK_LBA lba, int offset, void *buf, int size) {
+	char *data;
+
+	assert(offset >= 0 && offset + size <= BLOCK_SIZE_BYTES);
+	if((data = cacheGetBlock(myFileSystem, lba, true)) == NULL)
+		return -EIO;
+	memcpy(buf, data + offset, size);
+	cachePutBlock(myFileSystem, lba, false);
+	return 0;
+}
+
+int cacheWrite(MyFileSystem *myFileSystem, DISK_LBA lba, int offset, const void *buf, int size) {
+	char *data;
+
+	assert(offset >= 0 && offset + size <= BLOCK_SIZE_BYTES);
+	// Partial writes need the rest of the block
+	if((data = cacheGetBlock(myFileSystem, lba, size != BLOCK_SIZE_BYTES)) == NULL)
+		return -EIO;
+	memcpy(data + offset, buf, size);
+	cachePutBlock(myFileSystem, lba, true);
+	return 0;
+}
+
+int cacheReadRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, char *buf) {
+	BlockCache *cache = myFileSystem->cache;
+	int i = 0, j, s;
+
+	// The blocks of compressed clusters are inflated in the cache
+	if(IS_COMPRESSED(lba)) {
+		for(i = 0; i < numBlocks; i++) {
+			if(cacheRead(myFileSystem, lba + i, 0, buf + (size_t)i * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES))
+				return -EIO;
+		}
+		return 0;
+	}
+	if(cache->map) {
+		if(checkMapped(cache, lba, numBlocks))
+			return -EIO;
+		memcpy(buf, MAP_BLOCK(cache, lba), (size_t)numBlocks * BLOCK_SIZE_BYTES);
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	while(i < numBlocks) {
+		if((s = waitSlot(cache, lba + i)) != NO_SLOT) {
+			cache->hits++;
+			cache->slots[s].referenced = true;
+			memcpy(buf + (size_t)i * BLOCK_SIZE_BYTES, cache->slots[s].data, BLOCK_SIZE_BYTES);
+			i++;
+			continue;
+		}
+
+		// Longest run of blocks that are not in memory
+		int first = i;
+		while(i < numBlocks && lookupSlot(cache, lba + i) == NO_SLOT)
+			i++;
+		cache->misses += i - first;
+
+		// The lock is not held during the read, so readers of other files can go on. The blocks read
+		// belong to a file whose inode lock the caller holds, nobody can be modifying them in the cache
+		pthread_mutex_unlock(&cache->lock);
+		size_t bytes = (size_t)(i - first) * BLOCK_SIZE_BYTES;
+		ssize_t n = pread(myFileSystem->fdVirtualDisk, buf + (size_t)first * BLOCK_SIZE_BYTES, bytes, (off_t)(lba + first) * BLOCK_SIZE_BYTES);
+		if(n == -1) {
+			perror("Failed pread in cacheReadRun");
+			return -EIO;
+		}
+		if(n < bytes)
+			memset(buf + (size_t)first * BLOCK_SIZE_BYTES + n, 0, bytes - n);
+		for(j = first; j < i; j++) {
+			if(verifyBlock(myFileSystem, lba + j, buf + (size_t)j * BLOCK_SIZE_BYTES))
+				return -EIO;
+		}
+		pthread_mutex_lock(&cache->lock);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+DISK_LBA cacheNewDelayed(MyFileSystem *myFileSystem) {
+	BlockCache *cache = myFileSystem->cache;
+	CacheBlock *cb;
+	int s;
+
+	pthread_mutex_lock(&cache->lock);
+	if(cache->delayedBlocks >= CACHE_DELAYED_MAX || (s = evictSlot(myFileSystem, true)) == NO_SLOT) {
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+	// Others may have created delayed blocks while evictSlot wrote one back
+	if(cache->delayedBlocks >= CACHE_DELAYED_MAX) {
+		cache->slots[s].pinCount = 0;
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+	// The numbers wrap around, skipping the ones still in use
+	do {
+		if(++cache->nextDelayed < DELAYED_LBA)
+			cache->nextDelayed = DELAYED_LBA;
+	} while(lookupSlot(cache, cache->nextDelayed) != NO_SLOT);
+
+	cb = &cache->slots[s];
+	memset(cb->data, 0, BLOCK_SIZE_BYTES);
+	cb->lba = cache->nextDelayed;
+	// Dirty: nobody must look for its data in the disk
+	cb->dirty = true;
+	cb->referenced = true;
+	cb->pinCount = 1;
+	cb->nextInHash = cache->hash[HASH(cb->lba)];
+	cache->hash[HASH(cb->lba)] = s;
+	cache->delayedBlocks++;
+	pthread_mutex_unlock(&cache->lock);
+	return cb->lba;
+}
+
+void cacheAssignDelayed(MyFileSystem *myFileSystem, DISK_LBA delayed, DISK_LBA lba) {
+	BlockCache *cache = myFileSystem->cache;
+	CacheBlock *cb;
+	int s, old;
+
+	pthread_mutex_lock(&cache->lock);
+	// A copy of whatever the block held before is stale (once it is not being written back)
+	old = waitSlot(cache, lba);
+	s = lookupSlot(cache, delayed);
+	assert(s != NO_SLOT);
+	if(old != NO_SLOT) {
+		assert(cache->slots[old].pinCount == 0);
+		cache->slots[old].dirty = false;
+		unlinkSlot(cache, old);
+	}
+	unlinkSlot(cache, s);
+	cb = &cache->slots[s];
+	cb->lba = lba;
+	cb->dirty = !IS_COMPRESSED(lba);
+	cb->pinCount--;
+	cb->nextInHash = cache->hash[HASH(lba)];
+	cache->hash[HASH(lba)] = s;
+	cache->delayedBlocks--;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void cacheDropDelayed(MyFileSystem *myFileSystem, DISK_LBA delayed) {
+	BlockCache *cache = myFileSystem->cache;
+	int s;
+
+	pthread_mutex_lock(&cache->lock);
+	s = lookupSlot(cache, delayed);
+	assert(s != NO_SLOT);
+	cache->slots[s].pinCount--;
+	cache->slots[s].dirty = false;
+	cache->slots[s].referenced = false;
+	unlinkSlot(cache, s);
+	cache->delayedBlocks--;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+int cacheWriteRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, const struct iovec *iov, int iovcnt) {
+	BlockCache *cache = myFileSystem->cache;
+	off_t pos = (off_t)lba * BLOCK_SIZE_BYTES;
+	uint32_t *sums;
+	int i, s;
+
+	if(cache->map) {
+		char *data = MAP_BLOCK(cache, lba);
+		if(checkMapped(cache, lba, numBlocks))
+			return -EIO;
+		for(i = 0; i < iovcnt; i++) {
+			memcpy(data, iov[i].iov_base, iov[i].iov_len);
+			data += iov[i].iov_len;
+		}
+		pthread_mutex_lock(&cache->lock);
+		setMapDirty(cache, lba, numBlocks, true);
+		pthread_mutex_unlock(&cache->lock);
+		return 0;
+	}
+
+	// The checksums are computed before taking the lock and stored once the data is written. Meanwhile the
+	// backup file and the checksums may not match: cacheScrub leaves the mismatches for later
+	if((sums = malloc(numBlocks * sizeof(uint32_t))) == NULL)
+		return -ENOMEM;
+	checksumIov(iov, iovcnt, sums);
+
+	// An old copy in the cache must not be written back over the new data, nor read again. One being written
+	// back is dropped once that write is over
+	pthread_mutex_lock(&cache->lock);
+	cache->writingRuns++;
+	for(i = 0; i < numBlocks; i++) {
+		if((s = waitSlot(cache, lba + i)) != NO_SLOT) {
+			assert(cache->slots[s].pinCount == 0);
+			cache->slots[s].dirty = false;
+			cache->slots[s].referenced = false;
+			unlinkSlot(cache, s);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	// The caller holds the lock of the file: nobody brings the blocks back to the cache in the meantime
+	for(i = 0; i < iovcnt; i += IOV_MAX) {
+		int n = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+		ssize_t bytes = 0;
+		int j;
+
+		for(j = i; j < i + n; j++)
+			bytes += iov[j].iov_len;
+		if(pwritev(myFileSystem->fdVirtualDisk, iov + i, n, pos) != bytes) {
+			perror("Failed pwritev in cacheWriteRun");
+			break;
+		}
+		pos += bytes;
+	}
+
+	// Marked once written, so a flush running meanwhile does not leave them unsynced. Whatever the disk
+	// holds after a failed write cannot be verified
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < numBlocks; i++)
+		setChecksum(myFileSystem, lba + i, pos == (off_t)(lba + numBlocks) * BLOCK_SIZE_BYTES ? sums[i] : NO_CHECKSUM);
+	cache->writingRuns--;
+	cache->writeBacks += numBlocks;
+	cache->unsynced = true;
+	pthread_mutex_unlock(&cache->lock);
+	free(sums);
+	return pos == (off_t)(lba + numBlocks) * BLOCK_SIZE_BYTES ? 0 : -EIO;
+}
+
+void cachePrefetch(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks) {
+	BlockCache *cache = myFileSystem->cache;
+	int slots[CACHE_NUM_BLOCKS / 4];
+	struct iovec iov[CACHE_NUM_BLOCKS / 4];
+	uint32_t sums[CACHE_NUM_BLOCKS / 4];
+	BOOLEAN valid[CACHE_NUM_BLOCKS / 4];
+	int i = 0, j, n, first, s;
+	ssize_t r;
+
+	if(numBlocks > CACHE_NUM_BLOCKS / 4)
+		numBlocks = CACHE_NUM_BLOCKS / 4;
+	// Reading a block not cached inflates its whole cluster
+	if(IS_COMPRESSED(lba)) {
+		for(; i < numBlocks; i++) {
+			pthread_mutex_lock(&cache->lock);
+			s = lookupSlot(cache, lba + i);
+			pthread_mutex_unlock(&cache->lock);
+			if(s == NO_SLOT && cacheGetBlock(myFileSystem, lba + i, true) != NULL)
+				cachePutBlock(myFileSystem, lba + i, false);
+		}
+		return;
+	}
+	if(cache->map) {
+		if(checkMapped(cache, lba, numBlocks))
+			return;
+		madvise(MAP_BLOCK(cache, lba), (size_t)numBlocks * BLOCK_SIZE_BYTES, MADV_WILLNEED);
+		return;
+	}
+
+	while(i < numBlocks) {
+		pthread_mutex_lock(&cache->lock);
+		while(i < numBlocks && lookupSlot(cache, lba + i) != NO_SLOT)
+			i++;
+		// The slots are pinned and out of the hash while they are read: nobody else finds or evicts them
+		// Reading ahead is not worth a write back
+		for(first = i, n = 0; i < numBlocks && lookupSlot(cache, lba + i) == NO_SLOT; i++, n++) {
+			if((s = evictSlot(myFileSystem, false)) == NO_SLOT)
+				break;
+			slots[n] = s;
+			iov[n].iov_base = cache->slots[s].data;
+			iov[n].iov_len = BLOCK_SIZE_BYTES;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if(!n)
+			return;
+
+		if((r = preadv(myFileSystem->fdVirtualDisk, iov, n, (off_t)(lba + first) * BLOCK_SIZE_BYTES)) == -1)
+			perror("Failed preadv in cachePrefetch");
+		// Blocks past the end of the file are zeros
+		for(j = 0; r >= 0 && j < n; j++) {
+			ssize_t got = r - (ssize_t)j * BLOCK_SIZE_BYTES;
+			if(got < BLOCK_SIZE_BYTES)
+				memset(cache->slots[slots[j]].data + (got > 0 ? got : 0), 0, BLOCK_SIZE_BYTES - (got > 0 ? got : 0));
+			sums[j] = blockChecksum(cache->slots[slots[j]].data);
+		}
+
+		// A block that does not match its checksum is not kept: the read that needs it finds the mismatch and
+		// reports it. getChecksum may drop the lock, the slots stay pinned
+		pthread_mutex_lock(&cache->lock);
+		for(j = 0; r >= 0 && j < n; j++) {
+			uint32_t sum = getChecksum(myFileSystem, lba + first + j);
+			valid[j] = sum == NO_CHECKSUM || sum == sums[j];
+		}
+		for(j = 0; j < n; j++) {
+			CacheBlock *cb = &cache->slots[slots[j]];
+			cb->pinCount = 0;
+			// Somebody may have brought the block meanwhile: that copy wins
+			if(r == -1 || !valid[j] || lookupSlot(cache, lba + first + j) != NO_SLOT)
+				continue;
+			cb->lba = lba + first + j;
+			cb->dirty = false;
+			cb->referenced = true;
+			cb->nextInHash = cache->hash[HASH(cb->lba)];
+			cache->hash[HASH(cb->lba)] = slots[j];
+			cache->prefetched++;
+		}
+		pthread_mutex_unlock(&cache->lock);
+		if(r == -1)
+			return;
+	}
+}
+
+void cacheInvalidate(MyFileSystem *myFileSystem, DISK_LBA lba) {
+	BlockCache *cache = myFileSystem->cache;
+	int s;
+
+	pthread_mutex_lock(&cache->lock);
+	// A write back of the block running meanwhile would store its checksum again
+	s = cache->map && !IS_COMPRESSED(lba) ? NO_SLOT : waitSlot(cache, lba);
+	if(cache->map && !IS_COMPRESSED(lba)) {
+		// Its contents stay in the file, but there is no need to sync them
+		if(!checkMapped(cache, lba, 1))
+			setMapDirty(cache, lba, 1, false);
+	}
+	else if(s != NO_SLOT) {
+		assert(cache->slots[s].pinCount == 0);
+		cache->slots[s].dirty = false;
+		cache->slots[s].referenced = false;
+		unlinkSlot(cache, s);
+	}
+	// Nothing to verify in a free block (stored once the block is gone: setChecksum may drop the lock). A block
+	// of a compressed cluster only has the inflated copy
+	if(!IS_COMPRESSED(lba))
+		setChecksum(myFileSystem, lba, NO_CHECKSUM);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static int compareSlotsByLBA(const void *a, const void *b) {
+	const CacheBlock *x = *(const CacheBlock **)a;
+	const CacheBlock *y = *(const CacheBlock **)b;
+	return (x->lba > y->lba) - (x->lba < y->lba);
+}
+
+/**
+* @brief cacheFlush for mmap mode: every run of dirty blocks goes to disk with one msync. Called with the cache lock
+* 	 held, which is dropped during each msync
+**/
+static int mapFlush(MyFileSystem *myFileSystem) {
+	BlockCache *cache = myFileSystem->cache;
+	DISK_LBA i, j;
+	int ret = 0, synced;
+
+	for(i = 0; i < cache->mapBlocks; i = j) {
+		// Whole words of clean blocks at once
+		if(cache->mapDirty[i / 64] == 0) {
+			j = (i / 64 + 1) * 64;
+			continue;
+		}
+		if(!MAP_DIRTY(cache, i)) {
+			j = i + 1;
+			continue;
+		}
+		// The bits are cleared first: a block modified during the msync is synced (and its checksum computed) again next time
+		for(j = i; j < cache->mapBlocks && MAP_DIRTY(cache, j); j++) {
+			setMapDirty(cache, j, 1, false);
+			setChecksum(myFileSystem, j, blockChecksum(MAP_BLOCK(cache, j)));
+		}
+		pthread_mutex_unlock(&cache->lock);
+		synced = msync(MAP_BLOCK(cache, i), (size_t)(j - i) * BLOCK_SIZE_BYTES, MS_SYNC);
+		pthread_mutex_lock(&cache->lock);
+		if(synced == -1) {
+			perror("Failed msync in cacheFlush");
+			ret = -EIO;
+			continue;
+		}
+		cache->writeBacks += j - i;
+	}
+	return ret;
+}
+
+/**
+* @brief Takes a dirty slot for writeBackSlots: it becomes clean and busy. Called with the cache lock held
+**/
+static void takeDirtySlot(CacheBlock *cb) {
+	cb->dirty = false;
+	cb->busy = true;
+}
+
+/**
+* @brief Writes a list of slots taken with takeDirtySlot, sorted by LBA, consecutive blocks in a single pwritev.
+* 	 Called with the cache lock held, which is dropped during the writes: nobody evicts or reads a busy slot, and
+* 	 its owner marks it dirty again if it changes it meanwhile. A pinned slot may change while it is written, so
+* 	 a copy of it is written instead: the checksums are always those of the bytes written. A slot that fails to
+* 	 be written stays dirty
+**/
+static int writeBackSlots(MyFileSystem *myFileSystem, CacheBlock **dirty, int numDirty) {
+	BlockCache *cache = myFileSystem->cache;
+	struct iovec iov[CACHE_NUM_BLOCKS];
+	uint32_t sums[CACHE_NUM_BLOCKS];
+	BOOLEAN written[CACHE_NUM_BLOCKS], pinned[CACHE_NUM_BLOCKS];
+	char *copies = NULL;
+	int i, j, k, numPinned = 0, ret = 0;
+
+	for(i = 0; i < numDirty; i++) {
+		pinned[i] = dirty[i]->pinCount > 0;
+		numPinned += pinned[i];
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if(numPinned && (copies = malloc((size_t)numPinned * BLOCK_SIZE_BYTES)) == NULL)
+		perror("Error in malloc");
+	for(i = 0, numPinned = 0; i < numDirty; i = j) {
+		int numIov = 0;
+		// Without room for its copy a pinned slot waits for the next write back
+		if(pinned[i] && !copies) {
+			written[i] = false;
+			ret = -ENOMEM;
+			j = i + 1;
+			continue;
+		}
+		for(j = i; j < numDirty && numIov < IOV_MAX && dirty[j]->lba == dirty[i]->lba + (j - i) && (!pinned[j] || copies); j++) {
+			iov[numIov].iov_base = dirty[j]->data;
+			if(pinned[j]) {
+				iov[numIov].iov_base = copies + (size_t)numPinned++ * BLOCK_SIZE_BYTES;
+				memcpy(iov[numIov].iov_base, dirty[j]->data, BLOCK_SIZE_BYTES);
+			}
+			iov[numIov].iov_len = BLOCK_SIZE_BYTES;
+			sums[j] = blockChecksum(iov[numIov].iov_base);
+			numIov++;
+		}
+		written[i] = pwritev(myFileSystem->fdVirtualDisk, iov, numIov, (off_t)dirty[i]->lba * BLOCK_SIZE_BYTES) == (ssize_t)numIov * BLOCK_SIZE_BYTES;
+		if(!written[i]) {
+			perror("Failed pwritev in cacheFlush");
+			ret = -EIO;
+		}
+		for(k = i; k < j; k++)
+			written[k] = written[i];
+	}
+	free(copies);
+	pthread_mutex_lock(&cache->lock);
+
+	// The slots stay busy until their checksums are stored (setChecksum may drop the lock)
+	for(i = 0; i < numDirty; i++) {
+		if(written[i]) {
+			setChecksum(myFileSystem, dirty[i]->lba, sums[i]);
+			cache->writeBacks++;
+		}
+	}
+	for(i = 0; i < numDirty; i++) {
+		dirty[i]->busy = false;
+		if(!written[i])
+			dirty[i]->dirty = true;
+	}
+	pthread_cond_broadcast(&cache->ioDone);
+	return ret;
+}
+
+int cacheWriteBack(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks) {
+	BlockCache *cache = myFileSystem->cache;
+	CacheBlock *dirty[CACHE_NUM_BLOCKS];
+	int numDirty = 0, i, s, ret;
+
+	// The mapping is already the file
+	if(cache->map)
+		return 0;
+
+	// A block already being written goes on the next flush if it is still dirty
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < numBlocks && numDirty < CACHE_NUM_BLOCKS; i++) {
+		if((s = lookupSlot(cache, lba + i)) != NO_SLOT && cache->slots[s].dirty && !cache->slots[s].busy) {
+			takeDirtySlot(&cache->slots[s]);
+			dirty[numDirty++] = &cache->slots[s];
+		}
+	}
+	ret = writeBackSlots(myFileSystem, dirty, numDirty);
+	if(numDirty)
+		cache->unsynced = true;
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+static int compareFramesByBlock(const void *a, const void *b) {
+	const ChecksumFrame *x = *(const ChecksumFrame **)a;
+	const ChecksumFrame *y = *(const ChecksumFrame **)b;
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+/**
+* @brief Writes the dirty frames of the checksum area, sorted, consecutive blocks in a single pwritev. Called with the cache
+* 	 lock held, which is dropped during the writes: the frames are busy meanwhile, a checksum stored in one waits for it
+**/
+static int writeChecksums(MyFileSystem *myFileSystem) {
+	BlockCache *cache = myFileSystem->cache;
+	ChecksumFrame *dirty[CACHE_CHECKSUM_FRAMES];
+	struct iovec iov[CACHE_CHECKSUM_FRAMES];
+	BOOLEAN written[CACHE_CHECKSUM_FRAMES];
+	int numDirty = 0, i, j, k, ret = 0;
+
+	for(i = 0; i < CACHE_CHECKSUM_FRAMES; i++) {
+		ChecksumFrame *frame = &cache->checksumFrames[i];
+		// A frame being written back by evictChecksumFrame must be in the file before the fdatasync
+		while(frame->busy)
+			pthread_cond_wait(&cache->ioDone, &cache->lock);
+		if(frame->block != -1 && frame->dirty) {
+			frame->dirty = false;
+			frame->busy = true;
+			dirty[numDirty++] = frame;
+		}
+	}
+	if(!numDirty)
+		return 0;
+	qsort(dirty, numDirty, sizeof(ChecksumFrame *), compareFramesByBlock);
+
+	pthread_mutex_unlock(&cache->lock);
+	for(i = 0; i < numDirty; i = j) {
+		for(j = i; j < numDirty && dirty[j]->block == dirty[i]->block + (j - i); j++) {
+			iov[j - i].iov_base = dirty[j]->sums;
+			iov[j - i].iov_len = BLOCK_SIZE_BYTES;
+		}
+		written[i] = pwritev(myFileSystem->fdVirtualDisk, iov, j - i, (off_t)(myFileSystem->superBlock.checksumIdx + dirty[i]->block) * BLOCK_SIZE_BYTES) ==
+					 (ssize_t)(j - i) * BLOCK_SIZE_BYTES;
+		if(!written[i]) {
+			perror("Failed pwritev in writeChecksums");
+			ret = -EIO;
+		}
+		for(k = i; k < j; k++)
+			written[k] = written[i];
+	}
+	pthread_mutex_lock(&cache->lock);
+
+	// Tried again on the next flush
+	for(i = 0; i < numDirty; i++) {
+		dirty[i]->busy = false;
+		if(!written[i])
+			dirty[i]->dirty = true;
+	}
+	pthread_cond_broadcast(&cache->ioDone);
+	return ret;
+}
+
+/**
+* @brief True if some frame of the checksum area has to be written. Called with the cache lock held
+**/
+static BOOLEAN checksumsDirty(BlockCache *cache) {
+	int i;
+
+	for(i = 0; i < CACHE_CHECKSUM_FRAMES; i++) {
+		if(cache->checksumFrames[i].dirty || cache->checksumFrames[i].busy)
+			return true;
+	}
+	return false;
+}
+
+int cacheVerifyRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, const char *buf) {
+	int i, ret = 0;
+
+	for(i = 0; i < numBlocks; i++) {
+		if(verifyBlock(myFileSystem, lba + i, buf + (size_t)i * BLOCK_SIZE_BYTES))
+			ret = -EIO;
+	}
+	return ret;
+}
+
+int cacheChecksumRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, const struct iovec *iov, int iovcnt) {
+	BlockCache *cache = myFileSystem->cache;
+	uint32_t *sums;
+	int i;
+
+	if((sums = malloc(numBlocks * sizeof(uint32_t))) == NULL)
+		return -ENOMEM;
+	checksumIov(iov, iovcnt, sums);
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < numBlocks; i++)
+		setChecksum(myFileSystem, lba + i, sums[i]);
+	pthread_mutex_unlock(&cache->lock);
+	free(sums);
+	return 0;
+}
+
+int cacheScrub(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, char *buf) {
+	BlockCache *cache = myFileSystem->cache;
+	uint32_t sums[CACHE_SCRUB_BLOCKS];
+	int i, first = -1, last = -1;
+	ssize_t n;
+
+	// Nothing is verified in mmap mode
+	assert(numBlocks <= CACHE_SCRUB_BLOCKS);
+	if(cache->map)
+		return 0;
+
+	// Only the blocks from the first to the last one with a checksum are read
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < numBlocks; i++) {
+		if(getChecksum(myFileSystem, lba + i) != NO_CHECKSUM) {
+			if(first < 0)
+				first = i;
+			last = i;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	if(first < 0)
+		return 0;
+	lba += first;
+	numBlocks = last - first + 1;
+
+	if((n = pread(myFileSystem->fdVirtualDisk, buf, (size_t)numBlocks * BLOCK_SIZE_BYTES, (off_t)lba * BLOCK_SIZE_BYTES)) == -1) {
+		perror("Failed pread in cacheScrub");
+		return -EIO;
+	}
+	if(n < (ssize_t)numBlocks * BLOCK_SIZE_BYTES)
+		memset(buf + n, 0, (size_t)numBlocks * BLOCK_SIZE_BYTES - n);
+	for(i = 0; i < numBlocks; i++)
+		sums[i] = blockChecksum(buf + (size_t)i * BLOCK_SIZE_BYTES);
+
+	// A block written after the pread does not match: it is read again holding the lock, when nobody but
+	// cacheWriteRun writes the backup file. Cached blocks may be newer than the backup file, they are skipped
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < numBlocks; i++) {
+		// Before the lookup: getChecksum may drop the lock
+		uint32_t sum = getChecksum(myFileSystem, lba + i);
+		if(sum == NO_CHECKSUM || lookupSlot(cache, lba + i) != NO_SLOT)
+			continue;
+		if(sum != sums[i]) {
+			if(cache->writingRuns)
+				continue;
+			// Counted and reported if it still does not match
+			if(readBlock(myFileSystem, lba + i, buf + (size_t)i * BLOCK_SIZE_BYTES) == 0)
+				checkBlock(myFileSystem, lba + i, blockChecksum(buf + (size_t)i * BLOCK_SIZE_BYTES));
+		}
+		cache->scrubbed++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return numBlocks;
+}
+
+int cacheFlush(MyFileSystem *myFileSystem) {
+	BlockCache *cache = myFileSystem->cache;
+	CacheBlock *dirty[CACHE_NUM_BLOCKS];
+	int numDirty = 0, i, ret = 0;
+	BOOLEAN sync = true;
+	// The blocks freed by the operations already over become holes once this flush is in the disk
+	unsigned long holes = startHoleFlush(myFileSystem);
+
+	// Only the flushes wait for each other: the operations go on while the blocks are written and synced
+	pthread_mutex_lock(&cache->flushLock);
+	pthread_mutex_lock(&cache->lock);
+	if(cache->map) {
+		// msync already waits for the data
+		ret = mapFlush(myFileSystem);
+		sync = checksumsDirty(cache) || holes;
+		if(sync && writeChecksums(myFileSystem))
+			ret = -EIO;
+	}
+	else {
+		for(i = 0; i < CACHE_NUM_BLOCKS; i++) {
+			// A block being written back by evictSlot or cacheWriteBack must be in the file before the fdatasync
+			while(cache->slots[i].busy)
+				pthread_cond_wait(&cache->ioDone, &cache->lock);
+			if(cache->slots[i].lba != -1 && cache->slots[i].dirty && !IS_DELAYED(cache->slots[i].lba)) {
+				takeDirtySlot(&cache->slots[i]);
+				dirty[numDirty++] = &cache->slots[i];
+			}
+		}
+		if(!numDirty && !cache->unsynced && !checksumsDirty(cache) && !holes) {
+			pthread_mutex_unlock(&cache->lock);
+			pthread_mutex_unlock(&cache->flushLock);
+			return 0;
+		}
+
+		// Sorted by LBA, consecutive blocks go to disk in a single pwritev. The checksums go after the data. A
+		// pinned block may be written while its owner is still changing it, but it is marked dirty again when released
+		qsort(dirty, numDirty, sizeof(CacheBlock *), compareSlotsByLBA);
+		ret = writeBackSlots(myFileSystem, dirty, numDirty);
+		if(writeChecksums(myFileSystem))
+			ret = -EIO;
+	}
+	// A run written meanwhile by cacheWriteRun marks the file unsynced again
+	cache->unsynced = false;
+	pthread_mutex_unlock(&cache->lock);
+
+	if(sync && fdatasync(myFileSystem->fdVirtualDisk) == -1) {
+		perror("Failed fdatasync in cacheFlush");
+		ret = -EIO;
+		pthread_mutex_lock(&cache->lock);
+		cache->unsynced = true;
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_mutex_unlock(&cache->flushLock);
+	if(ret == 0)
+		punchFlushedHoles(myFileSystem, holes);
+	return ret;
+}
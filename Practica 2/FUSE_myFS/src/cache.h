@@ -0,0 +1,298 @@
+#ifndef _CACHE_H_
+
+#define _CACHE_H_
+
+#include "myFS.h"
+#include "checksum.h"
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define CACHE_NUM_BLOCKS 1024		// Blocks kept in memory (4 MiB)
+#define CACHE_HASH_SIZE 2048		// Buckets of the LBA index, must be a power of two
+#define NO_SLOT -1
+#define DELAYED_LBA ((DISK_LBA)1 << 62)	// Blocks from here on live only in the cache: they still have no place in the disk
+#define IS_DELAYED(lba) ((lba) >= DELAYED_LBA)
+#define CACHE_DELAYED_MAX (CACHE_NUM_BLOCKS / 2)	// Delayed blocks held at the same time
+#define CACHE_PINNED_TABLES (CACHE_NUM_BLOCKS / 8)	// Tables of open files kept pinned at the same time
+// The slots pinned for long (the delayed blocks, the pinned tables and up to a quarter of the cache being read by
+// cachePrefetch from the readahead thread) never take more than 7/8 of the cache: the rest can always be evicted
+// for the blocks the operations hold while they run
+#define CACHE_SCRUB_BLOCKS 64		// Most blocks verified by a cacheScrub call (256 KiB)
+#define CACHE_CHECKSUM_FRAMES 256	// Blocks of the checksum area kept in memory (1 MiB, the checksums of 1 GiB of disk)
+
+typedef struct CacheBlockStructure {
+	DISK_LBA lba;				// Block stored in this slot, -1 if the slot is empty
+	BOOLEAN dirty;				// Modified in memory, not yet written to the backup file
+	BOOLEAN referenced;			// Used since the clock hand last went over it
+	int pinCount;				// Number of users holding the block (pinned blocks are never evicted)
+	BOOLEAN busy;				// Being read or written without the cache lock: whoever needs the slot waits for ioDone
+	int nextInHash;				// Next slot in the same hash chain
+	char *data;					// BLOCK_SIZE_BYTES of data
+} CacheBlock;
+
+typedef struct ChecksumFrameStructure {
+	int block;					// Block of the checksum area stored in this frame, -1 if the frame is empty
+	BOOLEAN dirty;				// Modified in memory, not yet written to the backup file
+	BOOLEAN referenced;			// Used since the clock hand last went over it
+	BOOLEAN busy;				// Being read or written without the cache lock: whoever needs the frame waits for ioDone
+	uint32_t *sums;				// CHECKSUMS_PER_BLOCK checksums
+} ChecksumFrame;
+
+typedef struct BlockCacheStructure {
+	CacheBlock slots[CACHE_NUM_BLOCKS];	// Cached blocks
+	int hash[CACHE_HASH_SIZE];			// First slot of each hash chain
+	int clockHand;						// Next candidate for eviction
+	char *buffer;						// Memory for all the slots
+	unsigned long hits;					// Requests served from memory
+	unsigned long misses;				// Requests that had to read the backup file
+	unsigned long writeBacks;			// Dirty blocks written to the backup file
+	unsigned long prefetched;			// Blocks brought to memory by cachePrefetch
+	BOOLEAN unsynced;					// Blocks written by cacheWriteRun since the last fdatasync
+	int delayedBlocks;					// Blocks created by cacheNewDelayed still waiting for their place
+	int pinnedTables;					// Pins taken with cacheReservePin
+	DISK_LBA nextDelayed;				// Next number handed out by cacheNewDelayed
+	ChecksumFrame checksumFrames[CACHE_CHECKSUM_FRAMES];	// Blocks of the checksum area in memory: CRC32C of every block as written
+										// to the backup file (NO_CHECKSUM if never written)
+	int *checksumFrameOf;				// Frame of each block of the checksum area, NO_SLOT if it is only in the disk
+	int checksumHand;					// Next frame candidate for eviction
+	char *checksumBuffer;				// Memory for all the frames
+	int writingRuns;					// cacheWriteRun calls whose checksums are not stored yet
+	unsigned long checksumErrors;		// Blocks read from the backup file that did not match their checksum
+	unsigned long scrubbed;				// Blocks verified by cacheScrub
+	unsigned long inflated;				// Compressed clusters read from the backup file
+	pthread_mutex_t lock;				// Protects everything above (not the data of a pinned or busy block)
+	pthread_cond_t ioDone;				// Signaled when a slot or a frame stops being busy
+	pthread_mutex_t flushLock;			// Serializes cacheFlush: the I/O of a flush runs without the lock
+	char *map;							// Whole backup file mapped in memory (-M), NULL when the slots are used
+	DISK_LBA mapBlocks;					// Blocks in the mapping
+	uint64_t *mapDirty;					// Bit map of the blocks of the mapping modified since the last msync
+} BlockCache;
+
+/**
+ * @brief Allocates the block cache of the FS and the frames of its checksum area, which are read from the backup
+ *        file when needed (sized after the super block). Must be called once the virtual disk is open
+ *
+ * @param myFileSystem pointer to the FS
+ * @return 0 on success and <0 on error
+ **/
+int cacheInit(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Maps the first numBlocks blocks of the backup file (growing it if it is shorter) and serves every block
+ *        from the mapping from then on: no read or write calls, a block is modified in place and persisted with
+ *        msync when the cache is flushed. Must be called before the first block is used
+ *
+ * @param myFileSystem pointer to the FS
+ * @param numBlocks size of the disk in blocks
+ * @return 0 on success and <0 on error
+ **/
+int cacheMap(MyFileSystem *myFileSystem, DISK_LBA numBlocks);
+
+/**
+ * @brief Writes back every dirty block and frees the cache
+ *
+ * @param myFileSystem pointer to the FS
+ * @return void
+ **/
+void cacheFree(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Gets a block from the cache, reading it from the backup file on a miss. The block stays pinned until cachePutBlock.
+ *        Threads writing the same block must be serialized by the caller (the lock of the inode that owns it).
+ *        A block of a compressed cluster (COMPRESSED_LBA) is read only: on a miss the whole cluster is inflated and
+ *        its other blocks are kept in the cache too
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba block number
+ * @param load false if the caller is going to overwrite the whole block (it is not read, just zeroed)
+ * @return pointer to the BLOCK_SIZE_BYTES of the block, NULL on error
+ **/
+char *cacheGetBlock(MyFileSystem *myFileSystem, DISK_LBA lba, BOOLEAN load);
+
+/**
+ * @brief Releases a block obtained with cacheGetBlock
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba block number
+ * @param dirty true if the block was modified
+ * @return void
+ **/
+void cachePutBlock(MyFileSystem *myFileSystem, DISK_LBA lba, BOOLEAN dirty);
+
+/**
+ * @brief Takes one of the CACHE_PINNED_TABLES pins that may be held for long (the top level tables of the open files).
+ *        Beyond them a block is got and put as usual, so the long pins never leave the cache without slots to evict
+ *
+ * @param myFileSystem pointer to the FS
+ * @return true if the caller may keep a block pinned, false if every pin is taken
+ **/
+BOOLEAN cacheReservePin(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Gives back a pin taken with cacheReservePin, once the block is released
+ *
+ * @param myFileSystem pointer to the FS
+ * @return void
+ **/
+void cacheReleasePin(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Copies part of a block into buf
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba block number
+ * @param offset first byte inside the block
+ * @param buf destination buffer
+ * @param size number of bytes (offset + size <= BLOCK_SIZE_BYTES)
+ * @return 0 on success and <0 on error
+ **/
+int cacheRead(MyFileSystem *myFileSystem, DISK_LBA lba, int offset, void *buf, int size);
+
+/**
+ * @brief Copies buf into part of a block, marking it dirty. A whole block write does not read it first
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba block number
+ * @param offset first byte inside the block
+ * @param buf source buffer
+ * @param size number of bytes (offset + size <= BLOCK_SIZE_BYTES)
+ * @return 0 on success and <0 on error
+ **/
+int cacheWrite(MyFileSystem *myFileSystem, DISK_LBA lba, int offset, const void *buf, int size);
+
+/**
+ * @brief Creates a zeroed block that lives only in the cache (delayed allocation). It gets a number past
+ *        DELAYED_LBA, stays pinned and is never written until cacheAssignDelayed gives it a place in the disk
+ *
+ * @param myFileSystem pointer to the FS
+ * @return number of the new block, <0 if there are already CACHE_DELAYED_MAX delayed blocks (or no free slot)
+ **/
+DISK_LBA cacheNewDelayed(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Moves the data of a delayed block to its place in the disk: the block becomes a normal dirty block. If the
+ *        block went into a compressed cluster it stays clean instead, as the data the cluster inflates to
+ *
+ * @param myFileSystem pointer to the FS
+ * @param delayed number returned by cacheNewDelayed
+ * @param lba block of the disk assigned to it, or COMPRESSED_LBA of its place in a compressed cluster
+ * @return void
+ **/
+void cacheAssignDelayed(MyFileSystem *myFileSystem, DISK_LBA delayed, DISK_LBA lba);
+
+/**
+ * @brief Forgets a delayed block (its file was truncated before it got a place)
+ *
+ * @param myFileSystem pointer to the FS
+ * @param delayed number returned by cacheNewDelayed
+ * @return void
+ **/
+void cacheDropDelayed(MyFileSystem *myFileSystem, DISK_LBA delayed);
+
+/**
+ * @brief Writes the dirty blocks of a run with one pwritev per group of consecutive ones, without waiting for the disk
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba first block
+ * @param numBlocks number of blocks
+ * @return 0 on success and <0 on error
+ **/
+int cacheWriteBack(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks);
+
+/**
+ * @brief Writes numBlocks consecutive whole blocks with a single pwritev, bypassing the cache: the cached copies of
+ *        the blocks are dropped first. The data reaches the disk for good on the next cacheFlush
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba first block
+ * @param numBlocks number of blocks
+ * @param iov data (numBlocks * BLOCK_SIZE_BYTES bytes in total)
+ * @param iovcnt entries of iov
+ * @return 0 on success and <0 on error
+ **/
+int cacheWriteRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Reads numBlocks consecutive blocks. Cached blocks are copied from memory and every run of
+ *        blocks not cached is read with a single pread straight into buf (without filling the cache)
+ *        and verified against the checksums. The blocks of compressed clusters go through the cache
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba first block
+ * @param numBlocks number of blocks
+ * @param buf destination buffer (numBlocks * BLOCK_SIZE_BYTES)
+ * @return 0 on success and <0 on error
+ **/
+int cacheReadRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, char *buf);
+
+/**
+ * @brief Brings a run of blocks to the cache ahead of their use, with one preadv per run of blocks not cached
+ *        (compressed clusters are inflated). Never takes more than a quarter of the cache. The blocks must not be
+ *        written around the cache meanwhile (the caller holds the lock of the file they belong to)
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba first block
+ * @param numBlocks number of blocks
+ * @return void
+ **/
+void cachePrefetch(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks);
+
+/**
+ * @brief Drops a block from the cache without writing it back (used when the block is freed, or a compressed
+ *        cluster with it)
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba block number
+ * @return void
+ **/
+void cacheInvalidate(MyFileSystem *myFileSystem, DISK_LBA lba);
+
+/**
+ * @brief Verifies blocks read from the backup file without the cache (the metadata loaded by myMount)
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba first block
+ * @param numBlocks number of blocks
+ * @param buf data of the blocks
+ * @return 0 on success, -EIO if a block does not match its checksum
+ **/
+int cacheVerifyRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, const char *buf);
+
+/**
+ * @brief Stores the checksums of a run of blocks written around the cache (the metadata written by myMkfs): they
+ *        reach the checksum area on the next cacheFlush
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba first block
+ * @param numBlocks number of blocks
+ * @param iov data (numBlocks * BLOCK_SIZE_BYTES bytes in total)
+ * @param iovcnt entries of iov
+ * @return 0 on success and <0 on error
+ **/
+int cacheChecksumRun(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Reads a run of blocks from the backup file and verifies their checksums (scrubbing). The blocks without
+ *        checksum are not read, nor those cached (the backup file may hold an older version) or being written
+ *        around the cache. Does nothing in mmap mode
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba first block
+ * @param numBlocks number of blocks (up to CACHE_SCRUB_BLOCKS)
+ * @param buf scratch buffer (numBlocks * BLOCK_SIZE_BYTES)
+ * @return number of blocks read, <0 on error
+ **/
+int cacheScrub(MyFileSystem *myFileSystem, DISK_LBA lba, int numBlocks, char *buf);
+
+/**
+ * @brief Writes every dirty block to the backup file, merging consecutive blocks in a single write (a single msync
+ *        in mmap mode), and then the dirty frames of the checksum area. Delayed blocks are not written.
+ *        The writes and the fdatasync run without the cache lock, only other flushes wait.
+ *        Once the backup file is synchronized the blocks freed by the operations already over become holes
+ *
+ * @param myFileSystem pointer to the FS
+ * @return 0 on success and <0 on error
+ **/
+int cacheFlush(MyFileSystem *myFileSystem);
+
+#endif
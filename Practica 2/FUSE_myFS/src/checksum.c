@@ -0,0 +1,103 @@
+#include "checksum.h"
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSTRUCTION "sse4.2"
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define HAVE_CRC32_INSTRUCTION "+crc"
+#endif
+
+#define CRC32C_POLY 0x82F63B78		// Reversed Castagnoli polynomial
+
+static uint32_t crcTable[8][256];	// Slicing by 8: table k gives the CRC of a byte followed by k zero bytes
+static uint32_t (*crcKernel)(uint32_t crc, const unsigned char *p, size_t len);
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+/**
+* @brief Software CRC, 8 bytes per step
+**/
+static uint32_t crcTables(uint32_t crc, const unsigned char *p, size_t len) {
+	while(len && ((uintptr_t)p & 7)) {
+		crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while(len >= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^ crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+		      crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff] ^ crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while(len--)
+		crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef HAVE_CRC32_INSTRUCTION
+/**
+* @brief CRC with the instruction of the CPU, 8 bytes per instruction
+**/
+__attribute__((target(HAVE_CRC32_INSTRUCTION)))
+static uint32_t crcInstruction(uint32_t crc, const unsigned char *p, size_t len) {
+#if defined(__x86_64__)
+	uint64_t c = crc;
+	while(len && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	for(; len >= 8; p += 8, len -= 8)
+		c = _mm_crc32_u64(c, *(const uint64_t *)p);
+	while(len--)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+#elif defined(__i386__)
+	for(; len >= 4; p += 4, len -= 4)
+		crc = _mm_crc32_u32(crc, *(const uint32_t *)p);
+	while(len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+#else
+	for(; len >= 8; p += 8, len -= 8)
+		crc = __crc32cd(crc, *(const uint64_t *)p);
+	while(len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+#endif
+}
+#endif
+
+static void crcInit(void) {
+	uint32_t crc;
+	int i, j, k;
+
+	for(i = 0; i < 256; i++) {
+		crc = i;
+		for(j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crcTable[0][i] = crc;
+	}
+	for(i = 0; i < 256; i++) {
+		for(k = 1; k < 8; k++)
+			crcTable[k][i] = crcTable[0][crcTable[k - 1][i] & 0xff] ^ (crcTable[k - 1][i] >> 8);
+	}
+
+	crcKernel = crcTables;
+#if defined(HAVE_CRC32_INSTRUCTION) && (defined(__x86_64__) || defined(__i386__))
+	if(__builtin_cpu_supports("sse4.2"))
+		crcKernel = crcInstruction;
+#elif defined(HAVE_CRC32_INSTRUCTION)
+	if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crcKernel = crcInstruction;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	pthread_once(&crcOnce, crcInit);
+	return ~crcKernel(~crc, buf, len);
+}
@@ -0,0 +1,17 @@
+#ifndef _CHECKSUM_H_
+
+#define _CHECKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define NO_CHECKSUM 0				// Stored for the blocks never written (or freed): there is nothing to verify
+#define BLOCK_CHECKSUM(crc) ((crc) != NO_CHECKSUM ? (crc) : 1)	// Checksum stored for a block with that CRC
+
+/**
+* @brief CRC32C (Castagnoli) of a buffer, going on from the CRC of the data before it (0 for the first piece).
+* 	 Uses the crc32 instruction (SSE 4.2 or ARMv8) when the CPU has it, tables otherwise
+**/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
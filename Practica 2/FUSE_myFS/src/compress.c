@@ -0,0 +1,51 @@
+#include "compress.h"
+
+#include <string.h>
+#include <zlib.h>
+
+int compressBlocks(char *const blocks[], int numBlocks, char *out) {
+	size_t room = (size_t)(numBlocks - 1) * BLOCK_SIZE_BYTES;
+	uint32_t header[2];
+	z_stream z;
+	int i, ret = Z_OK;
+
+	if(numBlocks < 2 || room <= COMPRESS_HEADER)
+		return 0;
+	memset(&z, 0, sizeof(z));
+	if(deflateInit(&z, COMPRESS_LEVEL) != Z_OK)
+		return 0;
+	z.next_out = (Bytef *)out + COMPRESS_HEADER;
+	z.avail_out = room - COMPRESS_HEADER;
+	// Straight from the blocks, one piece of input each
+	for(i = 0; i < numBlocks && ret == Z_OK; i++) {
+		z.next_in = (Bytef *)blocks[i];
+		z.avail_in = BLOCK_SIZE_BYTES;
+		ret = deflate(&z, i == numBlocks - 1 ? Z_FINISH : Z_NO_FLUSH);
+		if(ret == Z_OK && z.avail_out == 0)
+			ret = Z_BUF_ERROR;
+	}
+	deflateEnd(&z);
+	if(ret != Z_STREAM_END)
+		return 0;
+
+	header[0] = z.total_out;
+	header[1] = numBlocks;
+	memcpy(out, header, COMPRESS_HEADER);
+	// The tail of the last block is not left with garbage
+	i = (COMPRESS_HEADER + z.total_out + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+	memset(out + COMPRESS_HEADER + z.total_out, 0, (size_t)i * BLOCK_SIZE_BYTES - COMPRESS_HEADER - z.total_out);
+	return i;
+}
+
+int inflateBlocks(const char *in, int numBlocks, char *out) {
+	uLongf size = (uLongf)COMPRESS_CLUSTER * BLOCK_SIZE_BYTES;
+	uint32_t header[2];
+
+	memcpy(header, in, COMPRESS_HEADER);
+	if(header[0] > (size_t)numBlocks * BLOCK_SIZE_BYTES - COMPRESS_HEADER || header[1] < 1 || header[1] > COMPRESS_CLUSTER)
+		return -1;
+	if(uncompress((Bytef *)out, &size, (const Bytef *)in + COMPRESS_HEADER, header[0]) != Z_OK ||
+	   size != (uLongf)header[1] * BLOCK_SIZE_BYTES)
+		return -1;
+	return header[1];
+}
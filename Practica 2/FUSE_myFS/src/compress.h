@@ -0,0 +1,22 @@
+#ifndef _COMPRESS_H_
+
+#define _COMPRESS_H_
+
+#include "myFS.h"
+
+#define COMPRESS_LEVEL 1			// zlib level: the fastest one, most of the gain of the others on file data
+#define COMPRESS_HEADER (2 * sizeof(uint32_t))	// Bytes of deflated data and blocks of data, before the data
+
+/**
+* @brief Deflates numBlocks whole blocks (up to COMPRESS_CLUSTER) into out, which has room for numBlocks - 1 blocks.
+* 	 Returns the number of blocks the cluster takes, 0 if that would not save a block
+**/
+int compressBlocks(char *const blocks[], int numBlocks, char *out);
+
+/**
+* @brief Inflates a cluster stored in numBlocks blocks into out (room for COMPRESS_CLUSTER blocks). Returns the
+* 	 number of blocks of data, <0 if the cluster is corrupted
+**/
+int inflateBlocks(const char *in, int numBlocks, char *out);
+
+#endif
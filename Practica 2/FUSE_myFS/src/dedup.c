@@ -0,0 +1,73 @@
+#include "dedup.h"
+#include "indirect.h"
+#include "cache.h"
+
+#include <string.h>
+#include <pthread.h>
+
+// A block of a file, found by the checksum of its data. An entry with nodeIdx 0 is empty: the root is a directory
+typedef struct {
+	uint32_t crc;
+	int nodeIdx;
+	int bl;
+} DedupEntry;
+
+static struct {
+	DedupEntry entries[DEDUP_INDEX_SIZE];	// By the low bits of the checksum, a new block takes the place of the old one
+	pthread_mutex_t lock;
+} dedup = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+* @brief Shares the block of the entry if it still holds the data. The caller holds the lock of the file of the entry
+**/
+static DISK_LBA shareEntry(DedupEntry *e, const char *data) {
+	NodeStruct *node = &myFileSystem.nodes[e->nodeIdx];
+	DISK_LBA lba;
+	char *block;
+	BOOLEAN same;
+
+	// The file may have changed since: only a placed block of a file that is not compressed
+	if(node->freeNode || node->nodeType != NODE_FILE || e->bl >= node->numBlocks)
+		return 0;
+	lba = getBF_from_BL(node, e->bl);
+	if(lba < FIRST_DATA_BLOCK(&myFileSystem) || IS_DELAYED(lba) || IS_COMPRESSED(lba))
+		return 0;
+	if((block = cacheGetBlock(&myFileSystem, lba, true)) == NULL)
+		return 0;
+	if((same = memcmp(block, data, BLOCK_SIZE_BYTES) == 0))
+		shareBlocks(&myFileSystem, lba, 1);
+	cachePutBlock(&myFileSystem, lba, false);
+	return same ? lba : 0;
+}
+
+DISK_LBA dedupBlock(int nodeIdx, int bl, const char *data) {
+	uint32_t crc = crc32c(0, data, BLOCK_SIZE_BYTES);
+	DedupEntry *slot = &dedup.entries[crc & (DEDUP_INDEX_SIZE - 1)], e;
+	DISK_LBA lba = 0;
+
+	__atomic_add_fetch(&myFileSystem.dedupChecked, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&dedup.lock);
+	e = *slot;
+	pthread_mutex_unlock(&dedup.lock);
+
+	// Nobody writes the block while its file is locked, even for reading. Waiting for the lock of another file could
+	// deadlock with a thread doing the same the other way round: if it is busy the block is not shared
+	if(e.nodeIdx > 0 && e.crc == crc && (e.nodeIdx != nodeIdx || e.bl != bl)) {
+		if(e.nodeIdx == nodeIdx) {
+			lba = shareEntry(&e, data);
+		}
+		else if(pthread_rwlock_tryrdlock(&myFileSystem.openNodes[e.nodeIdx].lock) == 0) {
+			lba = shareEntry(&e, data);
+			unlockNode(&myFileSystem, e.nodeIdx);
+		}
+	}
+	if(lba) {
+		__atomic_add_fetch(&myFileSystem.dedupShared, 1, __ATOMIC_RELAXED);
+		return lba;
+	}
+
+	pthread_mutex_lock(&dedup.lock);
+	*slot = (DedupEntry){ crc, nodeIdx, bl };
+	pthread_mutex_unlock(&dedup.lock);
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _DEDUP_H_
+
+#define _DEDUP_H_
+
+#include "myFS.h"
+
+extern MyFileSystem myFileSystem;
+
+#define DEDUP_INDEX_SIZE 65536		// Entries of the content index, must be a power of two (each one remembers a block)
+
+/**
+* @brief Looks for a block of the disk with the same data as the block bl of the node (about to be placed) in the
+* 	 content index. The index keeps the CRC32C of the blocks placed lately and where they are in their file: the block
+* 	 found is compared byte by byte, holding the lock of its file, and shared (shareBlocks). Returns that block, or 0
+* 	 if there is none and then it is the block bl of the node the index remembers for its data. The caller holds the
+* 	 lock of the node for writing
+**/
+DISK_LBA dedupBlock(int nodeIdx, int bl, const char *data);
+
+#endif
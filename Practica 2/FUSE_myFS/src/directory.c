@@ -0,0 +1,526 @@
+#include "directory.h"
+#include "fuseLib.h"
+#include "indirect.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#define KEY_SIZE (MAX_LEN_FILE_NAME + 1)
+
+/**
+* @brief FNV-1a hash of a name and the directory holding it, reduced to a slot of the lookup cache
+**/
+static unsigned int dentryHash(int parent, const char *name) {
+	uint32_t h = (2166136261u ^ (uint32_t)parent) * 16777619u;
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h & (DCACHE_SIZE - 1);
+}
+
+static int dcacheLookup(int parent, const char *name) {
+	unsigned int slot = dentryHash(parent, name);
+	Dentry *d = &myFileSystem.dcache[slot];
+	int nodeIdx = -1;
+
+	pthread_mutex_lock(&myFileSystem.dcacheLocks[slot % DCACHE_LOCKS]);
+	if(d->nodeIdx && d->parent == parent && strcmp(d->name, name) == 0)
+		nodeIdx = d->nodeIdx;
+	pthread_mutex_unlock(&myFileSystem.dcacheLocks[slot % DCACHE_LOCKS]);
+	return nodeIdx;
+}
+
+static void dcacheAdd(int parent, const char *name, int nodeIdx) {
+	unsigned int slot = dentryHash(parent, name);
+	Dentry *d = &myFileSystem.dcache[slot];
+
+	pthread_mutex_lock(&myFileSystem.dcacheLocks[slot % DCACHE_LOCKS]);
+	d->parent = parent;
+	d->nodeIdx = nodeIdx;
+	strcpy(d->name, name);
+	pthread_mutex_unlock(&myFileSystem.dcacheLocks[slot % DCACHE_LOCKS]);
+}
+
+static void dcacheDrop(int parent, const char *name) {
+	unsigned int slot = dentryHash(parent, name);
+	Dentry *d = &myFileSystem.dcache[slot];
+
+	pthread_mutex_lock(&myFileSystem.dcacheLocks[slot % DCACHE_LOCKS]);
+	if(d->parent == parent && strcmp(d->name, name) == 0)
+		d->nodeIdx = 0;
+	pthread_mutex_unlock(&myFileSystem.dcacheLocks[slot % DCACHE_LOCKS]);
+}
+
+/**
+* @brief Gets a page (logical block) of a directory from the block cache, pinned until putPage
+**/
+static DirPage *getPage(NodeStruct *dir, int page, DISK_LBA *lba) {
+	DirPage *p;
+
+	if((*lba = getBF_from_BL(dir, page)) < 1) {
+		fprintf(stderr, "Directory page %d without block\n", page);
+		return NULL;
+	}
+	if((p = (DirPage *)cacheGetBlock(&myFileSystem, *lba, true)) == NULL)
+		return NULL;
+	if(p->type != DIR_PAGE_LEAF && p->type != DIR_PAGE_INTERNAL) {
+		fprintf(stderr, "Corrupted directory page %d (block %" PRId64 ")\n", page, *lba);
+		cachePutBlock(&myFileSystem, *lba, false);
+		return NULL;
+	}
+	return p;
+}
+
+static void putPage(DISK_LBA lba, BOOLEAN dirty) {
+	cachePutBlock(&myFileSystem, lba, dirty);
+}
+
+/**
+* @brief Gets a page that is going to be modified: a page shared with a snapshot gets its own block first
+**/
+static DirPage *getPageForWrite(int dirIdx, int page, DISK_LBA *lba) {
+	if(unshareBlock(dirIdx, page) < 0)
+		return NULL;
+	return getPage(&myFileSystem.nodes[dirIdx], page, lba);
+}
+
+/**
+* @brief Adds a zeroed page at the end of the directory. Returns its number or <0 on error
+**/
+static int newPage(int dirIdx) {
+	int page = myFileSystem.nodes[dirIdx].numBlocks, ret;
+
+	if((ret = resizeNode(dirIdx, (size_t)(page + 1) * BLOCK_SIZE_BYTES)) < 0)
+		return ret;
+	return page;
+}
+
+/**
+* @brief Position of the first entry of a leaf not below name (*found tells if it is name itself)
+**/
+static int leafSearch(DirPage *p, const char *name, int *found) {
+	int low = 0, high = p->count;
+
+	while(low < high) {
+		int mid = (low + high) / 2;
+		if(strcmp(p->entries[mid].name, name) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	*found = low < p->count && strcmp(p->entries[low].name, name) == 0;
+	return low;
+}
+
+/**
+* @brief Child of an internal page to follow for name: the number of keys not above it
+**/
+static int childSearch(DirPage *p, const char *name) {
+	int low = 0, high = p->count;
+
+	while(low < high) {
+		int mid = (low + high) / 2;
+		if(strcmp(p->keys[mid], name) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/**
+* @brief Follows the internal pages from the root down to the leaf where name is or would be
+**/
+static int findLeaf(NodeStruct *dir, const char *name) {
+	int page = 0;
+
+	for(;;) {
+		DISK_LBA lba;
+		DirPage *p = getPage(dir, page, &lba);
+		int next;
+
+		if(p == NULL)
+			return -EIO;
+		if(p->type == DIR_PAGE_LEAF) {
+			putPage(lba, false);
+			return page;
+		}
+		// Without a name we want the first leaf
+		next = p->children[name ? childSearch(p, name) : 0];
+		putPage(lba, false);
+		page = next;
+	}
+}
+
+int dirCreate(int dirIdx) {
+	NodeStruct *dir = &myFileSystem.nodes[dirIdx];
+	DISK_LBA lba;
+	DirPage *p;
+	int ret;
+
+	assert(dir->numBlocks == 0);
+	if((ret = newPage(dirIdx)) < 0)
+		return ret;
+	if((lba = getBF_from_BL(dir, 0)) < 1 || (p = (DirPage *)cacheGetBlock(&myFileSystem, lba, true)) == NULL)
+		return -EIO;
+	p->type = DIR_PAGE_LEAF;
+	putPage(lba, true);
+	return 0;
+}
+
+int dirLookupNode(NodeStruct *dir, const char *name) {
+	int page, pos, found, nodeIdx;
+	DISK_LBA lba;
+	DirPage *p;
+
+	if((page = findLeaf(dir, name)) < 0)
+		return page;
+	if((p = getPage(dir, page, &lba)) == NULL)
+		return -EIO;
+	pos = leafSearch(p, name, &found);
+	nodeIdx = found ? p->entries[pos].nodeIdx : -ENOENT;
+	putPage(lba, false);
+	return nodeIdx;
+}
+
+int dirLookup(int dirIdx, const char *name) {
+	int nodeIdx;
+
+	if((nodeIdx = dcacheLookup(dirIdx, name)) != -1)
+		return nodeIdx;
+	if((nodeIdx = dirLookupNode(&myFileSystem.nodes[dirIdx], name)) >= 0)
+		dcacheAdd(dirIdx, name, nodeIdx);
+	return nodeIdx;
+}
+
+/**
+* @brief Inserts name in the subtree below page. A full page is split first: its upper half moves to a new
+* 	 page, returned in *sibling together with the lowest name it holds (splitKey). Returns 0 or <0 on error
+**/
+static int insertInPage(int dirIdx, int page, const char *name, int nodeIdx, int *sibling, char *splitKey) {
+	NodeStruct *dir = &myFileSystem.nodes[dirIdx];
+	DISK_LBA lba, siblingLba = 0;
+	DirPage *p, *q = NULL, *target;
+	int pos, found, half, ret;
+
+	// The pages on the way down are all modified if the leaf splits up to the root
+	*sibling = 0;
+	if((p = getPageForWrite(dirIdx, page, &lba)) == NULL)
+		return -EIO;
+
+	if(p->type == DIR_PAGE_LEAF) {
+		pos = leafSearch(p, name, &found);
+		if(found) {
+			putPage(lba, false);
+			return -EEXIST;
+		}
+		target = p;
+		if(p->count == DIR_LEAF_ENTRIES) {
+			// The page is released while the directory grows
+			putPage(lba, false);
+			if((ret = newPage(dirIdx)) < 0)
+				return ret;
+			*sibling = ret;
+			if((p = getPage(dir, page, &lba)) == NULL)
+				return -EIO;
+			if((siblingLba = getBF_from_BL(dir, *sibling)) < 1 ||
+			   (q = (DirPage *)cacheGetBlock(&myFileSystem, siblingLba, true)) == NULL) {
+				putPage(lba, false);
+				return -EIO;
+			}
+			half = p->count / 2;
+			q->type = DIR_PAGE_LEAF;
+			q->count = p->count - half;
+			memcpy(q->entries, p->entries + half, q->count * sizeof(DirEntry));
+			q->next = p->next;
+			p->next = *sibling;
+			p->count = half;
+			strcpy(splitKey, q->entries[0].name);
+			if(pos > half) {
+				target = q;
+				pos -= half;
+			}
+			else {
+				target = p;
+			}
+		}
+		memmove(&target->entries[pos + 1], &target->entries[pos], (target->count - pos) * sizeof(DirEntry));
+		strcpy(target->entries[pos].name, name);
+		target->entries[pos].nodeIdx = nodeIdx;
+		target->count++;
+	}
+	else {
+		int i = childSearch(p, name), child = p->children[i], childSibling;
+		char childKey[KEY_SIZE];
+
+		putPage(lba, false);
+		if((ret = insertInPage(dirIdx, child, name, nodeIdx, &childSibling, childKey)) < 0 || !childSibling)
+			return ret;
+
+		// The child was split: its new sibling goes right after it
+		if((p = getPage(dir, page, &lba)) == NULL)
+			return -EIO;
+		target = p;
+		if(p->count == DIR_INTERNAL_KEYS) {
+			putPage(lba, false);
+			if((ret = newPage(dirIdx)) < 0)
+				return ret;
+			*sibling = ret;
+			if((p = getPage(dir, page, &lba)) == NULL)
+				return -EIO;
+			if((siblingLba = getBF_from_BL(dir, *sibling)) < 1 ||
+			   (q = (DirPage *)cacheGetBlock(&myFileSystem, siblingLba, true)) == NULL) {
+				putPage(lba, false);
+				return -EIO;
+			}
+			// The middle key goes up, the keys above it (and their children) to the new page
+			half = p->count / 2;
+			strcpy(splitKey, p->keys[half]);
+			q->type = DIR_PAGE_INTERNAL;
+			q->count = p->count - half - 1;
+			memcpy(q->keys, p->keys[half + 1], q->count * KEY_SIZE);
+			memcpy(q->children, &p->children[half + 1], (q->count + 1) * sizeof(int));
+			p->count = half;
+			target = p;
+			if(i > half) {
+				target = q;
+				i -= half + 1;
+			}
+		}
+		memmove(target->keys[i + 1], target->keys[i], (target->count - i) * KEY_SIZE);
+		memmove(&target->children[i + 2], &target->children[i + 1], (target->count - i) * sizeof(int));
+		strcpy(target->keys[i], childKey);
+		target->children[i + 1] = childSibling;
+		target->count++;
+	}
+
+	putPage(lba, true);
+	if(q != NULL)
+		putPage(siblingLba, true);
+	return 0;
+}
+
+/**
+* @brief Height of the tree (1 when the root is a leaf)
+**/
+static int treeHeight(NodeStruct *dir) {
+	int page = 0, height = 1;
+
+	for(;;) {
+		DISK_LBA lba;
+		DirPage *p = getPage(dir, page, &lba);
+		int type, next;
+
+		if(p == NULL)
+			return -EIO;
+		type = p->type;
+		next = p->children[0];
+		putPage(lba, false);
+		if(type == DIR_PAGE_LEAF)
+			return height;
+		page = next;
+		height++;
+	}
+}
+
+int dirInsert(int dirIdx, const char *name, int nodeIdx) {
+	NodeStruct *dir = &myFileSystem.nodes[dirIdx];
+	int height, sibling, left, ret;
+	char splitKey[KEY_SIZE];
+	DISK_LBA lba, leftLba;
+	DirPage *root, *l;
+
+	// An insertion splits at most one page per level plus the root: once it starts there must be space for all of them
+	if((height = treeHeight(dir)) < 0)
+		return height;
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	ret = myFileSystem.superBlock.numOfFreeBlocks < height + 1 +
+	      indirectBlocksFor(dir->numBlocks + height + 1) - indirectBlocksFor(dir->numBlocks);
+	pthread_mutex_unlock(&myFileSystem.allocLock);
+	if(ret)
+		return -ENOSPC;
+
+	if((ret = insertInPage(dirIdx, 0, name, nodeIdx, &sibling, splitKey)) < 0)
+		return ret;
+
+	if(sibling) {
+		// The root stays in page 0: its lower half moves to a new page and the root points to both halves
+		if((left = newPage(dirIdx)) < 0)
+			return left;
+		if((root = getPage(dir, 0, &lba)) == NULL)
+			return -EIO;
+		if((leftLba = getBF_from_BL(dir, left)) < 1 ||
+		   (l = (DirPage *)cacheGetBlock(&myFileSystem, leftLba, true)) == NULL) {
+			putPage(lba, false);
+			return -EIO;
+		}
+		memcpy(l, root, sizeof(DirPage));
+		l->numEntries = 0;
+		root->type = DIR_PAGE_INTERNAL;
+		root->count = 1;
+		root->next = 0;
+		root->children[0] = left;
+		root->children[1] = sibling;
+		strcpy(root->keys[0], splitKey);
+		putPage(leftLba, true);
+		putPage(lba, true);
+	}
+
+	if((root = getPage(dir, 0, &lba)) == NULL)
+		return -EIO;
+	root->numEntries++;
+	putPage(lba, true);
+
+	dcacheAdd(dirIdx, name, nodeIdx);
+	return 0;
+}
+
+int dirRemove(int dirIdx, const char *name) {
+	NodeStruct *dir = &myFileSystem.nodes[dirIdx];
+	int page, pos, found, left;
+	DISK_LBA lba;
+	DirPage *p;
+
+	dcacheDrop(dirIdx, name);
+	if((page = findLeaf(dir, name)) < 0)
+		return page;
+	if((p = getPageForWrite(dirIdx, page, &lba)) == NULL)
+		return -EIO;
+	pos = leafSearch(p, name, &found);
+	if(!found) {
+		putPage(lba, false);
+		return -ENOENT;
+	}
+	// Pages are not merged: a leaf may stay empty until the whole directory is empty
+	memmove(&p->entries[pos], &p->entries[pos + 1], (p->count - pos - 1) * sizeof(DirEntry));
+	p->count--;
+	putPage(lba, true);
+
+	if((p = getPageForWrite(dirIdx, 0, &lba)) == NULL)
+		return -EIO;
+	left = --p->numEntries;
+	if(left == 0 && dir->numBlocks > 1) {
+		p->type = DIR_PAGE_LEAF;
+		p->count = 0;
+		p->next = 0;
+	}
+	putPage(lba, true);
+
+	if(left == 0 && dir->numBlocks > 1)
+		return resizeNode(dirIdx, BLOCK_SIZE_BYTES);
+	return 0;
+}
+
+int dirNumEntries(int dirIdx) {
+	DISK_LBA lba;
+	DirPage *p;
+	int numEntries;
+
+	if((p = getPage(&myFileSystem.nodes[dirIdx], 0, &lba)) == NULL)
+		return -EIO;
+	numEntries = p->numEntries;
+	putPage(lba, false);
+	return numEntries;
+}
+
+int dirForEach(int dirIdx, DirVisitor visit, void *arg) {
+	return dirForEachNode(&myFileSystem.nodes[dirIdx], visit, arg);
+}
+
+int dirForEachNode(NodeStruct *dir, DirVisitor visit, void *arg) {
+	int page, i;
+
+	// Leaves are chained in name order (page 0 is never the next one: it is the root)
+	if((page = findLeaf(dir, NULL)) < 0)
+		return page;
+	do {
+		DISK_LBA lba;
+		DirPage *p = getPage(dir, page, &lba);
+		int next;
+
+		if(p == NULL)
+			return -EIO;
+		for(i = 0; i < p->count; i++) {
+			if(visit(arg, p->entries[i].name, p->entries[i].nodeIdx)) {
+				putPage(lba, false);
+				return 0;
+			}
+		}
+		next = p->next;
+		putPage(lba, false);
+		page = next;
+	} while(page);
+	return 0;
+}
+
+int nextComponent(const char **path, char *name) {
+	const char *start = *path;
+	int len;
+
+	while(*start == '/')
+		start++;
+	for(len = 0; start[len] && start[len] != '/'; len++)
+		;
+	*path = start + len;
+	if(len > MAX_LEN_FILE_NAME)
+		return -ENAMETOOLONG;
+	memcpy(name, start, len);
+	name[len] = '\0';
+	return len;
+}
+
+/**
+* @brief Looks for name in a directory taking its lock for reading (the directory may have been removed
+* 	 since it was found)
+**/
+static int lookupLocked(int dirIdx, const char *name) {
+	NodeStruct *dir;
+	int ret;
+
+	lockNode(&myFileSystem, dirIdx, false);
+	dir = &myFileSystem.nodes[dirIdx];
+	if(dir->freeNode)
+		ret = -ENOENT;
+	else if(dir->nodeType != NODE_DIRECTORY)
+		ret = -ENOTDIR;
+	else
+		ret = dirLookup(dirIdx, name);
+	unlockNode(&myFileSystem, dirIdx);
+	return ret;
+}
+
+int lookupPath(const char *path) {
+	char name[KEY_SIZE];
+	int nodeIdx = ROOT_NODE, len;
+
+	// Only one directory is locked at a time
+	while((len = nextComponent(&path, name)) != 0) {
+		if(len < 0)
+			return len;
+		if((nodeIdx = lookupLocked(nodeIdx, name)) < 0)
+			return nodeIdx;
+	}
+	return nodeIdx;
+}
+
+int lookupParent(const char *path, char *name) {
+	char next[KEY_SIZE];
+	int dirIdx = ROOT_NODE, len;
+
+	if((len = nextComponent(&path, name)) <= 0)
+		return len ? len : -EINVAL;
+	while((len = nextComponent(&path, next)) != 0) {
+		if(len < 0)
+			return len;
+		// name was not the last component: go down into it
+		if((dirIdx = lookupLocked(dirIdx, name)) < 0)
+			return dirIdx;
+		strcpy(name, next);
+	}
+	return dirIdx;
+}
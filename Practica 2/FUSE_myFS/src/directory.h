@@ -0,0 +1,78 @@
+#ifndef _DIRECTORY_H_
+
+#define _DIRECTORY_H_
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include "myFS.h"
+
+extern MyFileSystem myFileSystem;
+
+// The dir* functions expect the caller to hold the lock of the directory (for writing if they modify it)
+
+/**
+* @brief Callback of dirForEach, called once per entry in name order. Returning non zero stops the walk
+**/
+typedef int (*DirVisitor)(void *arg, const char *name, int nodeIdx);
+
+/**
+* @brief Turns a node without blocks into an empty directory (a tree with a single empty leaf)
+**/
+int dirCreate(int dirIdx);
+
+/**
+* @brief Looks for a name in a directory. Returns its inode, -ENOENT if it is not there or -EIO
+**/
+int dirLookup(int dirIdx, const char *name);
+
+/**
+* @brief dirLookup for a copy of an inode (the directory of a snapshot): the lookup cache is not used
+**/
+int dirLookupNode(NodeStruct *dir, const char *name);
+
+/**
+* @brief Adds a name to a directory, growing it page by page. Returns 0, -EEXIST, -ENOSPC or -EIO
+**/
+int dirInsert(int dirIdx, const char *name, int nodeIdx);
+
+/**
+* @brief Removes a name from a directory. A directory left empty shrinks back to a single page.
+* 	 Returns 0, -ENOENT or -EIO
+**/
+int dirRemove(int dirIdx, const char *name);
+
+/**
+* @brief Number of names in a directory (<0 on error)
+**/
+int dirNumEntries(int dirIdx);
+
+/**
+* @brief Calls visit for every entry of the directory, in name order
+**/
+int dirForEach(int dirIdx, DirVisitor visit, void *arg);
+
+/**
+* @brief dirForEach for a copy of an inode (the directory of a snapshot)
+**/
+int dirForEachNode(NodeStruct *dir, DirVisitor visit, void *arg);
+
+/**
+* @brief Copies the next component of *path into name (MAX_LEN_FILE_NAME + 1 bytes) and moves *path past it.
+* 	 Returns its length, 0 when there are no more components or -ENAMETOOLONG
+**/
+int nextComponent(const char **path, char *name);
+
+/**
+* @brief Resolves a full path (starting at the root directory), locking each directory while it is searched.
+* 	 Returns the inode (not locked), -ENOENT, -ENOTDIR or -ENAMETOOLONG
+**/
+int lookupPath(const char *path);
+
+/**
+* @brief Resolves every component of a path but the last one, which is copied into name
+* 	 (MAX_LEN_FILE_NAME + 1 bytes). Returns the inode of the parent directory (not locked, and it is not checked
+* 	 to be a directory) or <0 as lookupPath
+**/
+int lookupParent(const char *path, char *name);
+
+#endif
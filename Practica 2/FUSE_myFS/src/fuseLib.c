@@ -1,4 +1,10 @@
 #include "fuseLib.h"
+#include "indirect.h"
+#include "directory.h"
+#include "cache.h"
+#include "readahead.h"
+#include "scrub.h"
+#include "snapshot.h"
 
 #include <stdio.h>
 #include <time.h>
@@ -9,75 +15,192 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/kdev_t.h>
+#include <sys/uio.h>
+
+/**
+ * @brief Moves the data of a file kept in its inode to its first block, growing it to newSize
+ *
+ * @param idxNode inode number
+ * @param newSize new size for the inode (> NODE_INLINE_BYTES)
+ * @return 0 on success and <0 on error
+ **/
+static int growInline(uint64_t idxNode, size_t newSize) {
+	NodeStruct *node = &myFileSystem.nodes[idxNode];
+	char data[NODE_INLINE_BYTES];
+	int64_t size = node->fileSize;
+	int ret;
+
+	memcpy(data, node->inlineData, size);
+	node->fileSize = 0;
+	if((ret = resizeNode(idxNode, newSize)) < 0) {
+		if(!node->numBlocks) {
+			memcpy(node->inlineData, data, size);
+			node->fileSize = size;
+		}
+		return ret;
+	}
+	/// Making room for the new blocks may have already placed the first one (packed or shared with another file)
+	if((ret = unpackCluster(idxNode, 0)) < 0 || (ret = unshareBlock(idxNode, 0)) < 0)
+		return ret;
+	return cacheWrite(&myFileSystem, getBF_from_BL(node, 0), 0, data, size) ? -EIO : 0;
+}
 
 /**
  * @brief Modifies the data size originally reserved by an inode, reserving or removing space if needed.
+ * The new blocks of an open file are delayed: they only take their place in the disk later on (see allocateDelayed).
+ * A regular file of up to NODE_INLINE_BYTES without blocks keeps its data in the inode.
+ * The caller holds the lock of the inode for writing.
  *
  * @param idxNode inode number
  * @param newSize new size for the inode
  * @return int
  **/
 int resizeNode(uint64_t idxNode, size_t newSize) {
-	NodeStruct *node = myFileSystem.nodes[idxNode];
-	char block[BLOCK_SIZE_BYTES];
-	int i, diff = newSize - node->fileSize;
+	NodeStruct *node = &myFileSystem.nodes[idxNode];
+	OpenNodeStruct *open = &myFileSystem.openNodes[idxNode];
+	char *block;
+	int i, ret;
+	int64_t diff = (int64_t)newSize - node->fileSize;
 
 	if(!diff)
 		return 0;
-
-	memset(block, 0, sizeof(char)*BLOCK_SIZE_BYTES);
+	if((newSize + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES > MAX_BLOCKS_PER_FILE)
+		return -EFBIG;
+
+	/// Data in the inode: only the inode changes
+	if(node->nodeType == NODE_FILE && !node->numBlocks) {
+		if(newSize <= NODE_INLINE_BYTES) {
+			if(diff > 0)
+				memset(node->inlineData + node->fileSize, 0, diff);
+			node->fileSize = newSize;
+			node->modificationTime = time(NULL);
+			updateNode(&myFileSystem, idxNode, node);
+			return 0;
+		}
+		if(node->fileSize)
+			return growInline(idxNode, newSize);
+		// The bytes of the inline data become pointers again
+		memset(node->blocks, 0, sizeof(node->blocks));
+		for(i = 0; i < NIVELES_INDIRECCION; i++)
+			node->indirecto[i] = -1;
+	}
 
 	/// File size increases
 	if(diff > 0) {
 
 		/// Delete the extra conent of the last block if it exists and is not full
 		if(node->numBlocks && node->fileSize % BLOCK_SIZE_BYTES) {
+			// A compressed or shared block cannot be modified in place
+			if((ret = unpackCluster(idxNode, node->numBlocks - 1)) < 0 || (ret = unshareBlock(idxNode, node->numBlocks - 1)) < 0)
+				return ret;
 			//int currentBlock = node->blocks[node->numBlocks - 1];
-			int currentBlock = getBF_of_last_BL(node);
-			if((lseek(myFileSystem.fdVirtualDisk, currentBlock * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-			        (read(myFileSystem.fdVirtualDisk, &block, BLOCK_SIZE_BYTES) == -1)) {
-				perror("Failed lseek/read in resizeNode");
+			DISK_LBA currentBlock = getBF_of_last_BL(node);
+			if((block = cacheGetBlock(&myFileSystem, currentBlock, true)) == NULL) {
+				fprintf(stderr, "Failed read in resizeNode\n");
 				return -EIO;
 			}
 			int offBlock = node->fileSize % BLOCK_SIZE_BYTES;
 			int bytes2Write = (diff > (BLOCK_SIZE_BYTES - offBlock)) ? BLOCK_SIZE_BYTES - offBlock : diff;
-			for(i = 0; i < bytes2Write; i++) {
-				block[offBlock++] = 0;
-			}
-
-			if((lseek(myFileSystem.fdVirtualDisk, currentBlock * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-			        (write(myFileSystem.fdVirtualDisk, &block, BLOCK_SIZE_BYTES) == -1)) {
-				perror("Failed lseek/write in resizeNode");
-				return -EIO;
-			}
+			memset(block + offBlock, 0, bytes2Write);
+			cachePutBlock(&myFileSystem, currentBlock, true);
 		}
 
 		/// File size in blocks after the increment
 		int newBlocks = (newSize + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES - node->numBlocks;
 		if(newBlocks) {
-			memset(block, 0, sizeof(char)*BLOCK_SIZE_BYTES);
+			// The indirect tables that the new blocks need are taken from the free blocks too
+			int newTables = indirectBlocksFor(node->numBlocks + newBlocks) - indirectBlocksFor(node->numBlocks);
 
 			// We check that there is enough space
-			if(newBlocks > myFileSystem.superBlock.numOfFreeBlocks)
+			pthread_mutex_lock(&myFileSystem.allocLock);
+			if(newBlocks + newTables > myFileSystem.superBlock.numOfFreeBlocks) {
+				pthread_mutex_unlock(&myFileSystem.allocLock);
 				return -ENOSPC;
-
-			myFileSystem.superBlock.numOfFreeBlocks -= newBlocks;
-			int currentBlock = node->numBlocks;
+			}
+			myFileSystem.superBlock.numOfFreeBlocks -= newBlocks + newTables;
+			pthread_mutex_unlock(&myFileSystem.allocLock);
+			// The tables that get the new pointers may be shared with a snapshot or a clone
+			if(node->numBlocks && (ret = unshareTables(idxNode, node->numBlocks)) < 0) {
+				pthread_mutex_lock(&myFileSystem.allocLock);
+				myFileSystem.superBlock.numOfFreeBlocks += newBlocks + newTables;
+				pthread_mutex_unlock(&myFileSystem.allocLock);
+				return ret;
+			}
+			int currentBlock = node->numBlocks, oldBlocks = node->numBlocks;
+			BOOLEAN retried = false;
 			node->numBlocks += newBlocks;
+			ret = 0;
+
+			// The data blocks of an open file wait in the cache until the file is closed or synchronized: then they
+			// are placed all at once, in long runs, and their first write is their data instead of zeros
+			while(currentBlock != node->numBlocks && node->nodeType == NODE_FILE && open->openCount && !myFileSystem.cache->map) {
+				DISK_LBA delayed = cacheNewDelayed(&myFileSystem);
+				if(delayed < 0) {
+					// Too many delayed blocks: the ones of this file go to disk and the rest of the file
+					// is placed now if there is still no room
+					if(retried || open->delayedFirst < 0)
+						break;
+					retried = true;
+					allocateDelayed(idxNode, true);
+					continue;
+				}
+				if(assignBF_to_BL(node, currentBlock, delayed) < 0) {
+					fprintf(stderr, "Failed to map a block in resizeNode\n");
+					cacheDropDelayed(&myFileSystem, delayed);
+					ret = -EIO;
+					break;
+				}
+				if(open->delayedFirst < 0)
+					open->delayedFirst = currentBlock;
+				currentBlock++;
+			}
 
-			for(i = 0; currentBlock != node->numBlocks; i++) {
-				if(myFileSystem.bitMap[i] == 0) {
-					myFileSystem.bitMap[i] = 1;
-					node->blocks[currentBlock] = i;
+			// The new blocks are taken in runs, starting right after the last block of the file
+			DISK_LBA goal = currentBlock ? nextGoal(getBF_from_BL(node, currentBlock - 1)) : FIRST_DATA_BLOCK(&myFileSystem), first, lba;
+			while(currentBlock != node->numBlocks && ret == 0) {
+				int len = allocBlocks(&myFileSystem, goal, node->numBlocks - currentBlock, &first), runStart = currentBlock;
+				if(len == 0) {
+					ret = -ENOSPC;
+					break;
+				}
+				for(lba = first; lba < first + len; lba++) {
+					if(assignBF_to_BL(node, currentBlock, lba) < 0) {
+						fprintf(stderr, "Failed to map a block in resizeNode\n");
+						ret = -EIO;
+						break;
+					}
 					currentBlock++;
-					// Clean disk (necessary for truncate)
-					if((lseek(myFileSystem.fdVirtualDisk, i * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-					        (write(myFileSystem.fdVirtualDisk, &block, BLOCK_SIZE_BYTES) == -1)) {
-						perror("Failed lseek/write in resizeNode");
-						return -EIO;
+					// A free block is a hole of the backup file: it already reads as zeros. Without holes the disk is
+					// cleaned (necessary for truncate): the cache hands out the block zeroed
+					if(myFileSystem.punchHoles)
+						continue;
+					if(cacheGetBlock(&myFileSystem, lba, false) == NULL) {
+						fprintf(stderr, "Failed to clean a block in resizeNode\n");
+						ret = -EIO;
+						break;
 					}
+					cachePutBlock(&myFileSystem, lba, true);
 				}
+				// The blocks of the run not mapped are not dropped with the block map
+				if(ret < 0 && currentBlock - runStart < len)
+					freeBlocks(&myFileSystem, first + currentBlock - runStart, len - (currentBlock - runStart));
+				goal = first + len;
 			}
+
+			// Half grown: the blocks mapped go back to the bitmap and the whole reservation to numOfFreeBlocks
+			if(ret < 0) {
+				truncateBlockMap(idxNode, oldBlocks);
+				node->numBlocks = oldBlocks;
+				if(open->delayedFirst >= oldBlocks)
+					open->delayedFirst = -1;
+				pthread_mutex_lock(&myFileSystem.allocLock);
+				myFileSystem.superBlock.numOfFreeBlocks += newBlocks + newTables;
+				pthread_mutex_unlock(&myFileSystem.allocLock);
+				updateBitmap(&myFileSystem);
+				return ret;
+			}
+			// Tables created for an open file stay in memory
+			pinIndirectBlockTables(idxNode);
 		}
 		node->fileSize += diff;
 
@@ -86,25 +209,27 @@ int resizeNode(uint64_t idxNode, size_t newSize) {
 	else {
 		// File size in blocks after truncation
 		int numBlocks = (newSize + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
-		myFileSystem.superBlock.numOfFreeBlocks += (node->numBlocks - numBlocks);
-
-		for(i = node->numBlocks; i > numBlocks; i--) {
-			int nBloque = node->blocks[i - 1];
-			myFileSystem.bitMap[nBloque] = 0;
-			// Clean disk (it is not really necessary)
-			if((lseek(myFileSystem.fdVirtualDisk, nBloque * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-			        (write(myFileSystem.fdVirtualDisk, &block, BLOCK_SIZE_BYTES) == -1)) {
-				perror("Failed lseek/write in resizeNode");
-				return -EIO;
-			}
-		}
+
+		// A compressed cluster goes as a whole: if the file now ends in the middle of one, it is unpacked first
+		if((node->flags & NODE_COMPRESSED) && numBlocks % COMPRESS_CLUSTER && numBlocks < node->numBlocks &&
+		   IS_COMPRESSED(getBF_from_BL(node, numBlocks)) && (ret = unpackCluster(idxNode, numBlocks)) < 0)
+			return ret;
+		// The tables kept in part lose some pointers: they cannot be shared with a snapshot or a clone
+		if(numBlocks && numBlocks < node->numBlocks && (ret = unshareTables(idxNode, numBlocks - 1)) < 0)
+			return ret;
+
+		// Data blocks and the tables not needed anymore go back to the bitmap (and out of the cache)
+		int freed = truncateBlockMap(idxNode, numBlocks);
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks += freed;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
 		node->numBlocks = numBlocks;
 		node->fileSize += diff;
+		if(open->delayedFirst >= numBlocks)
+			open->delayedFirst = -1;
 	}
 	node->modificationTime = time(NULL);
 
-	sync();
-	
 	/// Update all the information in the backup file
 	updateSuperBlock(&myFileSystem);
 	updateBitmap(&myFileSystem);
@@ -133,6 +258,70 @@ void mode_string(mode_t mode, char *str) {
 	str[9] = '\0';
 }
 
+/**
+ * @brief Resolves a path and takes the lock of its inode
+ *
+ * @param path full file path
+ * @param write true to lock the inode for writing, false for reading
+ * @return inode number (locked) or <0 on error
+ **/
+static int lockPath(const char *path, BOOLEAN write) {
+	int idxNodoI;
+
+	if((idxNodoI = lookupPath(path)) < 0)
+		return idxNodoI;
+	lockNode(&myFileSystem, idxNodoI, write);
+	// It may have been removed after the lookup
+	if(myFileSystem.nodes[idxNodoI].freeNode) {
+		unlockNode(&myFileSystem, idxNodoI);
+		return -ENOENT;
+	}
+	return idxNodoI;
+}
+
+/**
+ * @brief Fills the attributes of a file from its inode
+ *
+ * @param node inode
+ * @param ino inode number reported
+ * @param stbuf file attributes
+ * @return void
+ **/
+static void fillStat(NodeStruct *node, ino_t ino, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+
+	/// Directory attributes
+	if(node->nodeType == NODE_DIRECTORY) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	}
+	/// Rest of the world
+	else {
+		stbuf->st_mode = S_IFREG | 0644;
+		stbuf->st_nlink = 1;
+	}
+	stbuf->st_ino = ino;
+	stbuf->st_size = node->fileSize;
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	stbuf->st_mtime = stbuf->st_ctime = node->modificationTime;
+}
+
+/**
+ * @brief Attributes of a file of a snapshot (read-only) or of SNAPSHOT_DIR (snap < 0). Their inode numbers are the
+ * handles of their files, out of the range of the inodes of the FS
+ *
+ * @param snap snapshot
+ * @param idxNodoI inode in the snapshot
+ * @param node copy of the inode
+ * @param stbuf file attributes
+ * @return void
+ **/
+static void fillSnapshotStat(int snap, int idxNodoI, NodeStruct *node, struct stat *stbuf) {
+	fillStat(node, SNAPSHOT_HANDLE(snap < 0 ? MAX_SNAPSHOTS : snap, idxNodoI) + 1, stbuf);
+	stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+}
+
 /**
  * @brief Obtains the file attributes of a file just with the filename
  * 
@@ -161,40 +350,65 @@ void mode_string(mode_t mode, char *str) {
  * @return 0 on success and <0 on error
  **/
 static int my_getattr(const char *path, struct stat *stbuf) {
-	NodeStruct *node;
-	int idxDir;
+	NodeStruct node;
+	int idxNodoI, snap;
 
 	fprintf(stderr, "--->>>my_getattr: path %s\n", path);
 
-	memset(stbuf, 0, sizeof(struct stat));
-
-	/// Directory attributes
-	if(strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		stbuf->st_uid = getuid();
-		stbuf->st_gid = getgid();
-		stbuf->st_mtime = stbuf->st_ctime = myFileSystem.superBlock.creationTime;
+	if(snapshotPath(path) != SNAPSHOT_NONE) {
+		if((idxNodoI = snapshotLookup(path, &snap, &node)) < 0)
+			return idxNodoI;
+		fillSnapshotStat(snap, idxNodoI, &node, stbuf);
 		return 0;
 	}
+	if((idxNodoI = lockPath(path, false)) < 0)
+		return idxNodoI;
+	// Used with use_ino. Inode 0 means "no inode" for readdir, so numbers start at 1
+	fillStat(&myFileSystem.nodes[idxNodoI], idxNodoI + 1, stbuf);
+	unlockNode(&myFileSystem, idxNodoI);
+	return 0;
+}
 
-	/// Rest of the world
-	if((idxDir = findFileByName(&myFileSystem, (char *)path + 1)) != -1) {
-		node = myFileSystem.nodes[myFileSystem.directory.files[idxDir].nodeIdx];
-		stbuf->st_size = node->fileSize;
-		stbuf->st_mode = S_IFREG | 0644;
-		stbuf->st_nlink = 1;
-		stbuf->st_uid = getuid();
-		stbuf->st_gid = getgid();
-		stbuf->st_mtime = stbuf->st_ctime = node->modificationTime;
+/**
+ * @brief Obtains the attributes of an open file (fstat), straight from its inode
+ *
+ * @param path file path (NULL, see flag_nopath)
+ * @param stbuf file attributes
+ * @param fi FUSE structure linked to the opened file
+ * @return 0 on success and <0 on error
+ **/
+static int my_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	NodeStruct node;
+
+	fprintf(stderr, "--->>>my_fgetattr: fh %"PRIu64"\n", fi->fh);
+
+	if(IS_SNAPSHOT_HANDLE(fi->fh)) {
+		if(snapshotNode(HANDLE_SNAPSHOT(fi->fh), HANDLE_NODE(fi->fh), &node) < 0)
+			return -EIO;
+		fillSnapshotStat(HANDLE_SNAPSHOT(fi->fh), HANDLE_NODE(fi->fh), &node, stbuf);
 		return 0;
 	}
+	lockNode(&myFileSystem, fi->fh, false);
+	fillStat(&myFileSystem.nodes[fi->fh], fi->fh + 1, stbuf);
+	if(myFileSystem.openNodes[fi->fh].unlinked)
+		stbuf->st_nlink = 0;
+	unlockNode(&myFileSystem, fi->fh);
+	return 0;
+}
+
+// State of readdir handed to the visitor of the directory entries
+typedef struct {
+	void *buf;
+	fuse_fill_dir_t filler;
+} ReaddirArgs;
 
-	return -ENOENT;
+static int fillEntry(void *arg, const char *name, int nodeIdx) {
+	ReaddirArgs *args = arg;
+	return args->filler(args->buf, name, NULL, 0);
 }
 
 /**
- * @brief Reads the content of the root directory
+ * @brief Reads the content of a directory
  *
  * Help from FUSE:
  * 
@@ -225,24 +439,31 @@ static int my_getattr(const char *path, struct stat *stbuf) {
  * @return 0 on success and <0 on error
  **/
 static int my_readdir(const char *path, void *buf, fuse_fill_dir_t filler,  off_t offset, struct fuse_file_info *fi) {
-	int i;
+	ReaddirArgs args = { buf, filler };
+	int idxNodoI, ret;
 
 	fprintf(stderr, "--->>>my_readdir: path %s, offset %jd\n", path, (intmax_t)offset);
 
-	if(strcmp(path, "/") != 0)
-		return -ENOENT;
+	// The entries are dropped if it turns out not to be a directory
+	if(snapshotPath(path) != SNAPSHOT_NONE) {
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		return snapshotReaddir(path, fillEntry, &args);
+	}
+	if((idxNodoI = lockPath(path, false)) < 0)
+		return idxNodoI;
+	if(myFileSystem.nodes[idxNodoI].nodeType != NODE_DIRECTORY) {
+		unlockNode(&myFileSystem, idxNodoI);
+		return -ENOTDIR;
+	}
 
 	filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
 
-	for(i = 0; i < MAX_FILES_PER_DIRECTORY; i++) {
-		if(!(myFileSystem.directory.files[i].freeFile)) {
-			if(filler(buf, myFileSystem.directory.files[i].fileName, NULL, 0) == 1)
-				return -ENOMEM;
-		}
-	}
-
-	return 0;
+	// The leaves of the directory tree are walked in name order
+	ret = dirForEach(idxNodoI, fillEntry, &args);
+	unlockNode(&myFileSystem, idxNodoI);
+	return ret;
 }
 
 /**
@@ -277,83 +498,242 @@ static int my_readdir(const char *path, void *buf, fuse_fill_dir_t filler,  off_
  * @return 0 on success and <0 on error
  **/
 static int my_open(const char *path, struct fuse_file_info *fi) {
-	int idxDir;
+	int idxNodoI;
 
 	fprintf(stderr, "--->>>my_open: path %s, flags %d, %"PRIu64"\n", path, fi->flags, fi->fh);
 
-	//if(findFileByName(path, &idxNodoI)){
-	if((idxDir = findFileByName(&myFileSystem, (char *)path + 1)) == -1) {
-		return -ENOENT;
+	// The files of a snapshot are read-only
+	if(snapshotPath(path) != SNAPSHOT_NONE)
+		return (fi->flags & O_ACCMODE) != O_RDONLY ? -EROFS : snapshotOpen(path, &fi->fh);
+	if((idxNodoI = lockPath(path, true)) < 0)
+		return idxNodoI;
+	if(myFileSystem.nodes[idxNodoI].nodeType == NODE_DIRECTORY) {
+		unlockNode(&myFileSystem, idxNodoI);
+		return -EISDIR;
 	}
 
 	// Save the inode number in file handler to be used in the following calls
-	fi->fh = myFileSystem.directory.files[idxDir].nodeIdx;
+	fi->fh = idxNodoI;
+
+	// While the file is open its block map stays in memory
+	if(myFileSystem.openNodes[fi->fh].openCount++ == 0)
+		readaheadReset(fi->fh);
+	pinIndirectBlockTables(fi->fh);
+	unlockNode(&myFileSystem, idxNodoI);
 
 	return 0;
 }
 
 
 /**
- * @brief Write data on an opened file
+ * @brief Takes the next bytes of a vector of memory buffers as an iovec array, advancing the vector
  *
- * Help from FUSE
+ * @param src buffers (none of them a file descriptor)
+ * @param bytes number of bytes to take
+ * @param iov output array, with room for the buffers left in src
+ * @return number of entries of iov
+ **/
+static int takeIovec(struct fuse_bufvec *src, size_t bytes, struct iovec *iov) {
+	int n = 0;
+
+	while(bytes) {
+		struct fuse_buf *b = &src->buf[src->idx];
+		size_t len = b->size - src->off < bytes ? b->size - src->off : bytes;
+
+		iov[n].iov_base = (char *)b->mem + src->off;
+		iov[n++].iov_len = len;
+		bytes -= len;
+		if((src->off += len) == b->size) {
+			src->idx++;
+			src->off = 0;
+		}
+	}
+	return n;
+}
+
+/**
+ * @brief Writes the data of src in an inode, growing it if needed (common part of write and write_buf)
  *
- * Write should return exactly the number of bytes requested except on error.
- * 
- * @param path file path
- * @param buf buffer where we have data to write
- * @param size quantity of bytes to write
+ * @param idxNode inode of the opened file
+ * @param src data to write (fuse_buf_size(src) bytes)
  * @param offset offset over the writing
- * @param fi FUSE structure linked to the opened file
- * @return 0 on success and <0 on error
+ * @return number of bytes written or <0 on error
  **/
-static int my_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	char buffer[BLOCK_SIZE_BYTES];
-	int bytes2Write = size, totalWrite = 0;
-	NodeStruct *node = myFileSystem.nodes[fi->fh];
+static int writeNode(uint64_t idxNode, struct fuse_bufvec *src, off_t offset) {
+	NodeStruct *node = &myFileSystem.nodes[idxNode];
+	size_t size = fuse_buf_size(src), totalWrite = 0;
+	struct iovec *iov = NULL;
+	int i, ret = size;
+	char *buffer;
+
+	// Whole blocks can go from the request to the disk if the data is in memory (not in a splice pipe)
+	for(i = src->idx; i < src->count && !(src->buf[i].flags & FUSE_BUF_IS_FD); i++)
+		;
+	if(i == src->count && (iov = malloc((src->count - src->idx) * sizeof(struct iovec))) == NULL)
+		return -ENOMEM;
 
-	fprintf(stderr, "--->>>my_write: path %s, size %zu, offset %jd, fh %"PRIu64"\n", path, size, (intmax_t)offset, fi->fh);
+	lockNode(&myFileSystem, idxNode, true);
 
 	// Increase the file size if it is needed
-	if(resizeNode(fi->fh, size + offset) < 0)
-		return -EIO;
+	if(size + offset > node->fileSize && (ret = resizeNode(idxNode, size + offset)) < 0) {
+		unlockNode(&myFileSystem, idxNode);
+		free(iov);
+		return ret;
+	}
+	ret = size;
 
 	// Write data
-	while(bytes2Write) {
-		int i;
-		int currentBlock, offBloque;
-		//currentBlock = node->blocks[offset / BLOCK_SIZE_BYTES];
-		currentBlock = assignBF_to_BL(node, offset/BLOCK_SIZE_BYTES);
-		offBloque = offset % BLOCK_SIZE_BYTES;
-
-		if((lseek(myFileSystem.fdVirtualDisk, currentBlock * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-		        (read(myFileSystem.fdVirtualDisk, &buffer, BLOCK_SIZE_BYTES) == -1)) {
-			perror("Failed lseek/read in my_write");
-			return -EIO;
+	while(totalWrite < size) {
+		int block2Write = (offset + totalWrite) / BLOCK_SIZE_BYTES;
+		int offBloque = (offset + totalWrite) % BLOCK_SIZE_BYTES;
+		size_t bytes2Write = (size - totalWrite < BLOCK_SIZE_BYTES - offBloque) ? size - totalWrite : BLOCK_SIZE_BYTES - offBloque;
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(bytes2Write);
+		DISK_LBA currentBlock;
+		ssize_t copied;
+
+		// The blocks of a compressed cluster, and the shared ones, get their own place before they are modified
+		if(node->numBlocks && ((copied = unpackCluster(idxNode, block2Write)) < 0 || (copied = unshareBlock(idxNode, block2Write)) < 0)) {
+			ret = copied;
+			break;
+		}
+
+		// Runs of consecutive whole blocks: a single pwritev, nothing is read
+		if(iov && !offBloque && size - totalWrite >= BLOCK_SIZE_BYTES) {
+			int numBlocks = getExtent(node, block2Write, (size - totalWrite) / BLOCK_SIZE_BYTES, &currentBlock);
+			if(numBlocks <= 0 || currentBlock <= 0) {
+				ret = -EIO;
+				break;
+			}
+			// Delayed blocks only exist in the cache: they are copied one by one below
+			if(!IS_DELAYED(currentBlock)) {
+				// The run stops before the next shared block (copied on its turn) and at the end of the table
+				// unshared for the first one
+				if(numBlocks > nextTableBlock(block2Write) - block2Write)
+					numBlocks = nextTableBlock(block2Write) - block2Write;
+				for(i = 1; i < numBlocks && !BLOCK_SHARED(&myFileSystem, currentBlock + i); i++)
+					;
+				numBlocks = i;
+				if(cacheWriteRun(&myFileSystem, currentBlock, numBlocks, iov, takeIovec(src, (size_t)numBlocks * BLOCK_SIZE_BYTES, iov))) {
+					ret = -EIO;
+					break;
+				}
+				totalWrite += (size_t)numBlocks * BLOCK_SIZE_BYTES;
+				continue;
+			}
 		}
 
-		for(i = offBloque; (i < BLOCK_SIZE_BYTES) && (totalWrite < size); i++) {
-			buffer[i] = buf[totalWrite++];
+		// Tiny files are written in the inode (updated below)
+		if(!node->numBlocks) {
+			dst.buf[0].mem = node->inlineData + offBloque;
+			if((copied = fuse_buf_copy(&dst, src, 0)) != bytes2Write) {
+				ret = copied < 0 ? copied : -EIO;
+				break;
+			}
+			totalWrite += bytes2Write;
+			continue;
 		}
 
-		if((lseek(myFileSystem.fdVirtualDisk, currentBlock * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-		        (write(myFileSystem.fdVirtualDisk, &buffer, BLOCK_SIZE_BYTES) == -1)) {
-			perror("Failed lseek/write in my_write");
-			return -EIO;
+		// The block is written back to the backup file later on (release, fsync or eviction).
+		// A block covered by the write is not read first
+		currentBlock = getBF_from_BL(node, block2Write);
+		if((buffer = cacheGetBlock(&myFileSystem, currentBlock, bytes2Write != BLOCK_SIZE_BYTES)) == NULL) {
+			fprintf(stderr, "Failed read in my_write\n");
+			ret = -EIO;
+			break;
+		}
+
+		// Straight from the request (memory or the pipe of a splice) into the cached block
+		dst.buf[0].mem = buffer + offBloque;
+		copied = fuse_buf_copy(&dst, src, 0);
+		cachePutBlock(&myFileSystem, currentBlock, true);
+		if(copied != bytes2Write) {
+			ret = copied < 0 ? copied : -EIO;
+			break;
 		}
 
 		// Discont the written stuff
-		bytes2Write -= (i - offBloque);
-		offset += i;
+		totalWrite += bytes2Write;
 	}
-	sync();
-	
+
+	// The super block and the bitmap were updated by resizeNode if the file grew
 	node->modificationTime = time(NULL);
-	updateSuperBlock(&myFileSystem);
-	updateBitmap(&myFileSystem);
-	updateNode(&myFileSystem, fi->fh, node);
+	updateNode(&myFileSystem, idxNode, node);
+	unlockNode(&myFileSystem, idxNode);
+	free(iov);
+
+	return ret;
+}
+
+/**
+ * @brief Write data on an opened file
+ *
+ * Help from FUSE
+ *
+ * Write should return exactly the number of bytes requested except on error.
+ * 
+ * @param path file path (NULL, see flag_nopath)
+ * @param buf buffer where we have data to write
+ * @param size quantity of bytes to write
+ * @param offset offset over the writing
+ * @param fi FUSE structure linked to the opened file
+ * @return number of bytes written or <0 on error
+ **/
+static int my_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	int ret;
+
+	fprintf(stderr, "--->>>my_write: size %zu, offset %jd, fh %"PRIu64"\n", size, (intmax_t)offset, fi->fh);
+
+	src.buf[0].mem = (void *)buf;
+	beginUpdate(&myFileSystem);
+	ret = writeNode(fi->fh, &src, offset);
+	endUpdate(&myFileSystem);
+	return ret;
+}
 
-	return size;
+/**
+ * @brief Write data on an opened file without copying it to an intermediate buffer first
+ *
+ * With splice the data is still in a pipe: it is copied from there into the blocks of the cache.
+ *
+ * @param path file path (NULL, see flag_nopath)
+ * @param buf buffers holding the data
+ * @param offset offset over the writing
+ * @param fi FUSE structure linked to the opened file
+ * @return number of bytes written or <0 on error
+ **/
+static int my_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+	int ret;
+
+	fprintf(stderr, "--->>>my_write_buf: size %zu, offset %jd, fh %"PRIu64"\n", fuse_buf_size(buf), (intmax_t)offset, fi->fh);
+
+	beginUpdate(&myFileSystem);
+	ret = writeNode(fi->fh, buf, offset);
+	endUpdate(&myFileSystem);
+	return ret;
+}
+
+/**
+ * @brief Frees an inode that is in no directory and its blocks. The caller holds the lock of the inode for writing
+ *
+ * @param idxNodoI inode number
+ * @return void
+ **/
+static void dropNode(int idxNodoI) {
+	NodeStruct *node = &myFileSystem.nodes[idxNodoI];
+
+	//We resize the node to 0, which gives its blocks back to the bitmap
+	resizeNode(idxNodoI, 0);
+
+	//We update filesystem information
+	pthread_mutex_lock(&myFileSystem.nodeLock);
+	myFileSystem.numFreeNodes++;
+	node->freeNode = true;
+	updateNodeBitmap(&myFileSystem, idxNodoI, false);
+	pthread_mutex_unlock(&myFileSystem.nodeLock);
+	myFileSystem.openNodes[idxNodoI].unlinked = false;
+	updateBitmap(&myFileSystem);
+	updateNode(&myFileSystem, idxNodoI, node);
 }
 
 /**
@@ -374,80 +754,415 @@ static int my_write(const char *path, const char *buf, size_t size, off_t offset
  **/
 static int my_release(const char *path, struct fuse_file_info *fi) {
 	(void) path;
-	(void) fi;
 
-	fprintf(stderr, "--->>>my_release: path %s\n", path);
+	fprintf(stderr, "--->>>my_release: fh %"PRIu64"\n", fi->fh);
+
+	if(IS_SNAPSHOT_HANDLE(fi->fh)) {
+		snapshotRelease(fi->fh);
+		return 0;
+	}
+	beginUpdate(&myFileSystem);
+	lockNode(&myFileSystem, fi->fh, true);
+	allocateDelayed(fi->fh, false);
+	if(--myFileSystem.openNodes[fi->fh].openCount == 0) {
+		unpinIndirectBlockTables(fi->fh);
+		// Removed from its directory while it was open
+		if(myFileSystem.openNodes[fi->fh].unlinked)
+			dropNode(fi->fh);
+	}
+	unlockNode(&myFileSystem, fi->fh);
+	endUpdate(&myFileSystem);
 
+	// The dirty blocks reach the backup file on fsync, when the cache needs their slots or on unmount
 	return 0;
 }
 
 /**
- * @brief Create a file
+ * @brief Synchronizes the content of a file with the backup file
  *
  * Help from FUSE:
- * 
- * This is called for creation of all non-directory, non-symlink nodes.
- * If the filesystem defines a create() method, then for regular files that will be called instead.
- * 
+ *
+ * If the datasync parameter is non-zero, then only the user data should be flushed, not the meta data.
+ *
  * @param path file path
- * @param mode creation mode
- * @param device device where the device will be created (contains both major and minor numbers)
+ * @param datasync only data must be written
+ * @param fi FUSE structure linked to the opened file
  * @return 0 on success and <0 on error
  **/
-static int my_mknod(const char *path, mode_t mode, dev_t device) {
-	char modebuf[10];
+static int my_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	fprintf(stderr, "--->>>my_fsync: fh %"PRIu64", datasync %d\n", fi->fh, datasync);
 
-	mode_string(mode, modebuf);
-	fprintf(stderr, "--->>>my_mknod: path %s, mode %s, major %d, minor %d\n", path, modebuf, (int)MAJOR(device), (int)MINOR(device));
+	// Nothing of a snapshot changes after it is taken
+	if(IS_SNAPSHOT_HANDLE(fi->fh))
+		return 0;
+	// Delayed blocks have no place in the disk yet
+	beginUpdate(&myFileSystem);
+	lockNode(&myFileSystem, fi->fh, true);
+	allocateDelayed(fi->fh, false);
+	unlockNode(&myFileSystem, fi->fh);
+	endUpdate(&myFileSystem);
+
+	return cacheFlush(&myFileSystem);
+}
 
-	// We check that the length of the file name is correct
-	if(strlen(path + 1) > myFileSystem.superBlock.maxLenFileName) {
-		return -ENAMETOOLONG;
+/**
+ * @brief Synchronizes the whole FS with the backup file (sync mount-point): the operations leave their blocks in the
+ * cache, this is the way to have the backup file consistent while mounted (to check it with fsck)
+ *
+ * @param path directory path (NULL, see flag_nopath)
+ * @param datasync non-zero to flush only the user data
+ * @param fi FUSE structure linked to the opened directory
+ * @return 0 on success and <0 on error
+ **/
+static int my_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+	(void) path;
+	(void) fi;
+
+	fprintf(stderr, "--->>>my_fsyncdir: datasync %d\n", datasync);
+
+	return cacheFlush(&myFileSystem);
+}
+
+/**
+ * @brief Reads an extended attribute. The root folder publishes the FS counters as "user.myfs.stats" and every
+ * regular file tells whether it is compressed in "user.myfs.compress" ("1" or "0")
+ *
+ * @param path file path
+ * @param name attribute name
+ * @param value buffer for the value
+ * @param size size of value, 0 to ask for the size needed
+ * @return size of the value on success and <0 on error
+ **/
+static int my_getxattr(const char *path, const char *name, char *value, size_t size) {
+	char stats[1024];
+	int len, idxNodoI;
+
+	if(strcmp(name, "user.myfs.compress") == 0) {
+		if(snapshotPath(path) != SNAPSHOT_NONE)
+			return -ENODATA;
+		if((idxNodoI = lockPath(path, false)) < 0)
+			return idxNodoI;
+		len = myFileSystem.nodes[idxNodoI].nodeType == NODE_FILE ? 1 : -ENODATA;
+		stats[0] = myFileSystem.nodes[idxNodoI].flags & NODE_COMPRESS ? '1' : '0';
+		unlockNode(&myFileSystem, idxNodoI);
+		if(len < 0)
+			return len;
+	}
+	else if(strcmp(path, "/") == 0 && strcmp(name, "user.myfs.stats") == 0) {
+		len = myStats(&myFileSystem, stats, sizeof(stats));
+	}
+	else {
+		return -ENODATA;
 	}
 
-	// There exist an available inode
-	if(myFileSystem.numFreeNodes <= 0) {
-		return -ENOSPC;
+	if(size == 0)
+		return len;
+	if(size < len)
+		return -ERANGE;
+	memcpy(value, stats, len);
+	return len;
+}
+
+/**
+ * @brief Makes a regular file a clone of another one: its own blocks go back to the bitmap and it takes the block
+ * map of the source, whose blocks and top tables get one more reference. No data is copied: the first write to a
+ * shared table or block of either file gives it a copy of its own (see unshareTables and unshareBlock).
+ * The caller holds the lock of the destination for writing and keeps the source from changing.
+ *
+ * @param src inode of the source (of the FS or of a snapshot), without delayed blocks
+ * @param idxDst inode of the destination
+ * @return 0 on success and <0 on error
+ **/
+static int cloneNode(NodeStruct *src, uint64_t idxDst) {
+	NodeStruct *dst = &myFileSystem.nodes[idxDst];
+	int ret;
+
+	if(src->nodeType != NODE_FILE || dst->nodeType != NODE_FILE)
+		return -EISDIR;
+	if((ret = resizeNode(idxDst, 0)) < 0)
+		return ret;
+
+	// The pointers (or the inline data) are copied as they are
+	dst->numBlocks = src->numBlocks;
+	dst->fileSize = src->fileSize;
+	dst->flags = (dst->flags & NODE_COMPRESS) | (src->flags & NODE_COMPRESSED);
+	memcpy(dst->inlineData, src->inlineData, NODE_INLINE_BYTES);
+	shareBlockMap(dst);
+	pinIndirectBlockTables(idxDst);
+	dst->modificationTime = time(NULL);
+
+	updateBitmap(&myFileSystem);
+	updateNode(&myFileSystem, idxDst, dst);
+	return 0;
+}
+
+/**
+ * @brief Clones the file source into the file path (see cloneNode). The source may be a file of a snapshot
+ *
+ * @param path destination file path
+ * @param source source file path, inside the FS
+ * @return 0 on success and <0 on error
+ **/
+static int cloneFile(const char *path, const char *source) {
+	NodeStruct copy;
+	uint64_t fh;
+	int idxSrc, idxDst, first, second, ret;
+
+	if(snapshotPath(path) != SNAPSHOT_NONE)
+		return -EROFS;
+
+	// A snapshot is not dropped while one of its files is open
+	if(snapshotPath(source) != SNAPSHOT_NONE) {
+		if((ret = snapshotOpen(source, &fh)) < 0)
+			return ret;
+		if((ret = snapshotNode(HANDLE_SNAPSHOT(fh), HANDLE_NODE(fh), &copy)) == 0 && (idxDst = lockPath(path, true)) >= 0) {
+			ret = cloneNode(&copy, idxDst);
+			unlockNode(&myFileSystem, idxDst);
+		}
+		else if(ret == 0) {
+			ret = idxDst;
+		}
+		snapshotRelease(fh);
+		return ret;
 	}
 
-	// There is still space for a new file
-	if(myFileSystem.directory.numFiles >= MAX_FILES_PER_DIRECTORY) {
-		return -ENOSPC;
+	if((idxSrc = lookupPath(source)) < 0)
+		return idxSrc;
+	if((idxDst = lookupPath(path)) < 0)
+		return idxDst;
+	if(idxSrc == idxDst)
+		return -EINVAL;
+	// Two clones the other way round take the locks in the same order. The types are only known under the locks,
+	// and a directory is locked before its entries: the second lock is never waited for holding the first one
+	first = idxSrc < idxDst ? idxSrc : idxDst;
+	second = idxSrc < idxDst ? idxDst : idxSrc;
+	for(;;) {
+		lockNode(&myFileSystem, first, true);
+		if(tryLockNode(&myFileSystem, second, true))
+			break;
+		unlockNode(&myFileSystem, first);
+		lockNode(&myFileSystem, second, true);
+		unlockNode(&myFileSystem, second);
 	}
-	// The directory exists
-	if(findFileByName(&myFileSystem, (char *)path + 1) != -1)
-		return -EEXIST;
+	if(myFileSystem.nodes[first].freeNode || myFileSystem.nodes[second].freeNode) {
+		ret = -ENOENT;
+	}
+	else if(myFileSystem.nodes[first].nodeType != NODE_FILE || myFileSystem.nodes[second].nodeType != NODE_FILE) {
+		ret = -EISDIR;
+	}
+	else {
+		// The source gets its delayed blocks placed
+		allocateDelayed(idxSrc, false);
+		ret = cloneNode(&myFileSystem.nodes[idxSrc], idxDst);
+	}
+	unlockNode(&myFileSystem, second);
+	unlockNode(&myFileSystem, first);
+	return ret;
+}
 
-	/// Update all the information in the backup file:
-	int idxNodoI, idxDir;
-	if((idxNodoI = findFreeNode(&myFileSystem)) == -1 || (idxDir = findFreeFile(&myFileSystem)) == -1) {
-		return -ENOSPC;
+/**
+ * @brief Sets an extended attribute of a regular file:
+ *  - "user.myfs.compress": "1" to store its data compressed from now on (the blocks already in the disk stay as
+ *    they are until they are written again), "0" to stop
+ *  - "user.myfs.clone": the path of another file of the FS, from its root, whose content it takes without copying
+ *    any block (a reflink, see cloneNode). It is not kept as an attribute
+ *
+ * @param path file path
+ * @param name attribute name
+ * @param value new value
+ * @param size size of value
+ * @param flags XATTR_CREATE or XATTR_REPLACE (ignored, the attribute always exists)
+ * @return 0 on success and <0 on error
+ **/
+static int my_setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+	char source[1024];
+	NodeStruct *node;
+	int idxNodoI, ret = 0;
+
+	fprintf(stderr, "--->>>my_setxattr: path %s, name %s\n", path, name);
+
+	if(strcmp(name, "user.myfs.clone") == 0) {
+		if(size == 0 || value[0] != '/')
+			return -EINVAL;
+		if(size >= sizeof(source))
+			return -ENAMETOOLONG;
+		memcpy(source, value, size);
+		source[size] = '\0';
+		beginUpdate(&myFileSystem);
+		ret = cloneFile(path, source);
+		endUpdate(&myFileSystem);
+		cacheFlush(&myFileSystem);
+		return ret;
+	}
+	if(strcmp(name, "user.myfs.compress") != 0)
+		return -ENOTSUP;
+	if(size != 1 || (value[0] != '0' && value[0] != '1'))
+		return -EINVAL;
+	if(snapshotPath(path) != SNAPSHOT_NONE)
+		return -EROFS;
+	beginUpdate(&myFileSystem);
+	if((idxNodoI = lockPath(path, true)) < 0) {
+		endUpdate(&myFileSystem);
+		return idxNodoI;
+	}
+	node = &myFileSystem.nodes[idxNodoI];
+	if(node->nodeType != NODE_FILE) {
+		ret = -EISDIR;
+	}
+	else {
+		node->flags = value[0] == '1' ? node->flags | NODE_COMPRESS : node->flags & ~NODE_COMPRESS;
+		updateNode(&myFileSystem, idxNodoI, node);
+	}
+	unlockNode(&myFileSystem, idxNodoI);
+	endUpdate(&myFileSystem);
+	cacheFlush(&myFileSystem);
+	return ret;
+}
+
+/**
+ * @brief Takes the lock of a directory for writing, checking that it still is a directory
+ *
+ * @param idxDir inode of the directory
+ * @return 0 on success (the lock is held) and <0 on error
+ **/
+static int lockDirectory(int idxDir) {
+	NodeStruct *dir;
+
+	lockNode(&myFileSystem, idxDir, true);
+	dir = &myFileSystem.nodes[idxDir];
+	if(dir->freeNode || dir->nodeType != NODE_DIRECTORY) {
+		unlockNode(&myFileSystem, idxDir);
+		return dir->freeNode ? -ENOENT : -ENOTDIR;
+	}
+	return 0;
+}
+
+/**
+ * @brief Creates a new inode of the given type and links it in its parent directory
+ *
+ * @param path path of the new file or directory
+ * @param nodeType NODE_FILE or NODE_DIRECTORY
+ * @return 0 on success and <0 on error
+ **/
+static int createNode(const char *path, int nodeType) {
+	char name[MAX_LEN_FILE_NAME + 1];
+	int idxParent, idxNodoI, i, ret;
+	NodeStruct *node;
+
+	// A directory in SNAPSHOT_DIR takes a snapshot, nothing else is created there
+	if(snapshotPath(path) != SNAPSHOT_NONE) {
+		if(nodeType == NODE_DIRECTORY)
+			return snapshotCreate(path);
+		return snapshotPath(path) == SNAPSHOT_ROOT ? -EEXIST : -EROFS;
 	}
 
-	// Update root folder
+	// We check that the parent directory exists and the length of the file name is correct
+	if((idxParent = lookupParent(path, name)) < 0)
+		return idxParent;
+	if((ret = lockDirectory(idxParent)) < 0)
+		return ret;
+
+	// The file exists
+	if((ret = dirLookup(idxParent, name)) != -ENOENT) {
+		unlockNode(&myFileSystem, idxParent);
+		return ret < 0 ? ret : -EEXIST;
+	}
 
-	myFileSystem.directory.files[idxDir].freeFile = false;
-	myFileSystem.directory.numFiles++;
-	strcpy(myFileSystem.directory.files[idxDir].fileName, path + 1);
-	myFileSystem.directory.files[idxDir].nodeIdx = idxNodoI;
+	// There exist an available inode
+	pthread_mutex_lock(&myFileSystem.nodeLock);
+	if(myFileSystem.numFreeNodes <= 0 || (idxNodoI = findFreeNode(&myFileSystem)) == -1) {
+		pthread_mutex_unlock(&myFileSystem.nodeLock);
+		unlockNode(&myFileSystem, idxParent);
+		return -ENOSPC;
+	}
+	node = &myFileSystem.nodes[idxNodoI];
 	myFileSystem.numFreeNodes--;
+	updateNodeBitmap(&myFileSystem, idxNodoI, true);
+	pthread_mutex_unlock(&myFileSystem.nodeLock);
+
+	// Fill the fields of the new inode, taken in the bitmap but still free for those that found it before (a
+	// readahead or dedup entry of a previous file): it is in use once it is whole
+	lockNode(&myFileSystem, idxNodoI, true);
+	node->fileSize = 0;
+	node->numBlocks = 0;
+	node->modificationTime = time(NULL);
+	node->nodeType = nodeType;
+	node->flags = nodeType == NODE_FILE && myFileSystem.compress ? NODE_COMPRESS : 0;
+	for(i = 0; i < NIVELES_INDIRECCION; i++)
+		node->indirecto[i] = -1;
+	pthread_mutex_lock(&myFileSystem.nodeLock);
+	node->freeNode = false;
+	pthread_mutex_unlock(&myFileSystem.nodeLock);
+	unlockNode(&myFileSystem, idxNodoI);
+
+	// A new directory takes its first page, then the name goes into the parent
+	if((nodeType == NODE_DIRECTORY && (ret = dirCreate(idxNodoI)) < 0) ||
+	   (ret = dirInsert(idxParent, name, idxNodoI)) < 0) {
+		resizeNode(idxNodoI, 0);
+		pthread_mutex_lock(&myFileSystem.nodeLock);
+		node->freeNode = true;
+		myFileSystem.numFreeNodes++;
+		updateNodeBitmap(&myFileSystem, idxNodoI, false);
+		pthread_mutex_unlock(&myFileSystem.nodeLock);
+		updateNode(&myFileSystem, idxNodoI, node);
+		unlockNode(&myFileSystem, idxParent);
+		return ret;
+	}
 
-	// Fill the fields of the new inode
-	if(myFileSystem.nodes[idxNodoI] == NULL)
-		myFileSystem.nodes[idxNodoI] = malloc(sizeof(NodeStruct));
+	/// Update all the information in the backup file:
+	myFileSystem.nodes[idxParent].modificationTime = time(NULL);
+	updateNode(&myFileSystem, idxParent, &myFileSystem.nodes[idxParent]);
+	updateNode(&myFileSystem, idxNodoI, node);
+	unlockNode(&myFileSystem, idxParent);
 
-	myFileSystem.nodes[idxNodoI]->fileSize = 0;
-	myFileSystem.nodes[idxNodoI]->numBlocks = 0;
-	myFileSystem.nodes[idxNodoI]->modificationTime = time(NULL);
-	myFileSystem.nodes[idxNodoI]->freeNode = false;
+	return 0;
+}
 
-	reserveBlocksForNodes(&myFileSystem, myFileSystem.nodes[idxNodoI]->blocks, 0);
-	myFileSystem.nodes[idxNodoI]->indirecto = -1;
+/**
+ * @brief Create a file
+ *
+ * Help from FUSE:
+ * 
+ * This is called for creation of all non-directory, non-symlink nodes.
+ * If the filesystem defines a create() method, then for regular files that will be called instead.
+ * 
+ * @param path file path
+ * @param mode creation mode
+ * @param device device where the device will be created (contains both major and minor numbers)
+ * @return 0 on success and <0 on error
+ **/
+static int my_mknod(const char *path, mode_t mode, dev_t device) {
+	char modebuf[10];
+	int ret;
 
-	updateDirectory(&myFileSystem);
-	updateNode(&myFileSystem, idxNodoI, myFileSystem.nodes[idxNodoI]);
+	mode_string(mode, modebuf);
+	fprintf(stderr, "--->>>my_mknod: path %s, mode %s, major %d, minor %d\n", path, modebuf, (int)MAJOR(device), (int)MINOR(device));
 
-	return 0;
+	beginUpdate(&myFileSystem);
+	ret = createNode(path, NODE_FILE);
+	endUpdate(&myFileSystem);
+	return ret;
+}
+
+/**
+ * @brief Create a directory
+ *
+ * @param path directory path
+ * @param mode creation mode
+ * @return 0 on success and <0 on error
+ **/
+static int my_mkdir(const char *path, mode_t mode) {
+	int ret;
+
+	fprintf(stderr, "--->>>my_mkdir: path %s\n", path);
+
+	// Taking a snapshot waits for the operations in course (see snapshotCreate)
+	if(snapshotPath(path) != SNAPSHOT_NONE)
+		return createNode(path, NODE_DIRECTORY);
+	beginUpdate(&myFileSystem);
+	ret = createNode(path, NODE_DIRECTORY);
+	endUpdate(&myFileSystem);
+	return ret;
 }
 
 /**
@@ -458,20 +1173,108 @@ static int my_mknod(const char *path, mode_t mode, dev_t device) {
  * @return 0 on success and <0 on error
  **/
 static int my_truncate(const char *path, off_t size) {
-	int idxDir;
+	int idxNodoI, ret = 0;
 
 	fprintf(stderr, "--->>>my_truncate: path %s, size %jd\n", path, size);
 
-	if((idxDir = findFileByName(&myFileSystem, (char *)path + 1)) == -1) {
-		return -ENOENT;
+	if(snapshotPath(path) != SNAPSHOT_NONE)
+		return -EROFS;
+	beginUpdate(&myFileSystem);
+	if((idxNodoI = lockPath(path, true)) < 0) {
+		endUpdate(&myFileSystem);
+		return idxNodoI;
 	}
 
 	// Modify the size
-	if(resizeNode(myFileSystem.directory.files[idxDir].nodeIdx, size) < 0)
-		return -EIO;
+	if(myFileSystem.nodes[idxNodoI].nodeType == NODE_DIRECTORY)
+		ret = -EISDIR;
+	else
+		ret = resizeNode(idxNodoI, size);
+	unlockNode(&myFileSystem, idxNodoI);
+	endUpdate(&myFileSystem);
+	cacheFlush(&myFileSystem);
+
+	return ret;
+}
 
+/**
+ * @brief Change the size of an open file (ftruncate)
+ *
+ * @param path file path (NULL, see flag_nopath)
+ * @param size new size
+ * @param fi FUSE structure linked to the opened file
+ * @return 0 on success and <0 on error
+ **/
+static int my_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	int ret = 0;
+
+	fprintf(stderr, "--->>>my_ftruncate: fh %"PRIu64", size %jd\n", fi->fh, (intmax_t)size);
+
+	if(IS_SNAPSHOT_HANDLE(fi->fh))
+		return -EROFS;
+	beginUpdate(&myFileSystem);
+	lockNode(&myFileSystem, fi->fh, true);
+	ret = resizeNode(fi->fh, size);
+	unlockNode(&myFileSystem, fi->fh);
+	endUpdate(&myFileSystem);
+	cacheFlush(&myFileSystem);
+
+	return ret;
+}
+
+/**
+ * @brief Removes a name from its directory and frees its inode and blocks (on the last release if the file is open)
+ *
+ * @param path file or directory path
+ * @param nodeType type the node must have (-EISDIR/-ENOTDIR otherwise)
+ * @return 0 on success and <0 on error
+ **/
+static int removeNode(const char *path, int nodeType) {
+	char name[MAX_LEN_FILE_NAME + 1];
+	int idxParent, idxNodoI, ret;
+	NodeStruct *node;
+
+	// Removing a snapshot drops it
+	if(snapshotPath(path) != SNAPSHOT_NONE)
+		return nodeType == NODE_DIRECTORY ? snapshotDelete(path) : -EROFS;
+
+	//We look for the file (the parent is locked before the file)
+	if((idxParent = lookupParent(path, name)) < 0)
+		return idxParent;
+	if((ret = lockDirectory(idxParent)) < 0)
+		return ret;
+	if((idxNodoI = dirLookup(idxParent, name)) < 0) {
+		unlockNode(&myFileSystem, idxParent);
+		return idxNodoI;
+	}
+	lockNode(&myFileSystem, idxNodoI, true);
+	node = &myFileSystem.nodes[idxNodoI];
+	if(node->nodeType != nodeType)
+		ret = nodeType == NODE_DIRECTORY ? -ENOTDIR : -EISDIR;
+	else if(nodeType == NODE_DIRECTORY && (ret = dirNumEntries(idxNodoI)) != 0)
+		ret = ret < 0 ? ret : -ENOTEMPTY;
+	else
+		ret = dirRemove(idxParent, name);
+	if(ret < 0) {
+		unlockNode(&myFileSystem, idxNodoI);
+		unlockNode(&myFileSystem, idxParent);
+		return ret;
+	}
+
+	//An open file keeps its inode and its blocks until the last release
+	if(myFileSystem.openNodes[idxNodoI].openCount)
+		myFileSystem.openNodes[idxNodoI].unlinked = true;
+	else
+		dropNode(idxNodoI);
+
+	//We 'commit' the changes.
+	myFileSystem.nodes[idxParent].modificationTime = time(NULL);
+	updateNode(&myFileSystem, idxParent, &myFileSystem.nodes[idxParent]);
+	unlockNode(&myFileSystem, idxNodoI);
+	unlockNode(&myFileSystem, idxParent);
 	return 0;
 }
+
 /**
  * @brief Deletes a file from the filesystem
  *
@@ -479,116 +1282,297 @@ static int my_truncate(const char *path, off_t size) {
  * @return 0 on success and <0 on error
  */
 static int my_unlink(const char *path){
-    int idxNodoI, idxFile;
-    fprintf(stderr, "--->>>my_unlink: path %s", path);
-    
-    //We look for the file
-    if ( (idxFile = findFileByName( &myFileSystem, (char*)path+1)) == -1 ){
-        return -ENOENT;
-    }
-    //We look for the corresponding Inode
-    idxNodoI = myFileSystem.directory.files[idxFile].nodeIdx;
-    NodeStruct *node = (NodeStruct*) malloc (sizeof (NodeStruct));
-    readNode(&myFileSystem, idxNodoI, node);
-
-    //We clean the bitmap
-    BIT bit;
-    int i;
-    for (i =0; i<node->numBlocks; i++){
-    	bit = node->blocks[i];
-    	node->blocks[i]=0;
-    	myFileSystem.bitMap[bit]=0;
-    }
+    int ret;
+
+    fprintf(stderr, "--->>>my_unlink: path %s\n", path);
 
-    //We resize the node to 0
-    resizeNode(idxNodoI, 0);
-
-    //We update directory and filesystem information
-    myFileSystem.directory.files[idxFile].freeFile= true;
-    myFileSystem.directory.numFiles--;
-    myFileSystem.numFreeNodes++;
-    node->freeNode = true;
-    
-    //We 'commit' the changes.
-    updateBitmap(&myFileSystem);
-    updateDirectory(&myFileSystem);
-    updateNode(&myFileSystem, idxNodoI, node);
-    free(node);
-    sync();
-    return 0;
-    
+    beginUpdate(&myFileSystem);
+    ret = removeNode(path, NODE_FILE);
+    endUpdate(&myFileSystem);
+    return ret;
 }
+
+/**
+ * @brief Deletes an empty directory
+ *
+ * @param path directory path
+ * @return 0 on success and <0 on error
+ */
+static int my_rmdir(const char *path){
+    int ret;
+
+    fprintf(stderr, "--->>>my_rmdir: path %s\n", path);
+
+    beginUpdate(&myFileSystem);
+    ret = removeNode(path, NODE_DIRECTORY);
+    endUpdate(&myFileSystem);
+    return ret;
+}
+
+/**
+ * @brief Gets the inode of an open file for reading: the inode of the FS, locked for reading, or a copy of the inode
+ * of a snapshot (it never changes)
+ *
+ * @param fh file handle
+ * @param copy room for the inode of a snapshot
+ * @return the inode or NULL on error
+ **/
+static NodeStruct *lockHandle(uint64_t fh, NodeStruct *copy) {
+	if(IS_SNAPSHOT_HANDLE(fh))
+		return snapshotNode(HANDLE_SNAPSHOT(fh), HANDLE_NODE(fh), copy) < 0 ? NULL : copy;
+	lockNode(&myFileSystem, fh, false);
+	return &myFileSystem.nodes[fh];
+}
+
+/**
+ * @brief Undoes lockHandle
+ *
+ * @param fh file handle
+ * @return void
+ **/
+static void unlockHandle(uint64_t fh) {
+	if(!IS_SNAPSHOT_HANDLE(fh))
+		unlockNode(&myFileSystem, fh);
+}
+
 /**
  * @brief read data from a file in our filesystem
  *
+ * The requested range is translated into runs of consecutive physical blocks: partial blocks
+ * are served by the block cache and every run of whole blocks costs a single pread.
+ *
  * @param path file path
  * @param size ammount to read
  * @param offset where we want to read
- * @param fi file info from fuse
+ * @param fi file info from fuse (fi->fh is the inode, set in my_open)
  * @return ammount of bytes read or <0 on error
  */
 static int my_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-    int bytes2Read, block2Read,totalRead = 0;
-    int idxFile, idxNode;
-    int sizeRead, sizeLeft;
-    int i;
-    fprintf(stderr, "--->>>my_read: path %s", path);
-
-    //Look for the file.
-    if ( (idxFile = findFileByName( &myFileSystem, (char*)path+1)) == -1 ){
-            return -ENOENT;
-        }
-    
-    //Get the node corresponding to the file.
-    idxNode = myFileSystem.directory.files[idxFile].nodeIdx;
-    NodeStruct *node = (NodeStruct*) malloc (sizeof (NodeStruct));
-    readNode(&myFileSystem, idxNode, node);
-
-    //If fileSize is smaller than the read size
-    if (node->fileSize - offset < size){		
-    	bytes2Read = node->fileSize - offset;
-		// If offset is bigger than size, bytes2Read will be negative
-		if(bytes2Read < 0){
-			bytes2Read = 0;
-		}
-    }else{
-    	//Otherwise we read as much as needed
-    	bytes2Read = size;
+    NodeStruct copy, *node;
+    int bytes2Read, totalRead = 0;
+
+    fprintf(stderr, "--->>>my_read: size %zu, offset %jd, fh %"PRIu64"\n", size, (intmax_t)offset, fi->fh);
+
+    //Readers of the same file share the lock
+    if ((node = lockHandle(fi->fh, &copy)) == NULL)
+    	return -EIO;
+
+    //Nothing to read past the end of the file
+    if (offset >= node->fileSize) {
+    	unlockHandle(fi->fh);
+    	return 0;
     }
-    //If we have no bytes to read
-    if (bytes2Read <=0){
-    	return -ENOENT;
+    bytes2Read = (node->fileSize - offset < size) ? node->fileSize - offset : size;
+
+    //Tiny files are in the inode
+    if (!node->numBlocks) {
+    	memcpy(buf, node->inlineData + offset, bytes2Read);
+    	unlockHandle(fi->fh);
+    	return bytes2Read;
     }
+    if (!IS_SNAPSHOT_HANDLE(fi->fh))
+    	readaheadAccess(fi->fh, offset, bytes2Read);
 
     //While there's still bytes to read
     while (totalRead < bytes2Read){
-    	int currentBlock, offBlock;
-    	//We calculate wich block has the information we're looking for
-		block2Read = (offset + totalRead) / BLOCK_SIZE_BYTES;
-    	//currentBlock = myFileSystem.nodes[idxNode]->blocks[block2Read];
-    	currentBlock = getBF_from_BL(myFileSystem.nodes[idxNode], block2Read);
-    	//We calculate the position of the information in said block
-		offBlock = (offset + totalRead) % BLOCK_SIZE_BYTES;
-		//Move the pointer to such place
-    	lseek(myFileSystem.fdVirtualDisk, (currentBlock * BLOCK_SIZE_BYTES) + offBlock, SEEK_SET);
-    	//We read 1.
-    	if ((sizeRead = read(myFileSystem.fdVirtualDisk, buf, 1)) == -1){
-    		return -ENOENT;
+    	int block2Read = (offset + totalRead) / BLOCK_SIZE_BYTES;
+    	int offBlock = (offset + totalRead) % BLOCK_SIZE_BYTES;
+    	DISK_LBA currentBlock;
+    	int sizeRead;
+
+    	if (offBlock || bytes2Read - totalRead < BLOCK_SIZE_BYTES){
+    		//Part of a block: the cache keeps it for the next small read
+    		currentBlock = getBF_from_BL(node, block2Read);
+    		sizeRead = BLOCK_SIZE_BYTES - offBlock;
+    		if (sizeRead > bytes2Read - totalRead)
+    			sizeRead = bytes2Read - totalRead;
+    		//A hole reads as zeros
+    		if (currentBlock == 0)
+    			memset(buf + totalRead, 0, sizeRead);
+    		else if (currentBlock < 0 || cacheRead(&myFileSystem, currentBlock, offBlock, buf + totalRead, sizeRead)) {
+    			totalRead = -EIO;
+    			break;
+    		}
     	}
-		if (sizeRead > 0) {
-			buf += sizeRead;
-			totalRead += sizeRead;
-		}
+    	else {
+    		//Whole blocks: the extent tells how many of them are consecutive on disk (or a run of holes)
+    		int numBlocks = getExtent(node, block2Read, (bytes2Read - totalRead) / BLOCK_SIZE_BYTES, &currentBlock);
+    		sizeRead = numBlocks * BLOCK_SIZE_BYTES;
+    		if (numBlocks > 0 && currentBlock == 0)
+    			memset(buf + totalRead, 0, sizeRead);
+    		else if (numBlocks <= 0 || cacheReadRun(&myFileSystem, currentBlock, numBlocks, buf + totalRead)) {
+    			totalRead = -EIO;
+    			break;
+    		}
+    	}
+    	totalRead += sizeRead;
     }
-    //We concatenate the read character into the buffer
-	sizeLeft = size - totalRead;
-	for(i = 0; i < sizeLeft; i++){
-		*buf = '\0';
-		buf++;
-	}
+    unlockHandle(fi->fh);
 	return totalRead;
 }
 
+/**
+ * @brief read data from a file, without copying it for the files of a snapshot in mmap mode
+ *
+ * Only there are the runs of whole blocks returned as positions of the backup file (the mapping shares its pages),
+ * so the kernel splices them into the reply (but the compressed ones and the holes, which go in memory). The kernel
+ * reads the backup file once this returns, which is only safe for blocks nobody can free or rewrite meanwhile: the
+ * snapshot cannot be dropped while the file is open. Any other file is read by my_read into a single memory buffer,
+ * holding the lock of the file: one copy from the cache as with read, and FUSE sends it with nothing to gather.
+ *
+ * @param path file path (NULL, see flag_nopath)
+ * @param bufp where the buffers with the data are returned (FUSE frees them)
+ * @param size ammount to read
+ * @param offset where we want to read
+ * @param fi file info from fuse (fi->fh is the inode, set in my_open)
+ * @return 0 on success and <0 on error
+ **/
+static int my_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+	NodeStruct copy, *node;
+	struct fuse_bufvec *bufv;
+	size_t bytes2Read = 0, totalRead = 0;
+	int i, ret = 0;
+
+	fprintf(stderr, "--->>>my_read_buf: size %zu, offset %jd, fh %"PRIu64"\n", size, (intmax_t)offset, fi->fh);
+
+	// The blocks of a file that is not in a snapshot may be freed and reused as soon as its lock is released
+	if(!myFileSystem.mapDisk || !IS_SNAPSHOT_HANDLE(fi->fh)) {
+		if((bufv = malloc(sizeof(struct fuse_bufvec))) == NULL)
+			return -ENOMEM;
+		*bufv = FUSE_BUFVEC_INIT(size);
+		if((bufv->buf[0].mem = malloc(size ? size : 1)) == NULL) {
+			free(bufv);
+			return -ENOMEM;
+		}
+		if((ret = my_read(path, bufv->buf[0].mem, size, offset, fi)) < 0) {
+			free(bufv->buf[0].mem);
+			free(bufv);
+			return ret;
+		}
+		bufv->buf[0].size = ret;
+		*bufp = bufv;
+		return 0;
+	}
+
+	// At most one buffer per block plus the partial blocks at both ends
+	if((bufv = malloc(sizeof(struct fuse_bufvec) + (size / BLOCK_SIZE_BYTES + 2) * sizeof(struct fuse_buf))) == NULL)
+		return -ENOMEM;
+	*bufv = FUSE_BUFVEC_INIT(0);
+	bufv->count = 0;
+
+	if((node = lockHandle(fi->fh, &copy)) == NULL) {
+		free(bufv);
+		return -EIO;
+	}
+	if(offset < node->fileSize)
+		bytes2Read = (node->fileSize - offset < size) ? node->fileSize - offset : size;
+
+	while(totalRead < bytes2Read) {
+		struct fuse_buf *b = &bufv->buf[bufv->count++];
+		int block2Read = (offset + totalRead) / BLOCK_SIZE_BYTES;
+		int offBlock = (offset + totalRead) % BLOCK_SIZE_BYTES;
+		DISK_LBA currentBlock;
+
+		memset(b, 0, sizeof(struct fuse_buf));
+		if(offBlock || bytes2Read - totalRead < BLOCK_SIZE_BYTES) {
+			//Part of a block: copied from the cache
+			b->size = BLOCK_SIZE_BYTES - offBlock;
+			if(b->size > bytes2Read - totalRead)
+				b->size = bytes2Read - totalRead;
+			if((b->mem = malloc(b->size)) == NULL) {
+				ret = -ENOMEM;
+				break;
+			}
+			//Tiny files are in the inode, a hole reads as zeros
+			if(!node->numBlocks) {
+				memcpy(b->mem, node->inlineData + offBlock, b->size);
+			}
+			else if((currentBlock = getBF_from_BL(node, block2Read)) == 0) {
+				memset(b->mem, 0, b->size);
+			}
+			else if(currentBlock < 0 || cacheRead(&myFileSystem, currentBlock, offBlock, b->mem, b->size)) {
+				ret = -EIO;
+				break;
+			}
+		}
+		else {
+			//Whole blocks: one buffer per run of consecutive blocks
+			int numBlocks = getExtent(node, block2Read, (bytes2Read - totalRead) / BLOCK_SIZE_BYTES, &currentBlock);
+			if(numBlocks <= 0) {
+				ret = -EIO;
+				break;
+			}
+			b->size = (size_t)numBlocks * BLOCK_SIZE_BYTES;
+			if(currentBlock == 0) {
+				if((b->mem = calloc(1, b->size)) == NULL) {
+					ret = -ENOMEM;
+					break;
+				}
+			}
+			else if(!IS_COMPRESSED(currentBlock)) {
+				b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				b->fd = myFileSystem.fdVirtualDisk;
+				b->pos = (off_t)currentBlock * BLOCK_SIZE_BYTES;
+			}
+			else if((b->mem = malloc(b->size)) == NULL || cacheReadRun(&myFileSystem, currentBlock, numBlocks, b->mem)) {
+				ret = -EIO;
+				break;
+			}
+		}
+		totalRead += b->size;
+	}
+	unlockHandle(fi->fh);
+
+	if(ret < 0) {
+		for(i = 0; i < bufv->count; i++)
+			free(bufv->buf[i].mem);
+		free(bufv);
+		return ret;
+	}
+	if(bufv->count == 0)
+		bufv->count = 1;
+	*bufp = bufv;
+	return 0;
+}
+
+/**
+ * @brief Negotiates the connection with the kernel (big writes and splice in both directions if the kernel has them)
+ *        and starts the readahead thread and the scrubber (-S, not in mmap mode, where nothing is verified)
+ *
+ * @param conn capabilities of the kernel, the ones wanted are set here
+ * @return private data of the FS (unused)
+ **/
+static void *my_init(struct fuse_conn_info *conn) {
+	conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	// Threads started before fuse_main would not survive the fork into the background
+	readaheadStart();
+	if(myFileSystem.scrubRate > 0 && !myFileSystem.mapDisk)
+		scrubStart(myFileSystem.scrubRate);
+	return NULL;
+}
+
+/**
+ * @brief Called when the file system is unmounted: stops the threads started in init and places the blocks of the
+ * files that were never released
+ *
+ * @param private_data value returned by init
+ * @return void
+ **/
+static void my_destroy(void *private_data) {
+	int i;
+
+	readaheadStop();
+	scrubStop();
+	for(i = 0; i < NUM_NODES(&myFileSystem); i++) {
+		lockNode(&myFileSystem, i, true);
+		allocateDelayed(i, false);
+		if(myFileSystem.openNodes[i].unlinked)
+			dropNode(i);
+		unlockNode(&myFileSystem, i);
+	}
+	cacheFlush(&myFileSystem);
+}
+
 struct fuse_operations myFS_operations = {
 	.getattr	= my_getattr,					// Obtain attributes from a file
 	.readdir	= my_readdir,					// Read directory entries
@@ -599,5 +1583,19 @@ struct fuse_operations myFS_operations = {
 	.release	= my_release,					// Close an opened file
     .read		= my_read,						// Reads a file
 	.mknod		= my_mknod,						// Create a new file
+	.mkdir		= my_mkdir,						// Create a new directory
+	.rmdir		= my_rmdir,						// Delete an empty directory
+	.fsync		= my_fsync,						// Write the dirty blocks to the backup file
+	.fsyncdir	= my_fsyncdir,					// Write every dirty block to the backup file
+	.getxattr	= my_getxattr,					// Read an extended attribute (FS counters, compression of a file)
+	.setxattr	= my_setxattr,					// Compress a file or stop compressing it, clone a file
+	.fgetattr	= my_fgetattr,					// Obtain attributes from an opened file
+	.ftruncate	= my_ftruncate,					// Modify the size of an opened file
+	.read_buf	= my_read_buf,					// Reads a file, verifying its checksums (splicing the blocks of snapshots in mmap mode)
+	.write_buf	= my_write_buf,					// Write data into a file straight from the request
+	.init		= my_init,						// Connection options (big writes, splice), readahead and scrubber threads
+	.destroy	= my_destroy,					// Stop the readahead and scrubber threads
+	.flag_nullpath_ok = 1,						// Operations with a file handle do not need the path:
+	.flag_nopath = 1,							// libfuse does not rebuild it for them
 };
 
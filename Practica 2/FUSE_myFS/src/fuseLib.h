@@ -8,8 +8,21 @@
 
 #define MAX_FUSE_NARGS 64
 
+// Mount options always added: inode numbers from getattr, writes of up to 1 MiB (libfuse may lower it) and
+// kernel caching of names and attributes (every change goes through the kernel, so it never keeps stale data)
+#define FUSE_DEFAULT_OPTIONS "use_ino,big_writes,max_write=1048576,entry_timeout=60,attr_timeout=60,negative_timeout=10"
+
 extern struct fuse_operations myFS_operations;
 
 extern MyFileSystem myFileSystem;
 
+/**
+ * @brief Modifies the data size originally reserved by an inode, reserving or removing space if needed.
+ *
+ * @param idxNode inode number
+ * @param newSize new size for the inode
+ * @return 0 on success and <0 on error (-EFBIG, -ENOSPC, -EIO)
+ **/
+int resizeNode(uint64_t idxNode, size_t newSize);
+
 #endif
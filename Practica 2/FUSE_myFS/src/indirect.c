@@ -1,4 +1,7 @@
 #include "indirect.h"
+#include "cache.h"
+#include "compress.h"
+#include "dedup.h"
 
 #include <stdio.h>
 #include <time.h>
@@ -11,98 +14,219 @@
 #include <linux/kdev_t.h>
 
 /**
-* @brief Write to disk the content of the block pointed to the indirect pointer from the Inode
+* @brief Returns an indirect table straight from the block cache (no copy). The block stays
+* 	 pinned in the cache until putIndirectBlockTable is called
 **/
-int setIndirectBlockTable(NodeStruct *node, IBlockStruct* iblock) {
-	if ( node->indirecto < 1 ) {
-		fprintf(stderr,"----> Error getting indirect table!!! LBA requested %d\n", node->indirecto);
-		return -1;
+IBlockStruct* getIndirectBlockTable(DISK_LBA lba) {
+	IBlockStruct* block;
+	if ( lba < 1 ) {
+		fprintf(stderr,"----> Error getting indirect table!!! LBA requested %" PRId64 "\n", lba);
+		return NULL;
 	}
 
-	if((lseek(myFileSystem.fdVirtualDisk, (node->indirecto) * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-	        (write(myFileSystem.fdVirtualDisk, iblock, BLOCK_SIZE_BYTES) == -1)) {
-				perror("Failed lseek/read in getIndirectBlockTable");
-				return -1;
+	if((block = (IBlockStruct*) cacheGetBlock(&myFileSystem, lba, true)) == NULL) {
+		fprintf(stderr, "Failed read in getIndirectBlockTable\n");
+		return NULL;
 	}
-	return 0;
+	return block;
 }
 
+/**
+* @brief Releases the table obtained with getIndirectBlockTable. A modified table is written back to disk
+* 	 once, when the cache is flushed
+**/
+void putIndirectBlockTable(DISK_LBA lba, BOOLEAN dirty) {
+	cachePutBlock(&myFileSystem, lba, dirty);
+}
 
 /**
-* @brief Reads from disk the data block with the indrect table for the node. It mallocs the table, so someone should free it...
+* @brief Keeps the top level tables of an open node in the cache until the node is closed, so translating
+* 	 its blocks never has to read them from disk again. Once the pins of the cache are spent (cacheReservePin)
+* 	 the tables of the files opened later are just cached as any other block
 **/
-IBlockStruct* getIndirectBlockTable(NodeStruct *node) {
-	IBlockStruct* block;
-	if ( node->indirecto < 1 ) {
-		fprintf(stderr,"----> Error getting indirect table!!! LBA requested %d\n", node->indirecto);
-		return NULL;
+void pinIndirectBlockTables(int nodeIdx) {
+	NodeStruct *node = &myFileSystem.nodes[nodeIdx];
+	OpenNodeStruct *open = &myFileSystem.openNodes[nodeIdx];
+	int level;
+
+	// A file without blocks has no tables (its pointers may hold inline data)
+	if (open->openCount == 0 || node->numBlocks == 0)
+		return;
+	for (level = 0; level < NIVELES_INDIRECCION; level++) {
+		if (open->pinnedIndirect[level] > 0 || node->indirecto[level] < 1)
+			continue;
+		if (!cacheReservePin(&myFileSystem))
+			return;
+		if (getIndirectBlockTable(node->indirecto[level]) != NULL)
+			open->pinnedIndirect[level] = node->indirecto[level];
+		else
+			cacheReleasePin(&myFileSystem);
 	}
-	block = (IBlockStruct*) malloc(sizeof(IBlockStruct));
+}
 
-	if((lseek(myFileSystem.fdVirtualDisk, (node->indirecto) * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-	        (read(myFileSystem.fdVirtualDisk, block, BLOCK_SIZE_BYTES) == -1)) {
-				perror("Failed lseek/read in getIndirectBlockTable");
-				return NULL;
+/**
+* @brief Undoes pinIndirectBlockTables (called on the last release or before the tables change)
+**/
+void unpinIndirectBlockTables(int nodeIdx) {
+	OpenNodeStruct *open = &myFileSystem.openNodes[nodeIdx];
+	int level;
+
+	for (level = 0; level < NIVELES_INDIRECCION; level++) {
+		if (open->pinnedIndirect[level] > 0) {
+			putIndirectBlockTable(open->pinnedIndirect[level], false);
+			cacheReleasePin(&myFileSystem);
+			open->pinnedIndirect[level] = 0;
+		}
 	}
-	return block;
 }
 
 
 /**
-* @brief Called when a i-node uses the indirect poitner for the first time.
-* 	 Looks for a free block and inits it to be used as a table of direct pointer
+* @brief Reserves a block (close to goal) and inits it to be used as a table of pointers (all of them empty).
+* 	 The caller accounts for it in numOfFreeBlocks (see indirectBlocksFor)
 **/
-int initIndirectBlockTable(NodeStruct *node) {
-	int freeBlock=-1;
-	int i =0;
-	while (freeBlock==-1 && i<NUM_BITS) {
-		if(myFileSystem.bitMap[i] == 0) {
-			myFileSystem.bitMap[i] = 1;
-			freeBlock = i;
-			node->indirecto = freeBlock;
-		}
-		i++;
-	} 
-	if (freeBlock == -1 ) {
+static DISK_LBA initIndirectBlockTable(DISK_LBA goal) {
+	DISK_LBA freeBlock;
+
+	if (IS_DELAYED(goal) || IS_COMPRESSED(goal))
+		goal = FIRST_DATA_BLOCK(&myFileSystem);
+	if (allocBlocks(&myFileSystem, goal, 1, &freeBlock) == 0) {
 		fprintf(stderr,"Error finding free block in bitmap when init indirect block\n");
 		return -1;
 	}
+	// The cache hands out the block already zeroed
+	if(cacheGetBlock(&myFileSystem, freeBlock, false) == NULL) {
+		fprintf(stderr, "Failed to init the block in initIndirectBlockTable\n");
+		freeBlocks(&myFileSystem, freeBlock, 1);
+		return -1;
+	}
+	cachePutBlock(&myFileSystem, freeBlock, true);
+	return freeBlock;
+}
+
+/**
+* @brief Frees the cluster of a compressed block: its blocks in the disk and the inflated copies (a shared cluster
+* 	 only loses a reference). Returns the blocks freed
+**/
+static int freeCluster(DISK_LBA lba) {
+	int i, freed = freeBlocks(&myFileSystem, COMPRESSED_FIRST(lba), COMPRESSED_LEN(lba));
+
+	for (i = 0; freed && i < COMPRESS_CLUSTER; i++)
+		cacheInvalidate(&myFileSystem, COMPRESSED_LBA(COMPRESSED_FIRST(lba), COMPRESSED_LEN(lba), i));
+	return freed;
+}
+
+/**
+* @brief Frees the block of a pointer. Returns the blocks that go back to numOfFreeBlocks: a compressed cluster
+* 	 goes with the pointer of its first block (the file never keeps only part of it, see unpackCluster) and a
+* 	 shared block only loses a reference
+**/
+static int freeBlock(DISK_LBA lba) {
+	// A delayed block has nothing in the bitmap
+	if (IS_DELAYED(lba)) {
+		cacheDropDelayed(&myFileSystem, lba);
+	}
+	else if (IS_COMPRESSED(lba)) {
+		return COMPRESSED_INDEX(lba) == 0 ? freeCluster(lba) : 0;
+	}
 	else {
-		char block[BLOCK_SIZE_BYTES];
-		memset(block, 0, sizeof(char)*BLOCK_SIZE_BYTES);
-		if((lseek(myFileSystem.fdVirtualDisk, freeBlock * BLOCK_SIZE_BYTES, SEEK_SET) == (off_t) - 1) ||
-		   (write(myFileSystem.fdVirtualDisk, &block, BLOCK_SIZE_BYTES) == -1)) {
-				perror("Failed lseek/write in initIndirectBlockTable");
-				return -EIO;
-		}
+		return freeBlocks(&myFileSystem, lba, 1);
+	}
+	return 1;
+}
 
+/**
+* @brief Adds a reference to the block of a pointer, the counterpart of freeBlock
+**/
+static void sharePointer(DISK_LBA lba) {
+	if (IS_COMPRESSED(lba)) {
+		if (COMPRESSED_INDEX(lba) == 0)
+			shareBlocks(&myFileSystem, COMPRESSED_FIRST(lba), COMPRESSED_LEN(lba));
 	}
-	return 0;
+	else if (lba > 0 && !IS_DELAYED(lba)) {
+		shareBlocks(&myFileSystem, lba, 1);
+	}
+}
+
+DISK_LBA nextGoal(DISK_LBA lba) {
+	if (IS_DELAYED(lba) || lba < 1)
+		return FIRST_DATA_BLOCK(&myFileSystem);
+	return IS_COMPRESSED(lba) ? COMPRESSED_END(lba) : lba + 1;
 }
 
+/**
+* @brief Splits a logical block into the indirection level that maps it and the index to follow in each table
+* 	 of that level (idx[0] in the top table). Returns -1 for the direct pointers
+**/
+static int blockPath(int bl, int idx[NIVELES_INDIRECCION]) {
+	int64_t rest, span = PUNTEROS_POR_BLOQUE;
+	int level, i;
+
+	if (bl < NDIRECTOS)
+		return -1;
+	rest = bl - NDIRECTOS;
+	for (level = 0; level < NIVELES_INDIRECCION; level++) {
+		if (rest < span) {
+			for (i = level; i >= 0; i--) {
+				idx[i] = rest % PUNTEROS_POR_BLOQUE;
+				rest /= PUNTEROS_POR_BLOQUE;
+			}
+			return level;
+		}
+		rest -= span;
+		span *= PUNTEROS_POR_BLOQUE;
+	}
+	return -2;
+}
+
+int indirectBlocksFor(int numBlocks) {
+	int64_t rest = numBlocks - NDIRECTOS, span = PUNTEROS_POR_BLOQUE;
+	int level, tables = 0;
+
+	// Level L needs its top table plus, below it, one table per group of PUNTEROS_POR_BLOQUE^k blocks
+	for (level = 0; level < NIVELES_INDIRECCION && rest > 0; level++) {
+		int64_t used = rest < span ? rest : span;
+		int64_t groupSize = 1;
+		int k;
+		for (k = 0; k <= level; k++) {
+			groupSize *= PUNTEROS_POR_BLOQUE;
+			tables += (used + groupSize - 1) / groupSize;
+		}
+		rest -= used;
+		span *= PUNTEROS_POR_BLOQUE;
+	}
+	return tables;
+}
 
 
 /**
-* @brief Devuelve el LBA (BLOQUE FISICO) donde esta el bloque logico (bl) de un nodo-i
+* @brief Devuelve el LBA (BLOQUE FISICO) donde esta el bloque logico (bl) de un nodo-i, 0 si no tiene bloque
 **/
 DISK_LBA getBF_from_BL(NodeStruct *node, int bl) {
 
 	// 1. Si se debe usar puntero directo, la traduccion es directa: node->blocks[bl]
-	// 2 Si no, debemos leer la tabla apuntada por indirectos (getIndirectBlockTable) y buscar ahí la traducción
-	 
+	// 2 Si no, recorremos una tabla por nivel de indireccion (getIndirectBlockTable) hasta llegar al bloque de datos
+	int idx[NIVELES_INDIRECCION];
+	int level = blockPath(bl, idx), i;
+	DISK_LBA bf;
 
-	if (bl<=NDIRECTOS) {
+	if (level == -1) {
 		return node->blocks[bl];
 	}
-	else {
-		IBlockStruct * ind = getIndirectBlockTable(node);
-		int bf; // variable para guardar el LBA que vamos a devolver
-		
-		bf = ind->table[bl-2];
+	if (level < 0)
+		return -1;
+
+	bf = node->indirecto[level];
+	for (i = 0; i <= level && bf > 0; i++) {
+		IBlockStruct * ind = getIndirectBlockTable(bf);
+		DISK_LBA table = bf;
 
-		free(ind);
-		return bf;
+		if (ind == NULL)
+			return -1;
+		bf = ind->table[idx[i]];
+		putIndirectBlockTable(table, false);
 	}
+	return bf > 0 ? bf : 0;
 }
 
 /**
@@ -113,26 +237,631 @@ DISK_LBA getBF_of_last_BL(NodeStruct *node) {
 }
 
 /**
-* @brief Modifies the node to assign the BF (physical block) to the corresponding BL (maybe through the indirecto pointer)
-**/ 
-void assignBF_to_BL(NodeStruct *node, int bl, DISK_LBA bf) {
+* @brief Like getBF_from_BL but stops one level earlier: returns the table that holds the pointer of bl
+* 	 and the position of the pointer in it. Returns 0 for the direct pointers (*idx = bl) and -1 if the
+* 	 table does not exist
+**/
+static DISK_LBA leafTable(NodeStruct *node, int bl, int *idx) {
+	int path[NIVELES_INDIRECCION];
+	int level = blockPath(bl, path), i;
+	DISK_LBA table;
+
+	if (level == -1) {
+		*idx = bl;
+		return 0;
+	}
+	if (level < 0)
+		return -1;
+
+	table = node->indirecto[level];
+	for (i = 0; i < level && table > 0; i++) {
+		IBlockStruct * ind = getIndirectBlockTable(table);
+		DISK_LBA parent = table;
+
+		if (ind == NULL)
+			return -1;
+		table = ind->table[path[i]];
+		putIndirectBlockTable(parent, false);
+	}
+	*idx = path[level];
+	return table > 0 ? table : -1;
+}
+
+int getExtent(NodeStruct *node, int bl, int maxLen, DISK_LBA *bf) {
+	int len = 0;
+
+	*bf = getBF_from_BL(node, bl);
+	if (*bf < 0)
+		return 0;
+
+	// Pointers are compared table by table: one cache lookup per table instead of one per block
+	while (len < maxLen) {
+		int idx;
+		DISK_LBA table = leafTable(node, bl + len, &idx);
+		DISK_LBA *pointers;
+
+		if (table == 0) {
+			pointers = node->blocks;
+		}
+		else if (table > 0) {
+			IBlockStruct * ind = getIndirectBlockTable(table);
+			if (ind == NULL)
+				break;
+			pointers = ind->table;
+		}
+		else {
+			// A missing table is a hole as long as the blocks mapped by it
+			if (*bf != 0)
+				break;
+			len++;
+			continue;
+		}
+
+		int limit = (table == 0) ? NDIRECTOS : PUNTEROS_POR_BLOQUE;
+		int start = len;
+		for (; idx < limit && len < maxLen; idx++, len++) {
+			DISK_LBA p = pointers[idx] > 0 ? pointers[idx] : 0;
+			if (p != (*bf ? *bf + len : 0))
+				break;
+		}
+		if (table > 0)
+			putIndirectBlockTable(table, false);
+		if (idx < limit && len < maxLen)
+			break;
+		if (len == start)
+			break;
+	}
+	return len;
+}
+
+/**
+* @brief Modifies the node to assign the BF (physical block) to the corresponding BL (maybe through the indirect
+* 	 tables, creating the ones that are still missing)
+**/
+int assignBF_to_BL(NodeStruct *node, int bl, DISK_LBA bf) {
 
 	// 1. Si se debe usar puntero directo, la traduccion es directa: node->blocks[bl]
-	// 2 Si no, debemos leer la tabla apuntada por indirectos (getIndirectBlockTable) y buscar ahí la traducción, y actualizarla (setIndirectBlockTable)
+	// 2 Si no, recorremos las tablas de ese nivel creando las que falten y marcamos como modificada la ultima (putIndirectBlockTable)
+	int idx[NIVELES_INDIRECCION];
+	int level = blockPath(bl, idx), i;
+	DISK_LBA table;
 
-	if (bl<=NDIRECTOS) {
+	if (level == -1) {
 		node->blocks[bl] = bf;
+		return 0;
 	}
-	else {
-		IBlockStruct * ind = getIndirectBlockTable(node);
-	
-		ind->table[bl-2]=bf;
+	if (level < 0)
+		return -EFBIG;
+
+	if (node->indirecto[level] < 1 && (node->indirecto[level] = initIndirectBlockTable(bf)) < 1)
+		return -ENOSPC;
+
+	table = node->indirecto[level];
+	for (i = 0; i <= level; i++) {
+		IBlockStruct * ind = getIndirectBlockTable(table);
+		DISK_LBA next;
+
+		if (ind == NULL)
+			return -EIO;
+		if (i == level) {
+			ind->table[idx[i]] = bf;
+			putIndirectBlockTable(table, true);
+			break;
+		}
+		if ((next = ind->table[idx[i]]) < 1) {
+			if ((next = initIndirectBlockTable(bf)) < 1) {
+				putIndirectBlockTable(table, false);
+				return -ENOSPC;
+			}
+			ind->table[idx[i]] = next;
+			putIndirectBlockTable(table, true);
+		}
+		else {
+			putIndirectBlockTable(table, false);
+		}
+		table = next;
+	}
+	return 0;
+}
+
+/**
+* @brief Drops a pointer to a table whose entries map groups of `span` logical blocks. The blocks under it are
+* 	 dropped too when it is its last pointer (a shared table only loses a reference). Returns the number of blocks freed
+**/
+static int dropTable(DISK_LBA table, int64_t span) {
+	IBlockStruct *ind = getIndirectBlockTable(table), copy;
+	int i, freed;
+
+	if (ind == NULL)
+		return 0;
+	// Freeing the table drops it from the cache: its pointers are kept aside
+	memcpy(&copy, ind, sizeof(IBlockStruct));
+	putIndirectBlockTable(table, false);
+	if ((freed = freeBlock(table)) == 0)
+		return 0;
+	for (i = 0; i < PUNTEROS_POR_BLOQUE; i++) {
+		if (copy.table[i] > 0)
+			freed += span == 1 ? freeBlock(copy.table[i]) : dropTable(copy.table[i], span / PUNTEROS_POR_BLOQUE);
+	}
+	return freed;
+}
+
+/**
+* @brief Frees the data blocks and tables under a table whose entries map groups of `span` logical blocks,
+* 	 the first one being `first`. Blocks before `keep` are kept: a table partly kept must not be shared
+* 	 (see unshareTables). Returns the number of blocks freed
+**/
+static int truncateTable(DISK_LBA table, int64_t span, int64_t first, int64_t keep) {
+	IBlockStruct *ind;
+	int i, freed = 0;
+	BOOLEAN dirty = false;
+
+	if (first >= keep)
+		return dropTable(table, span);
+	if ((ind = getIndirectBlockTable(table)) == NULL)
+		return 0;
+	for (i = 0; i < PUNTEROS_POR_BLOQUE; i++) {
+		int64_t childFirst = first + i * span;
+		DISK_LBA child = ind->table[i];
 
+		if (child < 1 || childFirst + span <= keep)
+			continue;
+		if (span == 1) {
+			freed += freeBlock(child);
+		}
+		else {
+			freed += truncateTable(child, span / PUNTEROS_POR_BLOQUE, childFirst, keep);
+			if (childFirst < keep)
+				continue;
+		}
+		ind->table[i] = 0;
+		dirty = true;
+	}
+	putIndirectBlockTable(table, dirty);
+	return freed;
+}
+
+/**
+* @brief Frees the blocks of a block map past its first numBlocks logical blocks (see truncateBlockMap)
+**/
+static int truncatePointers(NodeStruct *node, int numBlocks) {
+	int64_t first = NDIRECTOS, span = 1;
+	int i, level, freed = 0;
+
+	for (i = numBlocks; i < node->numBlocks && i < NDIRECTOS; i++) {
+		if (node->blocks[i] > 0)
+			freed += freeBlock(node->blocks[i]);
+		node->blocks[i] = 0;
+	}
+	for (level = 0; level < NIVELES_INDIRECCION; level++) {
+		int64_t levelBlocks = span * PUNTEROS_POR_BLOQUE;
+
+		if (node->indirecto[level] > 0 && first + levelBlocks > numBlocks) {
+			freed += truncateTable(node->indirecto[level], span, first, numBlocks);
+			if (first >= numBlocks)
+				node->indirecto[level] = -1;
+		}
+		first += levelBlocks;
+		span = levelBlocks;
+	}
+	return freed;
+}
+
+int truncateBlockMap(int nodeIdx, int numBlocks) {
+	int freed;
+
+	// The pinned tables may be freed
+	unpinIndirectBlockTables(nodeIdx);
+	freed = truncatePointers(&myFileSystem.nodes[nodeIdx], numBlocks);
+	pinIndirectBlockTables(nodeIdx);
+	return freed;
+}
+
+void shareBlockMap(NodeStruct *node) {
+	int i;
+
+	// Tiny files keep their data in the inode
+	if (node->numBlocks == 0)
+		return;
+	for (i = 0; i < NDIRECTOS && i < node->numBlocks; i++)
+		sharePointer(node->blocks[i]);
+	for (i = 0; i < NIVELES_INDIRECCION; i++) {
+		if (node->indirecto[i] > 0)
+			shareBlocks(&myFileSystem, node->indirecto[i], 1);
+	}
+}
+
+int dropBlockMap(NodeStruct *node) {
+	return node->numBlocks ? truncatePointers(node, 0) : 0;
+}
+
+/**
+* @brief Gives the pointer to a shared table (*pointer, in the node or in a pinned table) a copy of its own, taken
+* 	 from numOfFreeBlocks. The entries of the table map groups of `span` logical blocks: the blocks under it are reached
+* 	 from both copies afterwards. Returns 0 or <0 on error
+**/
+static int copyTable(DISK_LBA *pointer, int64_t span) {
+	DISK_LBA old = *pointer, copy = -1;
+	IBlockStruct *from = NULL, *to = NULL;
+	int i, freed;
 
-		setIndirectBlockTable(node,ind);
-		free(ind);
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	if (myFileSystem.superBlock.numOfFreeBlocks < 1) {
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return -ENOSPC;
+	}
+	myFileSystem.superBlock.numOfFreeBlocks--;
+	pthread_mutex_unlock(&myFileSystem.allocLock);
 
+	if (allocBlocks(&myFileSystem, old, 1, &copy) == 0 || (from = getIndirectBlockTable(old)) == NULL ||
+	    (to = (IBlockStruct *)cacheGetBlock(&myFileSystem, copy, false)) == NULL) {
+		if (from)
+			putIndirectBlockTable(old, false);
+		if (copy > 0)
+			freeBlocks(&myFileSystem, copy, 1);
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks++;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return copy < 0 ? -ENOSPC : -EIO;
+	}
+	memcpy(to, from, sizeof(IBlockStruct));
+	putIndirectBlockTable(old, false);
+	for (i = 0; i < PUNTEROS_POR_BLOQUE; i++) {
+		if (span == 1)
+			sharePointer(to->table[i]);
+		else if (to->table[i] > 0)
+			shareBlocks(&myFileSystem, to->table[i], 1);
 	}
+	*pointer = copy;
+
+	// The other owners may have dropped the table meanwhile: then the copy takes its place
+	if ((freed = freeBlocks(&myFileSystem, old, 1)) > 0) {
+		for (i = 0; i < PUNTEROS_POR_BLOQUE; i++) {
+			if (to->table[i] > 0)
+				freed += span == 1 ? freeBlock(to->table[i]) : dropTable(to->table[i], span / PUNTEROS_POR_BLOQUE);
+		}
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks += freed;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+	}
+	cachePutBlock(&myFileSystem, copy, true);
+	return 0;
+}
 
+int unshareTables(int nodeIdx, int bl) {
+	NodeStruct *node = &myFileSystem.nodes[nodeIdx];
+	int path[NIVELES_INDIRECCION];
+	int level = blockPath(bl, path), i, ret = 0;
+	int64_t span = 1;
+	DISK_LBA table, next;
+	IBlockStruct *ind;
+
+	if (level < 0 || (table = node->indirecto[level]) < 1)
+		return 0;
+	for (i = 0; i < level; i++)
+		span *= PUNTEROS_POR_BLOQUE;
+	if (BLOCK_SHARED(&myFileSystem, table)) {
+		// The open file keeps its own copy in the cache
+		unpinIndirectBlockTables(nodeIdx);
+		ret = copyTable(&node->indirecto[level], span);
+		pinIndirectBlockTables(nodeIdx);
+		if (ret < 0)
+			return ret;
+		table = node->indirecto[level];
+	}
+	for (i = 0; i < level; i++, span /= PUNTEROS_POR_BLOQUE) {
+		if ((ind = getIndirectBlockTable(table)) == NULL)
+			return -EIO;
+		if ((next = ind->table[path[i]]) > 0 && BLOCK_SHARED(&myFileSystem, next)) {
+			ret = copyTable(&ind->table[path[i]], span / PUNTEROS_POR_BLOQUE);
+			next = ind->table[path[i]];
+			putIndirectBlockTable(table, ret == 0);
+		}
+		else {
+			putIndirectBlockTable(table, false);
+		}
+		if (ret < 0 || next < 1)
+			return ret;
+		table = next;
+	}
+	return 0;
+}
+
+int nextTableBlock(int bl) {
+	if (bl < NDIRECTOS)
+		return NDIRECTOS;
+	return bl + PUNTEROS_POR_BLOQUE - (bl - NDIRECTOS) % PUNTEROS_POR_BLOQUE;
+}
+
+/**
+* @brief Stores a cluster of delayed blocks (len of them from the logical block bl) compressed, in consecutive blocks
+* 	 close to goal. Returns the blocks it takes, 0 if the cluster is left to be placed as it is (it does not
+* 	 compress, or there is no free run that long) and <0 on error
+**/
+static int compressDelayed(NodeStruct *node, int bl, DISK_LBA *delayed, int len, DISK_LBA goal) {
+	char *data[COMPRESS_CLUSTER] = { NULL }, out[(COMPRESS_CLUSTER - 1) * BLOCK_SIZE_BYTES];
+	struct iovec iov = { out, 0 };
+	DISK_LBA first;
+	int n, got, i, ret = 0;
+
+	// The delayed blocks are always in the cache
+	for (i = 0; i < len && (data[i] = cacheGetBlock(&myFileSystem, delayed[i], true)) != NULL; i++)
+		;
+	n = i == len ? compressBlocks(data, len, out) : 0;
+	while (i--)
+		cachePutBlock(&myFileSystem, delayed[i], false);
+	if (n == 0)
+		return 0;
+	if ((got = allocBlocks(&myFileSystem, goal, n, &first)) < n) {
+		if (got)
+			freeBlocks(&myFileSystem, first, got);
+		return 0;
+	}
+	iov.iov_len = (size_t)n * BLOCK_SIZE_BYTES;
+	if (cacheWriteRun(&myFileSystem, first, n, &iov, 1)) {
+		freeBlocks(&myFileSystem, first, n);
+		return -EIO;
+	}
+
+	// The data stays in the cache as the inflated cluster
+	for (i = 0; i < len; i++) {
+		if ((ret = assignBF_to_BL(node, bl + i, COMPRESSED_LBA(first, n, i))) < 0)
+			break;
+		cacheAssignDelayed(&myFileSystem, delayed[i], COMPRESSED_LBA(first, n, i));
+	}
+	node->flags |= NODE_COMPRESSED;
+	if (i == 0) {
+		freeBlocks(&myFileSystem, first, n);
+		return ret;
+	}
+	// The blocks were taken from numOfFreeBlocks one by one: the ones saved go back (if it went wrong half way,
+	// the first i blocks are the cluster and the rest are still delayed)
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	myFileSystem.superBlock.numOfFreeBlocks += i - n;
+	pthread_mutex_unlock(&myFileSystem.allocLock);
+	__atomic_add_fetch(&myFileSystem.compressedClusters, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&myFileSystem.compressedSaved, i - n, __ATOMIC_RELAXED);
+	return ret < 0 ? ret : n;
 }
 
+/**
+* @brief Replaces the delayed blocks of the node from the logical block bl on with the blocks of the disk that
+* 	 already hold their data (see dedupBlock). Returns the number of blocks shared
+**/
+static int dedupDelayed(int nodeIdx, int bl) {
+	NodeStruct *node = &myFileSystem.nodes[nodeIdx];
+	DISK_LBA lba, shared;
+	char *data;
+	int found = 0;
+
+	for (; bl < node->numBlocks; bl++) {
+		if (!IS_DELAYED(lba = getBF_from_BL(node, bl)) || (data = cacheGetBlock(&myFileSystem, lba, true)) == NULL)
+			continue;
+		shared = dedupBlock(nodeIdx, bl, data);
+		cachePutBlock(&myFileSystem, lba, false);
+		// The table of the pointer exists already: assigning it cannot fail for lack of space
+		if (shared > 0 && assignBF_to_BL(node, bl, shared) == 0) {
+			cacheDropDelayed(&myFileSystem, lba);
+			found++;
+		}
+		else if (shared > 0) {
+			freeBlocks(&myFileSystem, shared, 1);
+		}
+	}
+	return found;
+}
+
+int allocateDelayed(int nodeIdx, BOOLEAN writeBack) {
+	NodeStruct *node = &myFileSystem.nodes[nodeIdx];
+	OpenNodeStruct *open = &myFileSystem.openNodes[nodeIdx];
+	DISK_LBA delayed[DELAYED_RUN], goal = FIRST_DATA_BLOCK(&myFileSystem), first, lba = 0;
+	int bl = open->delayedFirst, len, maxLen, got, i, ret = 0;
+
+	if (bl < 0)
+		return 0;
+	if (bl > 0)
+		goal = nextGoal(getBF_from_BL(node, bl - 1));
+
+	// The blocks that share the data of another block never take their own (they were taken from numOfFreeBlocks
+	// when the file grew). The clusters of a compressed file are not shared
+	if (myFileSystem.dedup && node->nodeType == NODE_FILE && !(node->flags & NODE_COMPRESS) && (got = dedupDelayed(nodeIdx, bl)) > 0) {
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks += got;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+	}
+
+	while (bl < node->numBlocks) {
+		// Next run of delayed blocks. The runs of a compressed file end with each cluster
+		maxLen = (node->flags & NODE_COMPRESS) ? COMPRESS_CLUSTER - bl % COMPRESS_CLUSTER : DELAYED_RUN;
+		for (len = 0; bl + len < node->numBlocks && len < maxLen; len++) {
+			if (!IS_DELAYED(lba = getBF_from_BL(node, bl + len)))
+				break;
+			delayed[len] = lba;
+		}
+		if (len == 0) {
+			// A shared block is wherever its first owner put it
+			if (lba > 0 && (IS_COMPRESSED(lba) || !BLOCK_SHARED(&myFileSystem, lba)))
+				goal = nextGoal(lba);
+			bl++;
+			continue;
+		}
+
+		// A whole cluster (or the last one of the file) goes compressed if that saves blocks
+		if ((node->flags & NODE_COMPRESS) && bl % COMPRESS_CLUSTER == 0 && (len == COMPRESS_CLUSTER || bl + len == node->numBlocks)) {
+			if ((got = compressDelayed(node, bl, delayed, len, goal)) < 0) {
+				ret = got;
+				break;
+			}
+			if (got > 0) {
+				goal = nextGoal(getBF_from_BL(node, bl));
+				bl += len;
+				continue;
+			}
+		}
+
+		// The blocks were already taken from numOfFreeBlocks when the file grew
+		if ((got = allocBlocks(&myFileSystem, goal, len, &first)) == 0) {
+			fprintf(stderr, "No free block for a delayed block in allocateDelayed\n");
+			ret = -ENOSPC;
+			break;
+		}
+		for (i = 0; i < got; i++) {
+			if ((ret = assignBF_to_BL(node, bl + i, first + i)) < 0) {
+				freeBlocks(&myFileSystem, first + i, got - i);
+				break;
+			}
+			cacheAssignDelayed(&myFileSystem, delayed[i], first + i);
+		}
+		if (ret < 0)
+			break;
+		if (writeBack)
+			cacheWriteBack(&myFileSystem, first, got);
+		goal = first + got;
+		bl += got;
+	}
+	open->delayedFirst = ret < 0 ? bl : -1;
+
+	updateSuperBlock(&myFileSystem);
+	updateBitmap(&myFileSystem);
+	updateNode(&myFileSystem, nodeIdx, node);
+	return ret;
+}
+
+int unpackCluster(int nodeIdx, int bl) {
+	NodeStruct *node = &myFileSystem.nodes[nodeIdx];
+	OpenNodeStruct *open = &myFileSystem.openNodes[nodeIdx];
+	DISK_LBA cluster, lba, blocks[COMPRESS_CLUSTER], goal;
+	int start = bl - bl % COMPRESS_CLUSTER, len, i, freed, ret = 0;
+	char *from, *to;
+
+	if (!(node->flags & NODE_COMPRESSED) || bl >= node->numBlocks || !IS_COMPRESSED(cluster = getBF_from_BL(node, bl)))
+		return 0;
+	// The compressed blocks of a cluster are the first ones (the file may have grown after the cluster was stored)
+	for (len = 0; start + len < node->numBlocks && len < COMPRESS_CLUSTER; len++) {
+		lba = getBF_from_BL(node, start + len);
+		if (!IS_COMPRESSED(lba) || COMPRESSED_FIRST(lba) != COMPRESSED_FIRST(cluster))
+			break;
+	}
+	// All their pointers change, maybe in more than one table
+	for (i = start; i < start + len; i = nextTableBlock(i)) {
+		if ((ret = unshareTables(nodeIdx, i)) < 0)
+			return ret;
+	}
+
+	// The cluster is freed once its blocks have their own place (unless it is shared)
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	if (len > myFileSystem.superBlock.numOfFreeBlocks) {
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return -ENOSPC;
+	}
+	myFileSystem.superBlock.numOfFreeBlocks -= len;
+	pthread_mutex_unlock(&myFileSystem.allocLock);
+
+	// Delayed blocks for an open file (they are compressed again when placed), blocks of the disk otherwise
+	goal = COMPRESSED_END(cluster);
+	for (i = 0; i < len; i++) {
+		lba = COMPRESSED_LBA(COMPRESSED_FIRST(cluster), COMPRESSED_LEN(cluster), i);
+		if (!open->openCount || myFileSystem.cache->map || (blocks[i] = cacheNewDelayed(&myFileSystem)) < 0) {
+			if (allocBlocks(&myFileSystem, goal, 1, &blocks[i]) == 0) {
+				ret = -ENOSPC;
+				break;
+			}
+			goal = blocks[i] + 1;
+		}
+		if ((from = cacheGetBlock(&myFileSystem, lba, true)) == NULL) {
+			freeBlock(blocks[i]);
+			ret = -EIO;
+			break;
+		}
+		if ((to = cacheGetBlock(&myFileSystem, blocks[i], IS_DELAYED(blocks[i]))) == NULL) {
+			cachePutBlock(&myFileSystem, lba, false);
+			freeBlock(blocks[i]);
+			ret = -EIO;
+			break;
+		}
+		memcpy(to, from, BLOCK_SIZE_BYTES);
+		cachePutBlock(&myFileSystem, blocks[i], true);
+		cachePutBlock(&myFileSystem, lba, false);
+	}
+	if (ret < 0) {
+		while (i--)
+			freeBlock(blocks[i]);
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks += len;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return ret;
+	}
+
+	// The tables of the cluster exist already: assigning the pointers cannot fail for lack of space
+	for (i = 0; i < len; i++) {
+		assignBF_to_BL(node, start + i, blocks[i]);
+		if (IS_DELAYED(blocks[i]) && (open->delayedFirst < 0 || open->delayedFirst > start + i))
+			open->delayedFirst = start + i;
+	}
+	freed = freeCluster(cluster);
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	myFileSystem.superBlock.numOfFreeBlocks += freed;
+	pthread_mutex_unlock(&myFileSystem.allocLock);
+	updateSuperBlock(&myFileSystem);
+	updateBitmap(&myFileSystem);
+	updateNode(&myFileSystem, nodeIdx, node);
+	return 0;
+}
+
+int unshareBlock(int nodeIdx, int bl) {
+	NodeStruct *node = &myFileSystem.nodes[nodeIdx];
+	OpenNodeStruct *open = &myFileSystem.openNodes[nodeIdx];
+	DISK_LBA lba, copy;
+	char *from = NULL, *to;
+	int freed;
+
+	// The counts of the blocks under a shared table do not tell whether they are shared
+	if (bl >= node->numBlocks)
+		return 0;
+	if ((freed = unshareTables(nodeIdx, bl)) < 0)
+		return freed;
+	if ((lba = getBF_from_BL(node, bl)) < 1 || IS_DELAYED(lba) || IS_COMPRESSED(lba) || !BLOCK_SHARED(&myFileSystem, lba))
+		return 0;
+
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	if (myFileSystem.superBlock.numOfFreeBlocks < 1) {
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return -ENOSPC;
+	}
+	myFileSystem.superBlock.numOfFreeBlocks--;
+	pthread_mutex_unlock(&myFileSystem.allocLock);
+
+	// A delayed block for an open file (it may be shared again when placed), a block of the disk otherwise
+	if (!open->openCount || myFileSystem.cache->map || (copy = cacheNewDelayed(&myFileSystem)) < 0) {
+		if (allocBlocks(&myFileSystem, bl ? nextGoal(getBF_from_BL(node, bl - 1)) : lba, 1, &copy) == 0)
+			copy = -1;
+	}
+	if (copy < 0 || (from = cacheGetBlock(&myFileSystem, lba, true)) == NULL ||
+	    (to = cacheGetBlock(&myFileSystem, copy, IS_DELAYED(copy))) == NULL) {
+		if (from)
+			cachePutBlock(&myFileSystem, lba, false);
+		if (copy > 0)
+			freeBlock(copy);
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks++;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return copy < 0 ? -ENOSPC : -EIO;
+	}
+	memcpy(to, from, BLOCK_SIZE_BYTES);
+	cachePutBlock(&myFileSystem, copy, true);
+	cachePutBlock(&myFileSystem, lba, false);
+
+	// The table of the pointer exists already. The other owners may have dropped the block meanwhile: then it is freed
+	assignBF_to_BL(node, bl, copy);
+	if (IS_DELAYED(copy) && (open->delayedFirst < 0 || open->delayedFirst > bl))
+		open->delayedFirst = bl;
+	if ((freed = freeBlocks(&myFileSystem, lba, 1)) > 0) {
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks += freed;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+	}
+	updateSuperBlock(&myFileSystem);
+	updateBitmap(&myFileSystem);
+	updateNode(&myFileSystem, nodeIdx, node);
+	return 0;
+}
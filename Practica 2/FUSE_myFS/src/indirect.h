@@ -7,14 +7,83 @@
 #include "myFS.h"
 
 #define MAX_FUSE_NARGS 64
+#define DELAYED_RUN 256			// Delayed blocks placed with a single allocBlocks
 
 
 extern MyFileSystem myFileSystem;
 
-IBlockStruct* getIndirectBlockTable(NodeStruct *node);
-int initIndirectBlockTable(NodeStruct *node);
+IBlockStruct* getIndirectBlockTable(DISK_LBA lba);
+void putIndirectBlockTable(DISK_LBA lba, BOOLEAN dirty);
+void pinIndirectBlockTables(int nodeIdx);
+void unpinIndirectBlockTables(int nodeIdx);
 DISK_LBA getBF_from_BL(NodeStruct *node, int bl);
 DISK_LBA getBF_of_last_BL(NodeStruct *node);
-void assignBF_to_BL(NodeStruct *node, int bl, DISK_LBA bf);
+int assignBF_to_BL(NodeStruct *node, int bl, DISK_LBA bf);
+
+/**
+* @brief Extent that starts at the logical block bl: number of following logical blocks (up to maxLen) stored
+* 	 in consecutive physical blocks, the first one returned in bf (0 for a run of blocks without data)
+**/
+int getExtent(NodeStruct *node, int bl, int maxLen, DISK_LBA *bf);
+
+/**
+* @brief Block to start looking for free blocks for what follows the block of a pointer (delayed, compressed or none)
+**/
+DISK_LBA nextGoal(DISK_LBA lba);
+
+/**
+* @brief Number of indirect tables (of any level) needed to map numBlocks logical blocks
+**/
+int indirectBlocksFor(int numBlocks);
+
+/**
+* @brief Frees every data block and indirect table of the node past its first numBlocks logical blocks
+* 	 (numOfFreeBlocks is left to the caller). Returns the number of blocks freed. A compressed cluster must not be
+* 	 cut in two (see unpackCluster)
+**/
+int truncateBlockMap(int nodeIdx, int numBlocks);
+
+/**
+* @brief Drops every block of a block map that is not in the inode table (the inodes of a snapshot), as
+* 	 truncateBlockMap to zero blocks. Returns the number of blocks freed
+**/
+int dropBlockMap(NodeStruct *node);
+
+/**
+* @brief Adds a reference to the blocks and top tables of a block map (a snapshot takes the inode, a clone copies
+* 	 it). The blocks below a table are counted by the table
+**/
+void shareBlockMap(NodeStruct *node);
+
+/**
+* @brief Gives a place in the disk to the delayed blocks of the node (see cacheNewDelayed), in runs as long as
+* 	 possible right after the block before them. With writeBack the runs are also written to the backup file.
+* 	 The clusters of a file with NODE_COMPRESS are stored compressed when that saves blocks. With -D the blocks
+* 	 whose data is already in a block of the disk share it instead
+**/
+int allocateDelayed(int nodeIdx, BOOLEAN writeBack);
+
+/**
+* @brief Gives back their own blocks to the blocks of the compressed cluster holding the logical block bl, so they
+* 	 can be modified (delayed blocks if the file is open), and frees the cluster. Does nothing if bl is not compressed
+**/
+int unpackCluster(int nodeIdx, int bl);
+
+/**
+* @brief Gives the logical block bl its own copy of its block if it is shared with another pointer, so it can be
+* 	 modified (a delayed block if the file is open). Does nothing if the block is not shared
+**/
+int unshareBlock(int nodeIdx, int bl);
+
+/**
+* @brief Copies the tables shared with a snapshot or a clone on the way to the logical block bl, top down, so its
+* 	 pointer can change. The blocks below a copied table get one more reference each
+**/
+int unshareTables(int nodeIdx, int bl);
+
+/**
+* @brief First logical block after bl that is mapped by another table (runs of blocks go table by table)
+**/
+int nextTableBlock(int bl);
 
 #endif
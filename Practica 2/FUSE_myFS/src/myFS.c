@@ -1,93 +1,421 @@
+#define _GNU_SOURCE
 #include "myFS.h"
+#include "cache.h"
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-void copyNode(NodeStruct *dest, NodeStruct *src) {
-	int i;
+#define METADATA_CHUNK 64	// Blocks of the reference counts read or zeroed at a time by myMount (after a crash) and myMkfs (256 KiB)
 
+void copyNode(NodeStruct *dest, NodeStruct *src) {
 	dest->numBlocks = src->numBlocks;
+	dest->flags = src->flags;
 	dest->fileSize = src->fileSize;
 	dest->modificationTime = src->modificationTime;
 	dest->freeNode = src->freeNode;
+	dest->nodeType = src->nodeType;
+
+	// Pointers or inline data
+	memcpy(dest->inlineData, src->inlineData, NODE_INLINE_BYTES);
+}
+
+int findFreeNode(MyFileSystem* myFileSystem) {
+	int w, numWords = NODE_BITMAP_BLOCKS(&myFileSystem->superBlock) * BITMAP_WORDS_PER_BLOCK;
+	// The bits past the last inode are set, so the first word with a zero bit has the free inode
+	for(w = myFileSystem->freeNodeHint; w < numWords; w++) {
+		if(~myFileSystem->nodeBitMap[w]) {
+			myFileSystem->freeNodeHint = w;
+			return w * 64 + __builtin_ctzll(~myFileSystem->nodeBitMap[w]);
+		}
+	}
+	// There is no free inode
+	myFileSystem->freeNodeHint = numWords;
+	return -1;
+}
+
+int updateNodeBitmap(MyFileSystem *myFileSystem, int nodeIdx, BOOLEAN used) {
+	int w = nodeIdx / 64;
+
+	if(used)
+		myFileSystem->nodeBitMap[w] |= UINT64_C(1) << (nodeIdx % 64);
+	else {
+		myFileSystem->nodeBitMap[w] &= ~(UINT64_C(1) << (nodeIdx % 64));
+		if(w < myFileSystem->freeNodeHint)
+			myFileSystem->freeNodeHint = w;
+	}
+	if(cacheWrite(myFileSystem, myFileSystem->superBlock.nodeBitmapIdx + w / BITMAP_WORDS_PER_BLOCK,
+				  (w % BITMAP_WORDS_PER_BLOCK) * sizeof(uint64_t), &myFileSystem->nodeBitMap[w], sizeof(uint64_t))) {
+		fprintf(stderr, "Failed write in updateNodeBitmap\n");
+		return -1;
+	}
+	return 0;
+}
+
+int initializeNodes(MyFileSystem *myFileSystem) {
+	int i, numNodes = NUM_NODES(myFileSystem);
+	pthread_rwlockattr_t attr;
+
+	// The table and its bitmap are aligned like the blocks they come from
+	if(posix_memalign((void **)&myFileSystem->nodes, BLOCK_SIZE_BYTES, (size_t)myFileSystem->superBlock.numNodeBlocks * BLOCK_SIZE_BYTES) ||
+	   posix_memalign((void **)&myFileSystem->nodeBitMap, BLOCK_SIZE_BYTES, (size_t)NODE_BITMAP_BLOCKS(&myFileSystem->superBlock) * BLOCK_SIZE_BYTES) ||
+	   (myFileSystem->openNodes = calloc(numNodes, sizeof(OpenNodeStruct))) == NULL) {
+		perror("Error allocating the inode table");
+		return -1;
+	}
+	myFileSystem->freeNodeHint = 0;
+
+	pthread_mutex_init(&myFileSystem->allocLock, NULL);
+	pthread_mutex_init(&myFileSystem->nodeLock, NULL);
+	// The operations waiting behind a snapshot do not let new ones in
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&myFileSystem->freezeLock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	for(i = 0; i < DCACHE_LOCKS; i++)
+		pthread_mutex_init(&myFileSystem->dcacheLocks[i], NULL);
+	for(i = 0; i < numNodes; i++) {
+		pthread_rwlock_init(&myFileSystem->openNodes[i].lock, NULL);
+		pthread_mutex_init(&myFileSystem->openNodes[i].readahead.lock, NULL);
+		myFileSystem->openNodes[i].delayedFirst = -1;
+	}
+	return 0;
+}
+
+int initializeBitmap(MyFileSystem *myFileSystem) {
+	int i, numBitmapBlocks = myFileSystem->superBlock.numBitmapBlocks;
+	int numRefCountBlocks = myFileSystem->superBlock.numRefCountBlocks;
+
+	// Aligned like the inode table: they are read from the backup file straight into them
+	if(posix_memalign((void **)&myFileSystem->bitMap, BLOCK_SIZE_BYTES, (size_t)numBitmapBlocks * BLOCK_SIZE_BYTES) ||
+	   (myFileSystem->bitmapFree = malloc(numBitmapBlocks * sizeof(int))) == NULL ||
+	   (myFileSystem->bitmapLongest = malloc(numBitmapBlocks * sizeof(int))) == NULL ||
+	   (myFileSystem->bitmapDirty = calloc(numBitmapBlocks, sizeof(BOOLEAN))) == NULL ||
+	   (myFileSystem->refCountsUsed = calloc(numRefCountBlocks, sizeof(int))) == NULL) {
+		perror("Error allocating the bit map");
+		return -1;
+	}
+	memset(myFileSystem->bitMap, 0, (size_t)numBitmapBlocks * BLOCK_SIZE_BYTES);
+	for(i = 0; i < numBitmapBlocks; i++)
+		myFileSystem->bitmapFree[i] = myFileSystem->bitmapLongest[i] = BITS_PER_BITMAP_BLOCK;
+	myFileSystem->freeHint = 0;
+	myFileSystem->bitmapDirtyLow = numBitmapBlocks;
+	myFileSystem->bitmapDirtyHigh = -1;
+	return 0;
+}
+
+/**
+* @brief Sets or clears a run of bits of the bit map, keeping its summary and the dirty blocks up to date.
+* 	 The caller holds myFileSystem->allocLock
+**/
+static void markBlocks(MyFileSystem *myFileSystem, DISK_LBA first, DISK_LBA numBlocks, BOOLEAN used) {
+	DISK_LBA lba;
+
+	for(lba = first; lba < first + numBlocks; lba++) {
+		int b = lba / BITS_PER_BITMAP_BLOCK;
+		uint64_t bit = UINT64_C(1) << (lba % 64);
+
+		if(used)
+			myFileSystem->bitMap[lba / 64] |= bit;
+		else
+			myFileSystem->bitMap[lba / 64] &= ~bit;
+		myFileSystem->bitmapFree[b] += used ? -1 : 1;
+		// A block freed may join two runs: only the free blocks bound the longest one then
+		if(!used || myFileSystem->bitmapLongest[b] > myFileSystem->bitmapFree[b])
+			myFileSystem->bitmapLongest[b] = myFileSystem->bitmapFree[b];
+		if(!used && b < myFileSystem->freeHint)
+			myFileSystem->freeHint = b;
+		myFileSystem->bitmapDirty[b] = true;
+		if(b < myFileSystem->bitmapDirtyLow)
+			myFileSystem->bitmapDirtyLow = b;
+		if(b > myFileSystem->bitmapDirtyHigh)
+			myFileSystem->bitmapDirtyHigh = b;
+	}
+	while(myFileSystem->freeHint < myFileSystem->superBlock.numBitmapBlocks && myFileSystem->bitmapFree[myFileSystem->freeHint] == 0)
+		myFileSystem->freeHint++;
+}
+
+/**
+* @brief Makes the summary of block b of the reference counts from its content in the cache, unless it is known.
+* 	 Readers may race to make it: they count the same, as the counts only change once it is known
+**/
+static void countReferences(MyFileSystem *myFileSystem, DISK_LBA b, uint32_t *counts) {
+	int i, used = 0, unknown = REFCOUNTS_UNKNOWN;
 
-	for(i = 0; i < MAX_BLOCKS_PER_FILE; i++)
-		dest->blocks[i] = src->blocks[i];
+	if(__atomic_load_n(&myFileSystem->refCountsUsed[b], __ATOMIC_ACQUIRE) != REFCOUNTS_UNKNOWN)
+		return;
+	for(i = 0; i < (int)REFCOUNTS_PER_BLOCK; i++)
+		used += __atomic_load_n(&counts[i], __ATOMIC_RELAXED) != 0;
+	__atomic_compare_exchange_n(&myFileSystem->refCountsUsed[b], &unknown, used, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
 }
 
-int findFileByName(MyFileSystem *myFileSystem, char *fileName) {
+/**
+* @brief Pins block b of the reference counts in the cache, with its summary counted (addReferences adjusts it).
+* 	 The caller does not hold myFileSystem->allocLock: the block may have to be read
+**/
+static uint32_t *getCounts(MyFileSystem *myFileSystem, DISK_LBA b) {
+	uint32_t *counts;
+
+	if((counts = (uint32_t *)cacheGetBlock(myFileSystem, myFileSystem->superBlock.refCountIdx + b, true)) == NULL) {
+		fprintf(stderr, "Failed to read block %" PRId64 " of the reference counts\n", b);
+		return NULL;
+	}
+	countReferences(myFileSystem, b, counts);
+	return counts;
+}
+
+/**
+* @brief Adds delta to the reference count of a block, in its block of the reference counts pinned by getCounts,
+* 	 keeping their summary up to date. The caller holds myFileSystem->allocLock
+**/
+static void addReferences(MyFileSystem *myFileSystem, uint32_t *counts, DISK_LBA lba, int delta) {
+	DISK_LBA b = lba / REFCOUNTS_PER_BLOCK;
+	uint32_t refs = counts[lba % REFCOUNTS_PER_BLOCK];
+
+	// getReferences reads it without the lock
+	__atomic_store_n(&counts[lba % REFCOUNTS_PER_BLOCK], refs + delta, __ATOMIC_RELAXED);
+	if(!refs != !(refs + delta))
+		__atomic_add_fetch(&myFileSystem->refCountsUsed[b], refs ? -1 : 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&myFileSystem->superBlock.sharedRefs, delta, __ATOMIC_RELAXED);
+}
+
+/**
+* @brief Gives a run of free blocks back to the host: they become a hole of the backup file, which reads as zeros.
+* 	 A backup file without holes (or an error) turns punchHoles off: the new blocks are written with zeros again
+**/
+static int punchRun(MyFileSystem *myFileSystem, DISK_LBA first, DISK_LBA numBlocks) {
+	if(fallocate(myFileSystem->fdVirtualDisk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)first * BLOCK_SIZE_BYTES,
+				 (off_t)numBlocks * BLOCK_SIZE_BYTES) == -1) {
+		if(errno != EOPNOTSUPP)
+			perror("Failed to punch a hole in the backup file");
+		myFileSystem->punchHoles = false;
+		return -1;
+	}
+	return 0;
+}
+
+// Set by addHole: the calling thread has runs of blocks freed that sealHoles has not seen yet
+static __thread BOOLEAN holesOpen;
+
+/**
+* @brief Zeroes blocks through the cache (they are written back with the rest): free blocks not punched yet must
+* 	 read as zeros when they are taken again. The blocks are in use, held by the caller without myFileSystem->allocLock
+**/
+static void zeroBlocks(MyFileSystem *myFileSystem, DISK_LBA first, DISK_LBA end) {
+	for(; first < end; first++) {
+		if(cacheGetBlock(myFileSystem, first, false) == NULL) {
+			fprintf(stderr, "Failed to zero block %" PRId64 "\n", first);
+			continue;
+		}
+		cachePutBlock(myFileSystem, first, true);
+	}
+}
+
+/**
+* @brief Drops a run of blocks waiting to be punched (the last one takes its place). The caller holds myFileSystem->allocLock
+**/
+static void dropHole(MyFileSystem *myFileSystem, int i) {
+	myFileSystem->holes[i] = myFileSystem->holes[--myFileSystem->numHoles];
+}
+
+/**
+* @brief Adds a block about to be freed to a run of the operation in course, which grows at both ends (a file is
+* 	 truncated table by table). Returns false without room for another run: the block has to be zeroed instead.
+* 	 The caller holds myFileSystem->allocLock
+**/
+static BOOLEAN addHole(MyFileSystem *myFileSystem, DISK_LBA lba) {
+	HoleRunStruct *run;
 	int i;
 
-	for(i = 0; i < MAX_FILES_PER_DIRECTORY; i++) {
-		if(myFileSystem->directory.files[i].freeFile == false) {
-			if(strcmp(fileName, myFileSystem->directory.files[i].fileName) == 0)
-				return i;
+	if(!myFileSystem->punchHoles)
+		return true;
+	for(i = myFileSystem->numHoles - 1; i >= 0; i--) {
+		run = &myFileSystem->holes[i];
+		if(run->sealed || !pthread_equal(run->owner, pthread_self()))
+			continue;
+		if(lba == run->end) {
+			run->end++;
+			return true;
+		}
+		if(lba == run->first - 1) {
+			run->first--;
+			return true;
 		}
 	}
-	return -1;
+	if(myFileSystem->numHoles == MAX_HOLE_RUNS)
+		return false;
+	myFileSystem->holes[myFileSystem->numHoles++] = (HoleRunStruct){ lba, lba + 1, pthread_self(), false, 0 };
+	holesOpen = true;
+	return true;
 }
 
-int findFreeFile(MyFileSystem *myFileSystem) {
+/**
+* @brief Takes the blocks of a run about to be reserved out of the runs waiting to be punched: [*zeroFirst, *zeroEnd)
+* 	 covers the ones to zero. A run is never split without room for another one: the reserved run is moved to the end
+* 	 of the run it falls into (same length, all of it free). Returns the first block of the run. The caller holds
+* 	 myFileSystem->allocLock
+**/
+static DISK_LBA takeHoles(MyFileSystem *myFileSystem, DISK_LBA first, int len, DISK_LBA *zeroFirst, DISK_LBA *zeroEnd) {
+	DISK_LBA end = first + len, from, to;
 	int i;
-	for(i = 0; i < MAX_FILES_PER_DIRECTORY; i++) {
-		if(myFileSystem->directory.files[i].freeFile == true)
-			return i;
+
+	for(i = 0; i < myFileSystem->numHoles; i++) {
+		HoleRunStruct *run = &myFileSystem->holes[i];
+		if(run->first < first && end < run->end && myFileSystem->numHoles == MAX_HOLE_RUNS) {
+			first = run->end - len;
+			end = run->end;
+			break;
+		}
 	}
-	// There is no a free file
-	return -1;
+	for(i = myFileSystem->numHoles - 1; i >= 0; i--) {
+		HoleRunStruct *run = &myFileSystem->holes[i];
+		if(run->end <= first || end <= run->first)
+			continue;
+		from = first > run->first ? first : run->first;
+		to = end < run->end ? end : run->end;
+		if(*zeroFirst == *zeroEnd || from < *zeroFirst)
+			*zeroFirst = from;
+		if(to > *zeroEnd)
+			*zeroEnd = to;
+		if(run->first < first && end < run->end) {
+			myFileSystem->holes[myFileSystem->numHoles] = *run;
+			myFileSystem->holes[myFileSystem->numHoles++].first = end;
+			run->end = first;
+		}
+		else if(run->first < first) {
+			run->end = first;
+		}
+		else if(end < run->end) {
+			run->first = end;
+		}
+		else {
+			dropHole(myFileSystem, i);
+		}
+	}
+	return first;
 }
 
-int findFreeNode(MyFileSystem* myFileSystem) {
+void sealHoles(MyFileSystem *myFileSystem) {
 	int i;
-	for(i = 0; i < MAX_NODES; i++) {
-		if(myFileSystem->nodes[i] == NULL)
-			return i;
+
+	if(!holesOpen)
+		return;
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	for(i = 0; i < myFileSystem->numHoles; i++) {
+		if(pthread_equal(myFileSystem->holes[i].owner, pthread_self()))
+			myFileSystem->holes[i].sealed = true;
 	}
-	// There is no free inode
-	return -1;
+	holesOpen = false;
+	pthread_mutex_unlock(&myFileSystem->allocLock);
 }
 
-int findNodeByPos(int nodeNum) {
-	int whichInodeBlock;
-	int whichInodeInBlock;
-	int inodeLocation;
+unsigned long startHoleFlush(MyFileSystem *myFileSystem) {
+	unsigned long flush = 0;
+	int i;
 
-	whichInodeBlock = nodeNum / NODES_PER_BLOCK;
-	whichInodeInBlock = nodeNum % NODES_PER_BLOCK;
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	for(i = 0; i < myFileSystem->numHoles; i++) {
+		HoleRunStruct *run = &myFileSystem->holes[i];
+		if(!flush && (run->flush || run->sealed))
+			flush = ++myFileSystem->holeFlushes;
+		if(run->sealed && !run->flush)
+			run->flush = flush;
+	}
+	pthread_mutex_unlock(&myFileSystem->allocLock);
+	return flush;
+}
 
-	inodeLocation = (NODES_IDX + whichInodeBlock) * BLOCK_SIZE_BYTES + whichInodeInBlock * sizeof(NodeStruct);
-	return inodeLocation;
+void punchFlushedHoles(MyFileSystem *myFileSystem, unsigned long flush) {
+	int i;
+
+	if(!flush)
+		return;
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	for(i = myFileSystem->numHoles - 1; i >= 0; i--) {
+		HoleRunStruct *run = &myFileSystem->holes[i];
+		if(!run->flush || run->flush > flush)
+			continue;
+		if(myFileSystem->punchHoles && punchRun(myFileSystem, run->first, run->end - run->first) == 0)
+			myFileSystem->blocksPunched += run->end - run->first;
+		dropHole(myFileSystem, i);
+	}
+	pthread_mutex_unlock(&myFileSystem->allocLock);
 }
 
-int initializeNodes(MyFileSystem *myFileSystem) {
-	int numNode;
-	NodeStruct temp;
+/**
+* @brief Makes every free data block a hole of the backup file, a run at a time, and finds out whether the
+* 	 backup file supports holes at all. Only for a new disk or one not unmounted cleanly: a crash (or myfs-fsck -r)
+* 	 may leave old data there
+**/
+static void punchFreeRuns(MyFileSystem *myFileSystem) {
+	DISK_LBA lba = FIRST_DATA_BLOCK(myFileSystem), end = myFileSystem->superBlock.diskSizeInBlocks, first;
 
-	// We read the inodes one by one
-	for(numNode = 0; numNode < MAX_NODES; numNode++) {
-		if(readNode(myFileSystem, numNode, &temp))
-			return -1;
-		// Free inode?
-		if(temp.freeNode) {
-			myFileSystem->nodes[numNode] = NULL;
+	myFileSystem->punchHoles = true;
+	myFileSystem->numHoles = 0;
+	while(lba < end && myFileSystem->punchHoles) {
+		if(lba % 64 == 0 && myFileSystem->bitMap[lba / 64] == UINT64_MAX) {
+			lba += 64;
+			continue;
 		}
-		// We alloc. an inode in mem. and copy the content from the backup file
-		else {
-			if( (myFileSystem->nodes[numNode] = malloc(sizeof(NodeStruct)))==NULL){
-				perror("Error in malloc");
-				return -2;
-			}
-			copyNode(myFileSystem->nodes[numNode], &temp);
-			myFileSystem->numFreeNodes--;
+		if(BLOCK_IN_USE(myFileSystem, lba)) {
+			lba++;
+			continue;
 		}
+		for(first = lba; lba < end && !BLOCK_IN_USE(myFileSystem, lba); )
+			lba += lba % 64 == 0 && lba + 64 <= end && myFileSystem->bitMap[lba / 64] == 0 ? 64 : 1;
+		punchRun(myFileSystem, first, lba - first);
 	}
-	return 0;
+	if(!myFileSystem->punchHoles)
+		fprintf(stderr, "The backup file has no holes: the new blocks are written with zeros\n");
+}
+
+void lockNode(MyFileSystem *myFileSystem, int nodeIdx, BOOLEAN write) {
+	if(write)
+		pthread_rwlock_wrlock(&myFileSystem->openNodes[nodeIdx].lock);
+	else
+		pthread_rwlock_rdlock(&myFileSystem->openNodes[nodeIdx].lock);
+}
+
+BOOLEAN tryLockNode(MyFileSystem *myFileSystem, int nodeIdx, BOOLEAN write) {
+	if(write)
+		return pthread_rwlock_trywrlock(&myFileSystem->openNodes[nodeIdx].lock) == 0;
+	return pthread_rwlock_tryrdlock(&myFileSystem->openNodes[nodeIdx].lock) == 0;
 }
 
-void initializeSuperBlock(MyFileSystem *myFileSystem, int diskSize) {
+void unlockNode(MyFileSystem *myFileSystem, int nodeIdx) {
+	pthread_rwlock_unlock(&myFileSystem->openNodes[nodeIdx].lock);
+}
+
+void beginUpdate(MyFileSystem *myFileSystem) {
+	pthread_rwlock_rdlock(&myFileSystem->freezeLock);
+}
+
+void endUpdate(MyFileSystem *myFileSystem) {
+	pthread_rwlock_unlock(&myFileSystem->freezeLock);
+	sealHoles(myFileSystem);
+	// Blocks keep waiting for a hole until a flush: with too many of them the next ones would be zeroed instead
+	if(__atomic_load_n(&myFileSystem->numHoles, __ATOMIC_RELAXED) > MAX_HOLE_RUNS / 2)
+		cacheFlush(myFileSystem);
+}
+
+off_t findNodeByPos(MyFileSystem *myFileSystem, int nodeNum) {
+	int whichInodeBlock;
+	int whichInodeInBlock;
+	off_t inodeLocation;
+
+	whichInodeBlock = nodeNum / NODES_PER_BLOCK;
+	whichInodeInBlock = nodeNum % NODES_PER_BLOCK;
+
+	inodeLocation = (myFileSystem->superBlock.nodesIdx + whichInodeBlock) * BLOCK_SIZE_BYTES + whichInodeInBlock * sizeof(NodeStruct);
+	return inodeLocation;
+}
+
+void initializeSuperBlock(MyFileSystem *myFileSystem, int64_t diskSize) {
 	myFileSystem->superBlock.diskSizeInBlocks = diskSize / BLOCK_SIZE_BYTES;
 	myFileSystem->superBlock.numOfFreeBlocks = myQuota(myFileSystem);
 
@@ -96,248 +424,895 @@ void initializeSuperBlock(MyFileSystem *myFileSystem, int diskSize) {
 	myFileSystem->superBlock.blockSize = BLOCK_SIZE_BYTES;
 	myFileSystem->superBlock.maxLenFileName = MAX_LEN_FILE_NAME;
 	myFileSystem->superBlock.maxBlocksPerFile = MAX_BLOCKS_PER_FILE;
+	myFileSystem->superBlock.clean = false;
 }
 
 void myFree(MyFileSystem *myFileSystem) {
+	char stats[512];
 	int i;
+
+	// No operation is left: every block freed is punched after the last flush
+	for(i = 0; i < myFileSystem->numHoles; i++)
+		myFileSystem->holes[i].sealed = true;
+	if(myFileSystem->cache) {
+		// The sum of the reference counts is not written with each change. The next mount trusts it (and the holes)
+		// only once everything else is in the disk
+		if(updateSuperBlock(myFileSystem) == 0 && cacheFlush(myFileSystem) == 0) {
+			myFileSystem->superBlock.clean = true;
+			if(updateSuperBlock(myFileSystem) == 0)
+				cacheFlush(myFileSystem);
+		}
+	}
+	if(myStats(myFileSystem, stats, sizeof(stats)) > 0)
+		fprintf(stderr, "%s", stats);
+	cacheFree(myFileSystem);
 	close(myFileSystem->fdVirtualDisk);
-	for(i = 0; i < MAX_NODES; i++) {
-		free(myFileSystem->nodes[i]);
-		myFileSystem->nodes[i] = NULL;
+	free(myFileSystem->nodes);
+	free(myFileSystem->nodeBitMap);
+	free(myFileSystem->openNodes);
+	free(myFileSystem->bitMap);
+	free(myFileSystem->bitmapFree);
+	free(myFileSystem->bitmapLongest);
+	free(myFileSystem->bitmapDirty);
+	free(myFileSystem->refCountsUsed);
+	myFileSystem->nodes = NULL;
+	myFileSystem->nodeBitMap = NULL;
+	myFileSystem->openNodes = NULL;
+	myFileSystem->bitMap = NULL;
+	myFileSystem->bitmapFree = NULL;
+	myFileSystem->bitmapLongest = NULL;
+	myFileSystem->bitmapDirty = NULL;
+	myFileSystem->refCountsUsed = NULL;
+}
+
+/**
+* @brief Zeroes a run of blocks of the backup file around the cache (myMkfs): it becomes a hole, or is written with
+* 	 zeros a chunk at a time if the backup file cannot have holes
+**/
+static int zeroArea(MyFileSystem *myFileSystem, DISK_LBA first, DISK_LBA numBlocks) {
+	char *zeros;
+	DISK_LBA n;
+
+	if(fallocate(myFileSystem->fdVirtualDisk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)first * BLOCK_SIZE_BYTES,
+				 (off_t)numBlocks * BLOCK_SIZE_BYTES) == 0)
+		return 0;
+	if((zeros = calloc(METADATA_CHUNK, BLOCK_SIZE_BYTES)) == NULL)
+		return -1;
+	for(; numBlocks > 0; first += n, numBlocks -= n) {
+		n = numBlocks < METADATA_CHUNK ? numBlocks : METADATA_CHUNK;
+		if(pwrite(myFileSystem->fdVirtualDisk, zeros, (size_t)n * BLOCK_SIZE_BYTES, (off_t)first * BLOCK_SIZE_BYTES) != (ssize_t)n * BLOCK_SIZE_BYTES) {
+			free(zeros);
+			return -1;
+		}
 	}
+	free(zeros);
+	return 0;
 }
 
-int myMkfs(MyFileSystem *myFileSystem, int diskSize, char *backupFileName) {
-	// We create the virtual disk:
-	myFileSystem->fdVirtualDisk = open(backupFileName, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+/**
+* @brief Prints the metadata regions of the disk (shared by myMkfs and myMount)
+**/
+static void printLayout(MyFileSystem *myFileSystem) {
+	SuperBlockStruct *sb = &myFileSystem->superBlock;
+
+	printf("1 block for SUPERBLOCK (%u B)\n", (unsigned int)sizeof(SuperBlockStruct));
+	printf("%d blocks for BITMAP (from block %d), covering %" PRId64 " blocks\n", sb->numBitmapBlocks, BITMAP_IDX,
+			(DISK_LBA)sb->numBitmapBlocks * BITS_PER_BITMAP_BLOCK);
+	printf("%d blocks for the inode bitmap (from block %" PRId64 ")\n", NODE_BITMAP_BLOCKS(sb), sb->nodeBitmapIdx);
+	printf("%d blocks for inodes (from block %" PRId64 ", %u B/inode, %u inodes)\n", sb->numNodeBlocks, sb->nodesIdx,
+			(unsigned int)sizeof(NodeStruct), (unsigned int)NUM_NODES(myFileSystem));
+	printf("%d blocks for reference counts (from block %" PRId64 ")\n", sb->numRefCountBlocks, sb->refCountIdx);
+	printf("%d blocks for checksums (from block %" PRId64 ", CRC32C of every block)\n", sb->numChecksumBlocks, sb->checksumIdx);
+}
 
+int myMkfs(MyFileSystem *myFileSystem, int64_t diskSize, int numNodes, char *backupFileName) {
 	// Some minimal checks:
 	assert(sizeof(SuperBlockStruct) <= BLOCK_SIZE_BYTES);
-	assert(sizeof(DirectoryStruct) <= BLOCK_SIZE_BYTES);
-	int numBlocks = diskSize / BLOCK_SIZE_BYTES;
-	int minNumBlocks = 3 + MAX_BLOCKS_WITH_NODES + 1;
-	int maxNumBlocks = NUM_BITS;
+	assert(sizeof(DirPage) <= BLOCK_SIZE_BYTES);
+	assert(NODES_PER_BLOCK * sizeof(NodeStruct) == BLOCK_SIZE_BYTES);
+	DISK_LBA numBlocks = diskSize / BLOCK_SIZE_BYTES;
+	if(numBlocks > MAX_DISK_BLOCKS) {
+		return -2;
+	}
+	if(numNodes > MAX_NODES) {
+		return -5;
+	}
+	if(numNodes <= 0)
+		numNodes = numBlocks / DEFAULT_BLOCKS_PER_NODE < DEFAULT_MAX_NODES ? numBlocks / DEFAULT_BLOCKS_PER_NODE : DEFAULT_MAX_NODES;
+
+	// Layout: super block, bit map, inode bitmap, inode table, reference counts, checksums and data
+	SuperBlockStruct *sb = &myFileSystem->superBlock;
+	sb->numNodeBlocks = numNodes > 0 ? (numNodes + NODES_PER_BLOCK - 1) / NODES_PER_BLOCK : 1;
+	sb->numBitmapBlocks = (numBlocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK;
+	sb->numChecksumBlocks = (numBlocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+	sb->numRefCountBlocks = (numBlocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+	sb->nodeBitmapIdx = BITMAP_IDX + sb->numBitmapBlocks;
+	sb->nodesIdx = sb->nodeBitmapIdx + NODE_BITMAP_BLOCKS(sb);
+	sb->refCountIdx = sb->nodesIdx + sb->numNodeBlocks;
+	sb->checksumIdx = sb->refCountIdx + sb->numRefCountBlocks;
+	sb->firstDataBlock = sb->checksumIdx + sb->numChecksumBlocks;
+	memset(sb->snapshots, 0, sizeof(sb->snapshots));
+	DISK_LBA minNumBlocks = FIRST_DATA_BLOCK(myFileSystem) + 2;
 	if(numBlocks < minNumBlocks) {
 		return -1;
 	}
-	if(numBlocks >= maxNumBlocks) {
-		return -2;
+	if(initializeNodes(myFileSystem) || initializeBitmap(myFileSystem)) {
+		return -4;
+	}
+	numNodes = NUM_NODES(myFileSystem);
+
+	// We create the virtual disk:
+	myFileSystem->fdVirtualDisk = open(backupFileName, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if(myFileSystem->fdVirtualDisk == -1 || cacheInit(myFileSystem)) {
+		perror(backupFileName);
+		return -4;
+	}
+	if(myFileSystem->mapDisk && cacheMap(myFileSystem, numBlocks)) {
+		return -4;
 	}
 
 	/// BITMAP
-	// Initialization
+	// The metadata blocks are in use and the first data block is the root directory. The bits past the
+	// end of the disk are set: they are never found free
 	int i;
-	for(i = 0; i < NUM_BITS; i++) {
-		myFileSystem->bitMap[i] = 0;
-	}
+	markBlocks(myFileSystem, SUPERBLOCK_IDX, FIRST_DATA_BLOCK(myFileSystem) + 1, true);
+	markBlocks(myFileSystem, numBlocks, (DISK_LBA)sb->numBitmapBlocks * BITS_PER_BITMAP_BLOCK - numBlocks, true);
+	myFileSystem->superBlock.diskSizeInBlocks = numBlocks;
 
-	// First three blocks will be superblock, bitmap and directory
-	myFileSystem->bitMap[BITMAP_IDX] = 1;
-	myFileSystem->bitMap[SUPERBLOCK_IDX] = 1;
-	myFileSystem->bitMap[DIRECTORY_IDX] = 1;
-	// Next MAX_BLOCKS_WITH_NODES will contain inodes
-	for(i = 3; i < 3 + MAX_BLOCKS_WITH_NODES; i++) {
-		myFileSystem->bitMap[i] = 1;
-	}
-	updateBitmap(myFileSystem);
+	/// INODE BITMAP
+	// Only the root is in use. The bits past the last inode are set: they are never found free
+	memset(myFileSystem->nodeBitMap, 0, (size_t)NODE_BITMAP_BLOCKS(sb) * BLOCK_SIZE_BYTES);
+	for(i = numNodes; i < NODE_BITMAP_BLOCKS(sb) * BITS_PER_BITMAP_BLOCK; i++)
+		myFileSystem->nodeBitMap[i / 64] |= UINT64_C(1) << (i % 64);
+	myFileSystem->nodeBitMap[ROOT_NODE / 64] |= UINT64_C(1) << (ROOT_NODE % 64);
 
-	/// DIRECTORY
-	// Initialization
-	myFileSystem->directory.numFiles = 0;
-	for(i = 0; i < MAX_FILES_PER_DIRECTORY; i++) {
-		myFileSystem->directory.files[i].freeFile = 1;
-	}
-	updateDirectory(myFileSystem);
+	/// ROOT DIRECTORY
+	// Its tree is a single empty leaf
+	NodeStruct root;
+	char rootPage[BLOCK_SIZE_BYTES];
+	memset(&root, 0, sizeof(NodeStruct));
+	memset(rootPage, 0, BLOCK_SIZE_BYTES);
+	for(i = 0; i < NIVELES_INDIRECCION; i++)
+		root.indirecto[i] = -1;
+	root.blocks[0] = FIRST_DATA_BLOCK(myFileSystem);
+	((DirPage *)rootPage)->type = DIR_PAGE_LEAF;
+	root.numBlocks = 1;
+	root.fileSize = BLOCK_SIZE_BYTES;
+	root.modificationTime = time(NULL);
+	root.freeNode = false;
+	root.nodeType = NODE_DIRECTORY;
 
 	/// INODES
-	NodeStruct currentNode;
-	currentNode.freeNode = 1;
-	for(i = 0; i < MAX_NODES; i++) {
-		updateNode(myFileSystem, i, &currentNode);
-	}
+	// The table in memory is the image of the inode blocks
+	memset(myFileSystem->nodes, 0, (size_t)myFileSystem->superBlock.numNodeBlocks * BLOCK_SIZE_BYTES);
+	for(i = 0; i < numNodes; i++)
+		myFileSystem->nodes[i].freeNode = true;
+	copyNode(&myFileSystem->nodes[ROOT_NODE], &root);
+	myFileSystem->numFreeNodes = numNodes - 1;
 
 	/// SUPERBLOCK
+	char superBlock[BLOCK_SIZE_BYTES];
 	initializeSuperBlock(myFileSystem, diskSize);
-	updateSuperBlock(myFileSystem);
-	sync();
+	memset(superBlock, 0, BLOCK_SIZE_BYTES);
+	memcpy(superBlock, &myFileSystem->superBlock, sizeof(SuperBlockStruct));
 
-	// At the end we have at least one block
-	assert(myQuota(myFileSystem) >= 1);
-
-	if(initializeNodes(myFileSystem)){
-		myFree(myFileSystem);
+	// The metadata up to the inode table is written at once, then the root directory. The reference counts and
+	// the checksum area between them start zeroed (no block shared, nothing to verify). The backup file takes the
+	// size of the disk (the data blocks are not written, they are read as zeros)
+	struct iovec iov[5] = {
+		{ superBlock, BLOCK_SIZE_BYTES },
+		{ myFileSystem->bitMap, (size_t)sb->numBitmapBlocks * BLOCK_SIZE_BYTES },
+		{ myFileSystem->nodeBitMap, (size_t)NODE_BITMAP_BLOCKS(sb) * BLOCK_SIZE_BYTES },
+		{ myFileSystem->nodes, (size_t)sb->numNodeBlocks * BLOCK_SIZE_BYTES },
+		{ rootPage, BLOCK_SIZE_BYTES }
+	};
+	if(ftruncate(myFileSystem->fdVirtualDisk, (off_t)numBlocks * BLOCK_SIZE_BYTES) == -1 ||
+	   pwritev(myFileSystem->fdVirtualDisk, iov, 4, 0) != (ssize_t)sb->refCountIdx * BLOCK_SIZE_BYTES ||
+	   zeroArea(myFileSystem, sb->refCountIdx, sb->numRefCountBlocks + sb->numChecksumBlocks) ||
+	   pwrite(myFileSystem->fdVirtualDisk, rootPage, BLOCK_SIZE_BYTES, (off_t)FIRST_DATA_BLOCK(myFileSystem) * BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES) {
+		perror("Failed to write the metadata in myMkfs");
+		return -3;
+	}
+	// Once the checksum area is zeroed: the flush writes the checksums and syncs the backup file
+	if(cacheChecksumRun(myFileSystem, SUPERBLOCK_IDX, sb->refCountIdx, iov, 4) ||
+	   cacheChecksumRun(myFileSystem, FIRST_DATA_BLOCK(myFileSystem), 1, iov + 4, 1) || cacheFlush(myFileSystem)) {
+		fprintf(stderr, "Failed to write the checksums in myMkfs\n");
 		return -3;
 	}
+	punchFreeRuns(myFileSystem);
 
-	printf("SF: %s, %d B (%d B/block), %d blocks\n", backupFileName, diskSize, BLOCK_SIZE_BYTES, numBlocks);
-	printf("1 block for SUPERBLOCK (%u B)\n", (unsigned int)sizeof(SuperBlockStruct));
-	printf("1 block for BITMAP, covering %u blocks, %u B\n", (unsigned int)NUM_BITS, (unsigned int)(NUM_BITS * BLOCK_SIZE_BYTES));
-	printf("1 block for DIRECTORY (%u B)\n", (unsigned int)sizeof(DirectoryStruct));
-	printf("%d blocks for inodes (%u B/inode, %u inodes)\n", MAX_BLOCKS_WITH_NODES, (unsigned int)sizeof(NodeStruct), (unsigned int)MAX_NODES);
-	printf("%d blocks for data (%d B)\n", myFileSystem->superBlock.numOfFreeBlocks, BLOCK_SIZE_BYTES * myFileSystem->superBlock.numOfFreeBlocks);
+	// At the end we have at least one block
+	assert(myQuota(myFileSystem) >= 1);
+	myFileSystem->bitmapDirtyLow = sb->numBitmapBlocks;
+	myFileSystem->bitmapDirtyHigh = -1;
+
+	printf("SF: %s, %" PRId64 " B (%d B/block), %" PRId64 " blocks\n", backupFileName, diskSize, BLOCK_SIZE_BYTES, numBlocks);
+	printLayout(myFileSystem);
+	printf("1 block for the root directory (%u entries/page)\n", (unsigned int)DIR_LEAF_ENTRIES);
+	printf("%" PRId64 " blocks for data (%" PRId64 " B)\n", sb->numOfFreeBlocks, BLOCK_SIZE_BYTES * sb->numOfFreeBlocks);
 	printf("Formatting completed!\n");
 
 	return 0;
 }
 
-int myQuota(MyFileSystem *myFileSystem) {
-	int freeCount = 0;
-	int i;
-	// We compute the number of free blocks
-	for(i = 0; i < myFileSystem->superBlock.diskSizeInBlocks; i++) {
-		// We are currently using a single uint to store each bit in the bitmap.
-		// We could use all the bits in a single uint to compact the information
-		if(myFileSystem->bitMap[i] == 0) {
-			freeCount++;
-		}
+int myStats(MyFileSystem *myFileSystem, char *buf, int size) {
+	unsigned long hits = 0, misses = 0, writeBacks = 0, prefetched = 0, checksumErrors = 0, scrubbed = 0, inflated = 0;
+	unsigned long compressed = __atomic_load_n(&myFileSystem->compressedClusters, __ATOMIC_RELAXED);
+	unsigned long saved = __atomic_load_n(&myFileSystem->compressedSaved, __ATOMIC_RELAXED);
+	unsigned long checked = __atomic_load_n(&myFileSystem->dedupChecked, __ATOMIC_RELAXED);
+	unsigned long shared = __atomic_load_n(&myFileSystem->dedupShared, __ATOMIC_RELAXED);
+	DISK_LBA refs = __atomic_load_n(&myFileSystem->superBlock.sharedRefs, __ATOMIC_RELAXED);
+	DISK_LBA used = myFileSystem->superBlock.diskSizeInBlocks - FIRST_DATA_BLOCK(myFileSystem) - myFileSystem->superBlock.numOfFreeBlocks;
+	int len, more, snapshots = 0, i;
+
+	for(i = 0; i < MAX_SNAPSHOTS; i++)
+		snapshots += myFileSystem->superBlock.snapshots[i].name[0] != '\0';
+
+	if(myFileSystem->cache) {
+		hits = myFileSystem->cache->hits;
+		misses = myFileSystem->cache->misses;
+		writeBacks = myFileSystem->cache->writeBacks;
+		prefetched = myFileSystem->cache->prefetched;
+		checksumErrors = __atomic_load_n(&myFileSystem->cache->checksumErrors, __ATOMIC_RELAXED);
+		scrubbed = myFileSystem->cache->scrubbed;
+		inflated = myFileSystem->cache->inflated;
 	}
+	if(myFileSystem->cache && myFileSystem->cache->map)
+		len = snprintf(buf, size, "mmap: %lu blocks synced\nchecksums: %lu errors\n", writeBacks, checksumErrors);
+	else
+		len = snprintf(buf, size, "cache: %lu hits, %lu misses, %lu prefetched, %lu blocks written back\nchecksums: %lu errors, %lu blocks scrubbed\n",
+					   hits, misses, prefetched, writeBacks, checksumErrors, scrubbed);
+	if(len < 0 || len >= size)
+		return len;
+	more = snprintf(buf + len, size - len, "compression: %lu clusters compressed, %lu blocks saved, %lu clusters inflated\n",
+					compressed, saved, inflated);
+	if(more < 0 || (len += more) >= size)
+		return len;
+	// The ratio counts every pointer to a block in use against the blocks in use
+	more = snprintf(buf + len, size - len, "dedup: %lu blocks looked up, %lu shared, %" PRId64 " extra references, ratio %.2f\n",
+					checked, shared, refs, used > 0 ? (double)(used + refs) / used : 1.0);
+	if(more < 0 || (len += more) >= size)
+		return len;
+	more = snprintf(buf + len, size - len, "snapshots: %d kept, the last one took %.3f ms\n",
+					snapshots, myFileSystem->snapshotMicros / 1000.0);
+	if(more < 0 || (len += more) >= size)
+		return len;
+	if(!myFileSystem->punchHoles)
+		return len + snprintf(buf + len, size - len, "holes: off (%lu blocks punched), the new blocks are written with zeros\n",
+							  myFileSystem->blocksPunched);
+	return len + snprintf(buf + len, size - len, "holes: %lu blocks punched, %d runs waiting for a flush\n",
+						  myFileSystem->blocksPunched, myFileSystem->numHoles);
+}
+
+DISK_LBA myQuota(MyFileSystem *myFileSystem) {
+	DISK_LBA freeCount = 0;
+	size_t i, numWords = (size_t)myFileSystem->superBlock.numBitmapBlocks * BITMAP_WORDS_PER_BLOCK;
+	// We compute the number of free blocks, a word at a time (the bits past the end of the disk are set)
+	for(i = 0; i < numWords; i++)
+		freeCount += 64 - __builtin_popcountll(myFileSystem->bitMap[i]);
 	return freeCount;
 }
 
 int readNode(MyFileSystem *myFileSystem, int nodeNum, NodeStruct* node) {
-	int posNode;
-	assert(nodeNum < MAX_NODES);
-	posNode = findNodeByPos(nodeNum);
+	off_t posNode;
+	assert(nodeNum < NUM_NODES(myFileSystem));
+	posNode = findNodeByPos(myFileSystem, nodeNum);
 
-	if( lseek(myFileSystem->fdVirtualDisk, posNode, SEEK_SET)==-1 ||
-		read(myFileSystem->fdVirtualDisk, node, sizeof(NodeStruct)) != sizeof(NodeStruct) ){
-		perror("Error when reading an inode");
+	if(cacheRead(myFileSystem, posNode / BLOCK_SIZE_BYTES, posNode % BLOCK_SIZE_BYTES, node, sizeof(NodeStruct))) {
+		fprintf(stderr, "Error when reading an inode\n");
 		return -1;
 	}
 	return 0;
 }
 
+/**
+* @brief Looks for the free runs that start in [i, to), inside a block of the bit map, at most maxLen blocks long
+* 	 (they may go on past to), keeping the longest one in *bestStart and *bestLen. Returns the longest free run
+* 	 inside [i, to), or -1 if it stopped at a run of maxLen blocks. The caller holds myFileSystem->allocLock
+**/
+static int scanGroup(MyFileSystem *myFileSystem, DISK_LBA i, DISK_LBA to, int maxLen, DISK_LBA *bestStart, int *bestLen) {
+	DISK_LBA end = myFileSystem->superBlock.diskSizeInBlocks, len;
+	int longest = 0;
+
+	while(i < to) {
+		if(myFileSystem->bitMap[i / 64] == UINT64_MAX) {
+			len = 64 - i % 64;
+		}
+		else if(BLOCK_IN_USE(myFileSystem, i)) {
+			len = 1;
+		}
+		else {
+			// Whole free words at once (the bits past the end of the disk are set)
+			for(len = 0; i + len < end && len < maxLen && !BLOCK_IN_USE(myFileSystem, i + len); ) {
+				if((i + len) % 64 == 0 && myFileSystem->bitMap[(i + len) / 64] == 0 && len + 64 <= maxLen)
+					len += 64;
+				else
+					len++;
+			}
+			if(len > *bestLen) {
+				*bestLen = len;
+				*bestStart = i;
+			}
+			if(len >= maxLen)
+				return -1;
+			if((len < to - i ? len : to - i) > longest)
+				longest = len < to - i ? len : to - i;
+		}
+		i += len;
+	}
+	return longest;
+}
+
+int allocBlocks(MyFileSystem *myFileSystem, DISK_LBA goal, int maxLen, DISK_LBA *first) {
+	DISK_LBA end = myFileSystem->superBlock.diskSizeInBlocks, bestStart = -1, from, to, zeroFirst = 0, zeroEnd = 0;
+	int numGroups = myFileSystem->superBlock.numBitmapBlocks, bestLen = 0, g, n, longest;
+
+	if(goal < FIRST_DATA_BLOCK(myFileSystem) || goal >= end)
+		goal = FIRST_DATA_BLOCK(myFileSystem);
+
+	pthread_mutex_lock(&myFileSystem->allocLock);
+
+	// From the goal to the end of the disk and then from freeHint up to the goal (its block of the bit map from the
+	// start), keeping the longest free run found until one is long enough. Only the blocks of the bit map that may
+	// hold a longer run are looked at: going over all of one makes its bound exact
+	g = goal / BITS_PER_BITMAP_BLOCK;
+	from = goal;
+	for(n = 0; n <= numGroups && bestLen < maxLen; n++) {
+		to = (DISK_LBA)(g + 1) * BITS_PER_BITMAP_BLOCK < end ? (DISK_LBA)(g + 1) * BITS_PER_BITMAP_BLOCK : end;
+		if(myFileSystem->bitmapFree[g] && myFileSystem->bitmapLongest[g] > bestLen) {
+			longest = scanGroup(myFileSystem, from, to, maxLen, &bestStart, &bestLen);
+			if(longest >= 0 && from == (DISK_LBA)g * BITS_PER_BITMAP_BLOCK)
+				myFileSystem->bitmapLongest[g] = longest;
+		}
+		if(++g == numGroups)
+			g = myFileSystem->freeHint < numGroups ? myFileSystem->freeHint : 0;
+		from = (DISK_LBA)g * BITS_PER_BITMAP_BLOCK;
+	}
+
+	// A block taken must read as zeros: the ones freed but not punched yet are zeroed without the lock
+	if(bestLen && myFileSystem->numHoles)
+		bestStart = takeHoles(myFileSystem, bestStart, bestLen, &zeroFirst, &zeroEnd);
+	markBlocks(myFileSystem, bestStart, bestLen, true);
+	pthread_mutex_unlock(&myFileSystem->allocLock);
+	zeroBlocks(myFileSystem, zeroFirst, zeroEnd);
+	*first = bestStart;
+	return bestLen;
+}
+
+#define CHUNK_BIT(set, i) (((set)[(i) / 64] >> ((i) % 64)) & 1)
+
+/**
+* @brief freeBlocks for the blocks [first, end) under the same block of the reference counts. The cache is not used
+* 	 holding myFileSystem->allocLock: the counts are read before taking it (if its summary says that some block is
+* 	 shared), and the blocks to free stay in use until they are out of the cache (and zeroed if no hole can take them)
+**/
+static int freeChunk(MyFileSystem *myFileSystem, DISK_LBA first, DISK_LBA end) {
+	DISK_LBA b = first / REFCOUNTS_PER_BLOCK, lba;
+	uint64_t drop[REFCOUNTS_PER_BLOCK / 64] = { 0 }, zero[REFCOUNTS_PER_BLOCK / 64] = { 0 };
+	uint32_t *counts = NULL;
+	BOOLEAN shared = false, zeroed = false;
+	int freed = 0;
+
+	// The summary does not change without the lock: most blocks are not shared and need no counts
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	while(counts == NULL && __atomic_load_n(&myFileSystem->refCountsUsed[b], __ATOMIC_RELAXED) != 0) {
+		pthread_mutex_unlock(&myFileSystem->allocLock);
+		if((counts = getCounts(myFileSystem, b)) == NULL) {
+			fprintf(stderr, "Failed to free blocks %" PRId64 " to %" PRId64 "\n", first, end - 1);
+			return 0;
+		}
+		pthread_mutex_lock(&myFileSystem->allocLock);
+	}
+	// A shared block stays, with its cached copy, for the other pointers
+	for(lba = first; lba < end; lba++) {
+		if(counts && counts[lba % REFCOUNTS_PER_BLOCK]) {
+			addReferences(myFileSystem, counts, lba, -1);
+			shared = true;
+		}
+		else {
+			drop[(lba - first) / 64] |= UINT64_C(1) << ((lba - first) % 64);
+		}
+	}
+	pthread_mutex_unlock(&myFileSystem->allocLock);
+	if(counts)
+		cachePutBlock(myFileSystem, myFileSystem->superBlock.refCountIdx + b, shared);
+
+	// Whatever the cache holds for a free block must not reach the disk
+	for(lba = first; lba < end; lba++) {
+		if(CHUNK_BIT(drop, lba - first))
+			cacheInvalidate(myFileSystem, lba);
+	}
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	for(lba = first; lba < end; lba++) {
+		if(!CHUNK_BIT(drop, lba - first))
+			continue;
+		if(!addHole(myFileSystem, lba)) {
+			zero[(lba - first) / 64] |= UINT64_C(1) << ((lba - first) % 64);
+			zeroed = true;
+			continue;
+		}
+		markBlocks(myFileSystem, lba, 1, false);
+		freed++;
+	}
+	pthread_mutex_unlock(&myFileSystem->allocLock);
+	if(!zeroed)
+		return freed;
+
+	// No room for another hole: zeroed while they are still in use
+	for(lba = first; lba < end; lba++) {
+		if(CHUNK_BIT(zero, lba - first))
+			zeroBlocks(myFileSystem, lba, lba + 1);
+	}
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	for(lba = first; lba < end; lba++) {
+		if(CHUNK_BIT(zero, lba - first)) {
+			markBlocks(myFileSystem, lba, 1, false);
+			freed++;
+		}
+	}
+	pthread_mutex_unlock(&myFileSystem->allocLock);
+	return freed;
+}
+
+int freeBlocks(MyFileSystem *myFileSystem, DISK_LBA first, int numBlocks) {
+	DISK_LBA lba, end = first + numBlocks, next;
+	int freed = 0;
+
+	// A block of the reference counts at a time
+	for(lba = first; lba < end; lba = next) {
+		next = (lba / REFCOUNTS_PER_BLOCK + 1) * REFCOUNTS_PER_BLOCK;
+		if(next > end)
+			next = end;
+		freed += freeChunk(myFileSystem, lba, next);
+	}
+	return freed;
+}
+
+uint32_t getReferences(MyFileSystem *myFileSystem, DISK_LBA lba) {
+	DISK_LBA b = lba / REFCOUNTS_PER_BLOCK;
+	uint32_t *counts, refs;
+
+	// Most blocks are not shared: the summary spares the read
+	if(__atomic_load_n(&myFileSystem->refCountsUsed[b], __ATOMIC_RELAXED) == 0)
+		return 0;
+	if((counts = (uint32_t *)cacheGetBlock(myFileSystem, myFileSystem->superBlock.refCountIdx + b, true)) == NULL)
+		return 1;
+	countReferences(myFileSystem, b, counts);
+	refs = __atomic_load_n(&counts[lba % REFCOUNTS_PER_BLOCK], __ATOMIC_RELAXED);
+	cachePutBlock(myFileSystem, myFileSystem->superBlock.refCountIdx + b, false);
+	return refs;
+}
+
+void shareBlocks(MyFileSystem *myFileSystem, DISK_LBA first, int numBlocks) {
+	DISK_LBA lba, end = first + numBlocks, next, b;
+	uint32_t *counts;
+
+	// A block of the reference counts at a time, read before taking the lock
+	for(lba = first; lba < end; lba = next) {
+		b = lba / REFCOUNTS_PER_BLOCK;
+		next = (b + 1) * REFCOUNTS_PER_BLOCK < end ? (b + 1) * REFCOUNTS_PER_BLOCK : end;
+		if((counts = getCounts(myFileSystem, b)) == NULL) {
+			fprintf(stderr, "Failed to share blocks %" PRId64 " to %" PRId64 "\n", lba, next - 1);
+			continue;
+		}
+		pthread_mutex_lock(&myFileSystem->allocLock);
+		for(; lba < next; lba++) {
+			assert(BLOCK_IN_USE(myFileSystem, lba));
+			addReferences(myFileSystem, counts, lba, 1);
+		}
+		pthread_mutex_unlock(&myFileSystem->allocLock);
+		cachePutBlock(myFileSystem, myFileSystem->superBlock.refCountIdx + b, true);
+	}
+}
+
 int reserveBlocksForNodes(MyFileSystem *myFileSystem, DISK_LBA blocks[], int numBlocks) {
-	int i = 0;
 	int currentBlock = 0;
+	DISK_LBA goal = FIRST_DATA_BLOCK(myFileSystem), first;
 
-	while((currentBlock < numBlocks) && (i < NUM_BITS)) {
-		if(myFileSystem->bitMap[i] == 0) {
-			myFileSystem->bitMap[i] = 1;
-			blocks[currentBlock] = i;
-			currentBlock++;
-		}
-		++i;
+	while(currentBlock < numBlocks) {
+		int len = allocBlocks(myFileSystem, goal, numBlocks - currentBlock, &first);
+		if(len == 0)
+			return -1;
+		for(goal = first; len--; goal++)
+			blocks[currentBlock++] = goal;
 	}
 
-	return (i==NUM_BITS)?-1:0;
+	return 0;
+}
+
+/**
+* @brief Writes the dirty blocks of a region of the metadata kept in memory (the bit map) in the cache, from block
+* 	 low to block high of the region. The caller holds myFileSystem->allocLock
+**/
+static int writeDirty(MyFileSystem *myFileSystem, DISK_LBA idx, const void *data, BOOLEAN *dirty, int *low, int *high, int numBlocks) {
+	int ret = 0, b;
+
+	for(b = *low; b <= *high; b++) {
+		if(!dirty[b])
+			continue;
+		if(cacheWrite(myFileSystem, idx + b, 0, (const char *)data + (size_t)b * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES))
+			ret = -1;
+		else
+			dirty[b] = false;
+	}
+	// The blocks that could not be written are tried again next time
+	if(!ret) {
+		*low = numBlocks;
+		*high = -1;
+	}
+	return ret;
 }
 
 int updateBitmap(MyFileSystem *myFileSystem) {
-	if(lseek(myFileSystem->fdVirtualDisk, BLOCK_SIZE_BYTES * BITMAP_IDX, SEEK_SET) == (off_t) - 1) {
-		perror("Failed lseek in updateBitmap");
-		return -1;
-	}
-	if(write(myFileSystem->fdVirtualDisk,
-	         myFileSystem->bitMap, sizeof(BIT) * NUM_BITS) == -1) {
-		perror("Failed write in updateBitmap");
+	int ret;
+
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	ret = writeDirty(myFileSystem, BITMAP_IDX, myFileSystem->bitMap, myFileSystem->bitmapDirty, &myFileSystem->bitmapDirtyLow,
+					 &myFileSystem->bitmapDirtyHigh, myFileSystem->superBlock.numBitmapBlocks);
+	pthread_mutex_unlock(&myFileSystem->allocLock);
+	if(ret) {
+		fprintf(stderr, "Failed write in updateBitmap\n");
 		return -1;
 	}
-	sync();
 	return 0;
 }
 
-int updateDirectory(MyFileSystem *myFileSystem) {
-	if(lseek(myFileSystem->fdVirtualDisk, BLOCK_SIZE_BYTES * DIRECTORY_IDX, SEEK_SET) == (off_t) - 1) {
-		perror("Failed lseek in updateDirectory");
+int updateNode(MyFileSystem *myFileSystem, int numNode, NodeStruct *node) {
+	off_t posNodoI;
+	assert(numNode < NUM_NODES(myFileSystem));
+	posNodoI = findNodeByPos(myFileSystem, numNode);
+
+	if(cacheWrite(myFileSystem, posNodoI / BLOCK_SIZE_BYTES, posNodoI % BLOCK_SIZE_BYTES, node, sizeof(NodeStruct))) {
+		fprintf(stderr, "Failed write in updateNode\n");
 		return -1;
 	}
-	if(write(myFileSystem->fdVirtualDisk, &(myFileSystem->directory), sizeof(DirectoryStruct)) == -1) {
-		perror("Failed write in updateDirectory");
+	return 0;
+}
+
+
+int updateSuperBlock(MyFileSystem *myFileSystem) {
+	int ret;
+
+	pthread_mutex_lock(&myFileSystem->allocLock);
+	ret = cacheWrite(myFileSystem, SUPERBLOCK_IDX, 0, &(myFileSystem->superBlock), sizeof(SuperBlockStruct));
+	pthread_mutex_unlock(&myFileSystem->allocLock);
+	if(ret) {
+		fprintf(stderr, "Failed write in updateSuperBlock\n");
 		return -1;
 	}
-	sync();
 	return 0;
 }
 
-int updateNode(MyFileSystem *myFileSystem, int numNode, NodeStruct *node) {
-	int posNodoI;
-	assert(numNode < MAX_NODES);
-	posNodoI = findNodeByPos(numNode);
+/* Code for the optional part of the lab assignment */
 
-	if(lseek(myFileSystem->fdVirtualDisk, posNodoI, SEEK_SET) == (off_t) - 1) {
-		perror("Failed lseek in updateNode");
+/**
+* @brief Reads the super block and checks it against this build
+**/
+static int readSuperblock(MyFileSystem* myFileSystem)
+{
+	SuperBlockStruct *sb = &myFileSystem->superBlock;
+	int i;
+
+	if(pread(myFileSystem->fdVirtualDisk, sb, sizeof(SuperBlockStruct), SUPERBLOCK_IDX * BLOCK_SIZE_BYTES) != sizeof(SuperBlockStruct)) {
+		perror("Failed pread in readSuperblock");
 		return -1;
 	}
-	if(write(myFileSystem->fdVirtualDisk, node, sizeof(NodeStruct)) == -1) {
-		perror("Failed write in updateNode");
+	if(sb->blockSize != BLOCK_SIZE_BYTES || sb->maxLenFileName != MAX_LEN_FILE_NAME || sb->maxBlocksPerFile != MAX_BLOCKS_PER_FILE) {
+		fprintf(stderr, "Disk formatted with another layout (block %d B, names of %d chars, %d blocks per file)\n",
+				sb->blockSize, sb->maxLenFileName, sb->maxBlocksPerFile);
+		return -1;
+	}
+	if(sb->numNodeBlocks < 1 || sb->numNodeBlocks > MAX_NODES / NODES_PER_BLOCK) {
+		fprintf(stderr, "Wrong size of the inode table: %d blocks\n", sb->numNodeBlocks);
+		return -1;
+	}
+	// The backup file may be shorter: blocks never written are read as zeros
+	if(sb->diskSizeInBlocks < 1 || sb->diskSizeInBlocks > MAX_DISK_BLOCKS) {
+		fprintf(stderr, "Wrong disk size: %" PRId64 " blocks\n", sb->diskSizeInBlocks);
+		return -1;
+	}
+	// The regions follow one another in this order, the bit map, the reference counts and the checksums covering the whole disk
+	if(sb->numBitmapBlocks != (sb->diskSizeInBlocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK ||
+	   sb->numChecksumBlocks != (sb->diskSizeInBlocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK ||
+	   sb->numRefCountBlocks != (sb->diskSizeInBlocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK ||
+	   sb->nodeBitmapIdx != BITMAP_IDX + sb->numBitmapBlocks || sb->nodesIdx != sb->nodeBitmapIdx + NODE_BITMAP_BLOCKS(sb) ||
+	   sb->refCountIdx != sb->nodesIdx + sb->numNodeBlocks || sb->checksumIdx != sb->refCountIdx + sb->numRefCountBlocks ||
+	   sb->firstDataBlock != sb->checksumIdx + sb->numChecksumBlocks ||
+	   sb->diskSizeInBlocks <= sb->firstDataBlock) {
+		fprintf(stderr, "Wrong layout of the disk (%d blocks of bit map, inodes from block %" PRId64 ", data from block %" PRId64 ")\n",
+				sb->numBitmapBlocks, sb->nodesIdx, sb->firstDataBlock);
+		return -1;
+	}
+	// The inode table of a snapshot is as long as the one of the FS
+	for(i = 0; i < MAX_SNAPSHOTS; i++) {
+		SnapshotStruct *snap = &sb->snapshots[i];
+		if(snap->name[0] && (memchr(snap->name, '\0', sizeof(snap->name)) == NULL || snap->nodes.numBlocks != sb->numNodeBlocks ||
+		   snap->nodes.fileSize != (int64_t)sb->numNodeBlocks * BLOCK_SIZE_BYTES)) {
+			fprintf(stderr, "Snapshot %d is corrupted\n", i);
+			return -1;
+		}
 	}
-	sync();
 	return 0;
 }
 
+/**
+* @brief Reads the metadata kept in memory (super block again, bit map, inode bitmap and inode table) with a single
+* 	 preadv, straight to their place in myFileSystem, and verifies their checksums. The reference counts and the
+* 	 checksum area stay in the disk
+**/
+static int readMetadata(MyFileSystem *myFileSystem)
+{
+	SuperBlockStruct *sb = &myFileSystem->superBlock;
+	size_t size = (size_t)sb->refCountIdx * BLOCK_SIZE_BYTES;
+	char superBlock[BLOCK_SIZE_BYTES];
+	struct iovec iov[4] = {
+		{ superBlock, BLOCK_SIZE_BYTES },
+		{ myFileSystem->bitMap, (size_t)sb->numBitmapBlocks * BLOCK_SIZE_BYTES },
+		{ myFileSystem->nodeBitMap, (size_t)NODE_BITMAP_BLOCKS(sb) * BLOCK_SIZE_BYTES },
+		{ myFileSystem->nodes, (size_t)sb->numNodeBlocks * BLOCK_SIZE_BYTES }
+	};
 
-int updateSuperBlock(MyFileSystem *myFileSystem) {
-	if(lseek(myFileSystem->fdVirtualDisk, BLOCK_SIZE_BYTES * SUPERBLOCK_IDX, SEEK_SET) == (off_t) - 1) {
-		perror("Failed lseek in updateSuperBlock");
+	if(preadv(myFileSystem->fdVirtualDisk, iov, 4, SUPERBLOCK_IDX * BLOCK_SIZE_BYTES) != size) {
+		perror("Failed preadv in readMetadata");
 		return -1;
 	}
-	if(write(myFileSystem->fdVirtualDisk, &(myFileSystem->superBlock), sizeof(SuperBlockStruct)) == -1) {
-		perror("Failed write in updateSuperBlock");
+	// Blocks written since the last flush have stale checksums after a crash: myfs-fsck -r sets them right
+	if(cacheVerifyRun(myFileSystem, SUPERBLOCK_IDX, 1, superBlock) ||
+	   cacheVerifyRun(myFileSystem, BITMAP_IDX, sb->numBitmapBlocks, (char *)myFileSystem->bitMap) ||
+	   cacheVerifyRun(myFileSystem, sb->nodeBitmapIdx, NODE_BITMAP_BLOCKS(sb), (char *)myFileSystem->nodeBitMap) ||
+	   cacheVerifyRun(myFileSystem, sb->nodesIdx, sb->numNodeBlocks, (char *)myFileSystem->nodes)) {
+		fprintf(stderr, "The metadata does not match its checksums\n");
 		return -1;
 	}
-	sync();
 	return 0;
 }
 
-/* Code for the optional part of the lab assignment */
-
-int readBitmap(MyFileSystem *myFileSystem)
+/**
+* @brief Checks the bit map (the metadata blocks and the bits past the end of the disk are in use), builds its
+* 	 summary and checks the free blocks against the super block. The reference counts are left in the disk: the
+* 	 super block keeps their sum and the summary of each of their blocks is made when it is first read
+**/
+static int readBitmap(MyFileSystem *myFileSystem)
 {
-	return -1;
+	SuperBlockStruct *sb = &myFileSystem->superBlock;
+	DISK_LBA lba, freeBlocks, end = (DISK_LBA)myFileSystem->superBlock.numBitmapBlocks * BITS_PER_BITMAP_BLOCK;
+	int b, w;
+
+	// The data blocks are skipped
+	for(lba = 0; lba < end; lba = lba + 1 == FIRST_DATA_BLOCK(myFileSystem) ? myFileSystem->superBlock.diskSizeInBlocks : lba + 1) {
+		if(!BLOCK_IN_USE(myFileSystem, lba)) {
+			fprintf(stderr, "Wrong bit map entry for block %" PRId64 "\n", lba);
+			return -1;
+		}
+	}
+	// Counted the first time each block of the reference counts is read
+	for(b = 0; b < sb->numRefCountBlocks; b++)
+		myFileSystem->refCountsUsed[b] = REFCOUNTS_UNKNOWN;
+	for(b = 0; b < myFileSystem->superBlock.numBitmapBlocks; b++) {
+		myFileSystem->bitmapFree[b] = 0;
+		for(w = 0; w < BITMAP_WORDS_PER_BLOCK; w++)
+			myFileSystem->bitmapFree[b] += 64 - __builtin_popcountll(myFileSystem->bitMap[b * BITMAP_WORDS_PER_BLOCK + w]);
+		myFileSystem->bitmapLongest[b] = myFileSystem->bitmapFree[b];
+	}
+	for(myFileSystem->freeHint = 0; myFileSystem->freeHint < sb->numBitmapBlocks && myFileSystem->bitmapFree[myFileSystem->freeHint] == 0; )
+		myFileSystem->freeHint++;
+	// The super block may be older than the bit map if the FS was not unmounted
+	if((freeBlocks = myQuota(myFileSystem)) != myFileSystem->superBlock.numOfFreeBlocks) {
+		fprintf(stderr, "Super block says %" PRId64 " free blocks, the bit map %" PRId64 ": using the bit map\n",
+				myFileSystem->superBlock.numOfFreeBlocks, freeBlocks);
+		myFileSystem->superBlock.numOfFreeBlocks = freeBlocks;
+	}
+	return 0;
 }
 
+/**
+* @brief Reads the reference counts a chunk at a time after a mount that did not follow a clean unmount, verifies
+* 	 them and builds their summary: only data blocks in use can be shared. Their sum in the super block may be stale
+**/
+static int sumReferences(MyFileSystem *myFileSystem)
+{
+	SuperBlockStruct *sb = &myFileSystem->superBlock;
+	DISK_LBA lba, refs = 0;
+	uint32_t *counts;
+	int b, i, n;
 
+	if((counts = malloc((size_t)METADATA_CHUNK * BLOCK_SIZE_BYTES)) == NULL) {
+		perror("Error in malloc");
+		return -1;
+	}
+	for(b = 0; b < sb->numRefCountBlocks; b += n) {
+		n = sb->numRefCountBlocks - b < METADATA_CHUNK ? sb->numRefCountBlocks - b : METADATA_CHUNK;
+		if(pread(myFileSystem->fdVirtualDisk, counts, (size_t)n * BLOCK_SIZE_BYTES, (off_t)(sb->refCountIdx + b) * BLOCK_SIZE_BYTES) != (ssize_t)n * BLOCK_SIZE_BYTES ||
+		   cacheVerifyRun(myFileSystem, sb->refCountIdx + b, n, (char *)counts)) {
+			fprintf(stderr, "Failed to read the reference counts from block %" PRId64 "\n", sb->refCountIdx + b);
+			free(counts);
+			return -1;
+		}
+		for(i = 0; i < n; i++)
+			myFileSystem->refCountsUsed[b + i] = 0;
+		for(i = 0; i < n * (int)REFCOUNTS_PER_BLOCK; i++) {
+			if(!counts[i])
+				continue;
+			lba = (DISK_LBA)b * REFCOUNTS_PER_BLOCK + i;
+			if(lba < FIRST_DATA_BLOCK(myFileSystem) || lba >= sb->diskSizeInBlocks || !BLOCK_IN_USE(myFileSystem, lba)) {
+				fprintf(stderr, "Wrong reference count for block %" PRId64 "\n", lba);
+				free(counts);
+				return -1;
+			}
+			myFileSystem->refCountsUsed[b + i / REFCOUNTS_PER_BLOCK]++;
+			refs += counts[i];
+		}
+	}
+	free(counts);
+	if(refs != sb->sharedRefs) {
+		fprintf(stderr, "Super block says %" PRId64 " extra references, the reference counts %" PRId64 ": using the reference counts\n",
+				sb->sharedRefs, refs);
+		sb->sharedRefs = refs;
+	}
+	return 0;
+}
 
-int readDirectory(MyFileSystem* myFileSystem)
+/**
+* @brief A pointer of an inode must be a data block in use (<1 for the pointers not used)
+**/
+static BOOLEAN validPointer(MyFileSystem *myFileSystem, DISK_LBA lba)
 {
-	return -1;
+	// A block of a compressed cluster leads to the blocks of the cluster
+	if(IS_COMPRESSED(lba))
+		return COMPRESSED_LEN(lba) > 0 && COMPRESSED_FIRST(lba) >= FIRST_DATA_BLOCK(myFileSystem) &&
+			   validPointer(myFileSystem, COMPRESSED_FIRST(lba)) && validPointer(myFileSystem, COMPRESSED_END(lba) - 1);
+	return lba < 1 || (lba >= FIRST_DATA_BLOCK(myFileSystem) && lba < myFileSystem->superBlock.diskSizeInBlocks && BLOCK_IN_USE(myFileSystem, lba));
 }
 
-
-int readSuperblock(MyFileSystem* myFileSystem)
+/**
+* @brief Checks every inode of the table loaded by readMetadata against the inode bitmap and counts the free ones
+**/
+static int readInodes(MyFileSystem* myFileSystem)
 {
-	return -1;
+	int numNode, i, numNodes = NUM_NODES(myFileSystem);
+
+	// Inodes past the end of the table are never free
+	for(i = numNodes; i < NODE_BITMAP_BLOCKS(&myFileSystem->superBlock) * BITS_PER_BITMAP_BLOCK; i++)
+		myFileSystem->nodeBitMap[i / 64] |= UINT64_C(1) << (i % 64);
+
+	myFileSystem->numFreeNodes = 0;
+	for(numNode = 0; numNode < numNodes; numNode++) {
+		NodeStruct *node = &myFileSystem->nodes[numNode];
+		BOOLEAN used = (myFileSystem->nodeBitMap[numNode / 64] >> (numNode % 64)) & 1;
+		BOOLEAN valid = true;
+
+		if(node->freeNode == used) {
+			fprintf(stderr, "Inode %d is %s but the inode bitmap says otherwise\n", numNode, used ? "free" : "in use");
+			return -1;
+		}
+		if(!used) {
+			myFileSystem->numFreeNodes++;
+			continue;
+		}
+
+		if(node->nodeType != NODE_FILE && node->nodeType != NODE_DIRECTORY)
+			valid = false;
+		else if(node->numBlocks == 0)
+			// Only a regular file can keep its data in the inode
+			valid = node->nodeType == NODE_FILE && node->fileSize >= 0 && node->fileSize <= NODE_INLINE_BYTES;
+		else
+			valid = node->numBlocks > 0 && node->numBlocks <= MAX_BLOCKS_PER_FILE &&
+					node->numBlocks == (node->fileSize + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+		for(i = 0; valid && node->numBlocks && i < NDIRECTOS; i++)
+			valid = i >= node->numBlocks || validPointer(myFileSystem, node->blocks[i]);
+		for(i = 0; valid && node->numBlocks && i < NIVELES_INDIRECCION; i++)
+			valid = validPointer(myFileSystem, node->indirecto[i]);
+		if(!valid || (numNode == ROOT_NODE && node->nodeType != NODE_DIRECTORY)) {
+			fprintf(stderr, "Inode %d is corrupted\n", numNode);
+			return -1;
+		}
+	}
+	if(myFileSystem->nodes[ROOT_NODE].freeNode) {
+		fprintf(stderr, "The root directory is missing\n");
+		return -1;
+	}
+	return 0;
 }
 
-int readInodes(MyFileSystem* myFileSystem)
+/**
+* @brief Checks the root page of the root directory. The rest of the tree is read on demand, through the cache
+**/
+static int readDirectory(MyFileSystem *myFileSystem)
 {
-	return -1;
+	DirPage *page;
+	DISK_LBA lba = myFileSystem->nodes[ROOT_NODE].blocks[0];
+	int i, ret = 0;
+
+	if(lba < FIRST_DATA_BLOCK(myFileSystem) || (page = (DirPage *)cacheGetBlock(myFileSystem, lba, true)) == NULL)
+		return -1;
+	if(page->type == DIR_PAGE_LEAF) {
+		if(page->count < 0 || page->count > DIR_LEAF_ENTRIES)
+			ret = -1;
+		for(i = 0; !ret && i < page->count; i++) {
+			int nodeIdx = page->entries[i].nodeIdx;
+			if(nodeIdx <= ROOT_NODE || nodeIdx >= NUM_NODES(myFileSystem) || myFileSystem->nodes[nodeIdx].freeNode)
+				ret = -1;
+		}
+	}
+	else if(page->type != DIR_PAGE_INTERNAL || page->count < 1 || page->count > DIR_INTERNAL_KEYS) {
+		ret = -1;
+	}
+	cachePutBlock(myFileSystem, lba, false);
+	return ret;
 }
 
 int myMount(MyFileSystem *myFileSystem, char *backupFileName){
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	if ((myFileSystem->fdVirtualDisk = open(backupFileName, O_RDWR))==-1){
 		perror(backupFileName);
 		return 1;
 	}
-	
-	if (readBitmap(myFileSystem)!=0){
-		fprintf(stderr,"Can't read bitmap\n");
-		return 2;
-	}
-	
+
 	if (readSuperblock(myFileSystem)!=0){
 		fprintf(stderr,"Can't read superblock\n");
 		return 3;
 	}
 
+	// The size of the bit map and of the inode table comes in the super block
+	if (initializeNodes(myFileSystem)!=0 || initializeBitmap(myFileSystem)!=0 || cacheInit(myFileSystem)!=0){
+		close(myFileSystem->fdVirtualDisk);
+		return 1;
+	}
+
+	// The whole disk is mapped (the backup file grows to its size if needed)
+	if (myFileSystem->mapDisk && cacheMap(myFileSystem, myFileSystem->superBlock.diskSizeInBlocks) != 0){
+		return 1;
+	}
+
+	// The rest of the metadata but the directories comes with a single read
+	if (readMetadata(myFileSystem) != 0){
+		fprintf(stderr,"Can't read the metadata\n");
+		return 1;
+	}
+
+	if (readBitmap(myFileSystem)!=0){
+		fprintf(stderr,"Can't read bitmap\n");
+		return 2;
+	}
+
 	if (readInodes(myFileSystem)!=0){
 		fprintf(stderr,"Can't read inodes\n");
 		return 4;
-	}	
+	}
 
 	if (readDirectory(myFileSystem)!=0){
-		fprintf(stderr,"Can't read directory\n");
+		fprintf(stderr,"Can't read the root directory\n");
 		return 5;
 	}
-	
-	printf("SF: %s, %d B (%d B/block), %d blocks\n", backupFileName, myFileSystem->superBlock.diskSizeInBlocks*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES, myFileSystem->superBlock.diskSizeInBlocks);
-	printf("1 block for SUPERBLOCK (%u B)\n", (unsigned int)sizeof(SuperBlockStruct));
-	printf("1 block for BITMAP, covering %u blocks, %u B\n", (unsigned int)NUM_BITS, (unsigned int)(NUM_BITS * BLOCK_SIZE_BYTES));
-	printf("1 block for DIRECTORY (%u B)\n", (unsigned int)sizeof(DirectoryStruct));
-	printf("%d blocks for inodes (%u B/inode, %u inodes)\n", MAX_BLOCKS_WITH_NODES, (unsigned int)sizeof(NodeStruct), (unsigned int)MAX_NODES);
-	printf("%d blocks for data (%d B)\n", myFileSystem->superBlock.numOfFreeBlocks, BLOCK_SIZE_BYTES * myFileSystem->superBlock.numOfFreeBlocks);
-	printf("Volume mounted successfully!\n");
+	// After a clean unmount the free blocks are holes already and the sum of the reference counts is right
+	if(myFileSystem->superBlock.clean) {
+		myFileSystem->punchHoles = true;
+		myFileSystem->numHoles = 0;
+	}
+	else {
+		if (sumReferences(myFileSystem)!=0){
+			fprintf(stderr,"Can't read the reference counts\n");
+			return 2;
+		}
+		// Only once the pointers of the inodes agree with the bit map: a free block may still hold data otherwise
+		punchFreeRuns(myFileSystem);
+	}
+
+	// A crash from now on leaves the disk unclean: the flag is in the disk before any other change
+	myFileSystem->superBlock.clean = false;
+	if (updateSuperBlock(myFileSystem)!=0 || cacheFlush(myFileSystem)!=0){
+		fprintf(stderr,"Can't write the superblock\n");
+		return 3;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("SF: %s, %" PRId64 " B (%d B/block), %" PRId64 " blocks\n", backupFileName, myFileSystem->superBlock.diskSizeInBlocks*BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES, myFileSystem->superBlock.diskSizeInBlocks);
+	printLayout(myFileSystem);
+	printf("%" PRId64 " blocks for data (%" PRId64 " B)\n", myFileSystem->superBlock.numOfFreeBlocks, BLOCK_SIZE_BYTES * myFileSystem->superBlock.numOfFreeBlocks);
+	printf("Volume mounted successfully in %.3f ms!\n", (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
 	return 0;
-} 
+}
 
@@ -6,72 +6,220 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define false 0
 #define true 1
 
-#define BIT unsigned
 #define BLOCK_SIZE_BYTES 4096
-#define NUM_BITS (BLOCK_SIZE_BYTES/sizeof(BIT))
-#define MAX_BLOCKS_WITH_NODES 5
-#define MAX_BLOCKS_PER_FILE 100
-#define MAX_FILES_PER_DIRECTORY 100
+#define BITS_PER_BITMAP_BLOCK (BLOCK_SIZE_BYTES * 8)	// Blocks of the disk covered by each block of the bit map
+#define BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint64_t))
+#define MAX_DISK_BLOCKS ((DISK_LBA)1 << 32)	// 16 TiB, the bit map takes 512 MiB of memory (the checksums and the reference counts, 16 GiB each, stay in the disk)
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint32_t))	// Blocks of the disk covered by each block of the checksum area
+#define REFCOUNTS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(uint32_t))	// Blocks of the disk covered by each block of the reference counts
+#define REFCOUNTS_UNKNOWN (-1)		// Summary of a block of the reference counts not read since the mount
+#define DEFAULT_BLOCKS_PER_NODE 4	// Without -i, mkfs makes one inode per DEFAULT_BLOCKS_PER_NODE blocks of disk
 #define MAX_LEN_FILE_NAME 15
-
-#define NDIRECTOS 1
-
-#define DISK_LBA int
+#define DCACHE_SIZE 4096		// Entries of the name lookup cache, must be a power of two
+#define DCACHE_LOCKS 64			// Locks of the name lookup cache (each one protects DCACHE_SIZE/DCACHE_LOCKS entries)
+#define MAX_SNAPSHOTS 8			// Snapshots kept in the super block (see snapshot.h)
+#define MAX_HOLE_RUNS 256		// Runs of blocks freed that wait to become holes of the backup file
+
+#define NDIRECTOS 8
+#define NIVELES_INDIRECCION 3		// Single, double and triple indirect pointers
+#define PUNTEROS_POR_BLOQUE (BLOCK_SIZE_BYTES/sizeof(DISK_LBA))
+#define MAX_BLOCKS_PER_FILE (NDIRECTOS + PUNTEROS_POR_BLOQUE + PUNTEROS_POR_BLOQUE * PUNTEROS_POR_BLOQUE + \
+                             PUNTEROS_POR_BLOQUE * PUNTEROS_POR_BLOQUE * PUNTEROS_POR_BLOQUE)
+
+#define DISK_LBA int64_t
 #define BOOLEAN int
 
 #define SUPERBLOCK_IDX 0
-#define BITMAP_IDX 1
-#define DIRECTORY_IDX 2
-#define NODES_IDX 3
+#define BITMAP_IDX 1				// superBlock.numBitmapBlocks blocks long, the super block records where the rest begins
+#define ROOT_NODE 0				// The root directory is always the first inode
+
+#define NODE_FILE 0
+#define NODE_DIRECTORY 1
+#define NODE_COMPRESS 1				// Flag: the data of the file is stored compressed from now on (-z or user.myfs.compress)
+#define NODE_COMPRESSED 2			// Flag: some cluster of the file may be compressed
+#define FIRST_DATA_BLOCK(fs) ((fs)->superBlock.firstDataBlock)
+#define BLOCK_IN_USE(fs, lba) (((fs)->bitMap[(lba) / 64] >> ((lba) % 64)) & 1)
+#define BLOCK_SHARED(fs, lba) (getReferences(fs, lba) != 0)	// More than one pointer leads to the block: it is copied before a write
+#define NUM_NODES(fs) ((fs)->superBlock.numNodeBlocks * (int)NODES_PER_BLOCK)
+#define NODE_BITMAP_BLOCKS(sb) (((sb)->numNodeBlocks * (int)NODES_PER_BLOCK + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK)	// Blocks of the inode bitmap
 
 // STRUCTS
-typedef struct FileStructure {
-	int  nodeIdx;                         	// Associated i-node
-	char fileName[MAX_LEN_FILE_NAME + 1];	// File name
-	BOOLEAN freeFile;                       // Free file
-} FileStruct;
-
-typedef struct DirectoryStructure {
-	int numFiles;                          		// Num files
-	FileStruct files[MAX_FILES_PER_DIRECTORY];	// Files
-} DirectoryStruct;
+struct BlockCacheStructure;
+
+// A directory is an inode whose logical blocks are the pages of a B+tree keyed on the name.
+// The root of the tree is always the logical block 0 of the directory
+#define DIR_PAGE_LEAF 1
+#define DIR_PAGE_INTERNAL 2
+
+typedef struct DirEntryStructure {
+	char name[MAX_LEN_FILE_NAME + 1];	// File name
+	int nodeIdx;						// Associated i-node
+} DirEntry;
+
+#define DIR_PAGE_HEADER (4 * sizeof(int))
+#define DIR_LEAF_ENTRIES ((BLOCK_SIZE_BYTES - DIR_PAGE_HEADER) / sizeof(DirEntry))
+#define DIR_INTERNAL_KEYS ((BLOCK_SIZE_BYTES - DIR_PAGE_HEADER - sizeof(int)) / (MAX_LEN_FILE_NAME + 1 + sizeof(int)))
+
+typedef struct DirPageStructure {
+	int type;							// DIR_PAGE_LEAF or DIR_PAGE_INTERNAL
+	int count;							// Entries (leaf) or keys (internal page) in use
+	int next;							// Leaf pages: next leaf in name order, 0 for the last one
+	int numEntries;						// Root page: number of files in the directory
+	union {
+		DirEntry entries[DIR_LEAF_ENTRIES];		// Sorted by name
+		struct {
+			int children[DIR_INTERNAL_KEYS + 1];	// children[i] holds the names below keys[i]
+			char keys[DIR_INTERNAL_KEYS][MAX_LEN_FILE_NAME + 1];
+		};
+	};
+} DirPage;
+
+// Name lookup cache (in memory only). A slot with nodeIdx 0 is empty: the root never has a name
+typedef struct DentryStructure {
+	int parent;							// Directory holding the name
+	int nodeIdx;						// Inode the name leads to
+	char name[MAX_LEN_FILE_NAME + 1];
+} Dentry;
+
+// A regular file with NODE_COMPRESS has its blocks in clusters of COMPRESS_CLUSTER logical blocks. A cluster
+// stored compressed takes len < COMPRESS_CLUSTER consecutive blocks of the disk and the pointer of its block i
+// is COMPRESSED_LBA(first, len, i): a number that only the block cache understands (it inflates the cluster)
+#define COMPRESS_CLUSTER 8
+#define COMPRESSED_BASE ((DISK_LBA)1 << 61)
+#define COMPRESSED_LBA(first, len, i) (COMPRESSED_BASE | (DISK_LBA)(len) << 40 | (DISK_LBA)(first) << 3 | (i))
+#define IS_COMPRESSED(p) ((p) >= COMPRESSED_BASE && (p) < (COMPRESSED_BASE << 1))
+#define COMPRESSED_FIRST(p) (((p) & (((DISK_LBA)1 << 40) - 1)) >> 3)
+#define COMPRESSED_LEN(p) ((int)((p) >> 40) & 7)
+#define COMPRESSED_INDEX(p) ((int)(p) & 7)
+#define COMPRESSED_END(p) (COMPRESSED_FIRST(p) + COMPRESSED_LEN(p))
 
 typedef struct IndirectBlockStructure {
 	DISK_LBA table[BLOCK_SIZE_BYTES/sizeof(DISK_LBA) ];
 } IBlockStruct;
 
+#define NODE_SIZE_BYTES 256			// Size of an inode in the backup file
+#define NODE_INLINE_BYTES (NODE_SIZE_BYTES - 4 * sizeof(int) - sizeof(int64_t) - sizeof(time_t))
+
+// A regular file without blocks keeps its data (up to NODE_INLINE_BYTES) in the inode, in place of the pointers
 typedef struct NodeStructure {
 	int numBlocks;                        		// Num blocks
-	int fileSize;                        		// File size
+	int flags;									// NODE_COMPRESS and NODE_COMPRESSED
+	int64_t fileSize;                        	// File size
 	time_t modificationTime;              		// Modification time
-	DISK_LBA blocks[NDIRECTOS];		// Blocks
-	DISK_LBA indirecto;
+	union {
+		struct {
+			DISK_LBA blocks[NDIRECTOS];		// Blocks
+			DISK_LBA indirecto[NIVELES_INDIRECCION];	// Single, double and triple indirect tables (<1 if not used)
+		};
+		char inlineData[NODE_INLINE_BYTES];	// Data of a file with numBlocks == 0
+	};
 	BOOLEAN freeNode;                        	// If the node is available
+	int nodeType;								// NODE_FILE or NODE_DIRECTORY
 } NodeStruct;
 
 #define NODES_PER_BLOCK (BLOCK_SIZE_BYTES/sizeof(NodeStruct))
-#define MAX_NODES (NODES_PER_BLOCK * MAX_BLOCKS_WITH_NODES)
+#define MAX_NODES (1 << 21)						// 512 MiB of inode table, the inode bitmap takes 64 blocks
+#define DEFAULT_MAX_NODES (BLOCK_SIZE_BYTES * 8)	// Without -i, at most the inodes of one block of the inode bitmap
+
+// Access pattern of an open file, shared by all its opens (see readahead.h)
+typedef struct ReadaheadStructure {
+	pthread_mutex_t lock;					// Readers update it holding the inode lock only for reading
+	off_t nextOffset;						// Offset a sequential read would start with
+	int window;								// Blocks kept prefetched ahead of nextBlock, 0 while the access is random
+	int end;								// First logical block not prefetched yet
+} ReadaheadStruct;
+
+// In-memory state of the nodes (not stored in the backup file)
+typedef struct OpenNodeStructure {
+	pthread_rwlock_t lock;					// Shared by lookups and reads, exclusive for anything modifying the node
+	int openCount;							// open() calls still waiting for their release()
+	BOOLEAN unlinked;						// Removed from its directory while open: freed by the last release()
+	DISK_LBA pinnedIndirect[NIVELES_INDIRECCION];	// Top level tables pinned in the block cache, 0 if none
+	ReadaheadStruct readahead;				// Sequential detection for the reads of the file
+	int delayedFirst;						// First logical block that may still be delayed (see allocateDelayed), -1 if none
+} OpenNodeStruct;
+
+// Run of blocks freed that becomes a hole of the backup file once the change that freed them is in the disk for
+// good: punched earlier, a crash could leave the old pointers leading to zeros
+typedef struct HoleRunStructure {
+	DISK_LBA first, end;				// Blocks [first, end), all of them free
+	pthread_t owner;					// Thread of the operation that freed them
+	BOOLEAN sealed;						// The operation is over: its inodes and tables are already in the cache
+	unsigned long flush;				// cacheFlush that makes them durable, 0 until one starts after sealed
+} HoleRunStruct;
+
+// A snapshot freezes the inode table: a copy of it is stored in the blocks of a file that only the super block
+// knows of, and the blocks reached from the inodes get one more reference
+typedef struct SnapshotStructure {
+	char name[MAX_LEN_FILE_NAME + 1];	// Name under /.snapshots, "" for a free slot
+	time_t creationTime;				// When it was taken
+	NodeStruct nodes;					// Its blocks hold the inode table as it was (numNodeBlocks of them)
+} SnapshotStruct;
 
 typedef struct SuperBlockStructure {
 	time_t creationTime;     	// Creation time
-	int diskSizeInBlocks;    	// # blocks in disk
-	int numOfFreeBlocks;     	// # of available blocks
+	DISK_LBA diskSizeInBlocks;	// # blocks in disk
+	DISK_LBA numOfFreeBlocks;	// # of available blocks
+	DISK_LBA sharedRefs;		// Sum of the reference counts (extra references to the shared blocks)
+	BOOLEAN clean;				// Unmounted cleanly: the free blocks are holes and sharedRefs is right
 	int blockSize;            	// Block size
 	int maxLenFileName;  		// Max. length of a file name
 	int maxBlocksPerFile; 		// Max. number of blocks per file
+	int numNodeBlocks;			// # blocks of the inode table
+	int numBitmapBlocks;		// # blocks of the bit map, from BITMAP_IDX on
+	int numChecksumBlocks;		// # blocks of the checksum area, one CRC32C per block of the disk
+	int numRefCountBlocks;		// # blocks of the reference counts, one per block of the disk
+	DISK_LBA nodeBitmapIdx;		// First block of the inode bitmap (NODE_BITMAP_BLOCKS of them)
+	DISK_LBA nodesIdx;			// First block of the inode table
+	DISK_LBA refCountIdx;		// First block of the reference counts
+	DISK_LBA checksumIdx;		// First block of the checksum area
+	DISK_LBA firstDataBlock;	// First block after the metadata (the root directory)
+	SnapshotStruct snapshots[MAX_SNAPSHOTS];	// Snapshots of the volume
 } SuperBlockStruct;
 
 typedef struct MyFileSystemStructure {
 	int fdVirtualDisk;             		// File descriptor where the whole filesystem is stored
 	SuperBlockStruct superBlock;   		// Super block
-	BIT bitMap[NUM_BITS];            	// Bit map
-	DirectoryStruct directory;     		// Root directory
-	NodeStruct* nodes[MAX_NODES];		// Array of inode pointers
+	uint64_t *bitMap;					// Bit map, one bit per block (bits past the end of the disk are set)
+	int *bitmapFree;					// Summary of the bit map: free blocks covered by each of its blocks
+	int *bitmapLongest;					// Bound of the longest free run inside each block of the bit map (exact once allocBlocks
+										// went over all of it, until a block is freed there)
+	int freeHint;						// No block of the bit map before this one has a free block
+	BOOLEAN *bitmapDirty;				// Blocks of the bit map modified since the last updateBitmap
+	int bitmapDirtyLow, bitmapDirtyHigh;	// Range of the blocks of the bit map that may be dirty
+	int *refCountsUsed;					// Summary of the reference counts (they stay in the disk, read through the cache): blocks
+										// shared among the ones covered by each of their blocks, REFCOUNTS_UNKNOWN until counted
+	uint64_t *nodeBitMap;				// Inodes in use, one bit each (bits past NUM_NODES are set)
+	int freeNodeHint;					// No word of nodeBitMap before this one has a free inode
+	NodeStruct *nodes;					// Inode table, NUM_NODES inodes laid out as in the backup file
+	OpenNodeStruct *openNodes;			// Locks and state of the open inodes, NUM_NODES of them
 	int numFreeNodes;                  // # of available inodes
+	Dentry dcache[DCACHE_SIZE];			// Recently resolved names
+	pthread_mutex_t allocLock;			// Bit map (and its summary), reference counts and numOfFreeBlocks of the super block
+	pthread_mutex_t nodeLock;			// Free inodes (nodeBitMap, nodes[i].freeNode and numFreeNodes)
+	pthread_rwlock_t freezeLock;		// Shared by the operations that modify the FS, exclusive while a snapshot is taken
+	pthread_mutex_t dcacheLocks[DCACHE_LOCKS];	// Name lookup cache, by slot
+	struct BlockCacheStructure *cache;	// Cache of blocks of the backup file
+	BOOLEAN mapDisk;					// Access the backup file through mmap instead of the block cache (-M)
+	int scrubRate;						// MiB/s read by the scrubber (-S), 0 to run without it
+	BOOLEAN compress;					// Files created are compressed (-z)
+	unsigned long compressedClusters;	// Clusters stored compressed since the mount
+	unsigned long compressedSaved;		// Blocks saved by them
+	BOOLEAN dedup;						// Blocks written with the content of a block already in the disk share it (-D)
+	unsigned long dedupChecked;			// Blocks looked up in the content index since the mount
+	unsigned long dedupShared;			// Blocks found there, and shared, since the mount
+	unsigned long snapshotMicros;		// Time taken by the last snapshot
+	BOOLEAN punchHoles;					// The free blocks are holes of the backup file: a new block already reads as zeros
+	HoleRunStruct holes[MAX_HOLE_RUNS];	// Blocks freed but not punched yet (under allocLock)
+	int numHoles;
+	unsigned long holeFlushes;			// cacheFlush calls that found holes to punch
+	unsigned long blocksPunched;		// Blocks given back to the host since the mount
 } MyFileSystem;
 
 
@@ -85,45 +233,124 @@ typedef struct MyFileSystemStructure {
 void copyNode(NodeStruct *dest, NodeStruct *src);
 
 /**
- * @brief Looks for the index a file has in the directory
+ * @brief Looks for an available node in the inode bitmap, a word at a time from freeNodeHint. The caller holds
+ * myFileSystem->nodeLock
  *
  * @param myFileSystem pointer to the FS
- * @param fileName name of the file we are looking for
- * @return index of the file in the array of files, -1 if the file is not found
+ * @return number of a free inode, -1 if not able to find one
  **/
-int findFileByName(MyFileSystem *myFileSystem, char *fileName);
+int findFreeNode(MyFileSystem *myFileSystem);
 
 /**
- * @brief This function looks for a free entry in the array of files
+ * @brief Allocates the inode table, its bitmap and the state of the open inodes for superBlock.numNodeBlocks
+ * blocks of inodes and initializes the locks of the FS (before formatting or mounting it)
  *
  * @param myFileSystem pointer to the FS
- * @return index of a free entry in the array of files, -1 if it does not exist
+ * @return 0 on success and <0 on error
  **/
-int findFreeFile(MyFileSystem *myFileSystem);
+int initializeNodes(MyFileSystem *myFileSystem);
 
 /**
- * @brief Looks for an available node
+ * @brief Allocates the bit map for superBlock.numBitmapBlocks blocks and its summary, all of them free and clean,
+ * and the summary of the reference counts for superBlock.numRefCountBlocks blocks (no block shared)
  *
  * @param myFileSystem pointer to the FS
- * @return number of a free inode, -1 if not able to find one
+ * @return 0 on success and <0 on error
  **/
-int findFreeNode(MyFileSystem *myFileSystem);
+int initializeBitmap(MyFileSystem *myFileSystem);
 
 /**
- * @brief Computes the position (byte) of a given inode in the backup file
+ * @brief Marks an inode as used or free in the inode bitmap and writes the word that holds it to the backup
+ * file. The caller holds myFileSystem->nodeLock
  *
- * @param inodeNum given inode (is position in the backup file)
- * @return the offset, or the starting position of the given inode
+ * @param myFileSystem pointer to the FS
+ * @param nodeIdx inode number
+ * @param used true if the inode is taken
+ * @return 0 on success and <0 on error
  **/
-int findNodeByPos(int nodeNum);
+int updateNodeBitmap(MyFileSystem *myFileSystem, int nodeIdx, BOOLEAN used);
 
 /**
- * @brief It reads the inodes from disk and store them in new structures myFileSystem->nodes[i]
+ * @brief Takes the lock of an inode. Locks of different inodes are always taken from the parent directory down
  *
  * @param myFileSystem pointer to the FS
- * @return 0 on success and <0 on error
+ * @param nodeIdx inode number
+ * @param write true for exclusive access, false for shared access
+ * @return void
  **/
-int initializeNodes(MyFileSystem *myFileSystem);
+void lockNode(MyFileSystem *myFileSystem, int nodeIdx, BOOLEAN write);
+
+/**
+ * @brief Takes the lock of an inode if nobody holds it in a conflicting mode, without waiting
+ *
+ * @param myFileSystem pointer to the FS
+ * @param nodeIdx inode number
+ * @param write true for exclusive access, false for shared access
+ * @return true if the lock was taken
+ **/
+BOOLEAN tryLockNode(MyFileSystem *myFileSystem, int nodeIdx, BOOLEAN write);
+
+/**
+ * @brief Releases the lock taken with lockNode
+ *
+ * @param myFileSystem pointer to the FS
+ * @param nodeIdx inode number
+ * @return void
+ **/
+void unlockNode(MyFileSystem *myFileSystem, int nodeIdx);
+
+/**
+ * @brief Enters a FUSE operation that modifies the FS, before any lock of an inode. A snapshot waits for the ones in
+ * course and holds the next ones back until it is taken: it goes first, so they never starve it. A thread enters once
+ *
+ * @param myFileSystem pointer to the FS
+ * @return void
+ **/
+void beginUpdate(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Leaves the operation entered with beginUpdate: the blocks it freed may be punched from the next cacheFlush on
+ *
+ * @param myFileSystem pointer to the FS
+ * @return void
+ **/
+void endUpdate(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Marks the blocks freed by the calling thread as ready to be punched (see HoleRunStruct). endUpdate does it
+ *
+ * @param myFileSystem pointer to the FS
+ * @return void
+ **/
+void sealHoles(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Called by cacheFlush before writing anything: the blocks freed by the operations already over are punched
+ * once the flush is in the disk (see punchFlushedHoles)
+ *
+ * @param myFileSystem pointer to the FS
+ * @return number of the flush, 0 if there is nothing to punch
+ **/
+unsigned long startHoleFlush(MyFileSystem *myFileSystem);
+
+/**
+ * @brief Called by cacheFlush once the backup file is synchronized: punches the blocks taken by startHoleFlush in
+ * that flush or an earlier one that failed
+ *
+ * @param myFileSystem pointer to the FS
+ * @param flush number returned by startHoleFlush
+ * @return void
+ **/
+void punchFlushedHoles(MyFileSystem *myFileSystem, unsigned long flush);
+
+/**
+ * @brief Computes the position (byte) of a given inode in the backup file
+ *
+ * @param myFileSystem pointer to the FS
+ * @param inodeNum given inode (is position in the backup file)
+ * @return the offset, or the starting position of the given inode
+ **/
+off_t findNodeByPos(MyFileSystem *myFileSystem, int nodeNum);
 
 /**
  * @brief Initializes the super block
@@ -132,7 +359,7 @@ int initializeNodes(MyFileSystem *myFileSystem);
  * @param diskSize size of the backup file for the FS
  * @return void
  **/
-void initializeSuperBlock(MyFileSystem *myFileSystem, int diskSize);
+void initializeSuperBlock(MyFileSystem *myFileSystem, int64_t diskSize);
 
 /**
  * @brief Free all the memory linked to the current FS
@@ -143,18 +370,23 @@ void initializeSuperBlock(MyFileSystem *myFileSystem, int diskSize);
 void myFree(MyFileSystem *myFileSystem);
 
 /**
- * @brief Formats the current disk. Saves all the bitmap, super block and the directory.
+ * @brief Formats the current disk. Saves all the bitmap, super block, inodes and the empty root directory, built in memory,
+ * zeroes the reference counts and the checksum area and stores the checksums of the rest.
  *
  * @param myFileSystem pointer to the FS
  * @param diskSize size of the disk we are creating
+ * @param numNodes number of inodes (rounded up to whole blocks, up to MAX_NODES), <=0 for one per DEFAULT_BLOCKS_PER_NODE
+ * blocks (up to DEFAULT_MAX_NODES)
  * @param backupFileName Name of the file that will store the FS
  * @return 0 on success and <0 on error
  **/
-int myMkfs(MyFileSystem *myFileSystem, int diskSize, char *backupFileName);
+int myMkfs(MyFileSystem *myFileSystem, int64_t diskSize, int numNodes, char *backupFileName);
 
 /**
  * @brief Mounts the current disk.  (Optional part of the lab assignment) 
- * 
+ * The super block is read first, then the bit maps and the inode table with a single preadv, and the reference counts
+ * (by chunks, to build their summary), all of them checked (and their checksums verified) before use
+ *
  * @param myFileSystem pointer to the FS
  * @param backupFileName Name of the file that stores the FS
  * @return 0 on success and <0 on error
@@ -162,13 +394,23 @@ int myMkfs(MyFileSystem *myFileSystem, int diskSize, char *backupFileName);
  int myMount(MyFileSystem *myFileSystem, char *backupFileName);
 
 
+/**
+ * @brief Writes a human readable summary of the FS counters (cache hits, misses, checksum errors...)
+ *
+ * @param myFileSystem pointer to the FS
+ * @param buf output buffer
+ * @param size size of buf
+ * @return number of characters written (without the final '\0')
+ **/
+int myStats(MyFileSystem *myFileSystem, char *buf, int size);
+
 /**
  * @brief Returns the number of free blocks in the FS, checking the bitmap
  *
  * @param myFileSystem pointer to the FS
  * @return number of free blocks
  **/
-int myQuota(MyFileSystem *myFileSystem);
+DISK_LBA myQuota(MyFileSystem *myFileSystem);
 
 /**
  * @brief Reads an inode from the backup file
@@ -180,6 +422,56 @@ int myQuota(MyFileSystem *myFileSystem);
  **/
 int readNode(MyFileSystem *myFileSystem, int nodeNum, NodeStruct* node);
 
+/**
+ * @brief Reserves a run of consecutive free blocks, as close as possible to goal. When there is no free run
+ *        of maxLen blocks the longest one found is reserved. The blocks of the bit map that cannot hold a run
+ *        longer than the best one found (see bitmapFree and bitmapLongest) and the full words are skipped without
+ *        looking at their bits, and the search wraps around at freeHint. A block freed but not punched yet is
+ *        zeroed through the cache once myFileSystem->allocLock is released
+ *
+ * @param myFileSystem pointer to the FS
+ * @param goal preferred first block (usually the block after the last one of the file)
+ * @param maxLen number of blocks wanted
+ * @param first output: first block of the run
+ * @return number of blocks reserved (between 1 and maxLen), 0 if the disk is full
+ **/
+int allocBlocks(MyFileSystem *myFileSystem, DISK_LBA goal, int maxLen, DISK_LBA *first);
+
+/**
+ * @brief Drops a pointer to each block of a run. A shared block only loses a reference, the rest go back to the
+ * bitmap and out of the block cache, and become a hole of the backup file (see HoleRunStruct: punched by the
+ * cacheFlush that follows the end of the operation). Takes myFileSystem->allocLock, but the cache is used without
+ * it: a block stays in use until it is out of the cache
+ *
+ * @param myFileSystem pointer to the FS
+ * @param first first block
+ * @param numBlocks number of blocks
+ * @return number of blocks freed
+ **/
+int freeBlocks(MyFileSystem *myFileSystem, DISK_LBA first, int numBlocks);
+
+/**
+ * @brief Adds a pointer to each block of a run (in use): they are shared, and copied before they are written.
+ * Takes myFileSystem->allocLock once their reference counts are in the cache
+ *
+ * @param myFileSystem pointer to the FS
+ * @param first first block
+ * @param numBlocks number of blocks
+ * @return void
+ **/
+void shareBlocks(MyFileSystem *myFileSystem, DISK_LBA first, int numBlocks);
+
+/**
+ * @brief Reference count of a block, read through the cache unless its summary says that no block around it is
+ * shared. The summary of a block of the counts is made the first time it is read after the mount. A count that
+ * cannot be read is taken as shared (the block is copied before a write)
+ *
+ * @param myFileSystem pointer to the FS
+ * @param lba block number
+ * @return pointers to the block besides the first one, 0 if it is not shared
+ **/
+uint32_t getReferences(MyFileSystem *myFileSystem, DISK_LBA lba);
+
 /**
  * @brief This function looks for empty blocks in the bitmap, reserving them
  *
@@ -191,21 +483,14 @@ int readNode(MyFileSystem *myFileSystem, int nodeNum, NodeStruct* node);
 int reserveBlocksForNodes(MyFileSystem* myFileSystem, DISK_LBA blockIdxs[], int numBlocks);
 
 /**
- * @brief Writes all the information of the bitmap into the backup file
+ * @brief Writes the blocks of the bit map modified since the last call into the backup file (the reference counts are
+ * modified in the cache)
  *
  * @param myFileSystem pointer to the FS
  * @return 0 on success and <0 on error
  **/
 int updateBitmap(MyFileSystem *myFileSystem);
 
-/**
- * @brief Writes the informatin of the directory into the backup file
- *
- * @param myFileSystem pointer to the FS
- * @return int
- **/
-int updateDirectory(MyFileSystem *myFileSystem);
-
 /**
  * @brief Writes all the information of an inode into the backup file
  *
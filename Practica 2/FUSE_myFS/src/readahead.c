@@ -0,0 +1,145 @@
+#include "readahead.h"
+#include "indirect.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+typedef struct {
+	int nodeIdx;
+	int first;			// First logical block
+	int numBlocks;
+} ReadaheadRequest;
+
+// Requests waiting for the prefetch thread (a ring)
+static struct {
+	ReadaheadRequest queue[READAHEAD_QUEUE];
+	int head;
+	int count;
+	BOOLEAN running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeUp;
+} readahead = { .lock = PTHREAD_MUTEX_INITIALIZER, .wakeUp = PTHREAD_COND_INITIALIZER };
+
+/**
+* @brief Brings the blocks of a request to the cache, one extent at a time
+**/
+static void prefetch(ReadaheadRequest *req) {
+	NodeStruct *node = &myFileSystem.nodes[req->nodeIdx];
+	int bl, len, end;
+
+	// Holding the lock nobody writes the blocks around the cache (cacheWriteRun) while they are read
+	lockNode(&myFileSystem, req->nodeIdx, false);
+	// The file may have been truncated or removed since the request was queued
+	if(!node->freeNode) {
+		end = req->first + req->numBlocks < node->numBlocks ? req->first + req->numBlocks : node->numBlocks;
+		for(bl = req->first; bl < end; bl += len) {
+			DISK_LBA lba;
+			if((len = getExtent(node, bl, end - bl, &lba)) <= 0)
+				break;
+			// Delayed blocks are always in the cache
+			if(lba > 0 && !IS_DELAYED(lba))
+				cachePrefetch(&myFileSystem, lba, len);
+		}
+	}
+	unlockNode(&myFileSystem, req->nodeIdx);
+}
+
+static void *readaheadThread(void *arg) {
+	ReadaheadRequest req;
+
+	pthread_mutex_lock(&readahead.lock);
+	while(readahead.running) {
+		if(!readahead.count) {
+			pthread_cond_wait(&readahead.wakeUp, &readahead.lock);
+			continue;
+		}
+		req = readahead.queue[readahead.head];
+		readahead.head = (readahead.head + 1) % READAHEAD_QUEUE;
+		readahead.count--;
+		pthread_mutex_unlock(&readahead.lock);
+		prefetch(&req);
+		pthread_mutex_lock(&readahead.lock);
+	}
+	pthread_mutex_unlock(&readahead.lock);
+	return NULL;
+}
+
+int readaheadStart(void) {
+	int ret;
+
+	readahead.head = readahead.count = 0;
+	readahead.running = true;
+	if((ret = pthread_create(&readahead.thread, NULL, readaheadThread, NULL)) != 0) {
+		fprintf(stderr, "Failed to start the readahead thread: %s\n", strerror(ret));
+		readahead.running = false;
+		return -ret;
+	}
+	return 0;
+}
+
+void readaheadStop(void) {
+	pthread_mutex_lock(&readahead.lock);
+	if(!readahead.running) {
+		pthread_mutex_unlock(&readahead.lock);
+		return;
+	}
+	readahead.running = false;
+	pthread_cond_signal(&readahead.wakeUp);
+	pthread_mutex_unlock(&readahead.lock);
+	pthread_join(readahead.thread, NULL);
+}
+
+void readaheadReset(int nodeIdx) {
+	ReadaheadStruct *state = &myFileSystem.openNodes[nodeIdx].readahead;
+
+	pthread_mutex_lock(&state->lock);
+	state->nextOffset = 0;
+	state->window = 0;
+	state->end = 0;
+	pthread_mutex_unlock(&state->lock);
+}
+
+void readaheadAccess(int nodeIdx, off_t offset, size_t size) {
+	ReadaheadStruct *state = &myFileSystem.openNodes[nodeIdx].readahead;
+	int numBlocks = myFileSystem.nodes[nodeIdx].numBlocks;
+	int next, first = 0, count = 0;
+
+	pthread_mutex_lock(&state->lock);
+	if(offset == state->nextOffset) {
+		state->window = state->window ? state->window * 2 : READAHEAD_MIN_BLOCKS;
+		if(state->window > READAHEAD_MAX_BLOCKS)
+			state->window = READAHEAD_MAX_BLOCKS;
+	}
+	else {
+		state->window = 0;
+		state->end = 0;
+	}
+	state->nextOffset = offset + size;
+
+	// New requests once half of the window has been consumed, so they are not one block long
+	next = (state->nextOffset + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+	if(state->window && state->end - next <= state->window / 2) {
+		first = state->end > next ? state->end : next;
+		count = (next + state->window < numBlocks ? next + state->window : numBlocks) - first;
+		if(count > 0)
+			state->end = first + count;
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	if(count <= 0)
+		return;
+	pthread_mutex_lock(&readahead.lock);
+	if(readahead.running && readahead.count < READAHEAD_QUEUE) {
+		ReadaheadRequest *req = &readahead.queue[(readahead.head + readahead.count) % READAHEAD_QUEUE];
+		req->nodeIdx = nodeIdx;
+		req->first = first;
+		req->numBlocks = count;
+		readahead.count++;
+		pthread_cond_signal(&readahead.wakeUp);
+	}
+	pthread_mutex_unlock(&readahead.lock);
+}
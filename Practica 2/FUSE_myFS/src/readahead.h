@@ -0,0 +1,36 @@
+#ifndef _READAHEAD_H_
+
+#define _READAHEAD_H_
+
+#include "myFS.h"
+
+extern MyFileSystem myFileSystem;
+
+#define READAHEAD_MIN_BLOCKS 4		// Window after the first sequential read
+#define READAHEAD_MAX_BLOCKS 64		// The window doubles on every sequential read up to this (256 KiB)
+#define READAHEAD_QUEUE 64			// Prefetch requests waiting for the thread (more are dropped)
+
+/**
+* @brief Starts the thread that prefetches blocks into the block cache. It must be started after FUSE
+* 	 becomes a daemon (init), the fork would lose it
+**/
+int readaheadStart(void);
+
+/**
+* @brief Stops the prefetch thread, dropping the requests still queued
+**/
+void readaheadStop(void);
+
+/**
+* @brief Forgets the access pattern of a file (first open)
+**/
+void readaheadReset(int nodeIdx);
+
+/**
+* @brief Tells that size bytes are being read at offset. A read that continues the previous one grows the window and
+* 	 queues the blocks missing to fill it, any other read collapses it. The caller holds the lock of the node
+* 	 (for reading at least)
+**/
+void readaheadAccess(int nodeIdx, off_t offset, size_t size);
+
+#endif
@@ -0,0 +1,95 @@
+#include "scrub.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+static struct {
+	BOOLEAN running;
+	int rate;				// MiB/s
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeUp;	// On CLOCK_MONOTONIC, signalled by scrubStop
+} scrub = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+* @brief Moves a deadline forward
+**/
+static void addNanoseconds(struct timespec *t, int64_t ns) {
+	ns += t->tv_nsec;
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec = ns % 1000000000;
+}
+
+static void *scrubThread(void *arg) {
+	DISK_LBA lba = 0, diskSize = myFileSystem.superBlock.diskSizeInBlocks;
+	struct timespec next, now;
+	char *buf;
+	int n;
+
+	if((buf = malloc((size_t)CACHE_SCRUB_BLOCKS * BLOCK_SIZE_BYTES)) == NULL) {
+		perror("Error in malloc");
+		return NULL;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	pthread_mutex_lock(&scrub.lock);
+	while(scrub.running) {
+		n = diskSize - lba < CACHE_SCRUB_BLOCKS ? diskSize - lba : CACHE_SCRUB_BLOCKS;
+		pthread_mutex_unlock(&scrub.lock);
+		n = cacheScrub(&myFileSystem, lba, n, buf);
+		pthread_mutex_lock(&scrub.lock);
+
+		// Each block read puts the next read off, so the average stays at the rate. Time lost is not made up
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(next.tv_sec < now.tv_sec || (next.tv_sec == now.tv_sec && next.tv_nsec < now.tv_nsec))
+			next = now;
+		if(n > 0)
+			addNanoseconds(&next, (int64_t)n * BLOCK_SIZE_BYTES * 1000000000 / ((int64_t)scrub.rate << 20));
+		if((lba += CACHE_SCRUB_BLOCKS) >= diskSize) {
+			lba = 0;
+			next.tv_sec += SCRUB_PAUSE_SECONDS;
+		}
+		while(scrub.running && pthread_cond_timedwait(&scrub.wakeUp, &scrub.lock, &next) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&scrub.lock);
+	free(buf);
+	return NULL;
+}
+
+int scrubStart(int rate) {
+	pthread_condattr_t attr;
+	int ret;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&scrub.wakeUp, &attr);
+	pthread_condattr_destroy(&attr);
+
+	scrub.rate = rate;
+	scrub.running = true;
+	if((ret = pthread_create(&scrub.thread, NULL, scrubThread, NULL)) != 0) {
+		fprintf(stderr, "Failed to start the scrubber thread: %s\n", strerror(ret));
+		scrub.running = false;
+		return -ret;
+	}
+	return 0;
+}
+
+void scrubStop(void) {
+	pthread_mutex_lock(&scrub.lock);
+	if(!scrub.running) {
+		pthread_mutex_unlock(&scrub.lock);
+		return;
+	}
+	scrub.running = false;
+	pthread_cond_signal(&scrub.wakeUp);
+	pthread_mutex_unlock(&scrub.lock);
+	pthread_join(scrub.thread, NULL);
+	pthread_cond_destroy(&scrub.wakeUp);
+}
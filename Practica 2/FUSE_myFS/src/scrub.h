@@ -0,0 +1,22 @@
+#ifndef _SCRUB_H_
+
+#define _SCRUB_H_
+
+#include "myFS.h"
+
+extern MyFileSystem myFileSystem;
+
+#define SCRUB_PAUSE_SECONDS 10		// Wait between two passes over the whole disk
+
+/**
+* @brief Starts the thread that verifies the checksums of the whole disk over and over, reading at most rate MiB/s.
+* 	 Like the readahead thread, it must be started after FUSE becomes a daemon (init)
+**/
+int scrubStart(int rate);
+
+/**
+* @brief Stops the scrubber thread, if running
+**/
+void scrubStop(void);
+
+#endif
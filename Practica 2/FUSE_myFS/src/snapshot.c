@@ -0,0 +1,292 @@
+#include "snapshot.h"
+#include "indirect.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+static struct {
+	pthread_rwlock_t lock;			// The snapshots of the super block: taken for writing to add or drop one
+	int opens[MAX_SNAPSHOTS];		// Files of each snapshot open (it cannot be dropped meanwhile)
+} snapshots = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+int snapshotPath(const char *path) {
+	size_t len = strlen(SNAPSHOT_DIR);
+
+	if(strncmp(path, SNAPSHOT_DIR, len) != 0)
+		return SNAPSHOT_NONE;
+	if(path[len] == '\0')
+		return SNAPSHOT_ROOT;
+	return path[len] == '/' ? SNAPSHOT_FILE : SNAPSHOT_NONE;
+}
+
+/**
+* @brief Slot of the snapshot with that name ("" for a free slot), -1 if there is none. The caller holds the lock of the snapshots
+**/
+static int findSnapshot(const char *name) {
+	int i;
+
+	for(i = 0; i < MAX_SNAPSHOTS; i++) {
+		if(strcmp(myFileSystem.superBlock.snapshots[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+* @brief Copies the name of the snapshot of SNAPSHOT_DIR/name, which must be the last component. Returns its length,
+* 	 0 for SNAPSHOT_DIR itself, -EROFS for a path inside a snapshot or -ENAMETOOLONG
+**/
+static int snapshotName(const char *path, char *name) {
+	char next[MAX_LEN_FILE_NAME + 1];
+	const char *rest = path + strlen(SNAPSHOT_DIR);
+	int len;
+
+	if((len = nextComponent(&rest, name)) <= 0)
+		return len;
+	return nextComponent(&rest, next) != 0 ? -EROFS : len;
+}
+
+/**
+* @brief Writes the inode table into new blocks, in runs, mapped by table (a file that only the super block knows of).
+* 	 The caller holds the lock of every inode. Returns 0, -ENOSPC or -EIO
+**/
+static int copyNodeTable(NodeStruct *table) {
+	int numBlocks = myFileSystem.superBlock.numNodeBlocks, need = numBlocks + indirectBlocksFor(numBlocks), bl = 0, len, i, ret = 0;
+	DISK_LBA goal = FIRST_DATA_BLOCK(&myFileSystem), first;
+	struct iovec iov;
+
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	if(need > myFileSystem.superBlock.numOfFreeBlocks) {
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return -ENOSPC;
+	}
+	myFileSystem.superBlock.numOfFreeBlocks -= need;
+	pthread_mutex_unlock(&myFileSystem.allocLock);
+
+	memset(table, 0, sizeof(NodeStruct));
+	for(i = 0; i < NIVELES_INDIRECCION; i++)
+		table->indirecto[i] = -1;
+	table->nodeType = NODE_FILE;
+	table->modificationTime = time(NULL);
+	while(bl < numBlocks && ret == 0) {
+		if((len = allocBlocks(&myFileSystem, goal, numBlocks - bl, &first)) == 0) {
+			ret = -ENOSPC;
+			break;
+		}
+		for(i = 0; i < len && (ret = assignBF_to_BL(table, bl + i, first + i)) == 0; i++)
+			table->numBlocks = bl + i + 1;
+		// The blocks of the run not mapped are not dropped with the table
+		if(ret < 0) {
+			freeBlocks(&myFileSystem, first + i, len - i);
+			break;
+		}
+		iov.iov_base = (char *)myFileSystem.nodes + (size_t)bl * BLOCK_SIZE_BYTES;
+		iov.iov_len = (size_t)len * BLOCK_SIZE_BYTES;
+		if(cacheWriteRun(&myFileSystem, first, len, &iov, 1))
+			ret = -EIO;
+		bl += len;
+		goal = first + len;
+	}
+
+	// Every block taken goes back to the bitmap
+	if(ret < 0) {
+		dropBlockMap(table);
+		memset(table, 0, sizeof(NodeStruct));
+		pthread_mutex_lock(&myFileSystem.allocLock);
+		myFileSystem.superBlock.numOfFreeBlocks += need;
+		pthread_mutex_unlock(&myFileSystem.allocLock);
+		return ret;
+	}
+	table->fileSize = (int64_t)numBlocks * BLOCK_SIZE_BYTES;
+	return 0;
+}
+
+int snapshotCreate(const char *path) {
+	SnapshotStruct *snap;
+	char name[MAX_LEN_FILE_NAME + 1];
+	struct timespec start, end;
+	int slot, i, ret;
+
+	if((ret = snapshotName(path, name)) <= 0)
+		return ret ? ret : -EEXIST;
+
+	// Nothing changes while the table is copied: the operations that modify the FS wait (the ones in course finish
+	// first). The lock of the snapshots goes after it, as in the operations that reach a snapshot
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_rwlock_wrlock(&myFileSystem.freezeLock);
+	pthread_rwlock_wrlock(&snapshots.lock);
+	if(findSnapshot(name) >= 0 || (slot = findSnapshot("")) < 0) {
+		ret = findSnapshot(name) >= 0 ? -EEXIST : -EMLINK;
+		pthread_rwlock_unlock(&snapshots.lock);
+		pthread_rwlock_unlock(&myFileSystem.freezeLock);
+		return ret;
+	}
+	snap = &myFileSystem.superBlock.snapshots[slot];
+
+	// The delayed blocks take their place first: the snapshot shares them. Only readers may hold the lock of an inode
+	for(i = 0; i < NUM_NODES(&myFileSystem); i++) {
+		lockNode(&myFileSystem, i, true);
+		if(!myFileSystem.nodes[i].freeNode)
+			allocateDelayed(i, false);
+		unlockNode(&myFileSystem, i);
+	}
+	if((ret = copyNodeTable(&snap->nodes)) == 0) {
+		for(i = 0; i < NUM_NODES(&myFileSystem); i++) {
+			if(!myFileSystem.nodes[i].freeNode)
+				shareBlockMap(&myFileSystem.nodes[i]);
+		}
+		strcpy(snap->name, name);
+		snap->creationTime = time(NULL);
+		updateSuperBlock(&myFileSystem);
+		updateBitmap(&myFileSystem);
+	}
+
+	// The blocks shared are never written again: the dirty ones reach the disk with the new table
+	sealHoles(&myFileSystem);
+	if(ret == 0 && cacheFlush(&myFileSystem))
+		ret = -EIO;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	myFileSystem.snapshotMicros = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	pthread_rwlock_unlock(&snapshots.lock);
+	pthread_rwlock_unlock(&myFileSystem.freezeLock);
+	return ret;
+}
+
+int snapshotDelete(const char *path) {
+	SnapshotStruct *snap;
+	char name[MAX_LEN_FILE_NAME + 1];
+	NodeStruct node;
+	int slot, i, freed = 0, ret;
+
+	if((ret = snapshotName(path, name)) <= 0)
+		return ret ? ret : -EBUSY;
+
+	// The files of the FS are not locked: the blocks shared with the snapshot only lose a reference
+	pthread_rwlock_wrlock(&snapshots.lock);
+	if((slot = findSnapshot(name)) < 0 || snapshots.opens[slot]) {
+		pthread_rwlock_unlock(&snapshots.lock);
+		return slot < 0 ? -ENOENT : -EBUSY;
+	}
+	snap = &myFileSystem.superBlock.snapshots[slot];
+	for(i = 0; i < NUM_NODES(&myFileSystem); i++) {
+		if(snapshotNode(slot, i, &node) < 0)
+			fprintf(stderr, "Inode %d of the snapshot %s lost: its blocks stay in use\n", i, name);
+		else if(!node.freeNode)
+			freed += dropBlockMap(&node);
+	}
+	freed += dropBlockMap(&snap->nodes);
+	memset(snap, 0, sizeof(SnapshotStruct));
+
+	pthread_mutex_lock(&myFileSystem.allocLock);
+	myFileSystem.superBlock.numOfFreeBlocks += freed;
+	pthread_mutex_unlock(&myFileSystem.allocLock);
+	updateSuperBlock(&myFileSystem);
+	updateBitmap(&myFileSystem);
+	pthread_rwlock_unlock(&snapshots.lock);
+	return cacheFlush(&myFileSystem) ? -EIO : 0;
+}
+
+int snapshotNode(int snap, int nodeIdx, NodeStruct *node) {
+	NodeStruct *table = &myFileSystem.superBlock.snapshots[snap].nodes;
+	DISK_LBA lba;
+
+	if(nodeIdx < 0 || nodeIdx >= NUM_NODES(&myFileSystem) || (lba = getBF_from_BL(table, nodeIdx / NODES_PER_BLOCK)) < 1 ||
+	   cacheRead(&myFileSystem, lba, (nodeIdx % NODES_PER_BLOCK) * sizeof(NodeStruct), node, sizeof(NodeStruct)))
+		return -EIO;
+	return 0;
+}
+
+/**
+* @brief snapshotLookup with the lock of the snapshots already taken (for reading at least)
+**/
+static int lookupLocked(const char *path, int *snap, NodeStruct *node) {
+	char name[MAX_LEN_FILE_NAME + 1];
+	const char *rest = path + strlen(SNAPSHOT_DIR);
+	int nodeIdx = ROOT_NODE, len;
+
+	*snap = -1;
+	if((len = nextComponent(&rest, name)) <= 0) {
+		// SNAPSHOT_DIR, made up
+		memset(node, 0, sizeof(NodeStruct));
+		node->nodeType = NODE_DIRECTORY;
+		node->modificationTime = myFileSystem.superBlock.creationTime;
+		return len < 0 ? len : ROOT_NODE;
+	}
+	if((*snap = findSnapshot(name)) < 0)
+		return -ENOENT;
+	if(snapshotNode(*snap, ROOT_NODE, node) < 0)
+		return -EIO;
+	while((len = nextComponent(&rest, name)) != 0) {
+		if(len < 0)
+			return len;
+		if(node->nodeType != NODE_DIRECTORY)
+			return -ENOTDIR;
+		if((nodeIdx = dirLookupNode(node, name)) < 0)
+			return nodeIdx;
+		if(snapshotNode(*snap, nodeIdx, node) < 0 || node->freeNode)
+			return -EIO;
+	}
+	return nodeIdx;
+}
+
+int snapshotLookup(const char *path, int *snap, NodeStruct *node) {
+	int ret;
+
+	pthread_rwlock_rdlock(&snapshots.lock);
+	ret = lookupLocked(path, snap, node);
+	pthread_rwlock_unlock(&snapshots.lock);
+	return ret;
+}
+
+int snapshotReaddir(const char *path, DirVisitor visit, void *arg) {
+	NodeStruct node;
+	int snap, i, ret;
+
+	// The snapshot is not dropped while its directories are read
+	pthread_rwlock_rdlock(&snapshots.lock);
+	if((ret = lookupLocked(path, &snap, &node)) < 0) {
+		pthread_rwlock_unlock(&snapshots.lock);
+		return ret;
+	}
+	if(node.nodeType != NODE_DIRECTORY) {
+		ret = -ENOTDIR;
+	}
+	else if(snap < 0) {
+		for(i = 0, ret = 0; i < MAX_SNAPSHOTS; i++) {
+			if(myFileSystem.superBlock.snapshots[i].name[0] && visit(arg, myFileSystem.superBlock.snapshots[i].name, i))
+				break;
+		}
+	}
+	else {
+		ret = dirForEachNode(&node, visit, arg);
+	}
+	pthread_rwlock_unlock(&snapshots.lock);
+	return ret;
+}
+
+int snapshotOpen(const char *path, uint64_t *fh) {
+	NodeStruct node;
+	int snap, nodeIdx;
+
+	pthread_rwlock_rdlock(&snapshots.lock);
+	if((nodeIdx = lookupLocked(path, &snap, &node)) >= 0) {
+		if(node.nodeType == NODE_DIRECTORY) {
+			nodeIdx = -EISDIR;
+		}
+		else {
+			__atomic_add_fetch(&snapshots.opens[snap], 1, __ATOMIC_RELAXED);
+			*fh = SNAPSHOT_HANDLE(snap, nodeIdx);
+		}
+	}
+	pthread_rwlock_unlock(&snapshots.lock);
+	return nodeIdx < 0 ? nodeIdx : 0;
+}
+
+void snapshotRelease(uint64_t fh) {
+	__atomic_sub_fetch(&snapshots.opens[HANDLE_SNAPSHOT(fh)], 1, __ATOMIC_RELAXED);
+}
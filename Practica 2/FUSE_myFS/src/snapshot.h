@@ -0,0 +1,72 @@
+#ifndef _SNAPSHOT_H_
+
+#define _SNAPSHOT_H_
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include "myFS.h"
+#include "directory.h"
+
+extern MyFileSystem myFileSystem;
+
+#define SNAPSHOT_DIR "/.snapshots"	// Read-only directory holding a directory per snapshot (mkdir takes one, rmdir drops it)
+
+#define SNAPSHOT_NONE 0				// A path outside SNAPSHOT_DIR
+#define SNAPSHOT_ROOT 1				// SNAPSHOT_DIR itself
+#define SNAPSHOT_FILE 2				// A snapshot or something inside it
+
+// File handle of a file of a snapshot: the snapshot (from 1) above the inode, so it never matches an inode of the FS
+#define SNAPSHOT_HANDLE(snap, nodeIdx) ((uint64_t)((snap) + 1) << 32 | (uint32_t)(nodeIdx))
+#define IS_SNAPSHOT_HANDLE(fh) (((fh) >> 32) != 0)
+#define HANDLE_SNAPSHOT(fh) ((int)((fh) >> 32) - 1)
+#define HANDLE_NODE(fh) ((int)((fh) & 0xffffffff))
+
+/**
+* @brief Tells whether a path is SNAPSHOT_DIR, inside it or none of them
+**/
+int snapshotPath(const char *path);
+
+/**
+* @brief Takes a snapshot named after the last component of path (SNAPSHOT_DIR/name): the operations that modify the
+* 	 FS are held back (see beginUpdate), the delayed blocks placed and the inode table copied to new blocks. The
+* 	 blocks of the files are not copied, only shared, so the time depends on the number of inodes and not on the
+* 	 data. Returns 0, -EEXIST, -EROFS (a path deeper in SNAPSHOT_DIR), -ENAMETOOLONG, -EMLINK (MAX_SNAPSHOTS taken)
+* 	 or -ENOSPC
+**/
+int snapshotCreate(const char *path);
+
+/**
+* @brief Drops the snapshot SNAPSHOT_DIR/name: the blocks only reached from it are freed. Returns 0, -ENOENT,
+* 	 -EBUSY (a file of the snapshot is open) or -EROFS
+**/
+int snapshotDelete(const char *path);
+
+/**
+* @brief Resolves a path of a snapshot: copies its inode into node and returns its number, with the snapshot in
+* 	 *snap. SNAPSHOT_DIR itself has no inode: returns ROOT_NODE with *snap = -1 and node as a directory. Returns
+* 	 -ENOENT, -ENOTDIR or -ENAMETOOLONG on error
+**/
+int snapshotLookup(const char *path, int *snap, NodeStruct *node);
+
+/**
+* @brief Copies the inode nodeIdx of the snapshot snap (as it was when it was taken). Returns 0 or -EIO
+**/
+int snapshotNode(int snap, int nodeIdx, NodeStruct *node);
+
+/**
+* @brief Calls visit for every entry of a directory of a snapshot, in name order. For SNAPSHOT_DIR the entries are the
+* 	 snapshots (nodeIdx is the slot in the super block). Returns 0 or an error of snapshotLookup (-ENOTDIR for a file)
+**/
+int snapshotReaddir(const char *path, DirVisitor visit, void *arg);
+
+/**
+* @brief Opens the file of a snapshot for reading: fh gets its handle. Returns 0, -EISDIR or an error of snapshotLookup
+**/
+int snapshotOpen(const char *path, uint64_t *fh);
+
+/**
+* @brief Undoes snapshotOpen
+**/
+void snapshotRelease(uint64_t fh);
+
+#endif
@@ -0,0 +1,297 @@
+/**
+ * Micro benchmarks for a mounted myFS volume (they work on any file system).
+ *
+ *	myfs-bench seqwrite <file> <MiB> [KiB per write]
+ *	myfs-bench seqread <file> [KiB per read]
+ *	myfs-bench randread <file> <reads> [KiB per read]
+ *	myfs-bench copies <dir> <MiB> <copies> [KiB per write]
+ *	myfs-bench entries <dir> <entries> [entries per subdirectory]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define USAGE "Usage:\n" \
+	"\t%s seqwrite <file> <MiB> [KiB per write]\n" \
+	"\t%s seqread <file> [KiB per read]\n" \
+	"\t%s randread <file> <reads> [KiB per read]\n" \
+	"\t%s copies <dir> <MiB> <copies> [KiB per write]\n" \
+	"\t%s entries <dir> <entries> [entries per subdirectory]\n"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Writes a new file of the given size sequentially and reports MiB/s (fsync included)
+ **/
+static int seqWrite(const char *file, long mib, long kib) {
+	size_t chunk = kib * 1024;
+	long long total = mib * 1024LL * 1024, done = 0;
+	char *buf = malloc(chunk);
+	int fd;
+	double t;
+
+	if(buf == NULL || (fd = open(file, O_CREAT | O_TRUNC | O_WRONLY, 0644)) == -1) {
+		perror(file);
+		return 1;
+	}
+	memset(buf, 'x', chunk);
+	t = now();
+	while(done < total) {
+		size_t n = (total - done < chunk) ? total - done : chunk;
+		if(write(fd, buf, n) != n) {
+			perror("write");
+			return 1;
+		}
+		done += n;
+	}
+	fsync(fd);
+	close(fd);
+	t = now() - t;
+	printf("seqwrite: %lld B in %.3f s, %.1f MiB/s (%ld KiB writes)\n", total, t, total / t / (1024 * 1024), kib);
+	free(buf);
+	return 0;
+}
+
+/**
+ * @brief Reads a whole file sequentially and reports MiB/s
+ **/
+static int seqRead(const char *file, long kib) {
+	size_t chunk = kib * 1024;
+	long long total = 0;
+	char *buf = malloc(chunk);
+	ssize_t n;
+	int fd;
+	double t;
+
+	if(buf == NULL || (fd = open(file, O_RDONLY)) == -1) {
+		perror(file);
+		return 1;
+	}
+	t = now();
+	while((n = read(fd, buf, chunk)) > 0)
+		total += n;
+	if(n == -1) {
+		perror("read");
+		return 1;
+	}
+	t = now() - t;
+	close(fd);
+	printf("seqread: %lld B in %.3f s, %.1f MiB/s (%ld KiB reads)\n", total, t, total / t / (1024 * 1024), kib);
+	free(buf);
+	return 0;
+}
+
+/**
+ * @brief Reads blocks at random offsets of an existing file and reports reads/s and MiB/s
+ **/
+static int randRead(const char *file, long reads, long kib) {
+	size_t chunk = kib * 1024;
+	char *buf = malloc(chunk);
+	struct stat st;
+	long i, slots;
+	int fd;
+	double t;
+
+	if(buf == NULL || (fd = open(file, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		perror(file);
+		return 1;
+	}
+	if((slots = st.st_size / chunk) == 0) {
+		fprintf(stderr, "%s is smaller than a read\n", file);
+		return 1;
+	}
+	srand(getpid());
+	t = now();
+	for(i = 0; i < reads; i++) {
+		off_t off = (off_t)(((long long)rand() * RAND_MAX + rand()) % slots) * chunk;
+		if(pread(fd, buf, chunk, off) != chunk) {
+			perror("pread");
+			return 1;
+		}
+	}
+	t = now() - t;
+	close(fd);
+	printf("randread: %ld reads in %.3f s, %.0f reads/s, %.1f MiB/s (%ld KiB reads)\n", reads, t, reads / t, reads * (double)chunk / t / (1024 * 1024), kib);
+	free(buf);
+	return 0;
+}
+
+/**
+ * @brief Writes the same pseudo-random content (no two blocks alike) to several new files in dir. Reports
+ *        MiB/s, the mean and worst latency of the writes, and the time of the fsync that closes each copy
+ **/
+static int copies(const char *dir, long mib, long numCopies, long kib) {
+	size_t chunk = kib * 1024, size = mib * 1024L * 1024, i;
+	char *data = malloc(size), path[4096];
+	double t, w, worst = 0, writes = 0, syncs = 0;
+	long c, numWrites = 0;
+	unsigned long long x = 88172645463325252ULL;
+	int fd;
+
+	if(data == NULL || chunk == 0) {
+		fprintf(stderr, "Wrong sizes\n");
+		return 1;
+	}
+	for(i = 0; i + sizeof(x) <= size; i += sizeof(x)) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(data + i, &x, sizeof(x));
+	}
+	t = now();
+	for(c = 0; c < numCopies; c++) {
+		sprintf(path, "%s/copy%04ld", dir, c);
+		if((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) == -1) {
+			perror(path);
+			return 1;
+		}
+		for(i = 0; i < size; i += chunk) {
+			size_t n = (size - i < chunk) ? size - i : chunk;
+
+			w = now();
+			if(write(fd, data + i, n) != n) {
+				perror("write");
+				return 1;
+			}
+			w = now() - w;
+			writes += w;
+			worst = w > worst ? w : worst;
+			numWrites++;
+		}
+		w = now();
+		fsync(fd);
+		syncs += now() - w;
+		close(fd);
+	}
+	t = now() - t;
+	printf("copies: %ld x %ld MiB in %.3f s, %.1f MiB/s (%ld KiB writes)\n", numCopies, mib, t, numCopies * mib / t, kib);
+	printf("copies: write latency %.1f us mean, %.1f us worst; fsync %.1f ms mean\n",
+			writes * 1e6 / numWrites, worst * 1e6, syncs * 1e3 / numCopies);
+	free(data);
+	return 0;
+}
+
+static void entryName(char *path, const char *dir, long i, long perDir) {
+	if(perDir)
+		sprintf(path, "%s/d%06ld/e%08ld", dir, i / perDir, i);
+	else
+		sprintf(path, "%s/e%08ld", dir, i);
+}
+
+static void report(const char *phase, long ops, double t) {
+	printf("entries: %-8s %ld ops in %.3f s, %.0f ops/s, %.1f us/op\n", phase, ops, t, ops / t, t * 1e6 / ops);
+}
+
+/**
+ * @brief Creates empty files in dir (or in subdirectories of perDir entries each), then stats them
+ *        in random order, lists the directories and removes everything. Reports ops/s of each phase
+ **/
+static int dirEntries(const char *dir, long entries, long perDir) {
+	char path[4096];
+	struct stat st;
+	struct dirent *de;
+	long i, listed = 0;
+	double t;
+	int fd;
+
+	if(mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		perror(dir);
+		return 1;
+	}
+	t = now();
+	for(i = 0; i < entries; i++) {
+		if(perDir && i % perDir == 0) {
+			sprintf(path, "%s/d%06ld", dir, i / perDir);
+			if(mkdir(path, 0755) == -1) {
+				perror(path);
+				return 1;
+			}
+		}
+		entryName(path, dir, i, perDir);
+		if((fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644)) == -1) {
+			perror(path);
+			fprintf(stderr, "entries: stopped after %ld entries\n", i);
+			entries = i;
+			break;
+		}
+		close(fd);
+	}
+	report("create", entries, now() - t);
+	if(entries == 0)
+		return 1;
+
+	srand(getpid());
+	t = now();
+	for(i = 0; i < entries; i++) {
+		entryName(path, dir, ((long long)rand() * RAND_MAX + rand()) % entries, perDir);
+		if(stat(path, &st) == -1) {
+			perror(path);
+			return 1;
+		}
+	}
+	report("stat", entries, now() - t);
+
+	t = now();
+	for(i = 0; i < (perDir ? (entries + perDir - 1) / perDir : 1); i++) {
+		DIR *d;
+		if(perDir)
+			sprintf(path, "%s/d%06ld", dir, i);
+		else
+			strcpy(path, dir);
+		if((d = opendir(path)) == NULL) {
+			perror(path);
+			return 1;
+		}
+		while((de = readdir(d)) != NULL) {
+			if(de->d_name[0] != '.')
+				listed++;
+		}
+		closedir(d);
+	}
+	report("readdir", listed, now() - t);
+	if(listed != entries)
+		fprintf(stderr, "entries: readdir returned %ld entries instead of %ld\n", listed, entries);
+
+	t = now();
+	for(i = 0; i < entries; i++) {
+		entryName(path, dir, i, perDir);
+		if(unlink(path) == -1) {
+			perror(path);
+			return 1;
+		}
+		if(perDir && (i + 1 == entries || (i + 1) % perDir == 0)) {
+			sprintf(path, "%s/d%06ld", dir, i / perDir);
+			rmdir(path);
+		}
+	}
+	report("unlink", entries, now() - t);
+	rmdir(dir);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if(argc >= 4 && strcmp(argv[1], "seqwrite") == 0)
+		return seqWrite(argv[2], atol(argv[3]), argc > 4 ? atol(argv[4]) : 128);
+	if(argc >= 3 && strcmp(argv[1], "seqread") == 0)
+		return seqRead(argv[2], argc > 3 ? atol(argv[3]) : 128);
+	if(argc >= 4 && strcmp(argv[1], "randread") == 0)
+		return randRead(argv[2], atol(argv[3]), argc > 4 ? atol(argv[4]) : 4);
+	if(argc >= 5 && strcmp(argv[1], "copies") == 0)
+		return copies(argv[2], atol(argv[3]), atol(argv[4]), argc > 5 ? atol(argv[5]) : 128);
+	if(argc >= 4 && strcmp(argv[1], "entries") == 0)
+		return dirEntries(argv[2], atol(argv[3]), argc > 4 ? atol(argv[4]) : 0);
+
+	fprintf(stderr, USAGE, argv[0], argv[0], argv[0], argv[0], argv[0]);
+	return -1;
+}
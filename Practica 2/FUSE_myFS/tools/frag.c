@@ -0,0 +1,217 @@
+/**
+ * Fragmentation report of a myFS virtual disk (it can be run while mounted, after a sync):
+ *
+ *	myfs-frag [-v] <virtual-disk>
+ *
+ * For each file it prints its blocks and extents (runs of consecutive physical blocks), then
+ * a summary of the files and of the free space. Compressed clusters count the blocks they take on disk.
+ */
+#include "../src/myFS.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef char FileName[MAX_LEN_FILE_NAME + 1];
+
+typedef struct {
+	int fd;
+	FileName *names;		// Directories: the names of their entries are collected here (indexed by inode)
+	int numNodes;			// Inodes of the disk
+	long extents;			// Extents of the current file
+	long blocks;			// Blocks of the current file
+	long stored;			// Physical blocks that hold them (fewer when clusters are compressed)
+	long largest;			// Longest extent of the current file
+	long run;				// Length of the current extent
+	DISK_LBA last;			// Last physical block seen
+} Walk;
+
+static int readBlock(int fd, DISK_LBA lba, void *buf) {
+	if(pread(fd, buf, BLOCK_SIZE_BYTES, (off_t)lba * BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES) {
+		perror("pread");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Adds a physical block to the extents of the current file
+ **/
+static void extend(Walk *w, DISK_LBA lba) {
+	if(w->stored && lba == w->last + 1) {
+		w->run++;
+	}
+	else {
+		w->extents++;
+		w->run = 1;
+	}
+	if(w->run > w->largest)
+		w->largest = w->run;
+	w->last = lba;
+	w->stored++;
+}
+
+static void visit(Walk *w, DISK_LBA bf) {
+	int i;
+
+	w->blocks++;
+	// A compressed cluster is stored once, in the blocks counted with its first pointer
+	if(IS_COMPRESSED(bf)) {
+		if(COMPRESSED_INDEX(bf) == 0) {
+			for(i = 0; i < COMPRESSED_LEN(bf); i++)
+				extend(w, COMPRESSED_FIRST(bf) + i);
+		}
+		return;
+	}
+	if(w->names) {
+		DirPage page;
+
+		if(readBlock(w->fd, bf, &page) == 0 && page.type == DIR_PAGE_LEAF) {
+			for(i = 0; i < page.count && i < DIR_LEAF_ENTRIES; i++) {
+				if(page.entries[i].nodeIdx > 0 && page.entries[i].nodeIdx < w->numNodes)
+					strcpy(w->names[page.entries[i].nodeIdx], page.entries[i].name);
+			}
+		}
+	}
+	extend(w, bf);
+}
+
+/**
+ * @brief Visits in logical order the data blocks under a table of the given depth (0: pointers to data)
+ **/
+static int walkTable(Walk *w, DISK_LBA table, int depth, long *left) {
+	IBlockStruct ind;
+	int i;
+
+	if(table < 1 || readBlock(w->fd, table, &ind))
+		return -1;
+	for(i = 0; i < PUNTEROS_POR_BLOQUE && *left > 0; i++) {
+		if(depth == 0) {
+			visit(w, ind.table[i]);
+			(*left)--;
+		}
+		else if(walkTable(w, ind.table[i], depth - 1, left)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int walkNode(Walk *w, NodeStruct *node) {
+	long left = node->numBlocks;
+	int i;
+
+	for(i = 0; i < NDIRECTOS && left > 0; i++, left--)
+		visit(w, node->blocks[i]);
+	for(i = 0; i < NIVELES_INDIRECCION && left > 0; i++) {
+		if(walkTable(w, node->indirecto[i], i, &left))
+			return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	SuperBlockStruct sb;
+	FileName *names;
+	uint64_t *bitMap;
+	NodeStruct *nodes;
+	char block[BLOCK_SIZE_BYTES];
+	int verbose = 0, fd, i, numNodes;
+	DISK_LBA lba;
+	long files = 0, fragmented = 0, totalBlocks = 0, totalStored = 0, totalExtents = 0;
+	long freeRuns = 0, freeBlocks = 0, largestFree = 0, run = 0;
+
+	if(argc > 1 && strcmp(argv[1], "-v") == 0) {
+		verbose = 1;
+		argv++;
+		argc--;
+	}
+	if(argc != 2) {
+		fprintf(stderr, "Usage: %s [-v] <virtual-disk>\n", argv[0]);
+		return -1;
+	}
+	if((fd = open(argv[1], O_RDONLY)) == -1) {
+		perror(argv[1]);
+		return -1;
+	}
+
+	if(readBlock(fd, SUPERBLOCK_IDX, block))
+		return -1;
+	memcpy(&sb, block, sizeof(sb));
+	// The bit map takes as many blocks as the super block says
+	if(sb.numBitmapBlocks < 1 || sb.diskSizeInBlocks > (DISK_LBA)sb.numBitmapBlocks * BITS_PER_BITMAP_BLOCK ||
+	   (bitMap = malloc((size_t)sb.numBitmapBlocks * BLOCK_SIZE_BYTES)) == NULL) {
+		fprintf(stderr, "Wrong size of the bit map: %d blocks\n", sb.numBitmapBlocks);
+		return -1;
+	}
+	for(i = 0; i < sb.numBitmapBlocks; i++) {
+		if(readBlock(fd, BITMAP_IDX + i, &bitMap[i * BITMAP_WORDS_PER_BLOCK]))
+			return -1;
+	}
+	// The inode table is as long as the super block says
+	numNodes = sb.numNodeBlocks * NODES_PER_BLOCK;
+	if(sb.numNodeBlocks < 1 || numNodes > MAX_NODES ||
+	   (nodes = malloc(sb.numNodeBlocks * BLOCK_SIZE_BYTES)) == NULL || (names = calloc(numNodes, sizeof(FileName))) == NULL) {
+		fprintf(stderr, "Wrong size of the inode table: %d blocks\n", sb.numNodeBlocks);
+		return -1;
+	}
+	for(i = 0; i < sb.numNodeBlocks; i++) {
+		if(readBlock(fd, sb.nodesIdx + i, &nodes[i * NODES_PER_BLOCK]))
+			return -1;
+	}
+
+	// Names come from the leaves of the directories
+	strcpy(names[ROOT_NODE], "/");
+	for(i = 0; i < numNodes; i++) {
+		Walk w = { fd, names, numNodes, 0, 0, 0, 0, 0, -1 };
+
+		if(!nodes[i].freeNode && nodes[i].nodeType == NODE_DIRECTORY)
+			walkNode(&w, &nodes[i]);
+	}
+
+	if(verbose)
+		printf("%-6s %-16s %12s %8s %8s %8s %8s\n", "INODE", "NAME", "SIZE", "BLOCKS", "STORED", "EXTENTS", "LARGEST");
+	for(i = 0; i < numNodes; i++) {
+		Walk w = { fd, NULL, numNodes, 0, 0, 0, 0, 0, -1 };
+		NodeStruct *node = &nodes[i];
+
+		if(node->freeNode)
+			continue;
+		if(walkNode(&w, node)) {
+			fprintf(stderr, "%d (%s): broken block map\n", i, names[i]);
+			continue;
+		}
+		files++;
+		totalBlocks += w.blocks;
+		totalStored += w.stored;
+		totalExtents += w.extents;
+		if(w.extents > 1)
+			fragmented++;
+		if(verbose)
+			printf("%-6d %-16s %12lld %8ld %8ld %8ld %8ld\n", i, names[i], (long long)node->fileSize, w.blocks, w.stored, w.extents, w.largest);
+	}
+
+	for(lba = sb.firstDataBlock; lba <= sb.diskSizeInBlocks; lba++) {
+		if(lba < sb.diskSizeInBlocks && !((bitMap[lba / 64] >> (lba % 64)) & 1)) {
+			run++;
+			freeBlocks++;
+			continue;
+		}
+		if(run) {
+			freeRuns++;
+			if(run > largestFree)
+				largestFree = run;
+		}
+		run = 0;
+	}
+
+	printf("%ld files and directories, %ld fragmented (%.1f%%)\n", files, fragmented, files ? 100.0 * fragmented / files : 0.0);
+	printf("%ld data blocks in %ld extents, %.1f blocks per extent\n", totalStored, totalExtents, totalExtents ? (double)totalStored / totalExtents : 0.0);
+	if(totalStored != totalBlocks)
+		printf("%ld blocks of data stored in %ld blocks (%.2fx compression)\n", totalBlocks, totalStored, totalStored ? (double)totalBlocks / totalStored : 0.0);
+	printf("%ld free blocks in %ld runs, largest run %ld blocks\n", freeBlocks, freeRuns, largestFree);
+	free(bitMap);
+	free(nodes);
+	free(names);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,710 @@
+/**
+ * Consistency check of a myFS virtual disk (unmounted, or mounted after a sync for a read only check):
+ *
+ *	myfs-fsck [-r] [-v] [-j threads] <virtual-disk>
+ *
+ * The metadata regions (super block, bit map, inode bitmap, inode table, reference counts and checksums) are read with a single
+ * pread. Then the inodes are shared out among the threads, which walk their block maps and directory pages
+ * marking every block they reach. The checksums of every block read are verified (the data of the files is
+ * left to the scrubber of the FS). At the end the blocks reached are compared with the bit map:
+ *  - orphaned blocks: in use in the bit map, but no inode has them
+ *  - double-allocated blocks: reached from two places
+ *  - lost blocks: reached from an inode, but free in the bit map
+ * A block reached from several pointers is not double-allocated if the reference counts say it is shared; every
+ * block must be reached exactly one time more than its reference count. A shared table counts once for the blocks
+ * below it, so they are only walked the first time it is reached.
+ * The snapshots are walked after the inodes of the FS: first the inode table of each one (a file that only the super
+ * block knows of), then the inodes it holds. Their problems are reported but never repaired, and their directories
+ * count no links.
+ * The blocks of a compressed cluster are reached from the pointer of its first block (a double-allocated one is
+ * not repaired). With -r the orphaned and lost blocks are fixed in the bit map, the double-allocated data blocks are copied
+ * to a free block for their second owner, the reference counts are set to the pointers found and the free blocks of the
+ * super block are recounted. The checksums
+ * of the metadata that did not match (as after a crash) are computed again and those of the free blocks dropped.
+ *
+ * Exit status: 0 if the disk is consistent, 1 if every problem was repaired, 4 if some problem is left.
+ */
+#include "../src/myFS.h"
+#include "../src/checksum.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+#define MAX_REPORTED 50		// Problems printed without -v
+
+#define CLAIM_DATA 0		// A data block: a second owner gets a copy
+#define CLAIM_TABLE 1		// An indirect table (its blocks belong to the first owner)
+#define CLAIM_COMPRESSED 2	// A block of a compressed cluster (the cluster would have to be copied as a whole)
+
+static const char *claimNames[] = { "block", "table", "compressed block" };
+
+// A block reached from a second place: an entry of a table, or a pointer of the inode when table is 0
+typedef struct {
+	int nodeIdx;
+	DISK_LBA table;			// Table holding the pointer, 0 for the pointers of the inode
+	int slot;				// Entry of the table, or index of blocks[] (indirecto[] for a table if table is 0)
+	DISK_LBA lba;			// Block reached
+	int kind;				// CLAIM_DATA, CLAIM_TABLE or CLAIM_COMPRESSED
+} Claim;
+
+typedef struct {
+	int fd;
+	SuperBlockStruct sb;
+	char *metadata;				// Every block before the data as read from the disk
+	uint64_t *bitMap;			// Inside metadata
+	uint64_t *nodeBitMap;		// Inside metadata
+	NodeStruct *nodes;			// Inside metadata
+	NodeStruct *walkNodes;		// Inodes being walked by the threads: nodes, or the inode table of a snapshot
+	int walkCount;				// Inodes in walkNodes
+	int walkSnap;				// Snapshot being walked, -1 for the FS itself
+	char where[MAX_LEN_FILE_NAME + 32];	// Printed before each problem, names the snapshot being walked
+	uint32_t *refCounts;		// Inside metadata
+	uint32_t *checksums;		// Inside metadata, the ones that did not match are set right as they are found
+	int numNodes;
+	uint64_t *seen;				// Blocks reached from the inodes, set with atomic operations
+	uint32_t *refs;				// Pointers of files to each data block accepted, counted with atomic operations
+	int *links;					// Directory entries leading to each inode
+	BOOLEAN *nodeDirty;			// Inodes changed by the repair
+	int nextNode;				// Next inode of walkNodes to be checked by a thread
+	pthread_mutex_t lock;		// Everything below
+	Claim *claims;				// Double-allocated blocks
+	int numClaims, maxClaims;
+	long problems;				// Problems found
+	long repairable;			// Problems -r knows how to fix
+	BOOLEAN verbose;
+} Check;
+
+static Check check;
+
+/**
+ * @brief Prints a problem and counts it. Only the first MAX_REPORTED ones are printed without -v
+ **/
+static void problem(BOOLEAN repairable, const char *fmt, ...) {
+	va_list ap;
+
+	pthread_mutex_lock(&check.lock);
+	if(check.verbose || check.problems < MAX_REPORTED) {
+		va_start(ap, fmt);
+		printf("%s", check.where);
+		vprintf(fmt, ap);
+		va_end(ap);
+	}
+	else if(check.problems == MAX_REPORTED) {
+		printf("... (-v prints every problem)\n");
+	}
+	check.problems++;
+	if(repairable)
+		check.repairable++;
+	pthread_mutex_unlock(&check.lock);
+}
+
+static int readBlock(DISK_LBA lba, void *buf) {
+	if(pread(check.fd, buf, BLOCK_SIZE_BYTES, (off_t)lba * BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES) {
+		perror("pread");
+		return -1;
+	}
+	return 0;
+}
+
+static uint32_t blockChecksum(const void *buf) {
+	return BLOCK_CHECKSUM(crc32c(0, buf, BLOCK_SIZE_BYTES));
+}
+
+/**
+ * @brief Verifies a block read against its checksum. The caller is the only one with that block
+ **/
+static void verifyBlock(DISK_LBA lba, const void *buf, const char *what) {
+	uint32_t sum = blockChecksum(buf);
+
+	if(check.checksums[lba] == NO_CHECKSUM || check.checksums[lba] == sum)
+		return;
+	problem(true, "Block %" PRId64 " (%s) does not match its checksum\n", lba, what);
+	check.checksums[lba] = sum;
+}
+
+static int writeBlock(DISK_LBA lba, const void *buf) {
+	if(pwrite(check.fd, buf, BLOCK_SIZE_BYTES, (off_t)lba * BLOCK_SIZE_BYTES) != BLOCK_SIZE_BYTES) {
+		perror("pwrite");
+		return -1;
+	}
+	return 0;
+}
+
+static BOOLEAN isSet(uint64_t *map, DISK_LBA lba) {
+	return (map[lba / 64] >> (lba % 64)) & 1;
+}
+
+/**
+ * @brief Marks a block as reached from a pointer. Returns 0 if its content has to be checked, -1 if the
+ * 	 pointer is wrong or the block was already reached from somewhere else (a shared block included)
+ **/
+static int claim(int nodeIdx, DISK_LBA table, int slot, DISK_LBA lba, int kind) {
+	uint64_t bit = UINT64_C(1) << (lba % 64);
+
+	if(lba < check.sb.firstDataBlock || lba >= check.sb.diskSizeInBlocks) {
+		problem(false, "Inode %d: %s %" PRId64 " out of the data blocks\n", nodeIdx, claimNames[kind], lba);
+		return -1;
+	}
+	if(!(__atomic_fetch_or(&check.seen[lba / 64], bit, __ATOMIC_RELAXED) & bit)) {
+		__atomic_add_fetch(&check.refs[lba], 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if(check.refCounts[lba] != 0) {
+		__atomic_add_fetch(&check.refs[lba], 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	// Only data blocks of the FS are repaired: a table would drag its blocks along, a snapshot is never written
+	problem(kind == CLAIM_DATA && check.walkSnap < 0, "Inode %d: %s %" PRId64 " is double-allocated\n", nodeIdx,
+			claimNames[kind], lba);
+	if(check.walkSnap >= 0)
+		return -1;
+	pthread_mutex_lock(&check.lock);
+	if(check.numClaims == check.maxClaims) {
+		check.maxClaims = check.maxClaims ? 2 * check.maxClaims : 64;
+		check.claims = realloc(check.claims, check.maxClaims * sizeof(Claim));
+	}
+	if(check.claims)
+		check.claims[check.numClaims++] = (Claim){ nodeIdx, table, slot, lba, kind };
+	pthread_mutex_unlock(&check.lock);
+	return -1;
+}
+
+/**
+ * @brief Checks a page of a directory, counting the links of the inodes of its entries (only those of the FS)
+ **/
+static void checkPage(int nodeIdx, DISK_LBA lba) {
+	DirPage page;
+	int i;
+
+	if(readBlock(lba, &page))
+		return;
+	verifyBlock(lba, &page, "directory page");
+	if(page.type == DIR_PAGE_INTERNAL) {
+		if(page.count < 1 || page.count > DIR_INTERNAL_KEYS)
+			problem(false, "Directory %d: wrong internal page in block %" PRId64 "\n", nodeIdx, lba);
+		return;
+	}
+	if(page.type != DIR_PAGE_LEAF || page.count < 0 || page.count > DIR_LEAF_ENTRIES) {
+		problem(false, "Directory %d: wrong page in block %" PRId64 "\n", nodeIdx, lba);
+		return;
+	}
+	for(i = 0; i < page.count; i++) {
+		int child = page.entries[i].nodeIdx;
+
+		if(child <= ROOT_NODE || child >= check.walkCount || check.walkNodes[child].freeNode) {
+			problem(false, "Directory %d: entry %.*s leads to inode %d, not in use\n", nodeIdx, MAX_LEN_FILE_NAME,
+					page.entries[i].name, child);
+			continue;
+		}
+		if(check.walkSnap < 0)
+			__atomic_add_fetch(&check.links[child], 1, __ATOMIC_RELAXED);
+		if(i > 0 && strncmp(page.entries[i - 1].name, page.entries[i].name, MAX_LEN_FILE_NAME + 1) >= 0)
+			problem(false, "Directory %d: entries out of order in block %" PRId64 "\n", nodeIdx, lba);
+	}
+}
+
+/**
+ * @brief Checks the pointer of the logical block bl of a file. A compressed cluster is claimed from the pointer of
+ * 	 its first block, the pointers of the rest must lead to the same cluster
+ **/
+static void checkData(int nodeIdx, DISK_LBA table, int slot, long bl, DISK_LBA lba) {
+	static __thread DISK_LBA cluster;
+	NodeStruct *node = &check.walkNodes[nodeIdx];
+	int i;
+
+	if(IS_COMPRESSED(lba)) {
+		if(node->nodeType != NODE_FILE || !(node->flags & NODE_COMPRESSED) || COMPRESSED_LEN(lba) < 1 ||
+		   COMPRESSED_INDEX(lba) != bl % COMPRESS_CLUSTER || (COMPRESSED_INDEX(lba) && lba != cluster + COMPRESSED_INDEX(lba))) {
+			problem(false, "Inode %d: wrong compressed pointer %" PRIx64 " for block %ld\n", nodeIdx, lba, bl);
+			return;
+		}
+		if(COMPRESSED_INDEX(lba) == 0) {
+			cluster = lba;
+			for(i = 0; i < COMPRESSED_LEN(lba); i++)
+				claim(nodeIdx, table, slot, COMPRESSED_FIRST(lba) + i, CLAIM_COMPRESSED);
+		}
+		return;
+	}
+	if(claim(nodeIdx, table, slot, lba, CLAIM_DATA) == 0 && node->nodeType == NODE_DIRECTORY)
+		checkPage(nodeIdx, lba);
+}
+
+/**
+ * @brief Walks the blocks under a table of the given depth (0: pointers to data), the table already claimed
+ **/
+static void walkTable(int nodeIdx, DISK_LBA table, int depth, long *left) {
+	long bl = check.walkNodes[nodeIdx].numBlocks - *left;
+	IBlockStruct ind;
+	long span = 1;
+	int i, d;
+
+	for(d = 0; d < depth; d++)
+		span *= PUNTEROS_POR_BLOQUE;
+	if(readBlock(table, &ind)) {
+		*left -= span * PUNTEROS_POR_BLOQUE;
+		return;
+	}
+	verifyBlock(table, &ind, "indirect table");
+	for(i = 0; i < PUNTEROS_POR_BLOQUE && *left > 0; i++) {
+		if(depth == 0) {
+			checkData(nodeIdx, table, i, bl + i, ind.table[i]);
+			(*left)--;
+		}
+		else if(claim(nodeIdx, table, i, ind.table[i], CLAIM_TABLE) == 0) {
+			walkTable(nodeIdx, ind.table[i], depth - 1, left);
+		}
+		else {
+			*left -= span;
+		}
+	}
+}
+
+/**
+ * @brief Checks an inode against the inode bitmap (a snapshot has none), then walks its blocks
+ **/
+static void checkNode(int nodeIdx) {
+	NodeStruct *node = &check.walkNodes[nodeIdx];
+	BOOLEAN used = check.walkSnap < 0 ? isSet(check.nodeBitMap, nodeIdx) : !node->freeNode;
+	long left, span = PUNTEROS_POR_BLOQUE;
+	int i;
+
+	if(node->freeNode == used) {
+		problem(false, "Inode %d is %s but the inode bitmap says otherwise\n", nodeIdx, used ? "free" : "in use");
+		return;
+	}
+	if(!used)
+		return;
+	if(node->nodeType != NODE_FILE && node->nodeType != NODE_DIRECTORY) {
+		problem(false, "Inode %d: unknown type %d\n", nodeIdx, node->nodeType);
+		return;
+	}
+	if(node->numBlocks == 0) {
+		if(node->nodeType != NODE_FILE || node->fileSize < 0 || node->fileSize > NODE_INLINE_BYTES)
+			problem(false, "Inode %d: no blocks for %" PRId64 " B\n", nodeIdx, node->fileSize);
+		return;
+	}
+	if(node->numBlocks < 0 || node->numBlocks > MAX_BLOCKS_PER_FILE ||
+	   node->numBlocks != (node->fileSize + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES) {
+		problem(false, "Inode %d: %d blocks for %" PRId64 " B\n", nodeIdx, node->numBlocks, node->fileSize);
+		return;
+	}
+
+	left = node->numBlocks;
+	for(i = 0; i < NDIRECTOS && left > 0; i++, left--)
+		checkData(nodeIdx, 0, i, i, node->blocks[i]);
+	for(i = 0; i < NIVELES_INDIRECCION; i++, span *= PUNTEROS_POR_BLOQUE) {
+		if(left <= 0) {
+			// Truncating a file frees the tables it no longer needs
+			if(node->indirecto[i] > 0)
+				problem(check.walkSnap < 0, "Inode %d: table %" PRId64 " past the end of the file\n", nodeIdx, node->indirecto[i]);
+			continue;
+		}
+		if(claim(nodeIdx, 0, i, node->indirecto[i], CLAIM_TABLE) == 0)
+			walkTable(nodeIdx, node->indirecto[i], i, &left);
+		else
+			left -= span;
+	}
+}
+
+static void *worker(void *arg) {
+	int first, i;
+
+	// Chunks of inodes handed out in order, so the threads stay busy with files of any size
+	while((first = __atomic_fetch_add(&check.nextNode, 64, __ATOMIC_RELAXED)) < check.walkCount) {
+		for(i = first; i < first + 64 && i < check.walkCount; i++)
+			checkNode(i);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Walks count inodes with the threads
+ **/
+static void walkNodes(NodeStruct *nodes, int count, pthread_t *threads, int numThreads) {
+	int i;
+
+	check.walkNodes = nodes;
+	check.walkCount = count;
+	check.nextNode = 0;
+	for(i = 0; i < numThreads; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	for(i = 0; i < numThreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/**
+ * @brief Block of a file holding its logical block bl, read through its tables (already checked). Returns 0 if
+ * 	 it cannot be read
+ **/
+static DISK_LBA mapBlock(NodeStruct *node, long bl) {
+	IBlockStruct ind;
+	DISK_LBA lba;
+	long span = PUNTEROS_POR_BLOQUE;
+	int level, d;
+
+	if(bl < NDIRECTOS)
+		return node->blocks[bl];
+	for(bl -= NDIRECTOS, level = 0; bl >= span; bl -= span, span *= PUNTEROS_POR_BLOQUE)
+		level++;
+	for(lba = node->indirecto[level], d = level; d >= 0; d--, span /= PUNTEROS_POR_BLOQUE) {
+		if(lba < check.sb.firstDataBlock || lba >= check.sb.diskSizeInBlocks || readBlock(lba, &ind))
+			return 0;
+		lba = ind.table[bl / (span / PUNTEROS_POR_BLOQUE)];
+		bl %= span / PUNTEROS_POR_BLOQUE;
+	}
+	return lba;
+}
+
+/**
+ * @brief Walks the inode table of a snapshot, then the inodes it holds. The problems are not repaired
+ **/
+static void checkSnapshot(int snap, pthread_t *threads, int numThreads) {
+	SnapshotStruct *s = &check.sb.snapshots[snap];
+	size_t size = (size_t)check.sb.numNodeBlocks * BLOCK_SIZE_BYTES;
+	NodeStruct *nodes;
+	DISK_LBA lba;
+	long problems = check.problems;
+	int bl;
+
+	check.walkSnap = snap;
+	snprintf(check.where, sizeof(check.where), "Snapshot %.*s, inode table: ", MAX_LEN_FILE_NAME, s->name);
+	if(s->nodes.numBlocks != check.sb.numNodeBlocks) {
+		problem(false, "%d blocks for %d of inodes\n", s->nodes.numBlocks, check.sb.numNodeBlocks);
+		return;
+	}
+	walkNodes(&s->nodes, 1, threads, 1);
+	if(check.problems != problems || (nodes = malloc(size)) == NULL)
+		return;
+
+	for(bl = 0; bl < check.sb.numNodeBlocks; bl++) {
+		char *block = (char *)nodes + (size_t)bl * BLOCK_SIZE_BYTES;
+
+		if((lba = mapBlock(&s->nodes, bl)) == 0 || readBlock(lba, block)) {
+			problem(false, "Block %d cannot be read\n", bl);
+			free(nodes);
+			return;
+		}
+		verifyBlock(lba, block, "inode table of a snapshot");
+	}
+	snprintf(check.where, sizeof(check.where), "Snapshot %.*s: ", MAX_LEN_FILE_NAME, s->name);
+	walkNodes(nodes, check.numNodes, threads, numThreads);
+	if(nodes[ROOT_NODE].freeNode || nodes[ROOT_NODE].nodeType != NODE_DIRECTORY)
+		problem(false, "The root directory is missing\n");
+	free(nodes);
+}
+
+/**
+ * @brief Reads and checks the super block, then the whole metadata with a single pread
+ **/
+static int readMetadata(void) {
+	SuperBlockStruct *sb = &check.sb;
+	char block[BLOCK_SIZE_BYTES];
+	DISK_LBA lba;
+	size_t size;
+
+	if(readBlock(SUPERBLOCK_IDX, block))
+		return -1;
+	memcpy(sb, block, sizeof(SuperBlockStruct));
+	if(sb->blockSize != BLOCK_SIZE_BYTES || sb->maxLenFileName != MAX_LEN_FILE_NAME || sb->maxBlocksPerFile != MAX_BLOCKS_PER_FILE) {
+		fprintf(stderr, "Disk formatted with another layout\n");
+		return -1;
+	}
+	if(sb->diskSizeInBlocks < 1 || sb->diskSizeInBlocks > MAX_DISK_BLOCKS ||
+	   sb->numNodeBlocks < 1 || sb->numNodeBlocks > MAX_NODES / NODES_PER_BLOCK ||
+	   sb->numBitmapBlocks != (sb->diskSizeInBlocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK ||
+	   sb->numChecksumBlocks != (sb->diskSizeInBlocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK ||
+	   sb->nodeBitmapIdx != BITMAP_IDX + sb->numBitmapBlocks || sb->nodesIdx != sb->nodeBitmapIdx + NODE_BITMAP_BLOCKS(sb) ||
+	   sb->numRefCountBlocks != (sb->diskSizeInBlocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK ||
+	   sb->refCountIdx != sb->nodesIdx + sb->numNodeBlocks || sb->checksumIdx != sb->refCountIdx + sb->numRefCountBlocks ||
+	   sb->firstDataBlock != sb->checksumIdx + sb->numChecksumBlocks ||
+	   sb->diskSizeInBlocks <= sb->firstDataBlock) {
+		fprintf(stderr, "Wrong layout in the super block\n");
+		return -1;
+	}
+
+	size = (size_t)sb->firstDataBlock * BLOCK_SIZE_BYTES;
+	if(posix_memalign((void **)&check.metadata, BLOCK_SIZE_BYTES, size) ||
+	   (check.seen = calloc(sb->numBitmapBlocks, BLOCK_SIZE_BYTES)) == NULL ||
+	   (check.refs = calloc(sb->diskSizeInBlocks, sizeof(uint32_t))) == NULL) {
+		perror("Error allocating the metadata");
+		return -1;
+	}
+	if(pread(check.fd, check.metadata, size, SUPERBLOCK_IDX * BLOCK_SIZE_BYTES) != size) {
+		perror("Failed to read the metadata");
+		return -1;
+	}
+	check.bitMap = (uint64_t *)(check.metadata + (size_t)BITMAP_IDX * BLOCK_SIZE_BYTES);
+	check.nodeBitMap = (uint64_t *)(check.metadata + (size_t)sb->nodeBitmapIdx * BLOCK_SIZE_BYTES);
+	check.nodes = (NodeStruct *)(check.metadata + (size_t)sb->nodesIdx * BLOCK_SIZE_BYTES);
+	check.refCounts = (uint32_t *)(check.metadata + (size_t)sb->refCountIdx * BLOCK_SIZE_BYTES);
+	check.checksums = (uint32_t *)(check.metadata + (size_t)sb->checksumIdx * BLOCK_SIZE_BYTES);
+	check.numNodes = sb->numNodeBlocks * NODES_PER_BLOCK;
+	check.walkSnap = -1;
+	for(lba = SUPERBLOCK_IDX; lba < sb->checksumIdx; lba++)
+		verifyBlock(lba, check.metadata + (size_t)lba * BLOCK_SIZE_BYTES, "metadata");
+	if((check.links = calloc(check.numNodes, sizeof(int))) == NULL ||
+	   (check.nodeDirty = calloc(check.numNodes, sizeof(BOOLEAN))) == NULL) {
+		perror("Error allocating the inode state");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Compares the blocks reached with the bit map, a word at a time. Returns the free data blocks
+ **/
+static DISK_LBA checkBitmap(void) {
+	DISK_LBA lba, start, end = (DISK_LBA)check.sb.numBitmapBlocks * BITS_PER_BITMAP_BLOCK, free = 0;
+	BOOLEAN used;
+
+	// The metadata and the bits past the end of the disk
+	for(lba = 0; lba < end; lba = lba + 1 == check.sb.firstDataBlock ? check.sb.diskSizeInBlocks : lba + 1) {
+		if(!isSet(check.bitMap, lba))
+			problem(true, "Block %" PRId64 " is metadata but free in the bit map\n", lba);
+	}
+
+	// Runs of data blocks where the bit map and the blocks reached differ
+	for(lba = check.sb.firstDataBlock; lba < check.sb.diskSizeInBlocks; ) {
+		if(lba % 64 == 0 && lba + 64 <= check.sb.diskSizeInBlocks && check.bitMap[lba / 64] == check.seen[lba / 64]) {
+			free += 64 - __builtin_popcountll(check.seen[lba / 64]);
+			lba += 64;
+			continue;
+		}
+		if(isSet(check.bitMap, lba) == isSet(check.seen, lba)) {
+			free += !isSet(check.seen, lba);
+			lba++;
+			continue;
+		}
+		used = isSet(check.bitMap, lba);
+		for(start = lba; lba < check.sb.diskSizeInBlocks && isSet(check.bitMap, lba) == used && isSet(check.seen, lba) != used; lba++)
+			free += used;
+		problem(true, "Blocks %" PRId64 "-%" PRId64 " are %s\n", start, lba - 1,
+				used ? "orphaned: in use in the bit map, but no inode has them" : "lost: an inode has them, but they are free in the bit map");
+	}
+	return free;
+}
+
+/**
+ * @brief Compares the pointers found to each block with the reference counts, fixing the counts in memory.
+ * 	 Returns the sum of the counts found
+ **/
+static DISK_LBA checkRefCounts(void) {
+	DISK_LBA lba, sum = 0;
+	uint32_t found;
+
+	for(lba = 0; lba < check.sb.diskSizeInBlocks; lba++) {
+		found = check.refs[lba] ? check.refs[lba] - 1 : 0;
+		sum += found;
+		if(check.refCounts[lba] == found)
+			continue;
+		problem(true, "Block %" PRId64 " has %" PRIu32 " extra references, the reference counts say %" PRIu32 "\n",
+				lba, found, check.refCounts[lba]);
+		check.refCounts[lba] = found;
+	}
+	return sum;
+}
+
+/**
+ * @brief Gives a free block (by the blocks reached) to the second owner of each double-allocated data block,
+ * 	 with a copy of its content. Returns the number of blocks repaired
+ **/
+static int cloneClaims(DISK_LBA *free) {
+	DISK_LBA next = check.sb.firstDataBlock, table = 0;
+	IBlockStruct ind;
+	char data[BLOCK_SIZE_BYTES];
+	int i, fixed = 0;
+
+	for(i = 0; i < check.numClaims; i++) {
+		Claim *c = &check.claims[i];
+
+		if(c->kind != CLAIM_DATA)
+			continue;
+		while(next < check.sb.diskSizeInBlocks && isSet(check.seen, next))
+			next++;
+		if(next == check.sb.diskSizeInBlocks) {
+			fprintf(stderr, "No free block to repair block %" PRId64 " of inode %d\n", c->lba, c->nodeIdx);
+			break;
+		}
+		// The copy keeps the checksum of the original, right or wrong
+		if(readBlock(c->lba, data) || writeBlock(next, data))
+			continue;
+		check.checksums[next] = check.checksums[c->lba];
+		if(c->table == 0) {
+			check.nodes[c->nodeIdx].blocks[c->slot] = next;
+			check.nodeDirty[c->nodeIdx] = true;
+		}
+		else {
+			if(c->table != table && readBlock(c->table, &ind))
+				continue;
+			table = c->table;
+			ind.table[c->slot] = next;
+			if(writeBlock(table, &ind))
+				continue;
+			check.checksums[table] = blockChecksum(&ind);
+		}
+		check.seen[next / 64] |= UINT64_C(1) << (next % 64);
+		(*free)--;
+		fixed++;
+	}
+	return fixed;
+}
+
+/**
+ * @brief Makes the metadata match what was found: tables past the end of the files dropped, the bit map
+ * 	 rebuilt from the blocks reached, the reference counts written as found, the free blocks and the references recounted and the checksums
+ * 	 of the metadata computed again. Returns the number of problems left
+ **/
+static long repair(DISK_LBA free, DISK_LBA refs) {
+	SuperBlockStruct *sb = &check.sb;
+	long left = check.problems - check.repairable;
+	size_t w, numWords = (size_t)sb->numBitmapBlocks * BITMAP_WORDS_PER_BLOCK;
+	DISK_LBA lba;
+	int i, b, level;
+
+	// The data blocks that could not be copied are left double-allocated
+	for(i = 0; i < check.numClaims; i++)
+		left += check.claims[i].kind == CLAIM_DATA;
+	left -= cloneClaims(&free);
+
+	// Tables past the end of the files: their blocks were never reached, so they become free
+	for(i = 0; i < check.numNodes; i++) {
+		NodeStruct *node = &check.nodes[i];
+		long need = node->numBlocks - NDIRECTOS, span = PUNTEROS_POR_BLOQUE;
+
+		if(node->freeNode || node->numBlocks == 0)
+			continue;
+		for(level = 0; level < NIVELES_INDIRECCION; level++, need -= span, span *= PUNTEROS_POR_BLOQUE) {
+			if(need <= 0 && node->indirecto[level] > 0) {
+				node->indirecto[level] = -1;
+				check.nodeDirty[i] = true;
+			}
+		}
+		if(check.nodeDirty[i] && pwrite(check.fd, node, sizeof(NodeStruct),
+				(off_t)sb->nodesIdx * BLOCK_SIZE_BYTES + (off_t)i * sizeof(NodeStruct)) != sizeof(NodeStruct)) {
+			perror("Failed to write an inode");
+			return left + 1;
+		}
+	}
+
+	// Nothing to verify in the free blocks
+	for(lba = sb->firstDataBlock; lba < sb->diskSizeInBlocks; lba++) {
+		if(!isSet(check.seen, lba))
+			check.checksums[lba] = NO_CHECKSUM;
+	}
+
+	// The bit map gets the blocks reached, the metadata and the bits past the end of the disk
+	for(w = 0; w < numWords; w++) {
+		DISK_LBA base = (DISK_LBA)w * 64;
+		uint64_t forced = 0;
+
+		if(base < sb->firstDataBlock || base + 64 > sb->diskSizeInBlocks) {
+			for(b = 0; b < 64; b++) {
+				if(base + b < sb->firstDataBlock || base + b >= sb->diskSizeInBlocks)
+					forced |= UINT64_C(1) << b;
+			}
+		}
+		check.bitMap[w] = check.seen[w] | forced;
+	}
+	sb->numOfFreeBlocks = free;
+	sb->sharedRefs = refs;
+	// The free blocks may hold data: the next mount punches them
+	sb->clean = false;
+	memcpy(check.metadata, sb, sizeof(SuperBlockStruct));
+
+	// The metadata in memory is now what the disk holds (the inodes were written one by one)
+	for(lba = SUPERBLOCK_IDX; lba < sb->checksumIdx; lba++)
+		check.checksums[lba] = blockChecksum(check.metadata + (size_t)lba * BLOCK_SIZE_BYTES);
+	if(pwrite(check.fd, check.bitMap, (size_t)sb->numBitmapBlocks * BLOCK_SIZE_BYTES, BITMAP_IDX * BLOCK_SIZE_BYTES) !=
+	   (ssize_t)sb->numBitmapBlocks * BLOCK_SIZE_BYTES || writeBlock(SUPERBLOCK_IDX, check.metadata) ||
+	   pwrite(check.fd, check.refCounts, (size_t)sb->numRefCountBlocks * BLOCK_SIZE_BYTES, (off_t)sb->refCountIdx * BLOCK_SIZE_BYTES) !=
+	   (ssize_t)sb->numRefCountBlocks * BLOCK_SIZE_BYTES ||
+	   pwrite(check.fd, check.checksums, (size_t)sb->numChecksumBlocks * BLOCK_SIZE_BYTES, (off_t)sb->checksumIdx * BLOCK_SIZE_BYTES) !=
+	   (ssize_t)sb->numChecksumBlocks * BLOCK_SIZE_BYTES || fdatasync(check.fd) == -1) {
+		perror("Failed to write the bit map and the reference counts");
+		return left + 1;
+	}
+	return left;
+}
+
+int main(int argc, char **argv) {
+	int opt, i, numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	BOOLEAN repairIt = false;
+	pthread_t *threads;
+	struct timespec start, end;
+	DISK_LBA free, refs;
+	long left;
+
+	while((opt = getopt(argc, argv, "rvj:")) != -1) {
+		switch(opt) {
+			case 'r':
+				repairIt = true;
+				break;
+			case 'v':
+				check.verbose = true;
+				break;
+			case 'j':
+				numThreads = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-r] [-v] [-j threads] <virtual-disk>\n", argv[0]);
+				return 8;
+		}
+	}
+	if(optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-r] [-v] [-j threads] <virtual-disk>\n", argv[0]);
+		return 8;
+	}
+	if(numThreads < 1)
+		numThreads = 1;
+	if((check.fd = open(argv[optind], repairIt ? O_RDWR : O_RDONLY)) == -1) {
+		perror(argv[optind]);
+		return 8;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(readMetadata())
+		return 8;
+
+	pthread_mutex_init(&check.lock, NULL);
+	if((threads = malloc(numThreads * sizeof(pthread_t))) == NULL)
+		return 8;
+	walkNodes(check.nodes, check.numNodes, threads, numThreads);
+
+	// The blocks of the FS are reached first: the directories of the snapshots count no links
+	for(i = 0; i < MAX_SNAPSHOTS; i++) {
+		if(check.sb.snapshots[i].name[0])
+			checkSnapshot(i, threads, numThreads);
+	}
+	check.walkSnap = -1;
+	check.where[0] = '\0';
+
+	if(check.nodes[ROOT_NODE].freeNode || check.nodes[ROOT_NODE].nodeType != NODE_DIRECTORY)
+		problem(false, "The root directory is missing\n");
+	for(i = ROOT_NODE + 1; i < check.numNodes; i++) {
+		if(!check.nodes[i].freeNode && isSet(check.nodeBitMap, i) && check.links[i] != 1)
+			problem(false, "Inode %d is in %d directory entries\n", i, check.links[i]);
+	}
+	free = checkBitmap();
+	refs = checkRefCounts();
+	if(free != check.sb.numOfFreeBlocks)
+		problem(true, "Super block says %" PRId64 " free blocks, there are %" PRId64 "\n", check.sb.numOfFreeBlocks, free);
+	if(refs != check.sb.sharedRefs)
+		problem(true, "Super block says %" PRId64 " extra references, there are %" PRId64 "\n", check.sb.sharedRefs, refs);
+
+	left = check.problems;
+	if(repairIt && check.repairable)
+		left = repair(free, refs);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%s: %" PRId64 " blocks, %" PRId64 " free, %d inodes, checked with %d threads in %.3f s\n", argv[optind],
+			check.sb.diskSizeInBlocks, free, check.numNodes, numThreads,
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+	if(check.problems == 0) {
+		printf("No problems found\n");
+		return 0;
+	}
+	printf("%ld problems found, %ld repaired\n", check.problems, check.problems - left);
+	return left ? 4 : 1;
+}